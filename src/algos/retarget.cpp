@@ -24,7 +24,6 @@
 
 using namespace types;
 
-extern std::map<uint256, CBlockIndex*> mapBlockIndex; 
 extern CBlockIndex* pindexGenesisBlock;
 
 namespace retarget {
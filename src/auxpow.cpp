@@ -87,6 +87,14 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID)
     int nNonce;
     memcpy(&nNonce, &pc[4], 4);
 
+    if (nChainIndex != GetExpectedIndex(nNonce, nChainID, nSize))
+        return error("Aux POW wrong index");
+
+    return true;
+}
+
+unsigned int CAuxPow::GetExpectedIndex(int nNonce, int nChainID, unsigned int nSize)
+{
     // Choose a pseudo-random slot in the chain merkle tree
     // but have it be fixed for a size/nonce/chain combination.
     //
@@ -98,10 +106,7 @@ bool CAuxPow::Check(uint256 hashAuxBlock, int nChainID)
     rand += nChainID;
     rand = rand * 1103515245 + 12345;
 
-    if (nChainIndex != (rand % nSize))
-        return error("Aux POW wrong index");
-
-    return true;
+    return rand % nSize;
 }
 
 CScript MakeCoinbaseWithAux(
@@ -126,8 +131,9 @@ CScript MakeCoinbaseWithAux(
 }
 
 
-void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, vector<unsigned char>& vchAux)
+void IncrementExtraNonceWithAux(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, vector<unsigned char>& vchAux)
 {
+    CBlock* pblock = &pblocktemplate->block;
     // Update nExtraNonce
     static uint256 hashPrevBlock;
     if (hashPrevBlock != pblock->hashPrevBlock)
@@ -142,7 +148,7 @@ void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigne
       nExtraNonce, 
       vchAux
     );
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblocktemplate->UpdateMerkleRoot();
 }
 
 
@@ -40,6 +40,10 @@ public:
 
     bool Check(uint256 hashAuxBlock, int nChainID);
 
+    // Slot of a chain in the chain merkle tree, fixed for a
+    // tree size/nonce/chain ID combination
+    static unsigned int GetExpectedIndex(int nNonce, int nChainID, unsigned int nSize);
+
     uint256 GetParentBlockHash()
     {
         return parentBlockHeader.GetPoWHash();
@@ -81,6 +85,9 @@ int ReadWriteAuxPow(Stream& s, boost::shared_ptr<CAuxPow>& auxpow, int nType, in
     }
 }
 
+// Marks the start of the chain merkle root in a parent coinbase
+extern unsigned char pchMergedMiningHeader[4];
+
 void RemoveMergedMiningHeader(std::vector<unsigned char>& vchAux);
 
 CScript MakeCoinbaseWithAux(
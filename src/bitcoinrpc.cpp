@@ -14,6 +14,7 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ip/v6_only.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
@@ -23,7 +24,9 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <limits>
 #include <list>
+#include <atomic>
 
 using namespace std;
 using namespace boost;
@@ -36,6 +39,19 @@ static std::string strRPCUserColonPass;
 static asio::io_service* rpc_io_service = NULL;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
+static boost::thread* rpc_longpoll_thread = NULL;
+// Helper threads RPCParallelFor hands work to, shared by all calls
+static asio::io_service* rpc_parallel_service = NULL;
+static asio::io_service::work* rpc_parallel_work = NULL;
+static boost::thread_group* rpc_parallel_group = NULL;
+static bool fLongPollStop = false; // guarded by csTemplateChange
+// Connection limits, read by StartRPCThreads
+static int64 nRPCServerTimeout = 30; // seconds a client has to send its whole request
+static int nRPCMaxIdle = 100;        // keep-alive connections waiting for their next request
+// Those connections, closed by StopRPCThreads if they are still waiting
+class AcceptedConnection;
+static std::set<AcceptedConnection*> setRPCIdle;
+static boost::mutex csRPCIdle;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -209,7 +225,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getdifficulty",          &getdifficulty,          true,      false,      false },
     { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
     { "getgenerate",            &getgenerate,            true,      false,      false },
-    { "setgenerate",            &setgenerate,            true,      false,      true },
+    { "setgenerate",            &setgenerate,            true,      true,       true },
     { "gethashespersec",        &gethashespersec,        true,      false,      false },
     { "getinfo",                &getinfo,                true,      false,      false },
     { "getmininginfo",          &getmininginfo,          true,      false,      false },
@@ -229,7 +245,7 @@ static const CRPCCommand vRPCCommands[] =
     { "walletpassphrasechange", &walletpassphrasechange, false,     false,      true },
     { "walletlock",             &walletlock,             true,      false,      true },
     { "encryptwallet",          &encryptwallet,          false,     false,      true },
-    { "validateaddress",        &validateaddress,        true,      false,      false },
+    { "validateaddress",        &validateaddress,        true,      true,       false },
     { "getbalance",             &getbalance,             false,     false,      true },
     { "move",                   &movecmd,                false,     false,      true },
     { "sendfrom",               &sendfrom,               false,     false,      true },
@@ -244,14 +260,15 @@ static const CRPCCommand vRPCCommands[] =
     { "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
     { "signmessage",            &signmessage,            false,     false,      true },
     { "verifymessage",          &verifymessage,          false,     false,      false },
-    { "getwork",                &getwork,                true,      false,      true },
-  { "getworkaux",             &getworkaux, true,    false,    true },
-    { "getworkex",              &getworkex,              true,      false,      true },
+    { "getwork",                &getwork,                true,      true,       true },
+    { "getworkaux",             &getworkaux,             true,      true,       true },
+    { "getworkex",              &getworkex,              true,      true,       true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
     { "settxfee",               &settxfee,               false,     false,      true },
     { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-  { "getauxblock",            &getauxblock,        true,    false,    true },
+    { "getauxblock",            &getauxblock,            true,      true,       true },
     { "submitblock",            &submitblock,            false,     false,      false },
+    { "submitshares",           &submitshares,           false,     true,       false },
     { "setmininput",            &setmininput,            false,     false,      false },
     { "listsinceblock",         &listsinceblock,         false,     false,      true },
     { "dumpprivkey",            &dumpprivkey,            true,      false,      true },
@@ -263,10 +280,17 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "dumptxoutset",           &dumptxoutset,           true,      false,      false },
+    { "loadtxoutset",           &loadtxoutset,           false,     false,      false },
+    { "compactdb",              &compactdb,              true,      true,       false },
+    { "getdbstats",             &getdbstats,             true,      true,       false },
     { "gettxout",               &gettxout,               true,      false,      false },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "listlockunspent",        &listlockunspent,        false,     false,      true },
     { "verifychain",            &verifychain,            true,      false,      false },
+    { "getaddressutxos",        &getaddressutxos,        false,     false,      false },
+    { "getaddresstxids",        &getaddresstxids,        false,     false,      false },
+    { "getspentinfo",           &getspentinfo,           false,     false,      false },
 };
 
 CRPCTable::CRPCTable()
@@ -326,25 +350,8 @@ string rfc1123Time()
     return string(buffer);
 }
 
-static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, const char* pszContentType, bool fLongPoll)
 {
-    if (nStatus == HTTP_UNAUTHORIZED)
-        return strprintf("HTTP/1.0 401 Authorization Required\r\n"
-            "Date: %s\r\n"
-            "Server: umbrella-ltc-json-rpc/%s\r\n"
-            "WWW-Authenticate: Basic realm=\"jsonrpc\"\r\n"
-            "Content-Type: text/html\r\n"
-            "Content-Length: 296\r\n"
-            "\r\n"
-            "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\"\r\n"
-            "\"http://www.w3.org/TR/1999/REC-html401-19991224/loose.dtd\">\r\n"
-            "<HTML>\r\n"
-            "<HEAD>\r\n"
-            "<TITLE>Error</TITLE>\r\n"
-            "<META HTTP-EQUIV='Content-Type' CONTENT='text/html; charset=ISO-8859-1'>\r\n"
-            "</HEAD>\r\n"
-            "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
-            "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
     const char *cStatus;
          if (nStatus == HTTP_OK) cStatus = "OK";
     else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
@@ -357,17 +364,41 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "Date: %s\r\n"
             "Connection: %s\r\n"
             "Content-Length: %" PRIszu "\r\n"
-            "Content-Type: application/json\r\n"
+            "Content-Type: %s\r\n"
+            "%s"
             "Server: umbrella-ltc-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
         cStatus,
         rfc1123Time().c_str(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+        nContentLength,
+        pszContentType,
+        // tells getwork miners where to longpoll
+        fLongPoll ? "X-Long-Polling: /LP\r\n" : "",
+        FormatFullVersion().c_str());
+}
+
+static string HTTPReply(int nStatus, const string& strMsg, bool keepalive, bool fLongPoll = false)
+{
+    if (nStatus == HTTP_UNAUTHORIZED)
+        return strprintf("HTTP/1.0 401 Authorization Required\r\n"
+            "Date: %s\r\n"
+            "Server: umbrella-ltc-json-rpc/%s\r\n"
+            "WWW-Authenticate: Basic realm=\"jsonrpc\"\r\n"
+            "Content-Type: text/html\r\n"
+            "Content-Length: 296\r\n"
+            "\r\n"
+            "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\"\r\n"
+            "\"http://www.w3.org/TR/1999/REC-html401-19991224/loose.dtd\">\r\n"
+            "<HTML>\r\n"
+            "<HEAD>\r\n"
+            "<TITLE>Error</TITLE>\r\n"
+            "<META HTTP-EQUIV='Content-Type' CONTENT='text/html; charset=ISO-8859-1'>\r\n"
+            "</HEAD>\r\n"
+            "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
+            "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
+    return HTTPReplyHeader(nStatus, keepalive, strMsg.size(), "application/json", fLongPoll) + strMsg;
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -504,7 +535,10 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     request.push_back(Pair("method", strMethod));
     request.push_back(Pair("params", params));
     request.push_back(Pair("id", id));
-    return write_string(Value(request), false) + "\n";
+    string strRequest;
+    fast_write_string(Value(request), strRequest);
+    strRequest += '\n';
+    return strRequest;
 }
 
 Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
@@ -521,8 +555,10 @@ Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
 
 string JSONRPCReply(const Value& result, const Value& error, const Value& id)
 {
-    Object reply = JSONRPCReplyObj(result, error, id);
-    return write_string(Value(reply), false) + "\n";
+    string strReply;
+    fast_write_string(Value(JSONRPCReplyObj(result, error, id)), strReply);
+    strReply += '\n';
+    return strReply;
 }
 
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
@@ -562,32 +598,73 @@ bool ClientAllowed(const boost::asio::ip::address& address)
 //
 // IOStream device that speaks SSL but can also speak non-SSL
 //
+// With fAsync, connect, read and write start the asynchronous operation
+// and run the io_service of the stream until it is done, so that a timer
+// on the same io_service can cut them short (see CRPCCallDeadline).
+//
 template <typename Protocol>
 class SSLIOStreamDevice : public iostreams::device<iostreams::bidirectional> {
 public:
-    SSLIOStreamDevice(asio::ssl::stream<typename Protocol::socket> &streamIn, bool fUseSSLIn) : stream(streamIn)
+    SSLIOStreamDevice(asio::ssl::stream<typename Protocol::socket> &streamIn, bool fUseSSLIn, bool fAsyncIn = false) : stream(streamIn)
     {
         fUseSSL = fUseSSLIn;
         fNeedHandshake = fUseSSLIn;
+        fAsync = fAsyncIn;
     }
 
     void handshake(ssl::stream_base::handshake_type role)
     {
         if (!fNeedHandshake) return;
         fNeedHandshake = false;
-        stream.handshake(role);
+        if (!fAsync) {
+            stream.handshake(role);
+            return;
+        }
+        boost::system::error_code error = asio::error::would_block;
+        stream.async_handshake(role, boost::bind(&SetError, &error, asio::placeholders::error));
+        Wait(error);
+        if (error)
+            throw boost::system::system_error(error);
     }
     std::streamsize read(char* s, std::streamsize n)
     {
         handshake(ssl::stream_base::server); // HTTPS servers read first
-        if (fUseSSL) return stream.read_some(asio::buffer(s, n));
-        return stream.next_layer().read_some(asio::buffer(s, n));
+        if (!fAsync) {
+            if (fUseSSL) return stream.read_some(asio::buffer(s, n));
+            return stream.next_layer().read_some(asio::buffer(s, n));
+        }
+        boost::system::error_code error = asio::error::would_block;
+        std::size_t nRead = 0;
+        if (fUseSSL)
+            stream.async_read_some(asio::buffer(s, n), boost::bind(&SetResult, &error, &nRead,
+                                   asio::placeholders::error, asio::placeholders::bytes_transferred));
+        else
+            stream.next_layer().async_read_some(asio::buffer(s, n), boost::bind(&SetResult, &error, &nRead,
+                                                asio::placeholders::error, asio::placeholders::bytes_transferred));
+        Wait(error);
+        if (error)
+            throw boost::system::system_error(error);
+        return nRead;
     }
     std::streamsize write(const char* s, std::streamsize n)
     {
         handshake(ssl::stream_base::client); // HTTPS clients write first
-        if (fUseSSL) return asio::write(stream, asio::buffer(s, n));
-        return asio::write(stream.next_layer(), asio::buffer(s, n));
+        if (!fAsync) {
+            if (fUseSSL) return asio::write(stream, asio::buffer(s, n));
+            return asio::write(stream.next_layer(), asio::buffer(s, n));
+        }
+        boost::system::error_code error = asio::error::would_block;
+        std::size_t nWritten = 0;
+        if (fUseSSL)
+            asio::async_write(stream, asio::buffer(s, n), boost::bind(&SetResult, &error, &nWritten,
+                              asio::placeholders::error, asio::placeholders::bytes_transferred));
+        else
+            asio::async_write(stream.next_layer(), asio::buffer(s, n), boost::bind(&SetResult, &error, &nWritten,
+                              asio::placeholders::error, asio::placeholders::bytes_transferred));
+        Wait(error);
+        if (error)
+            throw boost::system::system_error(error);
+        return nWritten;
     }
     bool connect(const std::string& server, const std::string& port)
     {
@@ -596,10 +673,17 @@ public:
         ip::tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
         ip::tcp::resolver::iterator end;
         boost::system::error_code error = asio::error::host_not_found;
-        while (error && endpoint_iterator != end)
+        // an aborted connect is the deadline passing; no other address gets a try
+        while (error && error != asio::error::operation_aborted && endpoint_iterator != end)
         {
             stream.lowest_layer().close();
-            stream.lowest_layer().connect(*endpoint_iterator++, error);
+            if (!fAsync) {
+                stream.lowest_layer().connect(*endpoint_iterator++, error);
+                continue;
+            }
+            error = asio::error::would_block;
+            stream.lowest_layer().async_connect(*endpoint_iterator++, boost::bind(&SetError, &error, asio::placeholders::error));
+            Wait(error);
         }
         if (error)
             return false;
@@ -609,7 +693,27 @@ public:
 private:
     bool fNeedHandshake;
     bool fUseSSL;
+    bool fAsync;
     asio::ssl::stream<typename Protocol::socket>& stream;
+
+    static void SetError(boost::system::error_code* perror, const boost::system::error_code& error)
+    {
+        *perror = error;
+    }
+    static void SetResult(boost::system::error_code* perror, std::size_t* pnBytes,
+                          const boost::system::error_code& error, std::size_t nBytes)
+    {
+        *perror = error;
+        *pnBytes = nBytes;
+    }
+
+    // Run the handlers of the io_service, the deadline's included, until
+    // the operation reporting to error has completed
+    void Wait(const boost::system::error_code& error)
+    {
+        while (error == asio::error::would_block)
+            stream.get_io_service().run_one();
+    }
 };
 
 class AcceptedConnection
@@ -620,6 +724,13 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    // Fail the reads and writes in progress; may be called from any thread
+    virtual void shutdown() = 0;
+
+    // True if a (pipelined) request is already buffered, so reading it won't block
+    virtual bool buffered() = 0;
+    // Call handler from the io_service once the peer has sent more data
+    virtual void async_wait_readable(const boost::function<void(const boost::system::error_code&)>& handler) = 0;
 };
 
 template <typename Protocol>
@@ -651,6 +762,22 @@ public:
         _stream.close();
     }
 
+    virtual void shutdown()
+    {
+        boost::system::error_code ec;
+        sslStream.lowest_layer().shutdown(socket_base::shutdown_both, ec);
+    }
+
+    virtual bool buffered()
+    {
+        return _stream.rdbuf()->in_avail() > 0;
+    }
+
+    virtual void async_wait_readable(const boost::function<void(const boost::system::error_code&)>& handler)
+    {
+        sslStream.lowest_layer().async_read_some(asio::null_buffers(), handler);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
@@ -660,6 +787,69 @@ private:
 };
 
 void ServiceConnection(AcceptedConnection *conn);
+static bool ServiceRequest(AcceptedConnection *conn, bool* pfParked = NULL);
+static void ThreadRPCLongPoll();
+
+static void RPCReadableHandler(AcceptedConnection* conn, const boost::system::error_code& error);
+
+/**
+ * Hand an idle connection, new or kept alive, to the io_service until the
+ * peer sends its next request, or close it if -rpcmaxidle others already
+ * wait there.
+ */
+static void WaitForNextRequest(AcceptedConnection* conn)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csRPCIdle);
+        if ((int)setRPCIdle.size() < nRPCMaxIdle)
+        {
+            setRPCIdle.insert(conn);
+            conn->async_wait_readable(boost::bind(&RPCReadableHandler, conn, asio::placeholders::error));
+            return;
+        }
+    }
+    conn->close();
+    delete conn;
+}
+
+/**
+ * Answer every request conn has buffered, then hand the idle connection back
+ * to the io_service until the peer sends more. Keep-alive connections thus
+ * don't pin one of the -rpcthreads while they wait for their next request.
+ */
+static void ServiceConnectionAsync(AcceptedConnection* conn)
+{
+    do {
+        bool fParked = false;
+        bool fKeepAlive = ServiceRequest(conn, &fParked);
+        // a parked longpoll belongs to ThreadRPCLongPoll until it is answered
+        if (fParked)
+            return;
+        if (!fKeepAlive)
+        {
+            conn->close();
+            delete conn;
+            return;
+        }
+    } while (conn->buffered());
+
+    WaitForNextRequest(conn);
+}
+
+static void RPCReadableHandler(AcceptedConnection* conn, const boost::system::error_code& error)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csRPCIdle);
+        setRPCIdle.erase(conn);
+    }
+    if (error)
+    {
+        conn->close();
+        delete conn;
+        return;
+    }
+    ServiceConnectionAsync(conn);
+}
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
@@ -723,11 +913,15 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
             conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
         delete conn;
     }
-    else {
+    // Decrypted SSL data may sit in the SSL layer where a readiness wait
+    // on the socket can't see it, so SSL connections keep their thread.
+    else if (fUseSSL) {
         ServiceConnection(conn);
         conn->close();
         delete conn;
     }
+    else
+        WaitForNextRequest(conn);
 }
 
 void StartRPCThreads()
@@ -844,18 +1038,64 @@ void StartRPCThreads()
         return;
     }
 
+    nRPCServerTimeout = GetArg("-rpcservertimeout", 30);
+    nRPCMaxIdle = GetArg("-rpcmaxidle", 100);
+
     rpc_worker_group = new boost::thread_group();
     for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+
+    {
+        boost::unique_lock<boost::mutex> lock(csTemplateChange);
+        fLongPollStop = false;
+    }
+    rpc_longpoll_thread = new boost::thread(&ThreadRPCLongPoll);
+
+    rpc_parallel_service = new asio::io_service();
+    rpc_parallel_work = new asio::io_service::work(*rpc_parallel_service);
+    rpc_parallel_group = new boost::thread_group();
+    for (unsigned int i = 1; i < std::max(boost::thread::hardware_concurrency(), 2U); i++)
+        rpc_parallel_group->create_thread(boost::bind(&asio::io_service::run, rpc_parallel_service));
 }
 
 void StopRPCThreads()
 {
     if (rpc_io_service == NULL) return;
 
+    // Drop the parked longpolls and release threads waiting in one
+    {
+        boost::unique_lock<boost::mutex> lock(csTemplateChange);
+        fLongPollStop = true;
+        cvTemplateChange.notify_all();
+    }
+    if (rpc_longpoll_thread != NULL)
+    {
+        rpc_longpoll_thread->join();
+        delete rpc_longpoll_thread; rpc_longpoll_thread = NULL;
+    }
+
     rpc_io_service->stop();
     rpc_worker_group->join_all();
     delete rpc_worker_group; rpc_worker_group = NULL;
+
+    // The keep-alive connections still waiting for a request; their
+    // handlers won't run any more
+    {
+        boost::unique_lock<boost::mutex> lock(csRPCIdle);
+        BOOST_FOREACH(AcceptedConnection* conn, setRPCIdle)
+        {
+            conn->close();
+            delete conn;
+        }
+        setRPCIdle.clear();
+    }
+
+    // only after the calls that could still be handing work to them
+    delete rpc_parallel_work; rpc_parallel_work = NULL;
+    rpc_parallel_service->stop();
+    rpc_parallel_group->join_all();
+    delete rpc_parallel_group; rpc_parallel_group = NULL;
+    delete rpc_parallel_service; rpc_parallel_service = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
     delete rpc_io_service; rpc_io_service = NULL;
 }
@@ -925,95 +1165,418 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
+// Whether a batch element calls a command that runs without cs_main/cs_wallet
+static bool IsThreadSafeRequest(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->threadSafe;
+}
+
+// One RPCParallelFor call. Items are claimed through nNext, so whoever runs
+// first does the work: helpers that get to it late find nothing left, and
+// the caller finishes alone if every helper thread is busy.
+struct CRPCParallelJob
+{
+    boost::function<void (size_t)> fn;
+    size_t nItems;
+    std::atomic<size_t> nNext;
+    size_t nDone;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+};
+
+static void RPCParallelWork(boost::shared_ptr<CRPCParallelJob> pjob)
+{
+    size_t i, nDone = 0;
+    while ((i = pjob->nNext++) < pjob->nItems)
+    {
+        pjob->fn(i);
+        nDone++;
+    }
+    if (nDone == 0)
+        return;
+    boost::unique_lock<boost::mutex> lock(pjob->mutex);
+    pjob->nDone += nDone;
+    if (pjob->nDone == pjob->nItems)
+        pjob->cond.notify_all();
+}
+
+void RPCParallelFor(size_t nItems, unsigned int nMaxThreads, const boost::function<void (size_t)>& fn)
+{
+    if (nItems == 0)
+        return;
+    boost::shared_ptr<CRPCParallelJob> pjob(new CRPCParallelJob());
+    pjob->fn = fn;
+    pjob->nItems = nItems;
+    pjob->nNext = 0;
+    pjob->nDone = 0;
+
+    if (rpc_parallel_service != NULL)
+    {
+        size_t nHelpers = std::min((size_t)std::max(nMaxThreads, 1U), nItems) - 1;
+        for (size_t i = 0; i < nHelpers; i++)
+            rpc_parallel_service->post(boost::bind(&RPCParallelWork, pjob));
+    }
+    RPCParallelWork(pjob);
+
+    boost::unique_lock<boost::mutex> lock(pjob->mutex);
+    while (pjob->nDone < pjob->nItems)
+        pjob->cond.wait(lock);
+}
+
+static void JSONRPCExecParallel(const Array* pvReq, const std::vector<unsigned int>* pvIdx,
+                                std::vector<Object>* pvRet, size_t i)
+{
+    (*pvRet)[(*pvIdx)[i]] = JSONRPCExecOne((*pvReq)[(*pvIdx)[i]]);
+}
+
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
+    // Thread-safe commands don't take cs_main, so they are run on up to
+    // -rpcthreads of the shared helper threads; the others run here, in order,
+    // before this thread joins in on the rest.
+    std::vector<Object> vRet(vReq.size());
+    std::vector<bool> vfParallel(vReq.size(), false);
+    std::vector<unsigned int> vParallel;
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+        if (IsThreadSafeRequest(vReq[reqIdx]))
+            vParallel.push_back(reqIdx);
+
+    if (vParallel.size() > 1)
+    {
+        BOOST_FOREACH(unsigned int reqIdx, vParallel)
+            vfParallel[reqIdx] = true;
+    }
+
+    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
+        if (!vfParallel[reqIdx])
+            vRet[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+    if (vParallel.size() > 1)
+        RPCParallelFor(vParallel.size(), std::max(1, (int)GetArg("-rpcthreads", 4)) + 1,
+                       boost::bind(&JSONRPCExecParallel, &vReq, &vParallel, &vRet, _1));
+
+    Array ret;
+    ret.reserve(vRet.size());
+    BOOST_FOREACH(const Object& reply, vRet)
+        ret.push_back(reply);
 
-    return write_string(Value(ret), false) + "\n";
+    string strReply;
+    fast_write_string(Value(ret), strReply);
+    strReply += '\n';
+    return strReply;
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+// Methods handing out work, whose replies point miners at the longpoll URI
+static bool IsWorkMethod(const string& strMethod)
 {
-    bool fRun = true;
-    while (fRun)
+    return strMethod == "getwork" || strMethod == "getworkaux" ||
+           strMethod == "getauxblock" || strMethod == "getblocktemplate";
+}
+
+// Run a parsed JSON-RPC request or batch and send the reply on conn.
+// Returns false if the connection should be closed afterwards.
+static bool JSONRPCExecRequest(AcceptedConnection *conn, const Value& valRequest, bool fRun)
+{
+    JSONRequest jreq;
+    try
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        string strReply;
+        bool fLongPoll = false;
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
+            fLongPoll = IsWorkMethod(jreq.strMethod);
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        conn->stream() << HTTPReply(HTTP_OK, strReply, fRun, fLongPoll) << std::flush;
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(conn->stream(), objError, jreq.id);
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return false;
+    }
+    return fRun;
+}
+
+//
+// Longpoll: a request for work is held back until the block template
+// changes (nTemplateChanges moves) or LONGPOLL_TIMEOUT passes. Parked
+// requests of async connections wait in listLongPoll, all watched by the
+// one ThreadRPCLongPoll, so they don't occupy an -rpcthreads worker.
+//
+static const int64 LONGPOLL_TIMEOUT = 5 * 60;
+
+struct CLongPoll
+{
+    AcceptedConnection* conn;
+    Value valRequest;
+    bool fRun;
+    unsigned int nChangesSeen;
+    int64 nDeadline;
+};
+
+// guarded by csTemplateChange
+static std::list<CLongPoll> listLongPoll;
+
+// Whether the request waits for a template change, and since which
+// nTemplateChanges: getblocktemplate with the "longpollid" of an earlier
+// template ("<previousblockhash><nTemplateChanges>"), or a request for new
+// work sent to the /LP URI given in the X-Long-Polling header.
+static bool IsLongPoll(const Value& valRequest, const string& strURI, unsigned int& nChangesSeen)
+{
+    if (valRequest.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(valRequest.get_obj(), "method");
+    const Value& valParams = find_value(valRequest.get_obj(), "params");
+    if (valMethod.type() != str_type)
+        return false;
+    const string& strMethod = valMethod.get_str();
+    const Array params = valParams.type() == array_type ? valParams.get_array() : Array();
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+    if (strMethod == "getblocktemplate" && params.size() > 0 && params[0].type() == obj_type)
+    {
+        const Value& valId = find_value(params[0].get_obj(), "longpollid");
+        if (valId.type() == str_type)
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            const string& strId = valId.get_str();
+            uint256 hashPrev;
+            hashPrev.SetHex(strId.substr(0, 64));
+            {
+                LOCK(cs_main);
+                // a template on an older block is already outdated
+                if (strId.size() <= 64 || hashPrev != hashBestChain)
+                    return false;
+            }
+            nChangesSeen = atoi(strId.substr(64));
+            return true;
         }
-        if (!HTTPAuthorized(mapHeaders))
+    }
+
+    if (strURI != "/LP")
+        return false;
+    if (((strMethod == "getwork" || strMethod == "getauxblock") && params.size() == 0) ||
+        (strMethod == "getworkaux" && params.size() == 1) ||
+        strMethod == "getblocktemplate")
+    {
+        boost::unique_lock<boost::mutex> lock(csTemplateChange);
+        nChangesSeen = nTemplateChanges;
+        return true;
+    }
+    return false;
+}
+
+// Hand the connection to ThreadRPCLongPoll; false if the template already changed
+static bool ParkLongPoll(AcceptedConnection *conn, const Value& valRequest, bool fRun, unsigned int nChangesSeen)
+{
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    if (nChangesSeen != nTemplateChanges || fLongPollStop)
+        return false;
+    CLongPoll longpoll;
+    longpoll.conn = conn;
+    longpoll.valRequest = valRequest;
+    longpoll.fRun = fRun;
+    longpoll.nChangesSeen = nChangesSeen;
+    longpoll.nDeadline = GetTime() + LONGPOLL_TIMEOUT;
+    listLongPoll.push_back(longpoll);
+    return true;
+}
+
+//
+// Read deadlines: once the server starts reading a request, the client has
+// nRPCServerTimeout seconds to send all of it. ThreadRPCLongPoll shuts down
+// the connections that miss theirs, which fails the blocked read, so a slow
+// or stalled client can't hold an -rpcthreads worker.
+//
+static boost::mutex csReadDeadlines;
+static std::map<AcceptedConnection*, int64> mapReadDeadlines;
+
+static void ExpireSlowRequests(int64 nNow)
+{
+    boost::unique_lock<boost::mutex> lock(csReadDeadlines);
+    for (std::map<AcceptedConnection*, int64>::iterator it = mapReadDeadlines.begin(); it != mapReadDeadlines.end(); )
+    {
+        if (nNow < it->second)
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            ++it;
+            continue;
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        it->first->shutdown();
+        mapReadDeadlines.erase(it++);
+    }
+}
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+// Read one HTTP request from conn; false if the peer closed the connection
+// or didn't send the request in time
+static bool ReadHTTPRequest(AcceptedConnection *conn, int &nProto, string &strMethod, string &strURI,
+                            map<string, string>& mapHeaders, string& strRequest)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csReadDeadlines);
+        mapReadDeadlines[conn] = GetTime() + nRPCServerTimeout;
+    }
 
-            string strReply;
+    bool fRead = ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI);
+    if (fRead)
+        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+    boost::unique_lock<boost::mutex> lock(csReadDeadlines);
+    if (mapReadDeadlines.erase(conn) == 0)
+        return false;
+    return fRead;
+}
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+// Longpoll for connections that keep their thread anyway (SSL)
+static void WaitForTemplateChange(unsigned int nChangesSeen)
+{
+    int64 nDeadline = GetTime() + LONGPOLL_TIMEOUT;
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    while (nChangesSeen == nTemplateChanges && GetTime() < nDeadline && !fLongPollStop)
+        cvTemplateChange.timed_wait(lock, boost::posix_time::seconds(1));
+}
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+// Answer a woken longpoll on an io_service thread, then go on with the connection
+static void RPCLongPollWake(AcceptedConnection* conn, Value valRequest, bool fRun)
+{
+    if (!JSONRPCExecRequest(conn, valRequest, fRun))
+    {
+        conn->close();
+        delete conn;
+    }
+    else if (conn->buffered())
+        ServiceConnectionAsync(conn);
+    else
+        WaitForNextRequest(conn);
+}
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+static void ThreadRPCLongPoll()
+{
+    RenameThread("bitcoin-rpclongpoll");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    while (true)
+    {
+        if (!fLongPollStop)
+            cvTemplateChange.timed_wait(lock, boost::posix_time::seconds(1));
+
+        // on shutdown, release the workers still waiting for a request too
+        int64 nNow = GetTime();
+        ExpireSlowRequests(fLongPollStop ? std::numeric_limits<int64>::max() : nNow);
+        for (std::list<CLongPoll>::iterator it = listLongPoll.begin(); it != listLongPoll.end(); )
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            if (fLongPollStop)
+            {
+                it->conn->close();
+                delete it->conn;
+            }
+            else if (it->nChangesSeen != nTemplateChanges || nNow >= it->nDeadline)
+                rpc_io_service->post(boost::bind(&RPCLongPollWake, it->conn, it->valRequest, it->fRun));
+            else
+            {
+                ++it;
+                continue;
+            }
+            it = listLongPoll.erase(it);
         }
-        catch (std::exception& e)
+
+        if (fLongPollStop)
+            return;
+    }
+}
+
+// Read one HTTP request from conn and answer it.
+// Returns false if the connection should be closed afterwards.
+// With pfParked, a longpoll may be parked instead of answered: *pfParked
+// is then set and conn belongs to ThreadRPCLongPoll.
+static bool ServiceRequest(AcceptedConnection *conn, bool* pfParked)
+{
+    bool fRun = true;
+    int nProto = 0;
+    map<string, string> mapHeaders;
+    string strRequest, strMethod, strURI;
+
+    // Read HTTP request line, message headers and body
+    if (!ReadHTTPRequest(conn, nProto, strMethod, strURI, mapHeaders, strRequest))
+        return false;
+
+    bool fBlockStream = (strURI.compare(0, 8, "/blocks/") == 0);
+    if (strURI != "/" && strURI != "/LP" && !fBlockStream) {
+        conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
+        return false;
+    }
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    if (mapHeaders["connection"] == "close")
+        fRun = false;
+
+    // Raw block range: answered in binary, outside of JSON-RPC
+    if (fBlockStream)
+        return HTTPStreamBlocks(conn->stream(), strURI, fRun);
+
+    // Parse request
+    Value valRequest;
+    if (!fast_read_string(strRequest, valRequest))
+    {
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, "Parse error"), Value::null);
+        return false;
+    }
+
+    unsigned int nChangesSeen;
+    if (IsLongPoll(valRequest, strURI, nChangesSeen))
+    {
+        if (pfParked == NULL)
+            WaitForTemplateChange(nChangesSeen);
+        else if (ParkLongPoll(conn, valRequest, fRun, nChangesSeen))
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            *pfParked = true;
+            return fRun;
         }
     }
+
+    return JSONRPCExecRequest(conn, valRequest, fRun);
+}
+
+void ServiceConnection(AcceptedConnection *conn)
+{
+    while (ServiceRequest(conn))
+        ;
 }
 
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
@@ -1064,18 +1627,68 @@ Object CallRPC(const string& strMethod, const Array& params)
                 GetConfigFile().string().c_str()));
 
     // Connect to localhost
-    bool fUseSSL = GetBoolArg("-rpcssl");
+    return CallRPC(GetArg("-rpcconnect", "127.0.0.1"), GetArg("-rpcport", itostr(GetDefaultRPCPort())),
+                   mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"], GetBoolArg("-rpcssl"),
+                   strMethod, params);
+}
+
+//
+// Deadline of one CallRPC. The call's SSLIOStreamDevice runs the io_service
+// while it waits for a connect, read or write, so the timer goes off on the
+// calling thread; it closes the socket, which aborts whichever of them the
+// call is waiting for.
+//
+class CRPCCallDeadline
+{
+public:
+    CRPCCallDeadline(asio::io_service& io_service, asio::ip::tcp::socket& socketIn, int nTimeout) :
+        timer(io_service), socket(socketIn), fExpired(false)
+    {
+        if (nTimeout <= 0)
+            return;
+        timer.expires_from_now(boost::posix_time::seconds(nTimeout));
+        timer.async_wait(boost::bind(&CRPCCallDeadline::Expire, this, asio::placeholders::error));
+    }
+
+    ~CRPCCallDeadline()
+    {
+        // the cancelled wait is never run, only destroyed with the io_service
+        boost::system::error_code ec;
+        timer.cancel(ec);
+    }
+
+    bool Expired() const { return fExpired; }
+
+private:
+    asio::deadline_timer timer;
+    asio::ip::tcp::socket& socket;
+    bool fExpired;
+
+    void Expire(const boost::system::error_code& error)
+    {
+        if (error == asio::error::operation_aborted)
+            return;
+        fExpired = true;
+        boost::system::error_code ec;
+        socket.close(ec);
+    }
+};
+
+Object CallRPC(const string& strHost, const string& strPort, const string& strUserPass, bool fUseSSL,
+               const string& strMethod, const Array& params, int nTimeout)
+{
     asio::io_service io_service;
     ssl::context context(io_service, ssl::context::sslv23);
     context.set_options(ssl::context::no_sslv2);
     asio::ssl::stream<asio::ip::tcp::socket> sslStream(io_service, context);
-    SSLIOStreamDevice<asio::ip::tcp> d(sslStream, fUseSSL);
+    SSLIOStreamDevice<asio::ip::tcp> d(sslStream, fUseSSL, nTimeout > 0);
     iostreams::stream< SSLIOStreamDevice<asio::ip::tcp> > stream(d);
-    if (!d.connect(GetArg("-rpcconnect", "127.0.0.1"), GetArg("-rpcport", itostr(GetDefaultRPCPort()))))
-        throw runtime_error("couldn't connect to server");
+    CRPCCallDeadline deadline(io_service, sslStream.next_layer(), nTimeout);
+    if (!d.connect(strHost, strPort))
+        throw runtime_error(deadline.Expired() ? "timed out connecting to server" : "couldn't connect to server");
 
     // HTTP basic authentication
-    string strUserPass64 = EncodeBase64(mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"]);
+    string strUserPass64 = EncodeBase64(strUserPass);
     map<string, string> mapRequestHeaders;
     mapRequestHeaders["Authorization"] = string("Basic ") + strUserPass64;
 
@@ -1093,6 +1706,8 @@ Object CallRPC(const string& strMethod, const Array& params)
     string strReply;
     ReadHTTPMessage(stream, mapHeaders, strReply, nProto);
 
+    if (deadline.Expired())
+        throw runtime_error(strprintf("no reply from server within %d seconds", nTimeout));
     if (nStatus == HTTP_UNAUTHORIZED)
         throw runtime_error("incorrect rpcuser or rpcpassword (authorization failed)");
     else if (nStatus >= 400 && nStatus != HTTP_BAD_REQUEST && nStatus != HTTP_NOT_FOUND && nStatus != HTTP_INTERNAL_SERVER_ERROR)
@@ -1102,7 +1717,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!fast_read_string(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -1124,7 +1739,7 @@ void ConvertTo(Value& value, bool fAllowNull=false)
         // reinterpret string as unquoted json value
         Value value2;
         string strJSON = value.get_str();
-        if (!read_string(strJSON, value2))
+        if (!fast_read_string(strJSON, value2))
             throw runtime_error(string("Error parsing JSON:")+strJSON);
         ConvertTo<T>(value2, fAllowNull);
         value = value2;
@@ -1173,6 +1788,7 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listaccounts"           && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
+    if (strMethod == "submitshares"           && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<boost::int64_t>(params[1]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<boost::int64_t>(params[2]);
@@ -1196,6 +1812,12 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "verifychain"            && n > 0) ConvertTo<boost::int64_t>(params[0]);
     if (strMethod == "verifychain"            && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    // a single address stays a string, a JSON list becomes an array
+    if (strMethod == "getaddressutxos"        && n > 0 && strParams[0].compare(0, 1, "[") == 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 0 && strParams[0].compare(0, 1, "[") == 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<boost::int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<boost::int64_t>(params[1]);
 
     return params;
 }
@@ -1232,7 +1854,7 @@ int CommandLineRPC(int argc, char *argv[])
         if (error.type() != null_type)
         {
             // Error
-            strPrint = "error: " + write_string(error, false);
+            strPrint = "error: " + fast_write_string(error, false);
             int code = find_value(error.get_obj(), "code").get_int();
             nRet = abs(code);
         }
@@ -1244,7 +1866,7 @@ int CommandLineRPC(int argc, char *argv[])
             else if (result.type() == str_type)
                 strPrint = result.get_str();
             else
-                strPrint = write_string(result, true);
+                strPrint = fast_write_string(result, true);
         }
     }
     catch (boost::thread_interrupted) {
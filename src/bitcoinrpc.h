@@ -10,12 +10,15 @@
 #include <list>
 #include <map>
 
+#include <boost/function.hpp>
+
 class CBlockIndex;
 class CReserveKey;
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
+#include "json/json_spirit_fast.h"
 
 #include "util.h"
 
@@ -70,8 +73,33 @@ json_spirit::Object JSONRPCError(int code, const std::string& message);
 
 void StartRPCThreads();
 void StopRPCThreads();
+
+/** Call fn(0) .. fn(nItems - 1) on up to nMaxThreads threads: this one and
+    the helper threads started with the RPC server. fn must not throw. */
+void RPCParallelFor(size_t nItems, unsigned int nMaxThreads, const boost::function<void (size_t)>& fn);
 int CommandLineRPC(int argc, char *argv[]);
 
+/** Send one JSON-RPC request to a node at strHost:strPort and return the reply object.
+    With nTimeout > 0 the call gives up after that many seconds. */
+json_spirit::Object CallRPC(const std::string& strHost, const std::string& strPort, const std::string& strUserPass, bool fUseSSL,
+                            const std::string& strMethod, const json_spirit::Array& params, int nTimeout = 0);
+
+/** HTTP status line and headers of a reply carrying nContentLength bytes of body.
+    fLongPoll adds the X-Long-Polling header of replies handing out work. */
+std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, const char* pszContentType = "application/json",
+                            bool fLongPoll = false);
+
+/**
+ * Answer an authenticated "/blocks/<height>/<count>[/undo]" request with the
+ * raw serialized main-chain blocks in that range, copied straight from
+ * blk*.dat (and rev*.dat for /undo). The body is a sequence of records
+ *   int32 height, uint256 hash, uint32 size, block bytes
+ *   [, uint32 undo size, undo bytes]
+ * in little-endian disk byte order. Returns false if the connection should
+ * be closed.
+ */
+bool HTTPStreamBlocks(std::ostream& stream, const std::string& strURI, bool keepalive);
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -152,6 +180,7 @@ extern json_spirit::Value getworkex(const json_spirit::Array& params, bool fHelp
 extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblocktemplate(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value submitblock(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value submitshares(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkaux(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getauxblock(const json_spirit::Array& params, bool fHelp);
 
@@ -205,7 +234,14 @@ extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool f
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumptxoutset(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value loadtxoutset(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value compactdb(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getdbstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp);
 
 #endif
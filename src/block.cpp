@@ -17,7 +17,18 @@ extern int nBestHeight;
 
 uint256 CTransaction::GetHash() const
 {
-  return SerializeHash(*this);
+  int nState = nHashState.load(std::memory_order_acquire);
+  if (nState == HASH_CACHED)
+    return hashCached;
+  const uint256 hash = SerializeHash(*this);
+  // the first caller on a read-only transaction keeps it
+  if (nState == HASH_CACHEABLE &&
+      nHashState.compare_exchange_strong(nState, HASH_COMPUTING))
+  {
+    hashCached = hash;
+    nHashState.store(HASH_CACHED, std::memory_order_release);
+  }
+  return hash;
 }
 
 int64 CTransaction::GetValueOut() const
@@ -145,10 +156,9 @@ bool CBlock::WriteToDisk(CDiskBlockPos &pos)
   pos.nPos = (unsigned int)fileOutPos;
   fileout << *this;
 
-  // Flush stdio buffers and commit to disk before returning
-  fflush(fileout);
-  if (!IsInitialBlockDownload())
-    FileCommit(fileout);
+  // Flush stdio buffers and start writing back; FlushBlockFile commits it
+  // before the coins that depend on it
+  FileWriteBack(fileout, pos.nPos, nSize);
 
   return true;
 }
@@ -157,14 +167,15 @@ bool CBlock::ReadFromDisk(const CDiskBlockPos &pos)
 {
   SetNull();
 
-  // Open history file to read
-  CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-  if (!filein)
-    return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+  // Map history file to read
+  CMappedBlock block(pos);
+  if (block.IsNull())
+    return error("CBlock::ReadFromDisk() : MapBlockFile failed");
 
   // Read block
   try {
-    filein >> *this;
+    CMemoryReader reader = block.GetReader();
+    reader >> *this;
   }
   catch (std::exception &e) {
     return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -303,6 +314,39 @@ CBigNum CBlockIndex::GetBlockWork() const
   return (CBigNum(1)<<256) / (bnTarget+1);
 }
 
+uint256 CBlockIndex::GetBlockWork256() const
+{
+  // Decode the compact target as CBigNum::SetCompact does
+  const unsigned int nCompact = nBits.compact;
+  const unsigned int nSize = nCompact >> 24;
+  unsigned int nWord = nCompact & 0x007fffff;
+  if (nWord == 0 || (nCompact & 0x00800000))
+    return 0; // zero or negative
+  if (nSize > 34 || (nWord > 0xff && nSize > 33) || (nWord > 0xffff && nSize > 32))
+    return 0; // overflows 256 bits
+  uint256 target;
+  if (nSize <= 3)
+  {
+    nWord >>= 8 * (3 - nSize);
+    target = nWord;
+  }
+  else
+  {
+    target = nWord;
+    target <<= 8 * (nSize - 3);
+  }
+  if (target == 0 || target == ~uint256(0))
+    return 0;
+
+  // 2**256 / (target+1) does not fit, but equals ~target / (target+1) + 1
+  uint256 work = ~target;
+  uint256 div = target;
+  ++div;
+  work /= div;
+  ++work;
+  return work;
+}
+
 bool CBlockIndex::IsInMainChain() const
 {
   return (pnext || this == pindexBest);
@@ -13,6 +13,7 @@
 #define BITCOIN_BLOCK_H
 
 #include <exception>
+#include <boost/unordered_map.hpp>
 #include "bignum.h"
 #include "log.h"
 #include "script.h"
@@ -63,6 +64,7 @@ class CTransaction;
 class CCoinsViewCache;
 class CValidationState;
 class CTxUndo;
+class CLevelDBBatch;
 struct CDiskBlockPos;
 class CAuxPow;
 
@@ -220,12 +222,15 @@ public:
    *  errors, and *pfClean will be true if no problems
    *  were found. Otherwise, the return value will be
    *  false in case of problems. Note that in any case,
-   *  coins may be modified. */
-  bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
+   *  coins may be modified. The address and spent index
+   *  changes are added to *pbatchIndex, if given. */
+  bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL, CLevelDBBatch *pbatchIndex = NULL);
 
   // Apply the effects of this block (with given index) on
-  // the UTXO set represented by coins
-  bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+  // the UTXO set represented by coins, and its address and
+  // spent index changes on *pbatchIndex, if given (also with
+  // fJustCheck)
+  bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, CLevelDBBatch *pbatchIndex = NULL);
 
   // Read a block from disk
   bool ReadFromDisk(const CBlockIndex* pindex);
@@ -242,6 +247,10 @@ public:
   // if dbp is provided, the file is known to already
   // reside on disk
   bool AcceptBlock(CValidationState &state, CDiskBlockPos *dbp = NULL);
+
+  // Add only the header to the block index, for headers-first sync;
+  // *ppindex is set to its entry, whether new or already known
+  bool AcceptHeader(CValidationState &state, CBlockIndex **ppindex);
 };
 
 enum BlockStatus {
@@ -259,7 +268,9 @@ enum BlockStatus {
 
   BLOCK_FAILED_VALID     =   32, // stage after last reached validness failed
   BLOCK_FAILED_CHILD     =   64, // descends from failed block
-  BLOCK_FAILED_MASK    =   96
+  BLOCK_FAILED_MASK    =   96,
+
+  BLOCK_PRUNED       =  128  // block and undo data deleted by -prune
 };
 
 struct CDiskBlockPos
@@ -384,6 +395,8 @@ public:
   int64 GetBlockTime() const;
   coin::times::block::time_point GetTimePoint() const;
   CBigNum GetBlockWork() const;
+  // GetBlockWork in fixed-width arithmetic
+  uint256 GetBlockWork256() const;
   bool IsInMainChain() const;
   bool CheckIndex() const;
 
@@ -404,6 +417,14 @@ public:
   void print() const;
 };
 
+/** Block hashes are already uniformly distributed, so any 64 bits of them hash well */
+struct BlockHasher
+{
+  size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 
 #endif
 
@@ -66,6 +66,21 @@ namespace Checkpoints
     }
 #endif
 
+    // UTXO snapshots a new node may start from: height, then block hash and
+    // gettxoutsetinfo hash_serialized at that height. Only add heights that
+    // are buried below a checkpoint as well.
+    typedef std::map<int, std::pair<uint256, uint256> > MapUTXOSnapshots;
+    static const MapUTXOSnapshots mapUTXOSnapshots;
+
+    bool CheckUTXOSnapshot(int nHeight, const uint256& hashBlock, const uint256& hashSerialized)
+    {
+        if (fTestNet) return true; // Testnet has no checkpoints
+
+        MapUTXOSnapshots::const_iterator i = mapUTXOSnapshots.find(nHeight);
+        if (i == mapUTXOSnapshots.end()) return false;
+        return hashBlock == i->second.first && hashSerialized == i->second.second;
+    }
+
     bool CheckBlock(int nHeight, const uint256& hash)
     {
 #ifdef USE_CHECKPOINTS
@@ -131,7 +146,7 @@ namespace Checkpoints
 #endif
     }
 
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex)
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex)
     {
 #ifdef USE_CHECKPOINTS
         if (fTestNet) return NULL; // Testnet has no checkpoints
@@ -143,7 +158,7 @@ namespace Checkpoints
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
         {
             const uint256& hash = i.second;
-            std::map<uint256, CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
+            BlockMap::const_iterator t = mapBlockIndex.find(hash);
             if (t != mapBlockIndex.end())
                 return t->second;
         }
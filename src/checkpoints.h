@@ -4,10 +4,7 @@
 #ifndef BITCOIN_CHECKPOINT_H
 #define BITCOIN_CHECKPOINT_H
 
-#include <map>
-
-class uint256;
-class CBlockIndex;
+#include "block.h"
 
 /** Block-chain checkpoints are compiled-in sanity checks.
  * They are updated every release or three.
@@ -21,7 +18,12 @@ namespace Checkpoints
     int GetTotalBlocksEstimate();
 
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
+
+    // Returns true if a dumptxoutset of the chain at nHeight, ending in block
+    // hashBlock with gettxoutsetinfo hash_serialized hashSerialized, may be
+    // loaded with loadtxoutset
+    bool CheckUTXOSnapshot(int nHeight, const uint256& hashBlock, const uint256& hashSerialized);
 
 #ifdef USE_CHECKPOINTS
     double GuessVerificationProgress(CBlockIndex *pindex);
@@ -1,3 +1,5 @@
+#include <mutex>
+#include <thread>
 #include "hash/hash.h"
 #include "hash/scrypt.hpp"
 #include "n_factor.h"
@@ -96,6 +98,63 @@ std::shared_ptr<hasher> hasher::instance(
       (block_time);
 }
 
+namespace {
+
+//! Idle hashers with the N-factor each one was made
+//! for. Hashers are taken out while in use, so any
+//! number of threads can hash at the same time.
+class hasher_pool
+{
+public:
+  std::shared_ptr<hasher> acquire(
+    coin::times::block::time_point block_time,
+    const n_factor_t& n_factor
+  )
+  {
+    {
+      std::lock_guard<std::mutex> lock(mx);
+      for (auto it = idle.rbegin(); it != idle.rend(); ++it)
+        if (it->first == n_factor)
+        {
+          auto h = std::move(it->second);
+          idle.erase(std::next(it).base());
+          return h;
+        }
+    }
+    return hasher::instance(block_time);
+  }
+
+  void release(
+    const n_factor_t& n_factor, 
+    std::shared_ptr<hasher> h
+  )
+  {
+    std::lock_guard<std::mutex> lock(mx);
+    // keep about one scratchpad per core
+    if (idle.size() >= std::max(4u, std::thread::hardware_concurrency()))
+      idle.erase(idle.begin());
+    idle.emplace_back(n_factor, std::move(h));
+  }
+
+private:
+  std::mutex mx;
+  std::vector<std::pair<n_factor_t, std::shared_ptr<hasher>>> idle;
+};
+
+hasher_pool pool;
+
+}
+
+uint256 hasher::pooled_hash(const CBlock& blk)
+{
+  const auto block_time = blk.GetTimePoint();
+  const n_factor_t n_factor = GetNfactor(block_time);
+  auto h = pool.acquire(block_time, n_factor);
+  const uint256 result = h->hash(blk);
+  pool.release(n_factor, std::move(h));
+  return result;
+}
+
 } // hash
 
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
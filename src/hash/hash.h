@@ -48,6 +48,11 @@ public:
 
   //! Calculates a hash
   virtual uint256 hash(const CBlock& blk) = 0;
+
+  //! Calculates a hash with a hasher borrowed from a
+  //! process-wide pool, so callers on any thread don't
+  //! allocate a scratchpad for every hash.
+  static uint256 pooled_hash(const CBlock& blk);
 };
 
 } // hash
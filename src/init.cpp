@@ -7,6 +7,8 @@
 #include "txdb.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
+#include "stratum.h"
+#include "mergedmining.h"
 #include "net.h"
 #include "init.h"
 #include "util.h"
@@ -86,8 +88,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown()
 {
     printf("Shutdown : In progress...\n");
@@ -98,6 +98,8 @@ void Shutdown()
     RenameThread("bitcoin-shutoff");
     nTransactionsUpdated++;
     StopRPCThreads();
+    StopStratumServer();
+    StopMergedMining();
     ShutdownRPCMining();
     if (pwalletMain)
         bitdb.Flush(false);
@@ -107,10 +109,15 @@ void Shutdown()
         LOCK(cs_main);
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
-        if (pblocktree)
+        if (pblocktree) {
+            FlushBlockFile();
             pblocktree->Flush();
+        }
         if (pcoinsTip)
-            pcoinsTip->Flush();
+            FlushCoinsAndIndexes();
+        if (pcoinsTip && !fReindex && !fImporting)
+            WriteBlockIndexSnapshot();
+        LOCK(cs_LevelDB);
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
@@ -294,6 +301,8 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbcachesplit=<n>      " + _("Percentage of the LevelDB cache used for the block cache shared by both databases, the rest is write buffers (10-90, default: 50, 25 during initial sync)") + "\n" +
+        "  -dbmaxopenfiles=<n>    " + _("Number of table files each LevelDB database keeps open (default: 64, 1000 during initial sync)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -349,6 +358,17 @@ std::string HelpMessage()
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
 #endif
         "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcservertimeout=<n>  " + _("Close JSON-RPC connections that take longer than <n> seconds to send a request (default: 30)") + "\n" +
+        "  -rpcmaxidle=<n>        " + _("Keep at most <n> idle JSON-RPC keep-alive connections open (default: 100)") + "\n" +
+        "  -longpollfees=<amt>    " + _("Wake longpolling miners when this much in new fees entered the memory pool (default: 0.1)") + "\n" +
+        "  -stratum               " + _("Accept Stratum mining connections, paying to this wallet (default: 0)") + "\n" +
+        "  -stratumport=<port>    " + _("Listen for Stratum connections on <port> (default: 3333)") + "\n" +
+        "  -stratumbind=<ip>      " + _("Bind the Stratum server to the given address (default: 127.0.0.1)") + "\n" +
+        "  -stratummaxconnections=<n> " + _("Maintain at most <n> Stratum connections (default: 64)") + "\n" +
+        "  -stratummaxsharerate=<n> " + _("Accept at most <n> shares per second from one Stratum connection (default: 5)") + "\n" +
+        "  -stratumdifficulty=<n> " + _("Initial share difficulty of Stratum miners (default: 16)") + "\n" +
+        "  -stratumsharetarget=<n> " + _("Adjust share difficulty for one share per <n> seconds (default: 10)") + "\n" +
+        "  -auxchain=<url>        " + _("Merged mine the aux chain node at <user>:<password>@<host>:<port> (repeatable)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
@@ -359,6 +379,9 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-4, default: 3)") + "\n" +
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
+        "  -addressindex          " + _("Maintain an index of outputs and inputs by address (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of where each output was spent (default: 0)") + "\n" +
+        "  -prune=<n>             " + _("Keep only recent blocks, deleting old block files to stay under <n> MiB (default: 0 = keep all, minimum: 550)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
@@ -436,6 +459,9 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             LoadExternalBlockFile(file);
         }
     }
+
+    // out-of-order blocks are kept across files, but no longer than this
+    FinishExternalBlockImport();
 }
 
 /** Initialize bitcoin.
@@ -499,6 +525,17 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fBloomFilters)
         nLocalServices |= NODE_BLOOM;
 
+    // a pruned node cannot serve old blocks, nor index transactions in them
+    if (GetArg("-prune", 0) > 0) {
+        if (GetArg("-prune", 0) < MIN_PRUNE_TARGET_MB)
+            return InitError(strprintf(_("Prune target below the minimum of %" PRI64d " MiB"), MIN_PRUNE_TARGET_MB));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex"));
+        fPruneMode = true;
+        nPruneTarget = (uint64)GetArg("-prune", 0) << 20;
+        nLocalServices &= ~NODE_NETWORK;
+    }
+
     if (mapArgs.count("-bind")) {
         // when specifying an explicit binding address, you want to listen on it
         // even when -connect or -proxy is specified
@@ -532,6 +569,10 @@ bool AppInit2(boost::thread_group& threadGroup)
         SoftSetBoolArg("-rescan", true);
     }
 
+    // a rescan would silently skip the blocks that were pruned
+    if (fPruneMode && GetBoolArg("-rescan"))
+        return InitError(_("Rescans are not possible in pruned mode. You will need to use -reindex which will download the whole block chain again."));
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
@@ -612,6 +653,12 @@ bool AppInit2(boost::thread_group& threadGroup)
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"].c_str()));
     }
 
+    if (mapArgs.count("-longpollfees"))
+    {
+        if (!ParseMoney(mapArgs["-longpollfees"], nLongPollFees))
+            return InitError(strprintf(_("Invalid amount for -longpollfees=<amount>: '%s'"), mapArgs["-longpollfees"].c_str()));
+    }
+
     if (mapArgs.count("-paytxfee"))
     {
         if (!ParseMoney(mapArgs["-paytxfee"], nTransactionFee))
@@ -850,18 +897,47 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
     }
 
+    // A snapshot load cut short leaves the databases half written
+    if (UTXOSnapshotLoadUnfinished())
+    {
+        printf("Unfinished UTXO snapshot load found, wiping the block and coin databases\n");
+        fReindex = true;
+    }
+
     // cache size calculations
     size_t nTotalCache = GetArg("-dbcache", 25) << 20;
     if (nTotalCache < (1 << 22))
         nTotalCache = (1 << 22); // total cache cannot be less than 4 MiB
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addressindex", false) && !GetBoolArg("-spentindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
 
+    // The LevelDB share is split between one block cache for both databases
+    // and their write buffers. An initial sync or reindex mostly writes, so
+    // it gets more write buffer and more open table files by default.
+    bool fInitialSync = fReindex || !filesystem::exists(GetDataDir() / "chainstate");
+    int nCacheSplit = std::max(10, std::min(90, (int)GetArg("-dbcachesplit", fInitialSync ? 25 : 50)));
+    size_t nBlockCache = (nBlockTreeDBCache + nCoinDBCache) / 100 * nCacheSplit;
+    nBlockTreeDBCache = nBlockTreeDBCache / 100 * (100 - nCacheSplit);
+    nCoinDBCache = nCoinDBCache / 100 * (100 - nCacheSplit);
+    SetLevelDBBlockCache(nBlockCache);
+
+    // MIN_CORE_FILEDESCRIPTORS covers 64 open files per database
+    int nDBMaxOpenFiles = std::max(16, (int)GetArg("-dbmaxopenfiles", fInitialSync ? 1000 : 64));
+    if (nDBMaxOpenFiles > 64) {
+        int nFDNeeded = nMaxConnections + MIN_CORE_FILEDESCRIPTORS + 2 * (nDBMaxOpenFiles - 64);
+        int nFDAvail = RaiseFileDescriptorLimit(nFDNeeded);
+        if (nFDAvail < nFDNeeded)
+            nDBMaxOpenFiles = std::max(64, nDBMaxOpenFiles - (nFDNeeded - nFDAvail + 1) / 2);
+    }
+    SetLevelDBMaxOpenFiles(nDBMaxOpenFiles);
+    printf("Using %" PRIszu " MiB LevelDB block cache, %i open files per database%s\n",
+        nBlockCache >> 20, nDBMaxOpenFiles, fInitialSync ? " (initial sync profile)" : "");
+
     bool fLoaded = false;
     while (!fLoaded) {
         bool fReset = fReindex;
@@ -872,17 +948,22 @@ bool AppInit2(boost::thread_group& threadGroup)
         nStart = GetTimeMillis();
         do {
             try {
-                UnloadBlockIndex();
-                delete pcoinsTip;
-                delete pcoinsdbview;
-                delete pblocktree;
-
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                {
+                    LOCK2(cs_main, cs_LevelDB);
+                    UnloadBlockIndex();
+                    delete pcoinsTip;
+                    delete pcoinsdbview;
+                    delete pblocktree;
+
+                    pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                    pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                    pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                }
 
-                if (fReindex)
+                if (fReindex) {
                     pblocktree->WriteReindexing(true);
+                    ClearUTXOSnapshotLoad();
+                }
 
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
@@ -906,6 +987,22 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Check for changed -addressindex and -spentindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+                if (fSpentIndex != GetBoolArg("-spentindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+
+                // Pruned history only comes back by downloading it again
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode. This will download the entire block chain again");
+                    break;
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg( "-checkblocks", 288))) {
@@ -958,7 +1055,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1059,6 +1156,15 @@ bool AppInit2(boost::thread_group& threadGroup)
             else
                 pindexRescan = pindexGenesisBlock;
         }
+        if (pindexBest && pindexBest != pindexRescan && fHavePruned)
+        {
+            // every block the wallet missed must still be on disk
+            CBlockIndex *pindex = pindexBest;
+            while (pindex && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA) && pindex != pindexRescan)
+                pindex = pindex->pprev;
+            if (pindex != pindexRescan)
+                return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole block chain again)."));
+        }
         if (pindexBest && pindexBest != pindexRescan)
         {
             uiInterface.InitMessage(_("Rescanning..."));
@@ -1125,6 +1231,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    // Push mining jobs to Stratum miners, with the -auxchain blocks committed
+    StartMergedMining();
+    StartStratumServer();
+
     // Generate coins in the background
     if (pwalletMain)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
@@ -0,0 +1,509 @@
+#ifndef JSON_SPIRIT_FAST
+#define JSON_SPIRIT_FAST
+
+//          Copyright John W. Wilkinson 2007 - 2009.
+// Distributed under the MIT License, see accompanying file LICENSE.txt
+
+/// Bitcoin: single pass reader and writer for json_spirit::Value.
+///
+/// read_string() and write_string() go through Boost.Spirit and
+/// std::ostringstream, which dominates RPC time for big requests and
+/// replies. fast_read_string() is a hand written recursive descent
+/// parser that builds the Value tree in place, fast_write_string()
+/// appends straight to one std::string. Both accept and produce exactly
+/// what the json_spirit templates do, so they can be swapped in freely.
+
+#include "json_spirit_value.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cwctype>
+#include <limits>
+#include <string>
+
+namespace json_spirit
+{
+    namespace fast
+    {
+        // nesting limit, so hostile input can't exhaust the stack
+        static const int max_depth = 512;
+
+        class Reader
+        {
+        public:
+
+            Reader( const char* begin, const char* end )
+            :   p_( begin )
+            ,   end_( end )
+            {
+            }
+
+            bool read( Value& value )
+            {
+                skip_ws();
+
+                return read_value( value, 0 );
+            }
+
+        private:
+
+            const char* p_;
+            const char* end_;
+
+            void skip_ws()
+            {
+                while( p_ != end_ && ( *p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r' || *p_ == '\f' || *p_ == '\v' ) ) ++p_;
+            }
+
+            bool literal( const char* s )
+            {
+                const char* q = p_;
+
+                for( ; *s; ++s, ++q )
+                {
+                    if( q == end_ || *q != *s ) return false;
+                }
+
+                p_ = q;
+
+                return true;
+            }
+
+            bool read_value( Value& value, int depth )
+            {
+                if( p_ == end_ ) return false;
+
+                switch( *p_ )
+                {
+                    case '{': return read_object( value, depth + 1 );
+                    case '[': return read_array( value, depth + 1 );
+                    case '"':
+                    {
+                        std::string s;
+
+                        if( !read_str( s ) ) return false;
+
+                        value = Value( s );
+
+                        return true;
+                    }
+                    case 't': if( !literal( "true" ) )  return false; value = Value( true );  return true;
+                    case 'f': if( !literal( "false" ) ) return false; value = Value( false ); return true;
+                    case 'n': if( !literal( "null" ) )  return false; value = Value();        return true;
+                }
+
+                return read_number( value );
+            }
+
+            bool read_object( Value& value, int depth )
+            {
+                if( depth > max_depth ) return false;
+
+                ++p_;  // '{'
+
+                value = Object();
+
+                Object& obj = value.get_obj();
+
+                skip_ws();
+
+                if( p_ != end_ && *p_ == '}' ) { ++p_; return true; }
+
+                for( ;; )
+                {
+                    if( p_ == end_ || *p_ != '"' ) return false;
+
+                    obj.push_back( Pair( std::string(), Value() ) );
+
+                    if( !read_str( obj.back().name_ ) ) return false;
+
+                    skip_ws();
+
+                    if( p_ == end_ || *p_ != ':' ) return false;
+
+                    ++p_;
+
+                    skip_ws();
+
+                    if( !read_value( obj.back().value_, depth ) ) return false;
+
+                    skip_ws();
+
+                    if( p_ == end_ ) return false;
+
+                    if( *p_ == '}' ) { ++p_; return true; }
+
+                    if( *p_ != ',' ) return false;
+
+                    ++p_;
+
+                    skip_ws();
+                }
+            }
+
+            bool read_array( Value& value, int depth )
+            {
+                if( depth > max_depth ) return false;
+
+                ++p_;  // '['
+
+                value = Array();
+
+                Array& arr = value.get_array();
+
+                skip_ws();
+
+                if( p_ != end_ && *p_ == ']' ) { ++p_; return true; }
+
+                for( ;; )
+                {
+                    arr.push_back( Value() );
+
+                    if( !read_value( arr.back(), depth ) ) return false;
+
+                    skip_ws();
+
+                    if( p_ == end_ ) return false;
+
+                    if( *p_ == ']' ) { ++p_; return true; }
+
+                    if( *p_ != ',' ) return false;
+
+                    ++p_;
+
+                    skip_ws();
+                }
+            }
+
+            static int hex_digit( char c )
+            {
+                if( ( c >= '0' ) && ( c <= '9' ) ) return c - '0';
+                if( ( c >= 'a' ) && ( c <= 'f' ) ) return c - 'a' + 10;
+                if( ( c >= 'A' ) && ( c <= 'F' ) ) return c - 'A' + 10;
+                return -1;
+            }
+
+            bool read_hex( int n, unsigned int& result )
+            {
+                if( end_ - p_ < n ) return false;
+
+                result = 0;
+
+                for( int i = 0; i < n; ++i )
+                {
+                    const int d = hex_digit( p_[i] );
+
+                    if( d < 0 ) return false;
+
+                    result = ( result << 4 ) + d;
+                }
+
+                p_ += n;
+
+                return true;
+            }
+
+            // same escapes as json_spirit, including its "\xHH" extension;
+            // "\uHHHH" is narrowed to a single char just like there
+            bool read_str( std::string& s )
+            {
+                ++p_;  // '"'
+
+                const char* start = p_;
+
+                while( p_ != end_ && *p_ != '"' && *p_ != '\\' ) ++p_;
+
+                s.assign( start, p_ );
+
+                while( p_ != end_ )
+                {
+                    const char c = *p_++;
+
+                    if( c == '"' ) return true;
+
+                    if( c != '\\' ) { s += c; continue; }
+
+                    if( p_ == end_ ) return false;
+
+                    unsigned int ch;
+
+                    switch( *p_++ )
+                    {
+                        case '"':  s += '"';  break;
+                        case '\\': s += '\\'; break;
+                        case '/':  s += '/';  break;
+                        case 'b':  s += '\b'; break;
+                        case 'f':  s += '\f'; break;
+                        case 'n':  s += '\n'; break;
+                        case 'r':  s += '\r'; break;
+                        case 't':  s += '\t'; break;
+                        case 'x':  if( !read_hex( 2, ch ) ) return false; s += static_cast< char >( ch ); break;
+                        case 'u':  if( !read_hex( 4, ch ) ) return false; s += static_cast< char >( ch ); break;
+                        default: return false;
+                    }
+                }
+
+                return false;
+            }
+
+            // integers become int64, or uint64 if they only fit there;
+            // anything with a fraction or exponent is a double
+            bool read_number( Value& value )
+            {
+                const char* start = p_;
+                const char* q = p_;
+
+                if( q != end_ && ( *q == '-' || *q == '+' ) ) ++q;
+
+                const char* digits = q;
+
+                while( q != end_ && *q >= '0' && *q <= '9' ) ++q;
+
+                bool is_real = false;
+
+                if( q != end_ && *q == '.' )
+                {
+                    is_real = true;
+                    ++q;
+                    while( q != end_ && *q >= '0' && *q <= '9' ) ++q;
+                }
+
+                if( q == digits || ( q == digits + 1 && *digits == '.' ) ) return false;
+
+                if( q != end_ && ( *q == 'e' || *q == 'E' ) )
+                {
+                    const char* e = q + 1;
+
+                    if( e != end_ && ( *e == '-' || *e == '+' ) ) ++e;
+
+                    if( e != end_ && *e >= '0' && *e <= '9' )
+                    {
+                        is_real = true;
+                        q = e;
+                        while( q != end_ && *q >= '0' && *q <= '9' ) ++q;
+                    }
+                }
+
+                const std::string num( start, q );
+
+                p_ = q;
+
+                char* num_end = 0;
+
+                errno = 0;
+
+                if( is_real )
+                {
+                    value = Value( strtod( num.c_str(), &num_end ) );
+
+                    return true;
+                }
+
+                const long long i = strtoll( num.c_str(), &num_end, 10 );
+
+                if( errno == 0 )
+                {
+                    value = Value( static_cast< boost::int64_t >( i ) );
+
+                    return true;
+                }
+
+                if( *start == '-' ) return false;
+
+                errno = 0;
+
+                const unsigned long long u = strtoull( num.c_str(), &num_end, 10 );
+
+                if( errno != 0 ) return false;
+
+                value = Value( static_cast< boost::uint64_t >( u ) );
+
+                return true;
+            }
+        };
+
+        class Writer
+        {
+        public:
+
+            Writer( std::string& out, bool pretty )
+            :   out_( out )
+            ,   indentation_level_( 0 )
+            ,   pretty_( pretty )
+            {
+            }
+
+            void output( const Value& value )
+            {
+                // fits "%.8f" of -DBL_MAX: sign, 309 integer digits, point, 8 decimals, NUL
+                char buf[ std::numeric_limits< double >::max_exponent10 + 12 ];
+
+                switch( value.type() )
+                {
+                    case obj_type:   output_obj( value.get_obj() );     break;
+                    case array_type: output_array( value.get_array() ); break;
+                    case str_type:   output_str( value.get_str() );     break;
+                    case bool_type:  out_ += value.get_bool() ? "true" : "false"; break;
+                    case int_type:
+                        if( value.is_uint64() )
+                            snprintf( buf, sizeof( buf ), "%llu", static_cast< unsigned long long >( value.get_uint64() ) );
+                        else
+                            snprintf( buf, sizeof( buf ), "%lld", static_cast< long long >( value.get_int64() ) );
+                        out_ += buf;
+                        break;
+                    case real_type:
+                        snprintf( buf, sizeof( buf ), "%.8f", value.get_real() );
+                        out_ += buf;
+                        break;
+                    case null_type:  out_ += "null";                   break;
+                    default: assert( false );
+                }
+            }
+
+        private:
+
+            void output_obj( const Object& obj )
+            {
+                out_ += '{'; new_line();
+
+                ++indentation_level_;
+
+                for( Object::const_iterator i = obj.begin(); i != obj.end(); ++i )
+                {
+                    if( i != obj.begin() ) { out_ += ','; new_line(); }
+
+                    indent();
+                    output_str( i->name_ );
+                    space(); out_ += ':'; space();
+                    output( i->value_ );
+                }
+
+                if( !obj.empty() ) new_line();
+
+                --indentation_level_;
+
+                indent(); out_ += '}';
+            }
+
+            void output_array( const Array& arr )
+            {
+                out_ += '['; new_line();
+
+                ++indentation_level_;
+
+                for( Array::const_iterator i = arr.begin(); i != arr.end(); ++i )
+                {
+                    if( i != arr.begin() ) { out_ += ','; new_line(); }
+
+                    indent();
+                    output( *i );
+                }
+
+                if( !arr.empty() ) new_line();
+
+                --indentation_level_;
+
+                indent(); out_ += ']';
+            }
+
+            void output_str( const std::string& s )
+            {
+                static const char hex[] = "0123456789ABCDEF";
+
+                out_ += '"';
+
+                const char* run = s.data();
+                const char* end = run + s.size();
+
+                for( const char* i = run; i != end; ++i )
+                {
+                    const unsigned char c = static_cast< unsigned char >( *i );
+
+                    // the common case: printable ASCII that needs no escape
+                    if( c >= 0x20 && c < 0x7f && c != '"' && c != '\\' ) continue;
+
+                    const char* esc = 0;
+
+                    switch( c )
+                    {
+                        case '"':  esc = "\\\""; break;
+                        case '\\': esc = "\\\\"; break;
+                        case '\b': esc = "\\b";  break;
+                        case '\f': esc = "\\f";  break;
+                        case '\n': esc = "\\n";  break;
+                        case '\r': esc = "\\r";  break;
+                        case '\t': esc = "\\t";  break;
+                    }
+
+                    if( !esc && iswprint( c ) ) continue;
+
+                    out_.append( run, i );
+                    run = i + 1;
+
+                    if( esc )
+                    {
+                        out_ += esc;
+                    }
+                    else
+                    {
+                        const char u[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF], 0 };
+                        out_ += u;
+                    }
+                }
+
+                out_.append( run, end );
+
+                out_ += '"';
+            }
+
+            void indent()
+            {
+                if( !pretty_ ) return;
+
+                out_.append( 4 * indentation_level_, ' ' );
+            }
+
+            void space()
+            {
+                if( pretty_ ) out_ += ' ';
+            }
+
+            void new_line()
+            {
+                if( pretty_ ) out_ += '\n';
+            }
+
+            std::string& out_;
+            int indentation_level_;
+            bool pretty_;
+        };
+    }
+
+    // drop-in for read_string( s, value ) on std::string input
+    inline bool fast_read_string( const std::string& s, Value& value )
+    {
+        fast::Reader reader( s.data(), s.data() + s.size() );
+
+        return reader.read( value );
+    }
+
+    // appends the JSON text of value to out
+    inline void fast_write_string( const Value& value, std::string& out, bool pretty = false )
+    {
+        fast::Writer( out, pretty ).output( value );
+    }
+
+    // drop-in for write_string( value, pretty )
+    inline std::string fast_write_string( const Value& value, bool pretty = false )
+    {
+        std::string out;
+
+        fast_write_string( value, out, pretty );
+
+        return out;
+    }
+}
+
+#endif
@@ -24,13 +24,40 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
+// Settings for the databases opened from now on
+static leveldb::Cache *pcacheShared = NULL;
+static int nMaxOpenFiles = 64;
+
+void SetLevelDBBlockCache(size_t nSize) {
+    delete pcacheShared;
+    pcacheShared = nSize ? leveldb::NewLRUCache(nSize) : NULL;
+}
+
+void SetLevelDBMaxOpenFiles(int nFiles) {
+    nMaxOpenFiles = nFiles;
+}
+
+class CLevelDBCleanup
+{
+public:
+    ~CLevelDBCleanup() {
+        SetLevelDBBlockCache(0);
+    }
+} instance_of_cleveldbcleanup;
+
 static leveldb::Options GetOptions(size_t nCacheSize) {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    if (pcacheShared) {
+        // all of nCacheSize is for the write buffers; up to two may be held in memory simultaneously
+        options.block_cache = pcacheShared;
+        options.write_buffer_size = nCacheSize / 2;
+    } else {
+        options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
+        options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    }
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.max_open_files = nMaxOpenFiles;
     return options;
 }
 
@@ -42,6 +69,7 @@ CLevelDB::CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool
     syncoptions.sync = true;
     options = GetOptions(nCacheSize);
     options.create_if_missing = true;
+    fSharedCache = (options.block_cache == pcacheShared);
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
         options.env = penv;
@@ -64,12 +92,29 @@ CLevelDB::~CLevelDB() {
     pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
-    delete options.block_cache;
+    if (!fSharedCache)
+        delete options.block_cache;
     options.block_cache = NULL;
     delete penv;
     options.env = NULL;
 }
 
+// Replays the changes of a batch into another
+class CLevelDBBatchAppender : public leveldb::WriteBatch::Handler {
+public:
+    leveldb::WriteBatch &batch;
+    CLevelDBBatchAppender(leveldb::WriteBatch &batchIn) : batch(batchIn) {}
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value) { batch.Put(key, value); }
+    void Delete(const leveldb::Slice& key) { batch.Delete(key); }
+};
+
+void CLevelDBBatch::Append(const CLevelDBBatch& batchIn) {
+    CLevelDBBatchAppender appender(batch);
+    leveldb::Status status = batchIn.batch.Iterate(&appender);
+    assert(status.ok());
+    nSize += batchIn.nSize;
+}
+
 bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
     if (!status.ok()) {
@@ -79,3 +124,19 @@ bool CLevelDB::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error)
     }
     return true;
 }
+
+void CLevelDB::Compact() {
+    pdb->CompactRange(NULL, NULL);
+}
+
+bool CLevelDB::GetProperty(const std::string &strName, std::string &strValue) {
+    return pdb->GetProperty(strName, &strValue);
+}
+
+uint64 CLevelDB::GetApproximateSize() {
+    // all our keys start with a type character below 0xff
+    leveldb::Range range("", "\xff");
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
@@ -19,6 +19,12 @@ public:
 
 void HandleError(const leveldb::Status &status) throw(leveldb_error);
 
+/** Share one LRU block cache of nSize bytes among the databases opened from
+ *  now on; with 0, each gets its own sized from its nCacheSize as before */
+void SetLevelDBBlockCache(size_t nSize);
+/** Number of table files each database opened from now on may keep open */
+void SetLevelDBMaxOpenFiles(int nFiles);
+
 // Batch of changes queued to be written to a CLevelDB
 class CLevelDBBatch
 {
@@ -26,8 +32,11 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t nSize;
 
 public:
+    CLevelDBBatch() : nSize(0) {}
+
     template<typename K, typename V> void Write(const K& key, const V& value) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
@@ -40,6 +49,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSize += slKey.size() + slValue.size();
     }
 
     template<typename K> void Erase(const K& key) {
@@ -49,7 +59,19 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSize += slKey.size();
+    }
+
+    // Queue the changes of batchIn after those queued already
+    void Append(const CLevelDBBatch& batchIn);
+
+    void Clear() {
+        batch.Clear();
+        nSize = 0;
     }
+
+    // Bytes of keys and values queued, 0 if empty
+    size_t GetSize() const { return nSize; }
 };
 
 class CLevelDB
@@ -76,6 +98,9 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    // whether options.block_cache is the one from SetLevelDBBlockCache
+    bool fSharedCache;
+
 public:
     CLevelDB(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
     ~CLevelDB();
@@ -148,6 +173,19 @@ public:
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // Compact the whole database, dropping erased and overwritten entries
+    void Compact();
+
+    // One of LevelDB's internal properties, such as "leveldb.stats"
+    bool GetProperty(const std::string &strName, std::string &strValue);
+
+    // Approximate size on disk, in bytes
+    uint64 GetApproximateSize();
+
+    const leveldb::Options &GetDBOptions() const {
+        return options;
+    }
 };
 
 #endif // BITCOIN_LEVELDB_H
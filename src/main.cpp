@@ -5,9 +5,14 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <vector>
+#include <deque>
+#include <atomic>
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include "alert.h"
 #include "checkpoints.h"
 #include "db.h"
@@ -18,6 +23,7 @@
 #include "ui_interface.h"
 #include "checkqueue.h"
 #include "hash/hash.h"
+#include "n_factor.h"
 #include "btc_time.h"
 #include "block.h"
 #include "log.h"
@@ -34,11 +40,19 @@ CCriticalSection cs_setpwalletRegistered;
 set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
+CCriticalSection cs_LevelDB;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
-
-map<uint256, CBlockIndex*> mapBlockIndex;
+boost::mutex csTemplateChange;
+boost::condition_variable cvTemplateChange;
+unsigned int nTemplateChanges = 0;
+int64 nLongPollFees = 0.1 * COIN;
+
+BlockMap mapBlockIndex;
+// Storage of the mapBlockIndex entries: one allocation per few hundred
+// entries instead of one each, and never moved once placed
+static std::deque<CBlockIndex> dequeBlockIndex;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
@@ -52,7 +66,14 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
 unsigned int nCoinCacheSize = 5000;
+bool fPruneMode = false;
+uint64 nPruneTarget = 0;
+bool fHavePruned = false;
+// Set when a block file fills up, and at startup in prune mode
+static bool fCheckForPruning = false;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = 100000;
@@ -64,6 +85,21 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Tip of the most-work header chain not known to be invalid, and that chain
+// by height. Blocks past the active tip are downloaded along it.
+CBlockIndex* pindexBestHeader = NULL;
+static vector<CBlockIndex*> vBestHeaderChain;
+
+// Blocks requested by the download window, and from whom. Guarded by its own
+// lock since peers are released from the network thread without cs_main.
+struct CBlockInFlight
+{
+  CNode* pnode;
+  int64 nTime;
+};
+static CCriticalSection cs_mapBlocksInFlight;
+static map<uint256, CBlockInFlight> mapBlocksInFlight;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -174,13 +210,36 @@ void static ResendWalletTransactions()
 // CCoinsView implementations
 //
 
+void CCoinsStats::Add(CHashWriter &ss, const uint256 &txid, const CCoins &coins)
+{
+  ss << txid;
+  ss << VARINT(coins.nVersion);
+  ss << (coins.fCoinBase ? 'c' : 'n');
+  ss << VARINT(coins.nHeight);
+  nTransactions++;
+  for (unsigned int i=0; i<coins.vout.size(); i++) {
+    const CTxOut &out = coins.vout[i];
+    if (!out.IsNull()) {
+      nTransactionOutputs++;
+      ss << VARINT(i+1);
+      ss << out;
+      nTotalAmount += out.nValue;
+    }
+  }
+  nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+  ss << VARINT(0);
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
 bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
+uint256 CCoinsView::GetBestBlockHash() { return 0; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
 bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
+bool CCoinsView::ForEachCoins(const CCoinsVisitor &visitor) { return false; }
+CCoinsView::CCoinsWalker CCoinsView::SnapshotCoins() { return CCoinsWalker(); }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
@@ -188,10 +247,13 @@ bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) { return bas
 bool CCoinsViewBacked::SetCoins(const uint256 &txid, const CCoins &coins) { return base->SetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(txid); }
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
+uint256 CCoinsViewBacked::GetBestBlockHash() { return base->GetBestBlockHash(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
+bool CCoinsViewBacked::ForEachCoins(const CCoinsVisitor &visitor) { return base->ForEachCoins(visitor); }
+CCoinsView::CCoinsWalker CCoinsViewBacked::SnapshotCoins() { return base->SnapshotCoins(); }
 
 CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
 
@@ -240,6 +302,12 @@ CBlockIndex *CCoinsViewCache::GetBestBlock() {
   return pindexTip;
 }
 
+uint256 CCoinsViewCache::GetBestBlockHash() {
+  if (pindexTip != NULL)
+    return pindexTip->GetBlockHash();
+  return base->GetBestBlockHash();
+}
+
 bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
   pindexTip = pindex;
   return true;
@@ -282,6 +350,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
   return mempool.exists(txid) || base->HaveCoins(txid);
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -596,7 +665,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
   }
 
   // Is the tx in a block that's in the main chain
-  map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+  BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
   if (mi == mapBlockIndex.end())
     return 0;
   CBlockIndex* pindex = (*mi).second;
@@ -773,6 +842,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     }
   }
 
+  int64 nFees = 0;
   if (fCheckInputs)
   {
     CCoinsView dummy;
@@ -817,7 +887,7 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     // you should add code here to check that the transaction does a
     // reasonable number of ECDSA signature verifications.
 
-    int64 nFees = tx.GetValueIn(view)-tx.GetValueOut();
+    nFees = tx.GetValueIn(view)-tx.GetValueOut();
     unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
     // Don't accept it if it can't get into a block
@@ -868,6 +938,8 @@ bool CTxMemPool::accept(CValidationState &state, CTransaction &tx, bool fCheckIn
     }
     addUnchecked(hash, tx);
   }
+  if (nFees > 0)
+    NotifyTemplateFees(nFees);
 
   ///// are we sure this is ok when loading transactions or restoring block txes
   // If updated, erase old tx from wallet
@@ -887,6 +959,39 @@ bool CTransaction::AcceptToMemoryPool(CValidationState &state, bool fCheckInputs
   }
 }
 
+// New mempool fees since the last template change, and when that was
+static int64 nTemplateFees = 0;
+static int64 nTemplateChangeTime = 0;
+
+// Fee driven template changes are no more frequent than this, in seconds
+static const int64 TEMPLATE_FEES_INTERVAL = 10;
+
+void NotifyTemplateChange()
+{
+  boost::unique_lock<boost::mutex> lock(csTemplateChange);
+  nTemplateChanges++;
+  nTemplateFees = 0;
+  nTemplateChangeTime = GetTime();
+  cvTemplateChange.notify_all();
+}
+
+unsigned int GetTemplateChanges()
+{
+  boost::unique_lock<boost::mutex> lock(csTemplateChange);
+  return nTemplateChanges;
+}
+
+void NotifyTemplateFees(int64 nFees)
+{
+  {
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    nTemplateFees += nFees;
+    if (nTemplateFees < nLongPollFees || GetTime() - nTemplateChangeTime < TEMPLATE_FEES_INTERVAL)
+      return;
+  }
+  NotifyTemplateChange();
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
 {
   // Add to memory pool without checking anything.  Don't call this directly,
@@ -902,11 +1007,15 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTransaction &tx)
 
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
+{
+  return remove(tx, tx.GetHash(), fRecursive);
+}
+
+bool CTxMemPool::remove(const CTransaction &tx, const uint256 &hash, bool fRecursive)
 {
   // Remove transaction from memory pool
   {
     LOCK(cs);
-    uint256 hash = tx.GetHash();
     if (fRecursive) {
       for (unsigned int i = 0; i < tx.vout.size(); i++) {
         std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
@@ -967,7 +1076,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
     return 0;
 
   // Find the block it claims to be in
-  map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+  BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
   if (mi == mapBlockIndex.end())
     return 0;
   CBlockIndex* pindex = (*mi).second;
@@ -1041,12 +1150,16 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     if (fTxIndex) {
       CDiskTxPos postx;
       if (pblocktree->ReadTxIndex(hash, postx)) {
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+        // Decode only the header and the one transaction, in place
+        CMappedBlock block(postx);
+        if (block.IsNull())
+          return error("%s() : MapBlockFile failed", __PRETTY_FUNCTION__);
         CBlockHeader header;
         try {
-          file >> header;
-          fseek(file, postx.nTxOffset, SEEK_CUR);
-          file >> txOut;
+          CMemoryReader reader = block.GetReader();
+          reader >> header;
+          reader.ignore(postx.nTxOffset);
+          reader >> txOut;
         } catch (std::exception &e) {
           return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
         }
@@ -1071,13 +1184,13 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
   }
 
   if (pindexSlow) {
-    CBlock block;
+    // Hash the transactions in place and decode only the one asked for
+    CBlockView block;
     if (block.ReadFromDisk(pindexSlow)) {
-      BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        if (tx.GetHash() == hash) {
-          txOut = tx;
+      for (unsigned int i = 0; i < block.GetTxCount(); i++) {
+        if (block.GetTxHash(i) == hash) {
           hashBlock = pindexSlow->GetBlockHash();
-          return true;
+          return block.GetTransaction(i, txOut);
         }
       }
     }
@@ -1140,6 +1253,170 @@ uint256 static GetOrphanRoot(const CBlockHeader* pblock)
   return pblock->GetHash();
 }
 
+// Whether blocks building on pindex can be stored: we have its data and that
+// of its ancestors, or it is connected already (if only from a UTXO snapshot)
+static bool HaveBlockData(const CBlockIndex* pindex)
+{
+  return (pindex->nStatus & BLOCK_HAVE_DATA) || pindex == pindexBest || pindex->pnext != NULL;
+}
+
+static bool HaveBlockData(const uint256& hash)
+{
+  BlockMap::iterator mi = mapBlockIndex.find(hash);
+  return mi != mapBlockIndex.end() && HaveBlockData(mi->second);
+}
+
+static void SetBestHeader(CBlockIndex* pindex)
+{
+  pindexBestHeader = pindex;
+  vBestHeaderChain.resize(pindex->nHeight + 1);
+  while (pindex && vBestHeaderChain[pindex->nHeight] != pindex)
+  {
+    vBestHeaderChain[pindex->nHeight] = pindex;
+    pindex = pindex->pprev;
+  }
+}
+
+static void UpdateBestHeader(CBlockIndex* pindex)
+{
+  if (pindexBestHeader == NULL || pindex->nChainWork > pindexBestHeader->nChainWork)
+    SetBestHeader(pindex);
+}
+
+// Recompute pindexBestHeader from scratch, skipping header chains that
+// descend from a block found invalid
+void FindBestHeader()
+{
+  vector<CBlockIndex*> vCandidates;
+  BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    if (pindexBest == NULL || item.second->nChainWork > pindexBest->nChainWork)
+      vCandidates.push_back(item.second);
+  sort(vCandidates.begin(), vCandidates.end(), CBlockIndexWorkComparator());
+
+  CBlockIndex* pindexNewBest = pindexBest;
+  for (vector<CBlockIndex*>::reverse_iterator it = vCandidates.rbegin(); it != vCandidates.rend(); ++it)
+  {
+    CBlockIndex* pindex = *it;
+    while (pindex && pindex != pindexBest && pindex->pnext == NULL && !(pindex->nStatus & BLOCK_FAILED_MASK))
+      pindex = pindex->pprev;
+    if (pindex == NULL || !(pindex->nStatus & BLOCK_FAILED_MASK))
+    {
+      pindexNewBest = *it;
+      break;
+    }
+  }
+
+  pindexBestHeader = NULL;
+  vBestHeaderChain.clear();
+  if (pindexNewBest)
+    SetBestHeader(pindexNewBest);
+}
+
+// Ask pfrom for the headers leading up to an orphan block. If we have them
+// already, its missing parents are on their way through the download window.
+void static AskForOrphanParents(CNode* pfrom, CBlock* pblockOrphan)
+{
+  uint256 hashRoot = GetOrphanRoot(pblockOrphan);
+  if (!mapBlockIndex.count(mapOrphanBlocks[hashRoot]->hashPrevBlock))
+    pfrom->PushGetHeaders(pindexBestHeader, hashRoot);
+}
+
+// Remember the most-work block pfrom is known to have, to ask it for blocks up to there
+void static UpdateBlockAvailability(CNode* pfrom, const uint256& hash)
+{
+  BlockMap::iterator mi = mapBlockIndex.find(hash);
+  if (mi == mapBlockIndex.end())
+    return;
+  if (pfrom->pindexBestKnownBlock == NULL || mi->second->nChainWork > pfrom->pindexBestKnownBlock->nChainWork)
+    pfrom->pindexBestKnownBlock = mi->second;
+}
+
+void ReleaseBlocksInFlight(CNode* pnode)
+{
+  LOCK(cs_mapBlocksInFlight);
+  map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin();
+  while (it != mapBlocksInFlight.end())
+  {
+    if (it->second.pnode == pnode)
+      mapBlocksInFlight.erase(it++);
+    else
+      ++it;
+  }
+  pnode->nBlocksInFlight = 0;
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+  LOCK(cs_mapBlocksInFlight);
+  map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+  if (it != mapBlocksInFlight.end())
+  {
+    it->second.pnode->nBlocksInFlight--;
+    mapBlocksInFlight.erase(it);
+  }
+}
+
+// Headers-first download window: request from pto the next blocks of the
+// best header chain that we are missing, up to BLOCK_DOWNLOAD_WINDOW past the
+// point where it leaves the active chain
+void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+  // Inbound peers only take part once the initial download is done, as new
+  // blocks they announce are fetched here too
+  if ((pto->fInbound && IsInitialBlockDownload()) || pto->fClient || pto->fOneShot || pto->fDisconnect || !pto->fSuccessfullyConnected)
+    return;
+  if (!(pto->nServices & NODE_NETWORK)) // pruned peers only have recent blocks
+    return;
+  if (pindexBestHeader == NULL || pindexBest == NULL || pindexBestHeader->nChainWork <= pindexBest->nChainWork)
+    return;
+
+  int nPeerHeight = pto->nStartingHeight;
+  if (pto->pindexBestKnownBlock && pto->pindexBestKnownBlock->nHeight > nPeerHeight)
+    nPeerHeight = pto->pindexBestKnownBlock->nHeight;
+
+  int nFork = std::min(pindexBest->nHeight, pindexBestHeader->nHeight);
+  while (nFork > 0 && vBestHeaderChain[nFork] != pindexBest && vBestHeaderChain[nFork]->pnext == NULL)
+    nFork--;
+  int nWindowEnd = std::min(nFork + BLOCK_DOWNLOAD_WINDOW, std::min(pindexBestHeader->nHeight, nPeerHeight));
+
+  int64 nNow = GetTime();
+  bool fFirstMissing = true;
+  LOCK(cs_mapBlocksInFlight);
+  for (int nHeight = nFork + 1; nHeight <= nWindowEnd; nHeight++)
+  {
+    CBlockIndex* pindex = vBestHeaderChain[nHeight];
+    if (pindex->nStatus & BLOCK_FAILED_MASK)
+      break;
+    const uint256& hash = pindex->GetBlockHash();
+    if ((pindex->nStatus & BLOCK_HAVE_DATA) || mapOrphanBlocks.count(hash))
+      continue;
+
+    map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.find(hash);
+    if (it != mapBlocksInFlight.end())
+    {
+      // The whole window waits for its first missing block; a peer sitting
+      // on that one gets dropped, which hands its requests to the others
+      if (fFirstMissing && it->second.pnode == pto && nNow - it->second.nTime > BLOCK_STALLING_TIMEOUT)
+      {
+        printf("peer %s is stalling block download at height %d, disconnecting\n", pto->addr.ToString().c_str(), nHeight);
+        pto->fDisconnect = true;
+        return;
+      }
+      fFirstMissing = false;
+      continue;
+    }
+    fFirstMissing = false;
+    if (pto->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+      break;
+
+    CBlockInFlight& inflight = mapBlocksInFlight[hash];
+    inflight.pnode = pto;
+    inflight.nTime = nNow;
+    pto->nBlocksInFlight++;
+    vGetData.push_back(CInv(MSG_BLOCK, hash));
+  }
+}
+
 
 int64 static GetBlockValue(int nHeight, int64 nFees)
 {
@@ -1192,6 +1469,7 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
   if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
     printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
+  FindBestHeader();
 }
 
 void static InvalidBlockFound(CBlockIndex *pindex) {
@@ -1283,8 +1561,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 uint256 CBlockHeader::GetPoWHash() const
 {
-  return ::hash::hasher::instance(GetTimePoint())
-    -> hash(*this);
+  return ::hash::hasher::pooled_hash(*this);
 }
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
@@ -1453,7 +1730,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
 
 
 
-bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean)
+bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &view, bool *pfClean, CLevelDBBatch *pbatchIndex)
 {
   assert(pindex == view.GetBestBlock());
 
@@ -1472,11 +1749,26 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
   if (blockUndo.vtxundo.size() + 1 != vtx.size())
     return error("DisconnectBlock() : block and undo data inconsistent");
 
+  std::vector<CAddressIndexEntry> vAddressIndex;
+  std::vector<CAddressUnspentEntry> vAddressUnspent;
+  std::vector<CSpentIndexEntry> vSpentIndex;
+
   // undo transactions in reverse order
   for (int i = vtx.size() - 1; i >= 0; i--) {
     const CTransaction &tx = vtx[i];
     uint256 hash = tx.GetHash();
 
+    if (fAddressIndex) {
+      for (unsigned int k = 0; k < tx.vout.size(); k++) {
+        unsigned char type;
+        uint160 hashBytes;
+        if (GetAddressIndexHash(tx.vout[k].scriptPubKey, type, hashBytes)) {
+          vAddressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, k, false), tx.vout[k].nValue));
+          vAddressUnspent.push_back(make_pair(CAddressUnspentKey(type, hashBytes, hash, k), CAddressUnspentValue()));
+        }
+      }
+    }
+
     // check that all outputs are available
     if (!view.HaveCoins(hash)) {
       fClean = fClean && error("DisconnectBlock() : outputs still spent? database corrupted");
@@ -1525,6 +1817,17 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
         coins.vout[out.n] = undo.txout;
         if (!view.SetCoins(out.hash, coins))
           return error("DisconnectBlock() : cannot restore coin inputs");
+
+        if (fAddressIndex) {
+          unsigned char type;
+          uint160 hashBytes;
+          if (GetAddressIndexHash(undo.txout.scriptPubKey, type, hashBytes)) {
+            vAddressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, hash, j, true), -undo.txout.nValue));
+            vAddressUnspent.push_back(make_pair(CAddressUnspentKey(type, hashBytes, out.hash, out.n), CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, coins.nHeight)));
+          }
+        }
+        if (fSpentIndex)
+          vSpentIndex.push_back(make_pair(out, CSpentIndexValue()));
       }
     }
   }
@@ -1532,6 +1835,15 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
   // move best block pointer to prevout block
   view.SetBestBlock(pindex->pprev);
 
+  if (pbatchIndex) {
+    if (fAddressIndex) {
+      pblocktree->EraseAddressIndex(*pbatchIndex, vAddressIndex);
+      pblocktree->UpdateAddressUnspentIndex(*pbatchIndex, vAddressUnspent);
+    }
+    if (fSpentIndex)
+      pblocktree->UpdateSpentIndex(*pbatchIndex, vSpentIndex);
+  }
+
   if (pfClean) {
     *pfClean = fClean;
     return true;
@@ -1540,27 +1852,141 @@ bool CBlock::DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoin
   }
 }
 
-void static FlushBlockFile(bool fFinalize = false)
+// Block and undo files written to since they were last committed to disk
+static set<int> setDirtyBlockFiles;
+static set<int> setDirtyUndoFiles;
+
+// Commit the dirty block and undo files, once per coins flush rather than
+// once per block. With fFinalize, only cut the preallocated tail off the file
+// being left behind; committing it waits for the next flush.
+void FlushBlockFile(bool fFinalize)
 {
   LOCK(cs_LastBlockFile);
 
-  CDiskBlockPos posOld(nLastBlockFile, 0);
+  if (fFinalize) {
+    CDiskBlockPos posOld(nLastBlockFile, 0);
 
-  FILE *fileOld = OpenBlockFile(posOld);
-  if (fileOld) {
-    if (fFinalize)
+    UnmapBlockFile(nLastBlockFile);
+    FILE *fileOld = OpenBlockFile(posOld, true);
+    if (fileOld) {
       TruncateFile(fileOld, infoLastBlockFile.nSize);
-    FileCommit(fileOld);
-    fclose(fileOld);
-  }
+      fclose(fileOld);
+    }
 
-  fileOld = OpenUndoFile(posOld);
-  if (fileOld) {
-    if (fFinalize)
+    fileOld = OpenUndoFile(posOld, true);
+    if (fileOld) {
       TruncateFile(fileOld, infoLastBlockFile.nUndoSize);
-    FileCommit(fileOld);
-    fclose(fileOld);
+      fclose(fileOld);
+    }
+    return;
+  }
+
+  BOOST_FOREACH(int nFile, setDirtyBlockFiles) {
+    FILE *file = OpenBlockFile(CDiskBlockPos(nFile, 0), true);
+    if (file) {
+      FileCommit(file);
+      fclose(file);
+    }
+  }
+  BOOST_FOREACH(int nFile, setDirtyUndoFiles) {
+    FILE *file = OpenUndoFile(CDiskBlockPos(nFile, 0), true);
+    if (file) {
+      FileCommit(file);
+      fclose(file);
+    }
+  }
+  setDirtyBlockFiles.clear();
+  setDirtyUndoFiles.clear();
+}
+
+// Address and spent index changes of the blocks connected to pcoinsTip
+// since it was last flushed. They are written just before the coins, so
+// the indexes on disk never fall behind them; should the node stop in
+// between, the blocks after the best block of the coins are connected
+// again and write the same changes once more.
+static CLevelDBBatch batchIndexPending;
+static const size_t MAX_INDEX_PENDING_BYTES = 32 * 1024 * 1024;
+
+bool FlushCoinsAndIndexes()
+{
+  if (batchIndexPending.GetSize() > 0) {
+    if (!pblocktree->WriteBatch(batchIndexPending, true))
+      return false;
+    batchIndexPending.Clear();
+  }
+  return pcoinsTip->Flush();
+}
+
+// -prune: delete the oldest block and undo files while all of them together
+// take more than nPruneTarget. The file being written and files holding blocks
+// within MIN_BLOCKS_TO_KEEP of the tip stay.
+bool static PruneBlockFiles(CValidationState &state)
+{
+  fCheckForPruning = false;
+  if (pindexBest == NULL || pindexBest->nHeight < MIN_BLOCKS_TO_KEEP)
+    return true;
+  unsigned int nKeepFrom = pindexBest->nHeight - MIN_BLOCKS_TO_KEEP;
+
+  set<int> setPruneFiles;
+  {
+    LOCK(cs_LastBlockFile);
+
+    vector<CBlockFileInfo> vinfo(nLastBlockFile + 1);
+    uint64 nTotal = 0;
+    for (int nFile = 0; nFile <= nLastBlockFile; nFile++)
+    {
+      if (nFile == nLastBlockFile)
+        vinfo[nFile] = infoLastBlockFile;
+      else
+        pblocktree->ReadBlockFileInfo(nFile, vinfo[nFile]);
+      nTotal += vinfo[nFile].nSize + vinfo[nFile].nUndoSize;
+    }
+
+    for (int nFile = 0; nFile < nLastBlockFile && nTotal > nPruneTarget; nFile++)
+    {
+      const CBlockFileInfo& info = vinfo[nFile];
+      if ((info.nSize == 0 && info.nUndoSize == 0) || info.nHeightLast >= nKeepFrom)
+        continue;
+      nTotal -= info.nSize + info.nUndoSize;
+      setPruneFiles.insert(nFile);
+      if (!pblocktree->WriteBlockFileInfo(nFile, CBlockFileInfo()))
+        return state.Abort(_("Failed to write file info"));
+    }
+  }
+  if (setPruneFiles.empty())
+    return true;
+
+  // Unmark the blocks before their files go away. Blocks they hold were
+  // connected long ago, but the coins must say so on disk too.
+  BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+  {
+    CBlockIndex* pindex = item.second;
+    if (!(pindex->nStatus & BLOCK_HAVE_MASK) || !setPruneFiles.count(pindex->nFile))
+      continue;
+    pindex->nStatus = (pindex->nStatus & ~BLOCK_HAVE_MASK) | BLOCK_PRUNED;
+    if (!pblocktree->WriteBlockIndex(*pindex))
+      return state.Abort(_("Failed to write block index"));
+    setBlockIndexValid.erase(pindex);
+  }
+  fHavePruned = true;
+  if (!pblocktree->WriteFlag("prunedblockfiles", true))
+    return state.Abort(_("Failed to write to block index"));
+  // as in SetBestChain: block and undo data before the coins referring to it
+  FlushBlockFile();
+  if (!FlushCoinsAndIndexes())
+    return state.Abort(_("Failed to write to coin database"));
+  if (!pblocktree->Flush())
+    return state.Abort(_("Failed to sync block index"));
+
+  BOOST_FOREACH(int nFile, setPruneFiles)
+  {
+    boost::system::error_code ec;
+    UnmapBlockFile(nFile);
+    boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile), ec);
+    boost::filesystem::remove(GetDataDir() / "blocks" / strprintf("rev%05u.dat", nFile), ec);
+    printf("PruneBlockFiles() : deleted blk%05u.dat and rev%05u.dat\n", nFile, nFile);
   }
+  return true;
 }
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
@@ -1572,7 +1998,7 @@ void ThreadScriptCheck() {
   scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, CLevelDBBatch *pbatchIndex)
 {
   // Check it again in case a previous version let a bad block in
     if (!CheckBlock(state, pindex->nHeight, !fJustCheck, !fJustCheck))
@@ -1630,6 +2056,9 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
   CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
   std::vector<std::pair<uint256, CDiskTxPos> > vPos;
   vPos.reserve(vtx.size());
+  std::vector<CAddressIndexEntry> vAddressIndex;
+  std::vector<CAddressUnspentEntry> vAddressUnspent;
+  std::vector<CSpentIndexEntry> vSpentIndex;
   for (unsigned int i=0; i<vtx.size(); i++)
   {
     const CTransaction &tx = vtx[i];
@@ -1660,6 +2089,35 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
       if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
         return false;
       control.Add(vChecks);
+
+      if (fAddressIndex || fSpentIndex) {
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+          const CTxIn &txin = tx.vin[j];
+          if (fAddressIndex) {
+            const CTxOut &prevout = view.GetCoins(txin.prevout.hash).vout[txin.prevout.n];
+            unsigned char type;
+            uint160 hashBytes;
+            if (GetAddressIndexHash(prevout.scriptPubKey, type, hashBytes)) {
+              vAddressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, GetTxHash(i), j, true), -prevout.nValue));
+              vAddressUnspent.push_back(make_pair(CAddressUnspentKey(type, hashBytes, txin.prevout.hash, txin.prevout.n), CAddressUnspentValue()));
+            }
+          }
+          if (fSpentIndex)
+            vSpentIndex.push_back(make_pair(txin.prevout, CSpentIndexValue(GetTxHash(i), j, pindex->nHeight)));
+        }
+      }
+    }
+
+    if (fAddressIndex) {
+      for (unsigned int k = 0; k < tx.vout.size(); k++) {
+        const CTxOut &out = tx.vout[k];
+        unsigned char type;
+        uint160 hashBytes;
+        if (GetAddressIndexHash(out.scriptPubKey, type, hashBytes)) {
+          vAddressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, pindex->nHeight, i, GetTxHash(i), k, false), out.nValue));
+          vAddressUnspent.push_back(make_pair(CAddressUnspentKey(type, hashBytes, GetTxHash(i), k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+        }
+      }
     }
 
     CTxUndo txundo;
@@ -1683,6 +2141,15 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
   if (fBenchmark)
     printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
 
+  if (pbatchIndex) {
+    if (fAddressIndex) {
+      pblocktree->WriteAddressIndex(*pbatchIndex, vAddressIndex);
+      pblocktree->UpdateAddressUnspentIndex(*pbatchIndex, vAddressUnspent);
+    }
+    if (fSpentIndex)
+      pblocktree->UpdateSpentIndex(*pbatchIndex, vSpentIndex);
+  }
+
   if (fJustCheck)
     return true;
 
@@ -1758,6 +2225,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     printf("REORGANIZE: Connect %" PRIszu " blocks; ..%s\n", vConnect.size(), pindexNew->GetBlockHash().ToString().c_str());
   }
 
+  // Address and spent index changes of the whole reorganization,
+  // written only once every block in it has been connected
+  CLevelDBBatch batchIndex;
+
   // Disconnect shorter branch
   vector<CTransaction> vResurrect;
   BOOST_FOREACH(CBlockIndex* pindex, vDisconnect) {
@@ -1765,7 +2236,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (!block.ReadFromDisk(pindex))
       return state.Abort(_("Failed to read block"));
     int64 nStart = GetTimeMicros();
-    if (!block.DisconnectBlock(state, pindex, view))
+    if (!block.DisconnectBlock(state, pindex, view, NULL, &batchIndex))
       return error("SetBestBlock() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
     if (fBenchmark)
       printf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -1779,13 +2250,13 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
   }
 
   // Connect longer branch
-  vector<CTransaction> vDelete;
+  vector<pair<uint256, CTransaction> > vDelete;
   BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
     CBlock block;
     if (!block.ReadFromDisk(pindex))
       return state.Abort(_("Failed to read block"));
     int64 nStart = GetTimeMicros();
-    if (!block.ConnectBlock(state, pindex, view)) {
+    if (!block.ConnectBlock(state, pindex, view, false, &batchIndex)) {
       if (state.IsInvalid()) {
         InvalidChainFound(pindexNew);
         InvalidBlockFound(pindex);
@@ -1795,11 +2266,15 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (fBenchmark)
       printf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
-    // Queue memory transactions to delete
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-      vDelete.push_back(tx);
+    // Queue memory transactions to delete, with the hashes ConnectBlock cached
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+      vDelete.push_back(make_pair(block.GetTxHash(i), block.vtx[i]));
   }
 
+  // the indexes go to disk along with the coins
+  if (fAddressIndex || fSpentIndex)
+    batchIndexPending.Append(batchIndex);
+
   // Flush changes to global coin state
   int64 nStart = GetTimeMicros();
   int nModified = view.GetCacheSize();
@@ -1810,7 +2285,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
   // Make sure it's successfully written to disk before changing memory structure
   bool fIsInitialDownload = IsInitialBlockDownload();
-  if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+  if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize || batchIndexPending.GetSize() > MAX_INDEX_PENDING_BYTES) {
     // Typical CCoins structures on disk are around 100 bytes in size.
     // Pushing a new one to the database can cause it to be written
     // twice (once in the log, and once in the tables). This is already
@@ -1820,7 +2295,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
       return state.Error();
     FlushBlockFile();
     pblocktree->Sync();
-    if (!pcoinsTip->Flush())
+    if (!FlushCoinsAndIndexes())
       return state.Abort(_("Failed to write to coin database"));
   }
 
@@ -1846,9 +2321,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
   }
 
   // Delete redundant memory transactions that are in the connected branch
-  BOOST_FOREACH(CTransaction& tx, vDelete) {
-    mempool.remove(tx);
-    mempool.removeConflicts(tx);
+  typedef pair<uint256, CTransaction> PairType;
+  BOOST_FOREACH(PairType& item, vDelete) {
+    mempool.remove(item.second, item.first);
+    mempool.removeConflicts(item.second);
   }
 
   // Update best block in wallet (so we can detect restored wallets)
@@ -1866,6 +2342,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
   nBestChainWork = pindexNew->nChainWork;
   nTimeBestReceived = GetTime();
   nTransactionsUpdated++;
+  NotifyTemplateChange();
 #ifdef USE_CHECKPOINTS
   printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f\n",
 #else
@@ -1915,22 +2392,29 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
 {
   // Check for duplicate
   uint256 hash = GetHash();
-  if (mapBlockIndex.count(hash))
+  BlockMap::iterator mi = mapBlockIndex.find(hash);
+  if (mi != mapBlockIndex.end() && HaveBlockData(mi->second))
     return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
-  // Construct new block index object
-  CBlockIndex* pindexNew = new CBlockIndex(*this);
-  assert(pindexNew);
-  map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-  pindexNew->phashBlock = &((*mi).first);
-  map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+  // Construct new block index object, unless its header came first
+  CBlockIndex* pindexNew;
+  if (mi != mapBlockIndex.end())
+    pindexNew = mi->second;
+  else
+  {
+    dequeBlockIndex.push_back(CBlockIndex(*this));
+    pindexNew = &dequeBlockIndex.back();
+    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+  }
+  BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
   if (miPrev != mapBlockIndex.end())
   {
     pindexNew->pprev = (*miPrev).second;
     pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
   }
   pindexNew->nTx = vtx.size();
-  pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
+  pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork256();
   pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
   pindexNew->nFile = pos.nFile;
   pindexNew->nDataPos = pos.nPos;
@@ -1941,6 +2425,7 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     /* write both the immutible data (CDiskBlockIndex) and the mutable data (BlockIndex) */
     if (!pblocktree->WriteDiskBlockIndex(CDiskBlockIndex(pindexNew, this->auxpow)) || !pblocktree->WriteBlockIndex(*pindexNew))
     return state.Abort(_("Failed to write block index"));
+  UpdateBestHeader(pindexNew);
 
   // New best?
   if (!ConnectBestBlock(state))
@@ -1954,6 +2439,9 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     hashPrevBestCoinBase = GetTxHash(0);
   }
 
+  if (fCheckForPruning && !PruneBlockFiles(state))
+    return false;
+
   if (!pblocktree->Flush())
     return state.Abort(_("Failed to sync block index"));
 
@@ -1979,12 +2467,14 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
       printf("Leaving block file %i: %s\n", nLastBlockFile, infoLastBlockFile.ToString().c_str());
       FlushBlockFile(true);
       nLastBlockFile++;
+      fCheckForPruning = fPruneMode;
       infoLastBlockFile.SetNull();
       pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile); // check whether data for the new file somehow already exist; can fail just fine
       fUpdatedLast = true;
     }
     pos.nFile = nLastBlockFile;
     pos.nPos = infoLastBlockFile.nSize;
+    setDirtyBlockFiles.insert(pos.nFile);
   }
 
   infoLastBlockFile.nSize += nAddSize;
@@ -2020,6 +2510,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
   pos.nFile = nFile;
 
   LOCK(cs_LastBlockFile);
+  setDirtyUndoFiles.insert(nFile);
 
   unsigned int nNewSize;
   if (nFile == nLastBlockFile) {
@@ -2065,6 +2556,11 @@ bool CBlock::CheckBlock(CValidationState &state, int nHeight, bool fCheckPOW, bo
   if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
     return state.DoS(100, error("CheckBlock() : size limits failed"));
 
+  // Build the merkle tree already. We need it anyway later, and it makes the
+  // block cache the transaction hashes, which means they don't need to be
+  // recalculated many times during this block's validation.
+  uint256 hashMerkleRootBuilt = BuildMerkleTree();
+
   // Litecoin: Special short-term limits to avoid 10,000 BDB lock limit:
   if (GetBlockTime() < 1376568000)  // stop enforcing 15 August 2013 00:00:00
   {
@@ -2073,7 +2569,7 @@ bool CBlock::CheckBlock(CValidationState &state, int nHeight, bool fCheckPOW, bo
     set<uint256> setTxIn;
     for (size_t i = 0; i < vtx.size(); i++)
     {
-      setTxIn.insert(vtx[i].GetHash());
+      setTxIn.insert(GetTxHash(i));
       if (i == 0) continue; // skip coinbase txin
       BOOST_FOREACH(const CTxIn& txin, vtx[i].vin)
         setTxIn.insert(txin.prevout.hash);
@@ -2122,11 +2618,6 @@ bool CBlock::CheckBlock(CValidationState &state, int nHeight, bool fCheckPOW, bo
     if (!tx.CheckTransaction(state))
       return error("CheckBlock() : CheckTransaction failed");
 
-  // Build the merkle tree already. We need it anyway later, and it makes the
-  // block cache the transaction hashes, which means they don't need to be
-  // recalculated many times during this block's validation.
-  BuildMerkleTree();
-
   // Check for duplicate txids. This is caught by ConnectInputs(),
   // but catching it earlier avoids a potential DoS attack:
   set<uint256> uniqueTx;
@@ -2145,7 +2636,7 @@ bool CBlock::CheckBlock(CValidationState &state, int nHeight, bool fCheckPOW, bo
     return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
   // Check merkle root
-  if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+  if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
     return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
   return true;
@@ -2155,18 +2646,20 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
 {
   // Check for duplicate
   uint256 hash = GetHash();
-  if (mapBlockIndex.count(hash))
+  if (HaveBlockData(hash))
     return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
 
   // Get prev block index
   CBlockIndex* pindexPrev = NULL;
   int nHeight = 0;
   if (hash != genesis::block::instance().known_hash()) {
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
       return state.DoS(10, error("AcceptBlock() : prev block not found"));
     pindexPrev = (*mi).second;
     nHeight = pindexPrev->nHeight+1;
+    if (!HaveBlockData(pindexPrev))
+      return state.Invalid(error("AcceptBlock() : prev block not stored yet"));
 
     // Check proof of work
     if (nBits != retarget::difficulty::instance()
@@ -2190,9 +2683,10 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     if (!Checkpoints::CheckBlock(nHeight, hash))
       return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
 
-    // Don't accept any forks from the main chain prior to last checkpoint
+    // Don't accept any forks from the main chain prior to last checkpoint.
+    // A header in the index passed this when it was accepted.
     CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight && !mapBlockIndex.count(hash))
       return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
 
     // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
@@ -2249,6 +2743,61 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
   return true;
 }
 
+bool CBlock::AcceptHeader(CValidationState &state, CBlockIndex **ppindex)
+{
+  // Check for duplicate
+  uint256 hash = GetHash();
+  BlockMap::iterator mi = mapBlockIndex.find(hash);
+  if (mi != mapBlockIndex.end())
+  {
+    *ppindex = (*mi).second;
+    if ((*mi).second->nStatus & BLOCK_FAILED_MASK)
+      return state.Invalid(error("AcceptHeader() : block %s is marked invalid", hash.ToString().c_str()));
+    return true;
+  }
+
+  // The context-free part of CheckBlock that covers the header
+  if (!CheckProofOfWork(*this))
+    return state.DoS(50, error("AcceptHeader() : proof of work failed"));
+  if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+    return state.Invalid(error("AcceptHeader() : block timestamp too far in the future"));
+
+  // and the header checks of AcceptBlock
+  mi = mapBlockIndex.find(hashPrevBlock);
+  if (mi == mapBlockIndex.end())
+    return state.DoS(10, error("AcceptHeader() : prev block not found"));
+  CBlockIndex* pindexPrev = (*mi).second;
+  int nHeight = pindexPrev->nHeight+1;
+  if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+    return state.DoS(100, error("AcceptHeader() : prev block invalid"));
+  if (nBits != retarget::difficulty::instance().next_block_difficulty(pindexPrev))
+    return state.DoS(100, error("AcceptHeader() : incorrect proof of work"));
+  if (GetBlockTime() <= pindexPrev->GetMedianTimePast())
+    return state.Invalid(error("AcceptHeader() : block's timestamp is too early"));
+  if (!Checkpoints::CheckBlock(nHeight, hash))
+    return state.DoS(100, error("AcceptHeader() : rejected by checkpoint lock-in at %d", nHeight));
+  CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+  if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+    return state.DoS(100, error("AcceptHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+  dequeBlockIndex.push_back(CBlockIndex(*this));
+  CBlockIndex* pindexNew = &dequeBlockIndex.back();
+  mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+  pindexNew->phashBlock = &((*mi).first);
+  pindexNew->pprev = pindexPrev;
+  pindexNew->nHeight = nHeight;
+  pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork256();
+  pindexNew->nChainTx = pindexPrev->nChainTx;
+  pindexNew->nStatus = BLOCK_VALID_TREE;
+
+  if (!pblocktree->WriteDiskBlockIndex(CDiskBlockIndex(pindexNew, this->auxpow)) || !pblocktree->WriteBlockIndex(*pindexNew))
+    return state.Abort(_("Failed to write block index"));
+  UpdateBestHeader(pindexNew);
+
+  *ppindex = pindexNew;
+  return true;
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
   // Litecoin: temporarily disable v2 block lockin until we are ready for v2 transition
@@ -2263,11 +2812,52 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
   return (nFound >= nRequired);
 }
 
+// Extra checks to prevent "fill up memory by spamming with bogus blocks",
+// for blocks that don't build on the best chain
+static bool CheckBlockMinDifficulty(CValidationState &state, const CBlock& block, const char* pszCaller)
+{
+  if (block.hashPrevBlock == hashBestChain)
+    return true;
+  try {
+    retarget::difficulty::instance().dos_check_min_difficulty(block);
+  }
+  catch(const except::dos& ex) {
+    LOG() << pszCaller << " : "
+          << ex.what() << std::endl;
+    return state.DoS(100);
+  }
+  return true;
+}
+
+// Recursively process any orphan blocks that depended on hash
+static void ProcessOrphanBlocks(const uint256& hash)
+{
+  vector<uint256> vWorkQueue;
+  vWorkQueue.push_back(hash);
+  for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+  {
+    uint256 hashPrev = vWorkQueue[i];
+    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+       mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
+       ++mi)
+    {
+      CBlock* pblockOrphan = (*mi).second;
+      // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
+      CValidationState stateDummy;
+      if (pblockOrphan->AcceptBlock(stateDummy))
+        vWorkQueue.push_back(pblockOrphan->GetHash());
+      mapOrphanBlocks.erase(pblockOrphan->GetHash());
+      delete pblockOrphan;
+    }
+    mapOrphanBlocksByPrev.erase(hashPrev);
+  }
+}
+
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
   // Check for duplicate
   uint256 hash = pblock->GetHash();
-  if (mapBlockIndex.count(hash))
+  if (HaveBlockData(hash))
     return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().c_str()));
   if (mapOrphanBlocks.count(hash))
     return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
@@ -2276,22 +2866,11 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (!pblock->CheckBlock(state, INT_MAX))
     return error("ProcessBlock() : CheckBlock FAILED");
 
-  if (pblock->hashPrevBlock != hashBestChain)
-  {
-    // Extra checks to prevent "fill up memory by spamming
-    // with bogus blocks"
-    try {
-      retarget::difficulty::instance().dos_check_min_difficulty(*pblock);
-    }
-    catch(const except::dos& ex) {
-      LOG() << "ProcessBlock() : " 
-            << ex.what() << std::endl;
-      return state.DoS(100);
-    }
-  }
+  if (!CheckBlockMinDifficulty(state, *pblock, "ProcessBlock()"))
+    return false;
 
   // If we don't already have its previous block, shunt it off to holding area until we get it
-  if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
+  if (pblock->hashPrevBlock != 0 && !HaveBlockData(pblock->hashPrevBlock))
   {
     printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().c_str());
 
@@ -2302,7 +2881,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
       mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
       // Ask this guy to fill in what we're missing
-      pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+      AskForOrphanParents(pfrom, pblock2);
     }
     return true;
   }
@@ -2311,26 +2890,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
   if (!pblock->AcceptBlock(state, dbp))
     return error("ProcessBlock() : AcceptBlock FAILED");
 
-  // Recursively process any orphan blocks that depended on this one
-  vector<uint256> vWorkQueue;
-  vWorkQueue.push_back(hash);
-  for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-  {
-    uint256 hashPrev = vWorkQueue[i];
-    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-       mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-       ++mi)
-    {
-      CBlock* pblockOrphan = (*mi).second;
-      // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
-      CValidationState stateDummy;
-      if (pblockOrphan->AcceptBlock(stateDummy))
-        vWorkQueue.push_back(pblockOrphan->GetHash());
-      mapOrphanBlocks.erase(pblockOrphan->GetHash());
-      delete pblockOrphan;
-    }
-    mapOrphanBlocksByPrev.erase(hashPrev);
-  }
+  ProcessOrphanBlocks(hash);
 
   printf("ProcessBlock: ACCEPTED\n");
   return true;
@@ -2369,6 +2929,33 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
   txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CBlockView& block, CBloomFilter& filter)
+{
+  header = block.GetHeader();
+
+  vector<bool> vMatch;
+  vector<uint256> vHashes;
+
+  vMatch.reserve(block.GetTxCount());
+  vHashes.reserve(block.GetTxCount());
+
+  CTransaction tx;
+  for (unsigned int i = 0; i < block.GetTxCount(); i++)
+  {
+    const uint256& hash = block.GetTxHash(i);
+    if (block.GetTransaction(i, tx) && filter.IsRelevantAndUpdate(tx, hash))
+    {
+      vMatch.push_back(true);
+      vMatchedTxn.push_back(make_pair(i, hash));
+    }
+    else
+      vMatch.push_back(false);
+    vHashes.push_back(hash);
+  }
+
+  txn = CPartialMerkleTree(vHashes, vMatch);
+}
+
 
 
 
@@ -2542,6 +3129,167 @@ FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly)
   return file;
 }
 
+// Mapped block files, least recently used dropped first
+struct CBlockFileMapping
+{
+  boost::shared_ptr<boost::interprocess::mapped_region> pregion;
+  int64 nLastUsed;
+};
+
+static CCriticalSection cs_mapBlockFileMapping;
+static map<int, CBlockFileMapping> mapBlockFileMapping;
+static int64 nBlockFileMappingUses = 0;
+
+boost::shared_ptr<const char> MapBlockFile(int nFile, size_t nMinSize, size_t &nSize)
+{
+  LOCK(cs_mapBlockFileMapping);
+
+  map<int, CBlockFileMapping>::iterator it = mapBlockFileMapping.find(nFile);
+  if (it == mapBlockFileMapping.end() || it->second.pregion->get_size() < nMinSize) {
+    // Not mapped yet, or the file has grown past the mapping since
+    if (it != mapBlockFileMapping.end())
+      mapBlockFileMapping.erase(it);
+    while (mapBlockFileMapping.size() >= MAX_MAPPED_BLOCK_FILES) {
+      map<int, CBlockFileMapping>::iterator itOldest = mapBlockFileMapping.begin();
+      for (map<int, CBlockFileMapping>::iterator mi = mapBlockFileMapping.begin(); mi != mapBlockFileMapping.end(); mi++)
+        if (mi->second.nLastUsed < itOldest->second.nLastUsed)
+          itOldest = mi;
+      mapBlockFileMapping.erase(itOldest);
+    }
+
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+    CBlockFileMapping mapping;
+    try {
+      boost::interprocess::file_mapping file(path.string().c_str(), boost::interprocess::read_only);
+      mapping.pregion.reset(new boost::interprocess::mapped_region(file, boost::interprocess::read_only));
+    } catch (boost::interprocess::interprocess_exception &e) {
+      printf("MapBlockFile() : unable to map %s: %s\n", path.string().c_str(), e.what());
+      return boost::shared_ptr<const char>();
+    }
+    if (mapping.pregion->get_size() < nMinSize) {
+      printf("MapBlockFile() : %s is shorter than %" PRIszu " bytes\n", path.string().c_str(), nMinSize);
+      return boost::shared_ptr<const char>();
+    }
+    it = mapBlockFileMapping.insert(make_pair(nFile, mapping)).first;
+  }
+
+  it->second.nLastUsed = ++nBlockFileMappingUses;
+  nSize = it->second.pregion->get_size();
+  // share ownership of the region, pointing at its bytes
+  return boost::shared_ptr<const char>(it->second.pregion, (const char*)it->second.pregion->get_address());
+}
+
+void UnmapBlockFile(int nFile)
+{
+  LOCK(cs_mapBlockFileMapping);
+  mapBlockFileMapping.erase(nFile);
+}
+
+CMappedBlock::CMappedBlock(const CDiskBlockPos &pos) : nBegin(0), nEnd(0)
+{
+  // The block is preceded by the message start and its size
+  if (pos.IsNull() || pos.nPos < 4)
+    return;
+  size_t nSize = 0;
+  pfile = MapBlockFile(pos.nFile, pos.nPos, nSize);
+  if (!pfile)
+    return;
+  unsigned int nBlockSize;
+  memcpy(&nBlockSize, pfile.get() + pos.nPos - 4, sizeof(nBlockSize));
+  if (nBlockSize < 80 || nBlockSize > MAX_BLOCK_SIZE) { // corrupt length prefix
+    pfile.reset();
+    return;
+  }
+  if ((size_t)pos.nPos + nBlockSize > nSize)
+    pfile = MapBlockFile(pos.nFile, (size_t)pos.nPos + nBlockSize, nSize);
+  nBegin = pos.nPos;
+  nEnd = (size_t)pos.nPos + nBlockSize;
+}
+
+// Compact sizes in the raw bytes must be canonical, or hashing the bytes would
+// disagree with hashing the decoded transaction
+static uint64 ReadViewCompactSize(CMemoryReader &reader)
+{
+  size_t nBefore = reader.size();
+  uint64 n = ReadCompactSize(reader);
+  if (nBefore - reader.size() != GetSizeOfCompactSize(n))
+    throw std::ios_base::failure("ReadViewCompactSize() : non-canonical compact size");
+  return n;
+}
+
+bool CBlockView::ReadFromDisk(const CDiskBlockPos &pos)
+{
+  vtx.clear();
+  block = CMappedBlock(pos);
+  if (block.IsNull())
+    return error("CBlockView::ReadFromDisk() : MapBlockFile failed");
+
+  try {
+    CMemoryReader reader = block.GetReader();
+    reader >> header;
+    uint64 nTx = ReadViewCompactSize(reader);
+    vtx.reserve(std::min(nTx, (uint64)(reader.size() / 60)));
+    for (uint64 i = 0; i < nTx; i++) {
+      CTxSpan span;
+      span.pend = span.pbegin = reader.begin();
+      span.fHashed = false;
+      reader.ignore(4); // nVersion
+      uint64 nIn = ReadViewCompactSize(reader);
+      for (uint64 j = 0; j < nIn; j++) {
+        reader.ignore(36); // prevout
+        reader.ignore(ReadViewCompactSize(reader)); // scriptSig
+        reader.ignore(4); // nSequence
+      }
+      uint64 nOut = ReadViewCompactSize(reader);
+      for (uint64 j = 0; j < nOut; j++) {
+        reader.ignore(8); // nValue
+        reader.ignore(ReadViewCompactSize(reader)); // scriptPubKey
+      }
+      reader.ignore(4); // nLockTime
+      span.pend = reader.begin();
+      vtx.push_back(span);
+    }
+  }
+  catch (std::exception &e) {
+    return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+  }
+
+  if (!CheckProofOfWork(header))
+    return error("CBlockView::ReadFromDisk() : errors in block header");
+  return true;
+}
+
+bool CBlockView::ReadFromDisk(const CBlockIndex *pindex)
+{
+  if (!ReadFromDisk(pindex->GetBlockPos()))
+    return false;
+  if (header.GetHash() != pindex->GetBlockHash())
+    return error("CBlockView::ReadFromDisk() : GetHash() doesn't match index");
+  return true;
+}
+
+const uint256 &CBlockView::GetTxHash(unsigned int i) const
+{
+  const CTxSpan &span = vtx[i];
+  if (!span.fHashed) {
+    span.hash = Hash(span.pbegin, span.pend);
+    span.fHashed = true;
+  }
+  return span.hash;
+}
+
+bool CBlockView::GetTransaction(unsigned int i, CTransaction &tx) const
+{
+  try {
+    CMemoryReader reader(vtx[i].pbegin, vtx[i].pend, SER_DISK, CLIENT_VERSION);
+    reader >> tx;
+  }
+  catch (std::exception &e) {
+    return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+  }
+  return true;
+}
+
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly) {
   return OpenDiskFile(pos, "blk", fReadOnly);
 }
@@ -2556,43 +3304,253 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return NULL;
 
   // Return existing
-  map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+  BlockMap::iterator mi = mapBlockIndex.find(hash);
   if (mi != mapBlockIndex.end())
     return (*mi).second;
 
   // Create new
-  CBlockIndex* pindexNew = new CBlockIndex();
-  if (!pindexNew)
-    throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+  dequeBlockIndex.push_back(CBlockIndex());
+  CBlockIndex* pindexNew = &dequeBlockIndex.back();
   mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
   pindexNew->phashBlock = &((*mi).first);
 
   return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+//
+// Block index snapshot
+//
+// On clean shutdown the in-memory block index is dumped to
+// blocks/indexsnapshot.dat as an array of fixed-size records sorted by
+// height, each referring to its parent by position. The next start maps
+// the file and builds mapBlockIndex from it directly, skipping the
+// LevelDB cursor scan and the chain work pass. The file is removed as
+// soon as it has been read, so it never outlives the block tree state it
+// was taken from; a crash simply means the next start takes the slow path.
+//
+
+static const char pchSnapshotMagic[4] = { 'U', 'B', 'I', 'S' };
+static const unsigned int SNAPSHOT_VERSION = 1;
+
+struct CBlockIndexSnapshotHeader
 {
-  if (!pblocktree->LoadBlockIndexGuts())
-    return false;
+  char pchMagic[4];
+  unsigned int nVersion;
+  unsigned int nRecords;
+  unsigned int nRecordSize; // also catches a layout change without a version bump
+  uint256 hashBestChain;    // must match the coin database best block
+  uint256 hashChecksum;     // Hash() of all records
+};
 
-  boost::this_thread::interruption_point();
+struct CBlockIndexSnapshotRecord
+{
+  uint256 hashBlock;
+  uint256 hashMerkleRoot;
+  uint256 nChainWork;
+  int nPrev; // position of pprev, or -1
+  int nHeight;
+  int nFile;
+  unsigned int nDataPos;
+  unsigned int nUndoPos;
+  unsigned int nTx;
+  unsigned int nChainTx;
+  unsigned int nStatus;
+  int nVersion;
+  unsigned int nTime;
+  unsigned int nBits;
+  unsigned int nNonce;
+};
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+  return GetDataDir() / "blocks" / "indexsnapshot.dat";
+}
+
+bool WriteBlockIndexSnapshot()
+{
+  if (mapBlockIndex.empty() || pindexBest == NULL)
+    return false;
 
-  // Calculate nChainWork
   vector<pair<int, CBlockIndex*> > vSortedByHeight;
   vSortedByHeight.reserve(mapBlockIndex.size());
   BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+  sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+  boost::unordered_map<const CBlockIndex*, int> mapPos;
+  vector<CBlockIndexSnapshotRecord> vRecords(vSortedByHeight.size());
+  for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
   {
-    CBlockIndex* pindex = item.second;
-    vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    const CBlockIndex* pindex = vSortedByHeight[i].second;
+    mapPos[pindex] = i;
+
+    CBlockIndexSnapshotRecord& record = vRecords[i];
+    record.hashBlock = pindex->GetBlockHash();
+    record.hashMerkleRoot = pindex->hashMerkleRoot;
+    record.nChainWork = pindex->nChainWork;
+    record.nPrev = -1;
+    if (pindex->pprev)
+    {
+      // parents sort before their children
+      boost::unordered_map<const CBlockIndex*, int>::const_iterator it = mapPos.find(pindex->pprev);
+      if (it == mapPos.end())
+        return error("WriteBlockIndexSnapshot() : parent of %s out of order", record.hashBlock.ToString().c_str());
+      record.nPrev = it->second;
+    }
+    record.nHeight = pindex->nHeight;
+    record.nFile = pindex->nFile;
+    record.nDataPos = pindex->nDataPos;
+    record.nUndoPos = pindex->nUndoPos;
+    record.nTx = pindex->nTx;
+    record.nChainTx = pindex->nChainTx;
+    record.nStatus = pindex->nStatus;
+    record.nVersion = pindex->nVersion;
+    record.nTime = pindex->nTime;
+    record.nBits = pindex->nBits.compact;
+    record.nNonce = pindex->nNonce;
+  }
+
+  CBlockIndexSnapshotHeader header;
+  memcpy(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic));
+  header.nVersion = SNAPSHOT_VERSION;
+  header.nRecords = vRecords.size();
+  header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+  header.hashBestChain = hashBestChain;
+  header.hashChecksum = Hash(BEGIN(vRecords[0]), END(vRecords.back()));
+
+  // write under a temporary name, so a partial file is never picked up
+  boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+  boost::filesystem::path pathTmp = pathSnapshot.string() + ".new";
+  FILE* file = fopen(pathTmp.string().c_str(), "wb");
+  if (!file)
+    return error("WriteBlockIndexSnapshot() : cannot open %s", pathTmp.string().c_str());
+  bool fOk = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(&vRecords[0], sizeof(CBlockIndexSnapshotRecord), vRecords.size(), file) == vRecords.size();
+  if (fOk)
+    FileCommit(file);
+  fclose(file);
+  if (!fOk || !RenameOver(pathTmp, pathSnapshot))
+  {
+    boost::filesystem::remove(pathTmp);
+    return error("WriteBlockIndexSnapshot() : cannot write %s", pathSnapshot.string().c_str());
   }
-  sort(vSortedByHeight.begin(), vSortedByHeight.end());
-  BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+
+  printf("WriteBlockIndexSnapshot(): wrote %u block index entries\n", header.nRecords);
+  return true;
+}
+
+// Build mapBlockIndex, nChainWork, nChainTx and setBlockIndexValid from the
+// snapshot, if there is one and it matches the databases
+bool LoadBlockIndexSnapshot()
+{
+  boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+  boost::system::error_code ec;
+  if (!boost::filesystem::exists(pathSnapshot, ec))
+    return false;
+
+  try
   {
-    CBlockIndex* pindex = item.second;
-    pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-    pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-    if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
-      setBlockIndexValid.insert(pindex);
+    boost::interprocess::file_mapping mapping(pathSnapshot.string().c_str(), boost::interprocess::read_only);
+    boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+    const char* pbegin = static_cast<const char*>(region.get_address());
+    const size_t nSize = region.get_size();
+
+    if (nSize < sizeof(CBlockIndexSnapshotHeader))
+      throw runtime_error("truncated");
+    const CBlockIndexSnapshotHeader& header = *reinterpret_cast<const CBlockIndexSnapshotHeader*>(pbegin);
+    if (memcmp(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic)) != 0 ||
+        header.nVersion != SNAPSHOT_VERSION ||
+        header.nRecordSize != sizeof(CBlockIndexSnapshotRecord))
+      throw runtime_error("unknown format");
+    if (header.nRecords == 0 ||
+        nSize != sizeof(header) + (size_t)header.nRecords * sizeof(CBlockIndexSnapshotRecord))
+      throw runtime_error("bad size");
+    uint256 hashCoinsBest = pcoinsTip->GetBestBlockHash();
+    if (header.hashBestChain != hashCoinsBest)
+      throw runtime_error(strprintf("taken at %s, coin database is at %s",
+        header.hashBestChain.ToString().c_str(), hashCoinsBest.ToString().c_str()));
+
+    const CBlockIndexSnapshotRecord* precords = reinterpret_cast<const CBlockIndexSnapshotRecord*>(pbegin + sizeof(header));
+    if (Hash(BEGIN(precords[0]), END(precords[header.nRecords - 1])) != header.hashChecksum)
+      throw runtime_error("checksum mismatch");
+
+    vector<CBlockIndex*> vIndex(header.nRecords);
+    for (unsigned int i = 0; i < header.nRecords; i++)
+    {
+      const CBlockIndexSnapshotRecord& record = precords[i];
+      if (record.nPrev >= (int)i)
+        throw runtime_error("parent out of order");
+
+      size_t nEntries = mapBlockIndex.size();
+      CBlockIndex* pindex = InsertBlockIndex(record.hashBlock);
+      if (pindex == NULL || mapBlockIndex.size() == nEntries)
+        throw runtime_error("duplicate entry");
+      vIndex[i] = pindex;
+      pindex->pprev = record.nPrev < 0 ? NULL : vIndex[record.nPrev];
+      pindex->nHeight = record.nHeight;
+      pindex->nFile = record.nFile;
+      pindex->nDataPos = record.nDataPos;
+      pindex->nUndoPos = record.nUndoPos;
+      pindex->nChainWork = record.nChainWork;
+      pindex->nTx = record.nTx;
+      pindex->nChainTx = record.nChainTx;
+      pindex->nStatus = record.nStatus;
+      pindex->nVersion = record.nVersion;
+      pindex->hashMerkleRoot = record.hashMerkleRoot;
+      pindex->nTime = record.nTime;
+      pindex->nBits = record.nBits;
+      pindex->nNonce = record.nNonce;
+
+      if (pindexGenesisBlock == NULL && pindex->GetBlockHash() == genesis::block::instance().known_hash())
+        pindexGenesisBlock = pindex;
+      if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & (BLOCK_FAILED_MASK | BLOCK_PRUNED)))
+        setBlockIndexValid.insert(pindex);
+    }
+    if (mapBlockIndex.find(header.hashBestChain) == mapBlockIndex.end())
+      throw runtime_error("best block missing");
+  }
+  catch (std::exception& e)
+  {
+    printf("LoadBlockIndexSnapshot(): not using %s: %s\n", pathSnapshot.string().c_str(), e.what());
+    UnloadBlockIndex();
+    boost::filesystem::remove(pathSnapshot, ec);
+    return false;
+  }
+
+  // single use: from here on the block tree moves past the snapshot
+  boost::filesystem::remove(pathSnapshot, ec);
+  printf("LoadBlockIndexSnapshot(): loaded %" PRIszu " block index entries\n", mapBlockIndex.size());
+  return true;
+}
+
+bool static LoadBlockIndexDB()
+{
+  if (!LoadBlockIndexSnapshot())
+  {
+    if (!pblocktree->LoadBlockIndexGuts())
+      return false;
+
+    boost::this_thread::interruption_point();
+
+    // Calculate nChainWork. LoadBlockIndexGuts leaves the work of each
+    // block itself in nChainWork, so this pass is only additions.
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+      CBlockIndex* pindex = item.second;
+      vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    }
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+      CBlockIndex* pindex = item.second;
+      if (pindex->pprev)
+        pindex->nChainWork += pindex->pprev->nChainWork;
+      pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+      if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & (BLOCK_FAILED_MASK | BLOCK_PRUNED)))
+        setBlockIndexValid.insert(pindex);
+    }
   }
 
   // Load block file info
@@ -2611,12 +3569,23 @@ bool static LoadBlockIndexDB()
   pblocktree->ReadReindexing(fReindexing);
   fReindex |= fReindexing;
 
+  // Check whether block files were pruned, and whether to prune more
+  pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+  fCheckForPruning = fPruneMode;
+
   // Check whether we have a transaction index
   pblocktree->ReadFlag("txindex", fTxIndex);
   printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+  // Check whether we have the address and spent indexes
+  pblocktree->ReadFlag("addressindex", fAddressIndex);
+  printf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+  pblocktree->ReadFlag("spentindex", fSpentIndex);
+  printf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
   // Load hashBestChain pointer to end of best chain
   pindexBest = pcoinsTip->GetBestBlock();
+  FindBestHeader();
   if (pindexBest == NULL)
     return true;
   hashBestChain = pindexBest->GetBlockHash();
@@ -2637,6 +3606,123 @@ bool static LoadBlockIndexDB()
   return true;
 }
 
+// Check levels 0-2 of VerifyDB for one block. These depend neither on other
+// blocks nor on the coins, so they can run on any thread.
+static bool VerifyStoredBlock(CBlockIndex* pindex, int nCheckLevel, CBlock& block, std::string& strError)
+{
+  CValidationState state;
+  // check level 0: read from disk
+  if (!block.ReadFromDisk(pindex))
+  {
+    strError = strprintf("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+    return false;
+  }
+  // check level 1: verify block validity
+  if (nCheckLevel >= 1 && !block.CheckBlock(state, pindex->nHeight))
+  {
+    strError = strprintf("VerifyDB() : *** found bad block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+    return false;
+  }
+  // check level 2: verify undo validity
+  if (nCheckLevel >= 2) {
+    CBlockUndo undo;
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (!pos.IsNull()) {
+      if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+      {
+        strError = strprintf("VerifyDB() : *** found bad undo data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Runs VerifyStoredBlock over a list of blocks on all cores, reading ahead of
+ * the consumer by at most nWindow blocks, and hands the blocks out in list
+ * order for the serial levels.
+ */
+class CBlockVerifier
+{
+public:
+  CBlockVerifier(const std::vector<CBlockIndex*>& vIndexIn, int nCheckLevelIn, unsigned int nThreads, unsigned int nWindowIn)
+    : vIndex(vIndexIn), nCheckLevel(nCheckLevelIn), nWindow(nWindowIn), nNext(0), nConsumed(0), fStop(false)
+  {
+    for (unsigned int i = 0; i < nThreads; i++)
+      threads.create_thread(boost::bind(&CBlockVerifier::ThreadVerify, this));
+  }
+
+  ~CBlockVerifier()
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex);
+      fStop = true;
+    }
+    condWorker.notify_all();
+    threads.join_all();
+  }
+
+  /** Wait for block i, after which blocks before i are forgotten */
+  bool Get(unsigned int i, CBlock& block, std::string& strError)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    std::map<unsigned int, CResult>::iterator it;
+    while ((it = mapDone.find(i)) == mapDone.end())
+      condDone.wait(lock);
+    std::swap(block, it->second.block);
+    strError = it->second.strError;
+    mapDone.erase(it);
+    nConsumed = i + 1;
+    condWorker.notify_all();
+    return strError.empty();
+  }
+
+private:
+  struct CResult
+  {
+    CBlock block;
+    std::string strError;
+  };
+
+  const std::vector<CBlockIndex*>& vIndex;
+  const int nCheckLevel;
+  const unsigned int nWindow;
+  unsigned int nNext;
+  unsigned int nConsumed;
+  bool fStop;
+  std::map<unsigned int, CResult> mapDone;
+  boost::mutex mutex;
+  boost::condition_variable condWorker;
+  boost::condition_variable condDone;
+  boost::thread_group threads;
+
+  void ThreadVerify()
+  {
+    RenameThread("bitcoin-verifydb");
+    for (;;)
+    {
+      unsigned int i;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && nNext < vIndex.size() && nNext >= nConsumed + nWindow)
+          condWorker.wait(lock);
+        if (fStop || nNext >= vIndex.size())
+          return;
+        i = nNext++;
+      }
+      CResult result;
+      if (!VerifyStoredBlock(vIndex[i], nCheckLevel, result.block, result.strError) && result.strError.empty())
+        result.strError = "VerifyDB() : unknown error";
+      {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::swap(mapDone[i], result);
+      }
+      condDone.notify_all();
+    }
+  }
+};
+
 bool VerifyDB(int nCheckLevel, int nCheckDepth)
 {
   if (pindexBest == NULL || pindexBest->pprev == NULL)
@@ -2654,27 +3740,35 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
   CBlockIndex* pindexFailure = NULL;
   int nGoodTransactions = 0;
   CValidationState state;
+
+  // Levels 0-2 run on all cores ahead of this loop, which keeps only the
+  // tip-first disconnects of level 3
+  vector<CBlockIndex*> vCheck;
   for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
   {
-    boost::this_thread::interruption_point();
     if (pindex->nHeight < nBestHeight-nCheckDepth)
       break;
-    CBlock block;
-    // check level 0: read from disk
-    if (!block.ReadFromDisk(pindex))
-      return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-    // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !block.CheckBlock(state, pindex->nHeight))
-      return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-    // check level 2: verify undo validity
-    if (nCheckLevel >= 2 && pindex) {
-      CBlockUndo undo;
-      CDiskBlockPos pos = pindex->GetUndoPos();
-      if (!pos.IsNull()) {
-        if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-          return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-      }
+    if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+      break; // below a loaded UTXO snapshot
+    vCheck.push_back(pindex);
+  }
+  const unsigned int nThreads = std::max(1U, boost::thread::hardware_concurrency());
+  CBlockVerifier verifier(vCheck, nCheckLevel, nThreads, std::max(16U, 4 * nThreads));
+  int nReportedPercent = -1;
+  for (unsigned int i = 0; i < vCheck.size(); i++)
+  {
+    boost::this_thread::interruption_point();
+    CBlockIndex* pindex = vCheck[i];
+    int nPercent = (int)((i + 1) * 100 / vCheck.size());
+    if (nPercent != nReportedPercent)
+    {
+      uiInterface.InitMessage(strprintf(_("Verifying blocks... (%d%%)"), nPercent));
+      nReportedPercent = nPercent;
     }
+    CBlock block;
+    std::string strError;
+    if (!verifier.Get(i, block, strError))
+      return error("%s", strError.c_str());
     // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
     if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
       bool fClean = true;
@@ -2712,7 +3806,9 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 
 void UnloadBlockIndex()
 {
+  batchIndexPending.Clear();
   mapBlockIndex.clear();
+  dequeBlockIndex.clear();
   setBlockIndexValid.clear();
   pindexGenesisBlock = NULL;
   nBestHeight = 0;
@@ -2720,6 +3816,9 @@ void UnloadBlockIndex()
   nBestInvalidWork = 0;
   hashBestChain = 0;
   pindexBest = NULL;
+  pindexBestHeader = NULL;
+  vBestHeaderChain.clear();
+  pblockindexFBBHLast = NULL;
 }
 
 bool LoadBlockIndex()
@@ -2753,6 +3852,10 @@ bool InitBlockIndex() {
   // Use the provided setting for -txindex in the new database
   fTxIndex = GetBoolArg("-txindex", false);
   pblocktree->WriteFlag("txindex", fTxIndex);
+  fAddressIndex = GetBoolArg("-addressindex", false);
+  pblocktree->WriteFlag("addressindex", fAddressIndex);
+  fSpentIndex = GetBoolArg("-spentindex", false);
+  pblocktree->WriteFlag("spentindex", fSpentIndex);
   printf("Initializing databases...\n");
 
   // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -2785,7 +3888,7 @@ void PrintBlockTree()
 {
   // pre-compute tree structure
   map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-  for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+  for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
   {
     CBlockIndex* pindex = (*mi).second;
     mapNext[pindex->pprev].push_back(pindex);
@@ -2845,82 +3948,577 @@ void PrintBlockTree()
       }
     }
 
-    // iterate children
-    for (unsigned int i = 0; i < vNext.size(); i++)
-      vStack.push_back(make_pair(nCol+i, vNext[i]));
-  }
+    // iterate children
+    for (unsigned int i = 0; i < vNext.size(); i++)
+      vStack.push_back(make_pair(nCol+i, vNext[i]));
+  }
+}
+
+//
+// Block importer for -reindex, -loadblock and bootstrap.dat
+//
+// The file is scanned for blocks on one thread, the blocks are decoded and
+// put through CheckBlock (PoW included) on all cores, and the calling
+// thread accepts them into the chain. Stages are joined by bounded queues,
+// so reading, hashing and connecting overlap without buffering whole files.
+//
+
+/** Bounded FIFO between two importer stages */
+template<typename T>
+class CImportQueue
+{
+public:
+  CImportQueue(size_t nMaxIn) : nMax(nMaxIn), fClosed(false) {}
+
+  /** Wait for room and move item in; false if the queue was closed */
+  bool Push(T& item)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fClosed && queue.size() >= nMax)
+      condNotFull.wait(lock);
+    if (fClosed)
+      return false;
+    queue.push_back(T());
+    std::swap(queue.back(), item);
+    condNotEmpty.notify_one();
+    return true;
+  }
+
+  /** Wait for an item and move it out; false once closed and drained */
+  bool Pop(T& item)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fClosed && queue.empty())
+      condNotEmpty.wait(lock);
+    if (queue.empty())
+      return false;
+    std::swap(item, queue.front());
+    queue.pop_front();
+    condNotFull.notify_one();
+    return true;
+  }
+
+  /** No more items will be pushed; with fDiscard, pending items are dropped too */
+  void Close(bool fDiscard = false)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fClosed = true;
+    if (fDiscard)
+      queue.clear();
+    condNotEmpty.notify_all();
+    condNotFull.notify_all();
+  }
+
+private:
+  std::deque<T> queue;
+  const size_t nMax;
+  bool fClosed;
+  boost::mutex mutex;
+  boost::condition_variable condNotEmpty;
+  boost::condition_variable condNotFull;
+};
+
+struct CImportRaw
+{
+  CDiskBlockPos pos;
+  bool fHavePos;
+  std::vector<char> vData;
+};
+
+struct CImportBlock
+{
+  CDiskBlockPos pos;
+  bool fHavePos;
+  unsigned int nSize;
+  CBlock block;
+};
+
+// Blocks met before their parent, by parent hash. -reindex goes through
+// the block files one LoadExternalBlockFile call at a time, so they are
+// kept from one call to the next.
+static std::multimap<uint256, CImportBlock> mapImportPending;
+static size_t nImportPendingBytes = 0;
+static const size_t MAX_IMPORT_PENDING_BYTES = 128 * 1024 * 1024;
+
+// Accept a checked block, followed by any held back blocks and network
+// orphans building on it. Returns false on a system error.
+static bool ImportAcceptBlock(CImportBlock& item, int& nLoaded)
+{
+  LOCK(cs_main);
+  if (HaveBlockData(item.block.GetHash()))
+    return true;
+  CValidationState stateDifficulty;
+  if (!CheckBlockMinDifficulty(stateDifficulty, item.block, "LoadExternalBlockFile()"))
+    return true;
+  if (item.block.hashPrevBlock != 0 && !HaveBlockData(item.block.hashPrevBlock))
+  {
+    if (nImportPendingBytes + item.nSize > MAX_IMPORT_PENDING_BYTES)
+    {
+      printf("LoadExternalBlockFile() : too many out-of-order blocks, dropping %s\n", item.block.GetHash().ToString().c_str());
+      return true;
+    }
+    nImportPendingBytes += item.nSize;
+    std::multimap<uint256, CImportBlock>::iterator it = mapImportPending.insert(make_pair(item.block.hashPrevBlock, CImportBlock()));
+    std::swap(it->second, item);
+    return true;
+  }
+
+  std::deque<CImportBlock> queue(1);
+  std::swap(queue.front(), item);
+  while (!queue.empty())
+  {
+    CImportBlock& current = queue.front();
+    uint256 hash = current.block.GetHash();
+    if (!HaveBlockData(hash))
+    {
+      CValidationState state;
+      if (current.block.AcceptBlock(state, current.fHavePos ? &current.pos : NULL))
+      {
+        nLoaded++;
+        ProcessOrphanBlocks(hash);
+      }
+      if (state.IsError())
+        return false;
+    }
+
+    std::pair<std::multimap<uint256, CImportBlock>::iterator, std::multimap<uint256, CImportBlock>::iterator> range = mapImportPending.equal_range(hash);
+    for (std::multimap<uint256, CImportBlock>::iterator it = range.first; it != range.second; ++it)
+    {
+      nImportPendingBytes -= it->second.nSize;
+      queue.push_back(CImportBlock());
+      std::swap(queue.back(), it->second);
+    }
+    mapImportPending.erase(range.first, range.second);
+    queue.pop_front();
+  }
+  return true;
+}
+
+class CBlockImporter
+{
+public:
+  CBlockImporter(FILE* fileInIn, CDiskBlockPos* dbpIn)
+    : fileIn(fileInIn), dbp(dbpIn), queueRaw(64), queueChecked(64), nCheckers(0) {}
+
+  ~CBlockImporter()
+  {
+    // also reached when the connecting thread is interrupted
+    queueRaw.Close(true);
+    queueChecked.Close(true);
+    threads.join_all();
+  }
+
+  int Run()
+  {
+    int nLoaded = 0;
+    nCheckers = std::max(1U, boost::thread::hardware_concurrency());
+    threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+    for (int i = 0; i < nCheckers; i++)
+      threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+    CImportBlock item;
+    while (queueChecked.Pop(item))
+    {
+      boost::this_thread::interruption_point();
+      if (!ImportAcceptBlock(item, nLoaded))
+        break;
+    }
+    queueRaw.Close(true);
+    queueChecked.Close(true);
+    threads.join_all();
+
+    if (!strReadError.empty())
+      AbortNode(_("Error: system error: ") + strReadError);
+    return nLoaded;
+  }
+
+private:
+  FILE* fileIn;
+  CDiskBlockPos* dbp;
+  CImportQueue<CImportRaw> queueRaw;
+  CImportQueue<CImportBlock> queueChecked;
+  boost::thread_group threads;
+  boost::mutex mutexCheckers;
+  int nCheckers;
+  std::string strReadError;
+
+  // Scan the file for message start + size headers and hand on the raw blocks
+  void ThreadRead()
+  {
+    RenameThread("bitcoin-loadblk-read");
+    try {
+      CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+      uint64 nStartByte = 0;
+      if (dbp) {
+        // (try to) skip already indexed part
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
+          nStartByte = info.nSize;
+          blkdat.Seek(info.nSize);
+        }
+      }
+      uint64 nRewind = blkdat.GetPos();
+      while (blkdat.good() && !blkdat.eof()) {
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+          // locate a header
+          unsigned char buf[4];
+          blkdat.FindByte(pchMessageStart[0]);
+          nRewind = blkdat.GetPos()+1;
+          blkdat >> FLATDATA(buf);
+          if (memcmp(buf, pchMessageStart, 4))
+            continue;
+          // read size
+          blkdat >> nSize;
+          if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            continue;
+        } catch (std::exception &e) {
+          // no valid block header found; don't complain
+          break;
+        }
+        try {
+          // read block
+          uint64 nBlockPos = blkdat.GetPos();
+          blkdat.SetLimit(nBlockPos + nSize);
+          CImportRaw raw;
+          raw.vData.resize(nSize);
+          blkdat.read(&raw.vData[0], nSize);
+          nRewind = blkdat.GetPos();
+
+          if (nBlockPos >= nStartByte) {
+            raw.fHavePos = dbp != NULL;
+            if (dbp)
+              raw.pos = CDiskBlockPos(dbp->nFile, nBlockPos);
+            if (!queueRaw.Push(raw))
+              break; // aborted
+          }
+        } catch (std::exception &e) {
+          printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+      }
+    } catch (std::runtime_error &e) {
+      strReadError = e.what();
+    }
+    fclose(fileIn);
+    queueRaw.Close();
+  }
+
+  // Decode and check blocks independently of the chain, on all cores
+  void ThreadCheck()
+  {
+    RenameThread("bitcoin-loadblk-check");
+    CImportRaw raw;
+    while (queueRaw.Pop(raw))
+    {
+      CImportBlock item;
+      item.pos = raw.pos;
+      item.fHavePos = raw.fHavePos;
+      item.nSize = raw.vData.size();
+      try {
+        CDataStream ss(raw.vData, SER_DISK, CLIENT_VERSION);
+        ss >> item.block;
+      } catch (std::exception &e) {
+        printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+        continue;
+      }
+      CValidationState state;
+      if (!item.block.CheckBlock(state, INT_MAX))
+      {
+        printf("LoadExternalBlockFile() : CheckBlock FAILED for %s\n", item.block.GetHash().ToString().c_str());
+        continue;
+      }
+      if (!queueChecked.Push(item))
+        break; // aborted
+    }
+
+    // the last checker out closes the way to the connecting stage
+    boost::unique_lock<boost::mutex> lock(mutexCheckers);
+    if (--nCheckers == 0)
+      queueChecked.Close();
+  }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+  int64 nStart = GetTimeMillis();
+
+  CBlockImporter importer(fileIn, dbp);
+  int nLoaded = importer.Run();
+  if (nLoaded > 0)
+    printf("Loaded %i blocks from external file in %" PRI64d "ms\n", nLoaded, GetTimeMillis() - nStart);
+  if (!mapImportPending.empty())
+    printf("LoadExternalBlockFile() : %" PRIszu " blocks waiting for their parent\n", mapImportPending.size());
+  return nLoaded > 0;
+}
+
+void FinishExternalBlockImport()
+{
+  LOCK(cs_main);
+  if (mapImportPending.empty())
+    return;
+  printf("FinishExternalBlockImport() : dropping %" PRIszu " blocks (%" PRIszu " bytes) whose parent never came\n",
+         mapImportPending.size(), nImportPendingBytes);
+  for (std::multimap<uint256, CImportBlock>::const_iterator it = mapImportPending.begin(); it != mapImportPending.end(); ++it)
+    printf("  %s (parent %s)\n", it->second.block.GetHash().ToString().c_str(), it->first.ToString().c_str());
+  mapImportPending.clear();
+  nImportPendingBytes = 0;
+}
+
+//
+// UTXO snapshots (dumptxoutset / loadtxoutset)
+//
+// A snapshot holds the coin database at some block, preceded by the
+// immutable index data (header, auxpow, height, tx count) of every block
+// from the genesis block to it. A fresh node loading a snapshot whose hash
+// is compiled into the checkpoints takes the headers as its block index and
+// the coins as its chainstate, and continues syncing from that block. The
+// blocks before it are never downloaded; the trust is in the compiled-in
+// hash, as for the blocks below a checkpoint.
+//
+// Format: nVersion, hashBlock, nHeight, one CDiskBlockIndex for each height
+// from 1 to nHeight, (txid, CCoins) pairs in txid order ending with a zero
+// txid, and the gettxoutsetinfo hash_serialized of the coins.
+//
+
+static const int UTXO_SNAPSHOT_VERSION = 1;
+
+static bool WriteSnapshotCoins(CAutoFile& file, CCoinsStats* pstats, CHashWriter* pss, const uint256 &txid, const CCoins &coins)
+{
+  file << txid << coins;
+  pstats->Add(*pss, txid, coins);
+  return true;
+}
+
+void DumpUTXOSnapshot(const boost::filesystem::path &path, CCoinsStats &stats)
+{
+  FILE* file = fopen(path.string().c_str(), "wb");
+  if (!file)
+    throw runtime_error(strprintf("cannot open %s", path.string().c_str()));
+  CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+
+  // the coins are walked without cs_main, on a view of the database fixed
+  // together with the tip; the RPC call that dumps is done before shutdown
+  // deletes the database
+  CCoinsView::CCoinsWalker walkCoins;
+  {
+    LOCK(cs_main);
+    if (pindexBest == NULL)
+      throw runtime_error("no chain to dump");
+    if (!FlushCoinsAndIndexes())
+      throw runtime_error("cannot flush the coin database");
+
+    stats = CCoinsStats();
+    stats.hashBlock = hashBestChain;
+    stats.nHeight = nBestHeight;
+    fileout << UTXO_SNAPSHOT_VERSION << stats.hashBlock << stats.nHeight;
+
+    // index data of the blocks up to the tip, oldest first
+    for (CBlockIndex* pindex = pindexGenesisBlock->pnext; pindex; pindex = pindex->pnext)
+    {
+      CDiskBlockIndex diskindex;
+      if (!pblocktree->ReadDiskBlockIndex(pindex->GetBlockHash(), diskindex))
+        throw runtime_error(strprintf("cannot read the index of block %s", pindex->GetBlockHash().ToString().c_str()));
+      fileout << diskindex;
+    }
+
+    walkCoins = pcoinsTip->SnapshotCoins();
+    if (!walkCoins)
+      throw runtime_error("cannot read the coin database");
+  }
+
+  CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+  ss << stats.hashBlock;
+  if (!walkCoins(boost::bind(&WriteSnapshotCoins, boost::ref(fileout), &stats, &ss, _1, _2)))
+    throw runtime_error("cannot read the coin database");
+  stats.hashSerialized = ss.GetHash();
+  fileout << uint256(0) << stats.hashSerialized;
+  FileCommit(fileout);
+}
+
+// Read the snapshot coins, feeding them to fn if given; returns the stats
+static void ReadSnapshotCoins(CAutoFile &filein, CCoinsStats &stats, const CCoinsView::CCoinsVisitor &fn)
+{
+  CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+  ss << stats.hashBlock;
+  while (true)
+  {
+    boost::this_thread::interruption_point();
+    uint256 txid;
+    filein >> txid;
+    if (txid == 0)
+      break;
+    CCoins coins;
+    filein >> coins;
+    stats.Add(ss, txid, coins);
+    if (fn)
+      fn(txid, coins);
+  }
+  uint256 hashExpected;
+  filein >> hashExpected;
+  stats.hashSerialized = ss.GetHash();
+  if (stats.hashSerialized != hashExpected)
+    throw runtime_error("snapshot is corrupt");
+}
+
+static bool LoadSnapshotCoin(const uint256 &txid, const CCoins &coins)
+{
+  pcoinsTip->SetCoins(txid, coins);
+  // the best block stays at genesis until all coins are written
+  if (pcoinsTip->GetCacheSize() > nCoinCacheSize * 10 && !pcoinsTip->Flush())
+    throw runtime_error("cannot write the coin database");
+  return true;
+}
+
+// Open the snapshot and read its header
+static FILE* OpenUTXOSnapshot(const boost::filesystem::path &path, CCoinsStats &stats)
+{
+  FILE* file = fopen(path.string().c_str(), "rb");
+  if (!file)
+    throw runtime_error(strprintf("cannot open %s", path.string().c_str()));
+  CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+  int nVersion;
+  filein >> nVersion;
+  if (nVersion != UTXO_SNAPSHOT_VERSION)
+    throw runtime_error("unknown snapshot version");
+  filein >> stats.hashBlock >> stats.nHeight;
+  if (stats.nHeight <= 0)
+    throw runtime_error("snapshot is corrupt");
+  return filein.release();
+}
+
+// Present while a snapshot is written to the databases, so that a node
+// stopped halfway wipes them when it starts again
+static boost::filesystem::path UTXOSnapshotLoadMarker()
+{
+  return GetDataDir() / "utxosnapshot.loading";
+}
+
+bool UTXOSnapshotLoadUnfinished()
+{
+  return boost::filesystem::exists(UTXOSnapshotLoadMarker());
+}
+
+void ClearUTXOSnapshotLoad()
+{
+  boost::system::error_code ec;
+  boost::filesystem::remove(UTXOSnapshotLoadMarker(), ec);
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+// Write the checked snapshot to the block tree and coin databases; returns the snapshot block
+static CBlockIndex* ApplyUTXOSnapshot(const boost::filesystem::path &path, const CCoinsStats &stats, const vector<uint256> &vHashes)
 {
-  int64 nStart = GetTimeMillis();
+  CCoinsStats statsLoaded;
+  CAutoFile filein(OpenUTXOSnapshot(path, statsLoaded), SER_DISK, CLIENT_VERSION);
+  if (statsLoaded.hashBlock != stats.hashBlock || statsLoaded.nHeight != stats.nHeight)
+    throw runtime_error("snapshot changed while loading");
+
+  FILE* fileMarker = fopen(UTXOSnapshotLoadMarker().string().c_str(), "wb");
+  if (!fileMarker)
+    throw runtime_error("cannot create the snapshot load marker");
+  FileCommit(fileMarker);
+  fclose(fileMarker);
+
+  // block index entries for the headers, without block data; those the
+  // headers sync added already are reused
+  CBlockIndex* pindexPrev = pindexGenesisBlock;
+  for (int nHeight = 1; nHeight <= stats.nHeight; nHeight++)
+  {
+    CDiskBlockIndex diskindex;
+    filein >> diskindex;
+    uint256 hash = diskindex.CalcBlockHash();
+    if (hash != vHashes[nHeight - 1])
+      throw runtime_error("snapshot changed while loading");
+
+    CBlockIndex* pindex = InsertBlockIndex(hash);
+    pindex->pprev          = pindexPrev;
+    pindex->nHeight        = diskindex.nHeight;
+    pindex->nVersion       = diskindex.nVersion;
+    pindex->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindex->nTime          = diskindex.nTime;
+    pindex->nBits          = diskindex.nBits;
+    pindex->nNonce         = diskindex.nNonce;
+    pindex->nTx            = diskindex.nTx;
+    pindex->nChainWork     = pindexPrev->nChainWork + pindex->GetBlockWork256();
+    pindex->nChainTx       = pindexPrev->nChainTx + pindex->nTx;
+    if ((pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE)
+      pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_TREE;
+    if (!pblocktree->WriteDiskBlockIndex(CDiskBlockIndex(pindex, diskindex.auxpow)) || !pblocktree->WriteBlockIndex(*pindex))
+      throw runtime_error("cannot write the block index");
+    pindexPrev = pindex;
+  }
+
+  ReadSnapshotCoins(filein, statsLoaded, boost::bind(&LoadSnapshotCoin, _1, _2));
+  if (statsLoaded.hashSerialized != stats.hashSerialized)
+    throw runtime_error("snapshot changed while loading");
+
+  pcoinsTip->SetBestBlock(pindexPrev);
+  if (!pcoinsTip->Flush() || !pblocktree->Flush())
+    throw runtime_error("cannot write the coin database");
+  ClearUTXOSnapshotLoad();
+  return pindexPrev;
+}
 
-  int nLoaded = 0;
-  try {
-    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-    uint64 nStartByte = 0;
-    if (dbp) {
-      // (try to) skip already indexed part
-      CBlockFileInfo info;
-      if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-        nStartByte = info.nSize;
-        blkdat.Seek(info.nSize);
-      }
-    }
-    uint64 nRewind = blkdat.GetPos();
-    while (blkdat.good() && !blkdat.eof()) {
-      boost::this_thread::interruption_point();
+void LoadUTXOSnapshot(const boost::filesystem::path &path, CCoinsStats &stats)
+{
+  LOCK(cs_main);
+  if (fReindex || fImporting)
+    throw runtime_error("cannot load a snapshot while importing blocks");
+  if (pindexBest != pindexGenesisBlock || pindexGenesisBlock == NULL || pcoinsTip->GetBestBlock() != pindexGenesisBlock)
+    throw runtime_error("a snapshot can only be loaded into a node that has no blocks yet");
+  // headers from the sync may be there already, but no blocks past genesis
+  BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    if (item.second != pindexGenesisBlock && (item.second->nStatus & BLOCK_HAVE_DATA))
+      throw runtime_error("a snapshot can only be loaded into a node that has no blocks yet");
 
-      blkdat.SetPos(nRewind);
-      nRewind++; // start one byte further next time, in case of failure
-      blkdat.SetLimit(); // remove former limit
-      unsigned int nSize = 0;
-      try {
-        // locate a header
-        unsigned char buf[4];
-        blkdat.FindByte(pchMessageStart[0]);
-        nRewind = blkdat.GetPos()+1;
-        blkdat >> FLATDATA(buf);
-        if (memcmp(buf, pchMessageStart, 4))
-          continue;
-        // read size
-        blkdat >> nSize;
-        if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-          continue;
-      } catch (std::exception &e) {
-        // no valid block header found; don't complain
-        break;
-      }
-      try {
-        // read block
-        uint64 nBlockPos = blkdat.GetPos();
-        blkdat.SetLimit(nBlockPos + nSize);
-        CBlock block;
-        blkdat >> block;
-        nRewind = blkdat.GetPos();
-
-        // process block
-        if (nBlockPos >= nStartByte) {
-          LOCK(cs_main);
-          if (dbp)
-            dbp->nPos = nBlockPos;
-          CValidationState state;
-          if (ProcessBlock(state, NULL, &block, dbp))
-            nLoaded++;
-          if (state.IsError())
-            break;
-        }
-      } catch (std::exception &e) {
-        printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
-      }
+  // first pass: check the headers and the coins against the checkpoints
+  stats = CCoinsStats();
+  vector<uint256> vHashes;
+  {
+    CAutoFile filein(OpenUTXOSnapshot(path, stats), SER_DISK, CLIENT_VERSION);
+    vHashes.reserve(stats.nHeight);
+    uint256 hashPrev = pindexGenesisBlock->GetBlockHash();
+    for (int nHeight = 1; nHeight <= stats.nHeight; nHeight++)
+    {
+      CDiskBlockIndex diskindex;
+      filein >> diskindex;
+      uint256 hash = diskindex.CalcBlockHash();
+      if (diskindex.nHeight != nHeight || diskindex.hashPrev != hashPrev || !Checkpoints::CheckBlock(nHeight, hash))
+        throw runtime_error(strprintf("snapshot header chain broken at height %d", nHeight));
+      vHashes.push_back(hash);
+      hashPrev = hash;
     }
-    fclose(fileIn);
-  } catch(std::runtime_error &e) {
-    AbortNode(_("Error: system error: ") + e.what());
+    if (hashPrev != stats.hashBlock)
+      throw runtime_error("snapshot header chain does not lead to its block");
+
+    ReadSnapshotCoins(filein, stats, CCoinsView::CCoinsVisitor());
+    if (!Checkpoints::CheckUTXOSnapshot(stats.nHeight, stats.hashBlock, stats.hashSerialized))
+      throw runtime_error(strprintf("snapshot of block %s at height %d with hash %s is not known to this version",
+        stats.hashBlock.ToString().c_str(), stats.nHeight, stats.hashSerialized.ToString().c_str()));
   }
-  if (nLoaded > 0)
-    printf("Loaded %i blocks from external file in %" PRI64d "ms\n", nLoaded, GetTimeMillis() - nStart);
-  return nLoaded > 0;
+
+  // second pass: a failure from here on leaves a half loaded node
+  CBlockIndex* pindexSnapshot;
+  try {
+    pindexSnapshot = ApplyUTXOSnapshot(path, stats, vHashes);
+  } catch (std::runtime_error &e) {
+    throw runtime_error(string(e.what()) + "; restart the node, which wipes the half loaded databases, before trying again");
+  }
+
+  // the snapshot block is the new tip
+  for (CBlockIndex* pindex = pindexSnapshot; pindex->pprev; pindex = pindex->pprev)
+    pindex->pprev->pnext = pindex;
+  pindexBest = pindexSnapshot;
+  hashBestChain = pindexBest->GetBlockHash();
+  nBestHeight = pindexBest->nHeight;
+  nBestChainWork = pindexBest->nChainWork;
+  FindBestHeader();
+  nTimeBestReceived = GetTime();
+  nTransactionsUpdated++;
+  printf("LoadUTXOSnapshot(): new best=%s  height=%d  transactions=%" PRI64u "\n",
+    hashBestChain.ToString().c_str(), nBestHeight, stats.nTransactions);
 }
 
 
@@ -3016,7 +4614,7 @@ bool static AlreadyHave(const CInv& inv)
         pcoinsTip->HaveCoins(inv.hash);
     }
   case MSG_BLOCK:
-    return mapBlockIndex.count(inv.hash) ||
+    return HaveBlockData(inv.hash) ||
          mapOrphanBlocks.count(inv.hash);
   }
   // Don't know what it is, just say we already got one
@@ -3057,7 +4655,7 @@ void static ProcessGetData(CNode* pfrom)
       if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
       {
         bool send = true;
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
         pfrom->nBlocksRequested++;
         if (mi != mapBlockIndex.end())
         {
@@ -3075,13 +4673,16 @@ void static ProcessGetData(CNode* pfrom)
         } else {
           send = false;
         }
+        if (send && !((*mi).second->nStatus & BLOCK_HAVE_DATA))
+          send = false; // only the header is known
         if (send)
         {
-          // Send block from disk
-          CBlock block;
-          block.ReadFromDisk((*mi).second);
-          if (inv.type == MSG_BLOCK)
-            pfrom->PushMessage("block", block);
+          // Send block from disk, as stored
+          CBlockView block;
+          if (!block.ReadFromDisk((*mi).second))
+            send = false;
+          else if (inv.type == MSG_BLOCK)
+            pfrom->PushMessage("block", block.GetMappedBlock());
           else // MSG_FILTERED_BLOCK)
           {
             LOCK(pfrom->cs_filter);
@@ -3097,8 +4698,11 @@ void static ProcessGetData(CNode* pfrom)
               // however we MUST always provide at least what the remote peer needs
               typedef std::pair<unsigned int, uint256> PairType;
               BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                  pfrom->PushMessage("tx", block.vtx[pair.first]);
+              {
+                CTransaction tx;
+                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)) && block.GetTransaction(pair.first, tx))
+                  pfrom->PushMessage("tx", tx);
+              }
             }
             // else
               // no response
@@ -3396,18 +5000,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
       if (!fAlreadyHave) {
-        if (!fImporting && !fReindex)
+        if (fImporting || fReindex)
+          ;
+        else if (inv.type != MSG_BLOCK)
           pfrom->AskFor(inv);
+        else if (!mapBlockIndex.count(inv.hash))
+          // Blocks are only fetched through the download window, which
+          // needs their header first; known headers are in it already
+          pfrom->PushGetHeaders(pindexBestHeader, inv.hash);
       } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-        pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+        AskForOrphanParents(pfrom, mapOrphanBlocks[inv.hash]);
       } else if (nInv == nLastBlock) {
         // In case we are on a very long side-chain, it is possible that we already have
-        // the last block in an inv bundle sent in response to getblocks. Try to detect
-        // this situation and push another getblocks to continue.
-        pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
+        // the last block in an inv bundle. Try to detect this situation and ask for
+        // the headers that follow it.
+        pfrom->PushGetHeaders(mapBlockIndex[inv.hash], uint256(0));
         if (fDebug)
           printf("force request: %s\n", inv.ToString().c_str());
       }
+      if (inv.type == MSG_BLOCK)
+        UpdateBlockAvailability(pfrom, inv.hash);
 
       // Track requests for our stuff
       Inventory(inv.hash);
@@ -3480,7 +5092,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     if (locator.IsNull())
     {
       // If locator is null, return the hashStop block
-      map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+      BlockMap::iterator mi = mapBlockIndex.find(hashStop);
       if (mi == mapBlockIndex.end())
         return true;
       pindex = (*mi).second;
@@ -3495,7 +5107,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
     vector<CBlock> vHeaders;
-    int nLimit = 2000;
+    int nLimit = MAX_HEADERS_RESULTS;
     printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
     for (; pindex; pindex = pindex->pnext)
     {
@@ -3507,6 +5119,47 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
   }
 
 
+  else if (strCommand == "headers" && !fImporting && !fReindex)
+  {
+    vector<CBlock> vHeaders;
+    vRecv >> vHeaders;
+    if (vHeaders.size() > MAX_HEADERS_RESULTS)
+    {
+      pfrom->Misbehaving(20);
+      return error("message headers size() = %" PRIszu "", vHeaders.size());
+    }
+
+    CBlockIndex* pindexLast = NULL;
+    BOOST_FOREACH(CBlock& header, vHeaders)
+    {
+      if (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash())
+      {
+        pfrom->Misbehaving(20);
+        return error("non-continuous headers sequence");
+      }
+      CValidationState state;
+      if (!header.AcceptHeader(state, &pindexLast))
+      {
+        int nDoS;
+        if (state.IsInvalid(nDoS) && nDoS > 0)
+          pfrom->Misbehaving(nDoS);
+        return error("invalid header received");
+      }
+    }
+
+    if (pindexLast)
+    {
+      UpdateBlockAvailability(pfrom, pindexLast->GetBlockHash());
+      printf("headers %d up to %d from %s, best header now %d\n", (int)vHeaders.size(), pindexLast->nHeight,
+        pfrom->addr.ToString().c_str(), pindexBestHeader->nHeight);
+    }
+
+    // A full message means the peer has more to send
+    if (vHeaders.size() == MAX_HEADERS_RESULTS && pindexLast)
+      pfrom->PushGetHeaders(pindexLast, uint256(0));
+  }
+
+
   else if (strCommand == "tx")
   {
     vector<uint256> vWorkQueue;
@@ -3529,7 +5182,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
       printf("AcceptToMemoryPool: %s %s : accepted %s (poolsz %" PRIszu ")\n",
         pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-        tx.GetHash().ToString().c_str(),
+        inv.hash.ToString().c_str(),
         mempool.mapTx.size());
 
       // Recursively process any orphan transactions that depended on this one
@@ -3580,7 +5233,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     int nDoS = 0;
     if (state.IsInvalid(nDoS))
     {
-      printf("%s from %s %s was not accepted into the memory pool\n", tx.GetHash().ToString().c_str(),
+      printf("%s from %s %s was not accepted into the memory pool\n", inv.hash.ToString().c_str(),
         pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
       if (nDoS > 0)
         pfrom->Misbehaving(nDoS);
@@ -3598,6 +5251,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     CInv inv(MSG_BLOCK, block.GetHash());
     pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(inv.hash);
 
     CValidationState state;
     if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
@@ -3606,6 +5260,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     if (state.IsInvalid(nDoS))
       if (nDoS > 0)
         pfrom->Misbehaving(nDoS);
+    UpdateBlockAvailability(pfrom, inv.hash);
   }
 
 
@@ -3905,10 +5560,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         pto->PushMessage("ping");
     }
 
-    // Start block sync
+    // Start block sync: headers from the sync node, blocks from all outbound peers
     if (pto->fStartSync && !fImporting && !fReindex) {
       pto->fStartSync = false;
-      pto->PushGetBlocks(pindexBest, uint256(0));
+      pto->PushGetHeaders(pindexBestHeader, uint256(0));
     }
 
     // Resend wallet transactions that haven't gotten in a block yet
@@ -4032,6 +5687,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
     // Message: getdata
     //
     vector<CInv> vGetData;
+    if (!fImporting && !fReindex)
+      FindBlocksToDownload(pto, vGetData);
     int64 nNow = GetTime() * 1000000;
     while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
     {
@@ -4110,25 +5767,167 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
     ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
+// What CreateNewBlock needs to know about a memory pool transaction. Entries
+// are kept between calls, so a new template only looks up the coins of
+// transactions that entered the memory pool since the last one.
+class CTemplateTx
+{
+public:
+  CTransaction* ptx;
+  uint256 hash;
+  unsigned int nTxSize;
+  unsigned int nSigOps; // legacy and pay-to-script-hash
+  int64 nFees;
+  // Priority at a tip of height h is ((h+1)*dValueIn - dValueHeight) / nTxSize,
+  // counting only inputs from the chain
+  double dValueIn;
+  double dValueHeight;
+  // Memory pool transactions this one spends from
+  vector<uint256> vDependsOn;
+  bool fValid;
+
+  CTemplateTx()
+  {
+    ptx = NULL;
+    nTxSize = nSigOps = 0;
+    nFees = 0;
+    dValueIn = dValueHeight = 0;
+    fValid = false;
+  }
+
+  double GetPriority(int nHeight) const
+  {
+    return ((nHeight + 1) * dValueIn - dValueHeight) / nTxSize;
+  }
+};
+
+// Template data per memory pool transaction, protected by cs_main and mempool.cs
+static map<uint256, CTemplateTx> mapTemplateTx;
+static CBlockIndex* pindexTemplateTip = NULL;
+static unsigned int nTemplateTransactionsUpdated = 0;
+
+static void AddTemplateTx(CTransaction& tx, const uint256& hash, CCoinsViewCache& view)
+{
+  CTemplateTx& ttx = mapTemplateTx[hash];
+  ttx.ptx = &tx;
+  ttx.hash = hash;
+  ttx.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+  int64 nTotalIn = 0;
+  BOOST_FOREACH(const CTxIn& txin, tx.vin)
+  {
+    map<uint256, CTransaction>::iterator mi = mempool.mapTx.find(txin.prevout.hash);
+    if (mi != mempool.mapTx.end())
+    {
+      // Has to wait for dependencies
+      if (find(ttx.vDependsOn.begin(), ttx.vDependsOn.end(), txin.prevout.hash) == ttx.vDependsOn.end())
+        ttx.vDependsOn.push_back(txin.prevout.hash);
+      nTotalIn += (*mi).second.vout[txin.prevout.n].nValue;
+      continue;
+    }
+    if (!view.HaveCoins(txin.prevout.hash))
+    {
+      // This should never happen; all transactions in the memory
+      // pool should connect to either transactions in the chain
+      // or other transactions in the memory pool.
+      printf("ERROR: mempool transaction missing input\n");
+      if (fDebug) assert("mempool transaction missing input" == 0);
+      return;
+    }
+    const CCoins &coins = view.GetCoins(txin.prevout.hash);
+    int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+    nTotalIn += nValueIn;
+    ttx.dValueIn += (double)nValueIn;
+    ttx.dValueHeight += (double)nValueIn * coins.nHeight;
+  }
+  ttx.nFees = nTotalIn - tx.GetValueOut();
+
+  // Scripts are checked once, against the memory pool view
+  if (!tx.HaveInputs(view))
+    return;
+  ttx.nSigOps = tx.GetLegacySigOpCount() + tx.GetP2SHSigOpCount(view);
+  CValidationState state;
+  if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+    return;
+  ttx.fValid = true;
+}
+
+// Bring mapTemplateTx up to date with the memory pool and the tip pindexPrev
+static void UpdateTemplateTxs(CBlockIndex* pindexPrev)
+{
+  // Transactions that failed their checks may pass them against a new tip
+  // or once the memory pool holds their parents, so they are looked at again
+  bool fRetryInvalid = (pindexPrev != pindexTemplateTip || nTransactionsUpdated != nTemplateTransactionsUpdated);
+  nTemplateTransactionsUpdated = nTransactionsUpdated;
+
+  if (pindexPrev != pindexTemplateTip)
+  {
+    if (pindexTemplateTip == NULL || pindexPrev->pprev != pindexTemplateTip)
+    {
+      // Reorganization: start over
+      mapTemplateTx.clear();
+    }
+    else
+    {
+      // The new block may have confirmed parents of the transactions that
+      // are left, changing their priority
+      for (map<uint256, CTemplateTx>::iterator it = mapTemplateTx.begin(); it != mapTemplateTx.end(); )
+      {
+        if (!(*it).second.vDependsOn.empty())
+          mapTemplateTx.erase(it++);
+        else
+          ++it;
+      }
+    }
+    pindexTemplateTip = pindexPrev;
+  }
+
+  // Evict what left the memory pool, mined or conflicted
+  for (map<uint256, CTemplateTx>::iterator it = mapTemplateTx.begin(); it != mapTemplateTx.end(); )
+  {
+    map<uint256, CTransaction>::iterator mi = mempool.mapTx.find((*it).first);
+    if (mi == mempool.mapTx.end() || (fRetryInvalid && !(*it).second.fValid))
+      mapTemplateTx.erase(it++);
+    else
+    {
+      (*it).second.ptx = &(*mi).second;
+      ++it;
+    }
+  }
+  if (mapTemplateTx.size() == mempool.mapTx.size())
+    return;
+
+  // And add what is new
+  CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+  CCoinsViewCache view(viewMemPool, false);
+  for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+  {
+    CTransaction& tx = (*mi).second;
+    if (tx.IsCoinBase() || mapTemplateTx.count((*mi).first))
+      continue;
+    AddTemplateTx(tx, (*mi).first, view);
+  }
+}
+
 // Some explaining would be appreciated
 class COrphan
 {
 public:
-  CTransaction* ptx;
+  CTemplateTx* pttx;
   set<uint256> setDependsOn;
   double dPriority;
   double dFeePerKb;
 
-  COrphan(CTransaction* ptxIn)
+  COrphan(CTemplateTx* pttxIn)
   {
-    ptx = ptxIn;
+    pttx = pttxIn;
     dPriority = dFeePerKb = 0;
   }
 
   void print() const
   {
     printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-         ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
+         pttx->hash.ToString().c_str(), dPriority, dFeePerKb);
     BOOST_FOREACH(uint256 hash, setDependsOn)
       printf("   setDependsOn %s\n", hash.ToString().c_str());
   }
@@ -4139,7 +5938,7 @@ uint64 nLastBlockTx = 0;
 uint64 nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, CTemplateTx*> TxPriority;
 class TxPriorityCompare
 {
   bool byFee;
@@ -4206,7 +6005,7 @@ CBlockTemplate* CreateNewBlock(
   {
     LOCK2(cs_main, mempool.cs);
     CBlockIndex* pindexPrev = pindexBest;
-    CCoinsViewCache view(*pcoinsTip, true);
+    UpdateTemplateTxs(pindexPrev);
 
     // Priority order to process transactions
     list<COrphan> vOrphan; // list memory doesn't move
@@ -4215,74 +6014,35 @@ CBlockTemplate* CreateNewBlock(
 
     // This vector will be sorted into a priority queue:
     vector<TxPriority> vecPriority;
-    vecPriority.reserve(mempool.mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+    vecPriority.reserve(mapTemplateTx.size());
+    for (map<uint256, CTemplateTx>::iterator mi = mapTemplateTx.begin(); mi != mapTemplateTx.end(); ++mi)
     {
-      CTransaction& tx = (*mi).second;
-      if (tx.IsCoinBase() || !tx.IsFinal())
+      CTemplateTx& ttx = (*mi).second;
+      if (!ttx.fValid || !ttx.ptx->IsFinal())
         continue;
 
-      COrphan* porphan = NULL;
-      double dPriority = 0;
-      int64 nTotalIn = 0;
-      bool fMissingInputs = false;
-      BOOST_FOREACH(const CTxIn& txin, tx.vin)
-      {
-        // Read prev transaction
-        if (!view.HaveCoins(txin.prevout.hash))
-        {
-          // This should never happen; all transactions in the memory
-          // pool should connect to either transactions in the chain
-          // or other transactions in the memory pool.
-          if (!mempool.mapTx.count(txin.prevout.hash))
-          {
-            printf("ERROR: mempool transaction missing input\n");
-            if (fDebug) assert("mempool transaction missing input" == 0);
-            fMissingInputs = true;
-            if (porphan)
-              vOrphan.pop_back();
-            break;
-          }
-
-          // Has to wait for dependencies
-          if (!porphan)
-          {
-            // Use list for automatic deletion
-            vOrphan.push_back(COrphan(&tx));
-            porphan = &vOrphan.back();
-          }
-          mapDependers[txin.prevout.hash].push_back(porphan);
-          porphan->setDependsOn.insert(txin.prevout.hash);
-          nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-          continue;
-        }
-        const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-        int64 nValueIn = coins.vout[txin.prevout.n].nValue;
-        nTotalIn += nValueIn;
-
-        int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-        dPriority += (double)nValueIn * nConf;
-      }
-      if (fMissingInputs) continue;
-
-      // Priority is sum(valuein * age) / txsize
-      unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-      dPriority /= nTxSize;
+      double dPriority = ttx.GetPriority(pindexPrev->nHeight);
 
       // This is a more accurate fee-per-kilobyte than is used by the client code, because the
       // client code rounds up the size to the nearest 1K. That's good, because it gives an
       // incentive to create smaller transactions.
-      double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+      double dFeePerKb = double(ttx.nFees) / (double(ttx.nTxSize)/1000.0);
 
-      if (porphan)
+      if (!ttx.vDependsOn.empty())
       {
+        // Has to wait for dependencies
+        vOrphan.push_back(COrphan(&ttx));
+        COrphan* porphan = &vOrphan.back();
         porphan->dPriority = dPriority;
         porphan->dFeePerKb = dFeePerKb;
+        BOOST_FOREACH(const uint256& hashParent, ttx.vDependsOn)
+        {
+          mapDependers[hashParent].push_back(porphan);
+          porphan->setDependsOn.insert(hashParent);
+        }
       }
       else
-        vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+        vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &ttx));
     }
 
     // Collect transactions into block
@@ -4290,6 +6050,8 @@ CBlockTemplate* CreateNewBlock(
     uint64 nBlockTx = 0;
     int nBlockSigOps = 100;
     bool fSortedByFee = (nBlockPrioritySize <= 0);
+    // Outputs spent by the transactions taken so far
+    set<COutPoint> setSpent;
 
     TxPriorityCompare comparer(fSortedByFee);
     std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
@@ -4299,18 +6061,19 @@ CBlockTemplate* CreateNewBlock(
       // Take highest priority transaction off the priority queue:
       double dPriority = vecPriority.front().get<0>();
       double dFeePerKb = vecPriority.front().get<1>();
-      CTransaction& tx = *(vecPriority.front().get<2>());
+      const CTemplateTx& ttx = *(vecPriority.front().get<2>());
+      const CTransaction& tx = *ttx.ptx;
 
       std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
       vecPriority.pop_back();
 
       // Size limits
-      unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+      unsigned int nTxSize = ttx.nTxSize;
       if (nBlockSize + nTxSize >= nBlockMaxSize)
         continue;
 
-      // Legacy limits on sigOps:
-      unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+      // Limits on sigOps, legacy and pay-to-script-hash:
+      unsigned int nTxSigOps = ttx.nSigOps;
       if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
         continue;
 
@@ -4328,22 +6091,19 @@ CBlockTemplate* CreateNewBlock(
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
       }
 
-      if (!tx.HaveInputs(view))
-        continue;
-
-      int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
-
-      nTxSigOps += tx.GetP2SHSigOpCount(view);
-      if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-        continue;
-
-      CValidationState state;
-      if (!tx.CheckInputs(state, view, true, SCRIPT_VERIFY_P2SH))
+      // Inputs and scripts were checked when ttx entered the cache; only a
+      // conflict with a transaction already in the block is left to rule out
+      bool fConflict = false;
+      BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setSpent.count(txin.prevout))
+          fConflict = true;
+      if (fConflict)
         continue;
+      BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        setSpent.insert(txin.prevout);
 
-      CTxUndo txundo;
-      uint256 hash = tx.GetHash();
-      tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
+      int64 nTxFees = ttx.nFees;
+      const uint256& hash = ttx.hash;
 
       // Added
       pblock->vtx.push_back(tx);
@@ -4357,7 +6117,7 @@ CBlockTemplate* CreateNewBlock(
       if (fPrintPriority)
       {
         printf("priority %.1f feeperkb %.1f txid %s\n",
-             dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+             dPriority, dFeePerKb, hash.ToString().c_str());
       }
 
       // Add transactions that depend on this one to the priority queue
@@ -4370,7 +6130,7 @@ CBlockTemplate* CreateNewBlock(
             porphan->setDependsOn.erase(hash);
             if (porphan->setDependsOn.empty())
             {
-              vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+              vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->pttx));
               std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
             }
           }
@@ -4405,6 +6165,7 @@ CBlockTemplate* CreateNewBlock(
     if (!pblock->ConnectBlock(state, &indexDummy, viewNew, true))
       throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
   }
+  pblocktemplate->vCoinbaseMerkleBranch = pblock->GetMerkleBranch(0);
 
   return pblocktemplate.release();
 }
@@ -4421,8 +6182,9 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
   return CreateNewBlock(scriptPubKey1, scriptPubKey2);
 }
 
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+void IncrementExtraNonce(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
+  CBlock* pblock = &pblocktemplate->block;
   // Update nExtraNonce
   static uint256 hashPrevBlock;
   if (hashPrevBlock != pblock->hashPrevBlock)
@@ -4435,7 +6197,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
   pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
   assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
-  pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+  pblocktemplate->UpdateMerkleRoot();
 }
 
 
@@ -4555,167 +6317,231 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
   return true;
 }
 
-void static TheMiner(CWallet *pwallet)
+// A block to mine on, shared by all miner threads. Jobs are immutable once
+// published; a new one replaces the pointer in CMinerState::pjob.
+struct CMiningJob
+{
+  CBlockTemplate blocktemplate;
+  CBlockIndex* pindexPrev;
+};
+
+// Hashes done by one miner thread; only that thread writes it. Padded so
+// the threads don't share cache lines.
+struct CMinerCounter
+{
+  std::atomic<uint64_t> nHashes;
+  char pad[64 - sizeof(std::atomic<uint64_t>)];
+
+  CMinerCounter() : nHashes(0) {}
+};
+
+// State shared by the miner threads of one GenerateBitcoins call
+class CMinerState
+{
+public:
+  CWallet* pwallet;
+  CReserveKey reservekey;
+  // current job, read and written with std::atomic_load/atomic_store
+  std::shared_ptr<const CMiningJob> pjob;
+  std::vector<CMinerCounter> vCounters;
+  // serializes CheckWork, which keeps reservekey's key
+  CCriticalSection cs_found;
+
+  CMinerState(CWallet* pwalletIn, unsigned int nThreads)
+    : pwallet(pwalletIn), reservekey(pwalletIn), vCounters(nThreads) {}
+};
+
+// Builds new jobs whenever the tip or the memory pool changes (SetBestChain
+// and new fee-paying transactions notify cvTemplateChange), and meters the
+// hash rate of the workers.
+void static MinerCoordinator(std::shared_ptr<CMinerState> pstate)
 {
-  static int miner_id_ = 0;
-  const int miner_id = ++miner_id_;
-  LOG() << "LitecoinMiner " << miner_id << " started"
-    << std::endl;
-  SetThreadPriority(THREAD_PRIORITY_LOWEST);
   RenameThread("litecoin-miner");
 
-  // Each thread has its own key and counter
-  CReserveKey reservekey(pwallet);
-  unsigned int nExtraNonce = 0;
+  unsigned int nTemplateChangesLast = 0;
+  unsigned int nTransactionsUpdatedLast = 0;
+  int64 nStart = 0;
+  uint64_t nHashesLast = 0;
+  nHPSTimerStart = GetTimeMillis();
 
   try { loop {
-  while (vNodes.empty())
+  boost::this_thread::interruption_point();
+
+  std::shared_ptr<const CMiningJob> pjob = std::atomic_load(&pstate->pjob);
+  if (vNodes.empty())
+  {
+    if (pjob)
+      std::atomic_store(&pstate->pjob, std::shared_ptr<const CMiningJob>());
     MilliSleep(1000);
+    continue;
+  }
 
-  //
-  // Create new block
-  //
-  unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-  CBlockIndex* pindexPrev = pindexBest;
+  unsigned int nTemplateChangesNew;
+  {
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    nTemplateChangesNew = nTemplateChanges;
+  }
+  CBlockIndex* pindexBestNew;
+  unsigned int nTransactionsUpdatedNew;
+  {
+    LOCK(cs_main);
+    pindexBestNew = pindexBest;
+    nTransactionsUpdatedNew = nTransactionsUpdated;
+  }
+  if (!pjob || pjob->pindexPrev != pindexBestNew || nTemplateChangesNew != nTemplateChangesLast ||
+    (nTransactionsUpdatedNew != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+  {
+    std::shared_ptr<CMiningJob> pjobNew(new CMiningJob());
+    CBlockTemplate* pblocktemplate;
+    {
+      // Keep the tip from moving between reading it and building on it
+      LOCK(cs_main);
+      nTransactionsUpdatedLast = nTransactionsUpdated;
+      pjobNew->pindexPrev = pindexBest;
+      pblocktemplate = CreateNewBlockWithKey(pstate->reservekey);
+    }
+    if (!pblocktemplate)
+    {
+      // Don't let the workers grind on a stale job; try again shortly
+      if (pjob)
+        std::atomic_store(&pstate->pjob, std::shared_ptr<const CMiningJob>());
+      MilliSleep(1000);
+      continue;
+    }
+    nTemplateChangesLast = nTemplateChangesNew;
+    nStart = GetTime();
+    pjobNew->blocktemplate = *pblocktemplate;
+    delete pblocktemplate;
+    const CBlock& block = pjobNew->blocktemplate.block;
 
-  auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-  if (!pblocktemplate.get())
-    return;
-  CBlock *pblock = &pblocktemplate->block;
-  IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+    printf("Running TheMiner with %" PRIszu " transactions in block (%u bytes)\n", block.vtx.size(),
+       ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    LOG() << "Current target: " << CBigNum().SetCompact(block.nBits).getuint256() << std::endl;
+    std::atomic_store(&pstate->pjob, std::shared_ptr<const CMiningJob>(pjobNew));
+  }
 
-  printf("Running TheMiner with %" PRIszu " transactions in block (%u bytes)\n", pblock->vtx.size(),
-     ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+  // Meter hashes/sec
+  if (GetTimeMillis() - nHPSTimerStart > 4000)
+  {
+    uint64_t nHashes = 0;
+    BOOST_FOREACH(const CMinerCounter& counter, pstate->vCounters)
+      nHashes += counter.nHashes.load(std::memory_order_relaxed);
+    dHashesPerSec = 1000.0 * (nHashes - nHashesLast) / (GetTimeMillis() - nHPSTimerStart);
+    nHPSTimerStart = GetTimeMillis();
+    nHashesLast = nHashes;
+    static int64 nLogTime;
+    if (GetTime() - nLogTime > 30 * 60)
+    {
+      nLogTime = GetTime();
+      LOG() << "hashmeter " << std::fixed
+        << dHashesPerSec << " hash/s" << std::endl;
+    }
+  }
 
-  //
-  // Pre-build hash buffers
-  //
-  char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-  char pdatabuf[128+16];  char* pdata   = alignup<16>(pdatabuf);
-  char phash1buf[64+16];  char* phash1  = alignup<16>(phash1buf);
+  {
+    boost::unique_lock<boost::mutex> lock(csTemplateChange);
+    if (nTemplateChanges == nTemplateChangesLast)
+      cvTemplateChange.timed_wait(lock, boost::posix_time::seconds(1));
+  }
+  } }
+  catch (boost::thread_interrupted)
+  {
+  printf("TheMiner terminated\n");
+  throw;
+  }
+}
+
+// Hashes the current job. Each worker keeps its own hasher (and so its own
+// scratchpad) for as long as the N-factor stays the same, and takes every
+// nThreads-th extra nonce so the workers never search the same space.
+void static TheMiner(std::shared_ptr<CMinerState> pstate, unsigned int nThread)
+{
+  LOG() << "LitecoinMiner " << nThread + 1 << " started"
+    << std::endl;
+  SetThreadPriority(THREAD_PRIORITY_LOWEST);
+  RenameThread("litecoin-miner");
+
+  const unsigned int nThreads = pstate->vCounters.size();
+  std::atomic<uint64_t>& nHashCounter = pstate->vCounters[nThread].nHashes;
+  uint64_t nHashesDone = 0;
+
+  std::shared_ptr< ::hash::hasher> H;
+  n_factor_t nFactor;
+  std::shared_ptr<const CMiningJob> pjob;
+  CBlockTemplate blocktemplate;
+  CBlock* pblock = &blocktemplate.block;
+  unsigned int nExtraNonce = 0;
+  uint256 hashTarget;
 
-  FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+  try { loop {
+  boost::this_thread::interruption_point();
+
+  // Pick up a new job
+  std::shared_ptr<const CMiningJob> pjobNew = std::atomic_load(&pstate->pjob);
+  if (!pjobNew)
+  {
+    pjob.reset();
+    MilliSleep(100);
+    continue;
+  }
+  bool fNewCoinbase = false;
+  if (pjobNew != pjob)
+  {
+    pjob = pjobNew;
+    blocktemplate = pjob->blocktemplate;
+    nExtraNonce = nThread;
+    fNewCoinbase = true;
+  }
+  else if (pblock->nNonce >= 0xffff0000)
+  {
+    nExtraNonce += nThreads;
+    fNewCoinbase = true;
+  }
+  if (fNewCoinbase)
+  {
+    unsigned int nHeight = pjob->pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    blocktemplate.UpdateMerkleRoot();
+    pblock->nNonce = 0;
+  }
 
-  unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-  unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-  //unsigned int& nBlockNonce = *(unsigned int*)(pdata + 64 + 12);
+  // Update nTime every few seconds; on testnet this can change the work required
+  pblock->UpdateTime(pjob->pindexPrev);
+  hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
+  n_factor_t nFactorNew = GetNfactor(pblock->GetTimePoint());
+  if (!H || nFactorNew != nFactor)
+  {
+    H = ::hash::hasher::instance(pblock->GetTimePoint());
+    nFactor = nFactorNew;
+  }
 
   //
   // Search
   //
-  int64 nStart = GetTime();
-  uint256 hashTarget = CBigNum().SetCompact(pblock->nBits)
-    . getuint256();
-  LOG() << '(' << miner_id << ") Current target: " 
-        << hashTarget << std::endl;
-
-//#define LOG_BEST_HASH
-#ifdef LOG_BEST_HASH
-  static auto global_best_hash = ~uint256();
-  auto best_hash = global_best_hash;
-#endif
-
   loop
   {
-    unsigned int nHashesDone = 0;
-
-    uint256 thash;
-    auto H = ::hash::hasher::instance
-       (pblock->GetTimePoint());
-    loop
-    {
-      thash = H->hash(*pblock);
-      
-      if (thash <= hashTarget)
-      {
-        // Found a solution
-        SetThreadPriority(THREAD_PRIORITY_NORMAL);
-        CheckWork(pblock, *pwallet, reservekey);
-        SetThreadPriority(THREAD_PRIORITY_LOWEST);
-        break;
-      }
-      pblock->nNonce += 1;
-      nHashesDone += 1;
-
-#ifdef LOG_BEST_HASH
-      if (thash < best_hash) {
-        best_hash = thash;
-        static CCriticalSection cs;
-        bool global_best = false;
-        {
-          LOCK(cs);
-          if (thash < global_best_hash)
-          {
-            global_best_hash = thash;
-            global_best = true;
-          }
-          else 
-            best_hash = global_best_hash;
-        }
-        if (global_best) {
-          LOG() << '(' << miner_id << ") Best hash: " 
-                << thash << std::endl;
-          break;
-        }
-      }
-#endif
-      if ((pblock->nNonce & 0xFF) == 0)
-        break;
-    }
-
-    // Meter hashes/sec
-    static int64 nHashCounter;
-    if (nHPSTimerStart == 0)
-    {
-    nHPSTimerStart = GetTimeMillis();
-    nHashCounter = 0;
-    }
-    else
-    nHashCounter += nHashesDone;
-    if (GetTimeMillis() - nHPSTimerStart > 4000)
-    {
-    static CCriticalSection cs;
+    uint256 thash = H->hash(*pblock);
+    if (thash <= hashTarget)
     {
-      LOCK(cs);
-      if (GetTimeMillis() - nHPSTimerStart > 4000)
-      {
-      dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-      nHPSTimerStart = GetTimeMillis();
-      nHashCounter = 0;
-      static int64 nLogTime;
-      if (GetTime() - nLogTime > 30 * 60)
+      // Found a solution
+      SetThreadPriority(THREAD_PRIORITY_NORMAL);
       {
-        nLogTime = GetTime();
-        LOG() << "hashmeter " << std::fixed 
-          << dHashesPerSec << " hash/s" << std::endl;
+        LOCK(pstate->cs_found);
+        CheckWork(pblock, *pstate->pwallet, pstate->reservekey);
       }
-      }
-    }
-    }
-
-    // Check for stop or if block needs to be rebuilt
-    boost::this_thread::interruption_point();
-    if (vNodes.empty())
-    break;
-    if (pblock->nNonce >= 0xffff0000)
-    break;
-    if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
-    break;
-    if (pindexPrev != pindexBest)
-    break;
-
-    // Update nTime every few seconds
-    pblock->UpdateTime(pindexPrev);
-    nBlockTime = ByteReverse(pblock->nTime);
-    if (fTestNet)
-    {
-    // Changing pblock->nTime can change work required on
-    // testnet:
-    nBlockBits = ByteReverse(pblock->nBits.compact);
-    hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+      SetThreadPriority(THREAD_PRIORITY_LOWEST);
+      // don't look at the same extra nonce again
+      pblock->nNonce = 0xffff0000;
+      break;
     }
+    pblock->nNonce += 1;
+    nHashesDone += 1;
+    if ((pblock->nNonce & 0xFF) == 0)
+      break;
   }
+  nHashCounter.store(nHashesDone, std::memory_order_relaxed);
   } }
   catch (boost::thread_interrupted)
   {
@@ -4724,9 +6550,13 @@ void static TheMiner(CWallet *pwallet)
   }
 }
 
+// Must not be called with cs_main or a wallet lock held: the miner threads
+// take both before they notice the interruption, so joining them would deadlock.
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 {
   static boost::thread_group* minerThreads = NULL;
+  static CCriticalSection cs_generate;
+  LOCK(cs_generate);
 
   int nThreads = GetArg("-genproclimit", -1);
   if (nThreads < 0)
@@ -4735,6 +6565,7 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
   if (minerThreads != NULL)
   {
     minerThreads->interrupt_all();
+    minerThreads->join_all();
     delete minerThreads;
     minerThreads = NULL;
   }
@@ -4742,10 +6573,14 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
   if (nThreads == 0 || !fGenerate)
     return;
 
+  std::shared_ptr<CMinerState> pstate(new CMinerState(pwallet, nThreads));
   minerThreads = new boost::thread_group();
+  minerThreads->create_thread(
+    boost::bind(&MinerCoordinator, pstate)
+  );
   for (int i = 0; i < nThreads; i++)
     minerThreads->create_thread(
-      boost::bind(&TheMiner, pwallet)
+      boost::bind(&TheMiner, pstate, i)
     );
 }
 
@@ -4821,10 +6656,8 @@ public:
   CMainCleanup() {}
   ~CMainCleanup() {
     // block headers
-    std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-    for (; it1 != mapBlockIndex.end(); it1++)
-      delete (*it1).second;
     mapBlockIndex.clear();
+    dequeBlockIndex.clear();
 
     // orphan blocks
     std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <sstream>
 #include <list>
+#include <boost/function.hpp>
 #include "bignum.h"
 #include "sync.h"
 #include "net.h"
@@ -30,6 +31,7 @@ class CNode;
 class CAuxPow;
 
 struct CBlockIndexWorkComparator;
+struct CCoinsStats;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 1000000;            // 1000KB block hard limit
@@ -65,6 +67,18 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Number of headers in a full "headers" message; a full one means the peer has more */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** How far past the last block we can connect the download window reaches */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Number of blocks that may be requested from a single peer at once */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds a peer may keep us waiting for the block that holds back the window */
+static const int64 BLOCK_STALLING_TIMEOUT = 120;
+/** Depth below the tip down to which -prune keeps blocks and undo data, so reorgs stay possible */
+static const int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target in MiB: MIN_BLOCKS_TO_KEEP full blocks, their undo data and a file being filled */
+static const int64 MIN_PRUNE_TARGET_MB = 550;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -80,7 +94,10 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/** Held while pblocktree and pcoinsdbview are replaced or deleted (after cs_main),
+    so compactdb and getdbstats can use them without blocking the node */
+extern CCriticalSection cs_LevelDB;
+extern BlockMap mapBlockIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
@@ -89,6 +106,12 @@ extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+// Bumped, with cvTemplateChange notified, whenever a new block template would
+// differ materially: a new best block or nLongPollFees of new mempool fees
+extern boost::mutex csTemplateChange;
+extern boost::condition_variable cvTemplateChange;
+extern unsigned int nTemplateChanges;
+extern int64 nLongPollFees;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
 extern const std::string strMessageMagic;
@@ -103,7 +126,12 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
 extern unsigned int nCoinCacheSize;
+extern bool fPruneMode;
+extern uint64 nPruneTarget;
+extern bool fHavePruned;
 
 // Settings
 extern int64 nTransactionFee;
@@ -116,6 +144,7 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
+class CCoinsViewDB;
 struct CDiskBlockPos;
 class CCoins;
 class CTxUndo;
@@ -142,12 +171,28 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Free the blocks LoadExternalBlockFile still holds back for want of their parent */
+void FinishExternalBlockImport();
+/** Write the coin database at the tip, with the block headers before it, to a file (throws on error) */
+void DumpUTXOSnapshot(const boost::filesystem::path &path, CCoinsStats &stats);
+/** Start a node without blocks from a dumped coin database known to the checkpoints (throws on error) */
+void LoadUTXOSnapshot(const boost::filesystem::path &path, CCoinsStats &stats);
+/** Whether a LoadUTXOSnapshot was cut short, leaving the databases half written */
+bool UTXOSnapshotLoadUnfinished();
+/** Forget the cut short LoadUTXOSnapshot once the databases have been wiped */
+void ClearUTXOSnapshotLoad();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Commit the block and undo files written since the last call (or just finalize the last one) */
+void FlushBlockFile(bool fFinalize = false);
+/** Write the pending address and spent index changes, then the coins of pcoinsTip */
+bool FlushCoinsAndIndexes();
+/** Dump the block index for a fast next start; call on clean shutdown only */
+bool WriteBlockIndexSnapshot();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
 /** Print the loaded block tree */
@@ -158,6 +203,8 @@ CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Forget the blocks requested from a peer that is going away, so others get asked */
+void ReleaseBlocksInFlight(CNode* pnode);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Run the miner threads */
@@ -169,12 +216,18 @@ CBlockTemplate* CreateNewBlock(
 );
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey);
 /** Modify the extranonce in a block */
-void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
-void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, std::vector<unsigned char>& vchAux);
+void IncrementExtraNonce(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+void IncrementExtraNonceWithAux(CBlockTemplate* pblocktemplate, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, std::vector<unsigned char>& vchAux);
 /** Do mining precalculation */
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 /** Check mined block */
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+/** Wake everyone waiting on cvTemplateChange (longpolling miners) */
+void NotifyTemplateChange();
+/** nTemplateChanges, read under csTemplateChange */
+unsigned int GetTemplateChanges();
+/** Account for nFees of a transaction entering the memory pool; enough of them change the template */
+void NotifyTemplateFees(int64 nFees);
 
 /** 
  * Check whether a block hash satisfies the proof-of-work
@@ -271,6 +324,76 @@ struct CDiskTxPos : public CDiskBlockPos
   }
 };
 
+/** Block files kept mapped at once. Mappings are address space only, but
+ *  32-bit builds can't afford many 128 MiB ones. */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 64 : 4;
+/** Read-only memory mapping of block file nFile covering at least nMinSize bytes,
+ *  from a small cache of mappings; null if the file can't be mapped */
+boost::shared_ptr<const char> MapBlockFile(int nFile, size_t nMinSize, size_t &nSize);
+/** Drop the cached mapping of block file nFile before it is truncated or deleted */
+void UnmapBlockFile(int nFile);
+
+/** The serialized bytes of the block stored at a disk position, read in place
+ *  from the mapped block file instead of through fread */
+class CMappedBlock
+{
+private:
+  boost::shared_ptr<const char> pfile; // keeps the mapping alive
+  size_t nBegin;
+  size_t nEnd;
+
+public:
+  CMappedBlock() : nBegin(0), nEnd(0) {}
+  CMappedBlock(const CDiskBlockPos &pos);
+
+  bool IsNull() const { return !pfile; }
+
+  CMemoryReader GetReader(int nType = SER_DISK, int nVersion = CLIENT_VERSION) const {
+    return CMemoryReader(pfile.get() + nBegin, pfile.get() + nEnd, nType, nVersion);
+  }
+
+  // Serializes as the stored bytes, so a block can be relayed without decoding it
+  unsigned int GetSerializeSize(int nType, int nVersion) const {
+    return nEnd - nBegin;
+  }
+
+  template<typename Stream>
+  void Serialize(Stream &s, int nType, int nVersion) const {
+    s.write(pfile.get() + nBegin, nEnd - nBegin);
+  }
+};
+
+/** A stored block viewed in place: the header is decoded, the transactions are
+ *  only located. Their hashes are computed from the raw bytes when first asked
+ *  for and single transactions are decoded on demand, sparing the allocations
+ *  of a whole CBlock (one per script) to callers that need a few of them. */
+class CBlockView
+{
+private:
+  struct CTxSpan
+  {
+    const char *pbegin;
+    const char *pend;
+    mutable uint256 hash;
+    mutable bool fHashed;
+  };
+
+  CMappedBlock block;
+  CBlockHeader header;
+  std::vector<CTxSpan> vtx;
+
+public:
+  bool ReadFromDisk(const CDiskBlockPos &pos);
+  bool ReadFromDisk(const CBlockIndex *pindex);
+
+  const CBlockHeader &GetHeader() const { return header; }
+  const CMappedBlock &GetMappedBlock() const { return block; }
+  unsigned int GetTxCount() const { return vtx.size(); }
+
+  const uint256 &GetTxHash(unsigned int i) const;
+  bool GetTransaction(unsigned int i, CTransaction &tx) const;
+};
+
 
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
@@ -387,10 +510,9 @@ public:
     hasher << *this;
     fileout << hasher.GetHash();
 
-    // Flush stdio buffers and commit to disk before returning
-    fflush(fileout);
-    if (!IsInitialBlockDownload())
-      FileCommit(fileout);
+    // Flush stdio buffers and start writing back; FlushBlockFile commits it
+    // before the coins that depend on it
+    FileWriteBack(fileout, pos.nPos, nSize + 32);
 
     return true;
   }
@@ -826,7 +948,7 @@ public:
      if (nBlocks==0 || nTimeFirst > nTimeIn)
        nTimeFirst = nTimeIn;
      nBlocks++;
-     if (nHeightIn > nHeightFirst)
+     if (nHeightIn > nHeightLast)
        nHeightLast = nHeightIn;
      if (nTimeIn > nTimeLast)
        nTimeLast = nTimeIn;
@@ -1002,7 +1124,7 @@ public:
 
   explicit CBlockLocator(uint256 hashBlock)
   {
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi != mapBlockIndex.end())
       Set((*mi).second);
   }
@@ -1053,7 +1175,7 @@ public:
     int nStep = 1;
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-      std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+      BlockMap::iterator mi = mapBlockIndex.find(hash);
       if (mi != mapBlockIndex.end())
       {
         CBlockIndex* pindex = (*mi).second;
@@ -1072,7 +1194,7 @@ public:
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-      std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+      BlockMap::iterator mi = mapBlockIndex.find(hash);
       if (mi != mapBlockIndex.end())
       {
         CBlockIndex* pindex = (*mi).second;
@@ -1088,7 +1210,7 @@ public:
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-      std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+      BlockMap::iterator mi = mapBlockIndex.find(hash);
       if (mi != mapBlockIndex.end())
       {
         CBlockIndex* pindex = (*mi).second;
@@ -1125,6 +1247,8 @@ public:
   bool accept(CValidationState &state, CTransaction &tx, bool fCheckInputs, bool fLimitFree, bool* pfMissingInputs);
   bool addUnchecked(const uint256& hash, const CTransaction &tx);
   bool remove(const CTransaction &tx, bool fRecursive = false);
+  // Same, with the hash of tx already known
+  bool remove(const CTransaction &tx, const uint256 &hash, bool fRecursive = false);
   bool removeConflicts(const CTransaction &tx);
   void clear();
   void queryHashes(std::vector<uint256>& vtxid);
@@ -1149,6 +1273,8 @@ public:
 
 extern CTxMemPool mempool;
 
+class CHashWriter;
+
 struct CCoinsStats
 {
   int nHeight;
@@ -1160,6 +1286,10 @@ struct CCoinsStats
   int64 nTotalAmount;
 
   CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+
+  // Count one CCoins and feed it to the writer of hashSerialized, which
+  // must have been started with hashBlock
+  void Add(CHashWriter &ss, const uint256 &txid, const CCoins &coins);
 };
 
 /** Abstract view on the open txout dataset. */
@@ -1179,6 +1309,9 @@ public:
   // Retrieve the block index whose state this CCoinsView currently represents
   virtual CBlockIndex *GetBestBlock();
 
+  // Hash of that block, available before the block index is loaded
+  virtual uint256 GetBestBlockHash();
+
   // Modify the currently active block index
   virtual bool SetBestBlock(CBlockIndex *pindex);
 
@@ -1188,6 +1321,16 @@ public:
   // Calculate statistics about the unspent transaction output set
   virtual bool GetStats(CCoinsStats &stats);
 
+  // Call visitor for every CCoins in txid order until it returns false.
+  // Caches are not included, Flush them first.
+  typedef boost::function<bool (const uint256 &txid, const CCoins &coins)> CCoinsVisitor;
+  virtual bool ForEachCoins(const CCoinsVisitor &visitor);
+
+  // Fix the coins as they are now, to be walked later like ForEachCoins
+  // does, with no lock held. Empty if not supported.
+  typedef boost::function<bool (const CCoinsVisitor &visitor)> CCoinsWalker;
+  virtual CCoinsWalker SnapshotCoins();
+
   // As we use CCoinsViews polymorphically, have a virtual destructor
   virtual ~CCoinsView() {}
 };
@@ -1204,10 +1347,13 @@ public:
   bool SetCoins(const uint256 &txid, const CCoins &coins);
   bool HaveCoins(const uint256 &txid);
   CBlockIndex *GetBestBlock();
+  uint256 GetBestBlockHash();
   bool SetBestBlock(CBlockIndex *pindex);
   void SetBackend(CCoinsView &viewIn);
   bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
   bool GetStats(CCoinsStats &stats);
+  bool ForEachCoins(const CCoinsVisitor &visitor);
+  CCoinsWalker SnapshotCoins();
 };
 
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
@@ -1225,6 +1371,7 @@ public:
   bool SetCoins(const uint256 &txid, const CCoins &coins);
   bool HaveCoins(const uint256 &txid);
   CBlockIndex *GetBestBlock();
+  uint256 GetBestBlockHash();
   bool SetBestBlock(CBlockIndex *pindex);
   bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
 
@@ -1257,6 +1404,9 @@ public:
   bool HaveCoins(const uint256 &txid);
 };
 
+/** Global variable that points to the coin database under pcoinsTip */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -1268,6 +1418,16 @@ struct CBlockTemplate
   CBlock block;
   std::vector<int64_t> vTxFees;
   std::vector<int64_t> vTxSigOps;
+  // Merkle branch of the coinbase; it does not depend on the coinbase itself
+  std::vector<uint256> vCoinbaseMerkleBranch;
+
+  /** Recompute the merkle root after a change to the coinbase only */
+  void UpdateMerkleRoot()
+  {
+    block.hashMerkleRoot = CBlock::CheckMerkleBranch(block.vtx[0].GetHash(), vCoinbaseMerkleBranch, 0);
+    // the cached tree no longer matches the coinbase
+    block.vMerkleTree.clear();
+  }
 };
 
 #if defined(_M_IX86) || defined(__i386__) || defined(__i386) || defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64)
@@ -1297,6 +1457,8 @@ public:
   // Note that this will call IsRelevantAndUpdate on the filter for each transaction,
   // thus the filter will likely be modified.
   CMerkleBlock(const CBlock& block, CBloomFilter& filter);
+  // Same from a stored block, decoding one transaction at a time
+  CMerkleBlock(const CBlockView& block, CBloomFilter& filter);
 
   IMPLEMENT_SERIALIZE
   (
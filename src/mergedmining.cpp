@@ -0,0 +1,384 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mergedmining.h"
+#include "main.h"
+#include "bitcoinrpc.h"
+#include "netbase.h"
+#include "ui_interface.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+// Largest chain merkle tree tried is 2^MAX_AUX_MERKLE_BRANCH slots
+static const unsigned int MAX_AUX_MERKLE_BRANCH = 8;
+
+// Nonces tried per tree size to give every chain its own slot
+static const int MAX_AUX_MERKLE_NONCE = 16;
+
+// How often the aux chains are asked for new blocks, in seconds
+static const int AUX_UPDATE_INTERVAL = 5;
+
+// Longest wait for an aux chain to answer one request, in seconds
+static const int AUX_RPC_TIMEOUT = 10;
+
+CRPCAuxChain::CRPCAuxChain(const string& strURL) : fUseSSL(false)
+{
+    string strRest = strURL;
+    if (boost::algorithm::starts_with(strRest, "https://"))
+    {
+        fUseSSL = true;
+        strRest.erase(0, 8);
+    }
+    else if (boost::algorithm::starts_with(strRest, "http://"))
+        strRest.erase(0, 7);
+    while (!strRest.empty() && strRest[strRest.size() - 1] == '/')
+        strRest.erase(strRest.size() - 1);
+
+    size_t nAt = strRest.rfind('@');
+    if (nAt != string::npos)
+    {
+        strUserPass = strRest.substr(0, nAt);
+        strRest.erase(0, nAt + 1);
+    }
+
+    int nPort = 0;
+    SplitHostPort(strRest, nPort, strHost);
+    if (strHost.empty() || nPort <= 0)
+        throw runtime_error(strprintf("Invalid -auxchain '%s', expected <user>:<password>@<host>:<port>", strURL.c_str()));
+    strPort = itostr(nPort);
+}
+
+static Value CallAuxRPC(const string& strHost, const string& strPort, const string& strUserPass, bool fUseSSL,
+                        const string& strMethod, const Array& params)
+{
+    Object reply = CallRPC(strHost, strPort, strUserPass, fUseSSL, strMethod, params, AUX_RPC_TIMEOUT);
+    const Value& error = find_value(reply, "error");
+    if (error.type() != null_type)
+        throw runtime_error(strMethod + ": " + fast_write_string(error));
+    return find_value(reply, "result");
+}
+
+bool CRPCAuxChain::GetAuxBlock(uint256& hashBlock, int& nChainID, uint256& hashTarget)
+{
+    Value result = CallAuxRPC(strHost, strPort, strUserPass, fUseSSL, "getauxblock", Array());
+    if (result.type() != obj_type)
+        return false;
+    const Value& hash = find_value(result.get_obj(), "hash");
+    const Value& chainid = find_value(result.get_obj(), "chainid");
+    const Value& target = find_value(result.get_obj(), "target");
+    if (hash.type() != str_type || chainid.type() != int_type || target.type() != str_type)
+        return false;
+
+    // target is sent as the raw (little endian) bytes
+    vector<unsigned char> vchTarget = ParseHex(target.get_str());
+    if (vchTarget.size() != sizeof(hashTarget))
+        return false;
+    memcpy(hashTarget.begin(), &vchTarget[0], sizeof(hashTarget));
+
+    hashBlock.SetHex(hash.get_str());
+    nChainID = chainid.get_int();
+    return true;
+}
+
+bool CRPCAuxChain::SubmitAuxBlock(const uint256& hashBlock, const CAuxPow& auxpow)
+{
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << auxpow;
+
+    Array params;
+    params.push_back(hashBlock.GetHex());
+    params.push_back(HexStr(ss.begin(), ss.end()));
+    Value result = CallAuxRPC(strHost, strPort, strUserPass, fUseSSL, "getauxblock", params);
+    return result.type() == bool_type && result.get_bool();
+}
+
+// Slots of all blocks in a tree of nSize with nNonce; false if two collide
+static bool AssignChainIndexes(vector<CAuxWork::CAuxBlock>& vBlocks, unsigned int nSize, int nNonce)
+{
+    set<unsigned int> setSlots;
+    BOOST_FOREACH(CAuxWork::CAuxBlock& block, vBlocks)
+    {
+        block.nChainIndex = CAuxPow::GetExpectedIndex(nNonce, block.nChainID, nSize);
+        if (!setSlots.insert(block.nChainIndex).second)
+            return false;
+    }
+    return true;
+}
+
+bool CAuxWork::BuildMerkleTree()
+{
+    // Smallest tree (and nonce) where no two chains want the same slot
+    bool fFound = false;
+    for (unsigned int nSize = 1; nSize <= (1u << MAX_AUX_MERKLE_BRANCH) && !fFound; nSize *= 2)
+    {
+        for (int nNonce = 0; nNonce < MAX_AUX_MERKLE_NONCE && !fFound; nNonce++)
+        {
+            if (nSize < vBlocks.size() || !AssignChainIndexes(vBlocks, nSize, nNonce))
+                continue;
+            nMerkleSize = nSize;
+            nMerkleNonce = nNonce;
+            fFound = true;
+        }
+    }
+    if (!fFound)
+        return false;
+
+    // Unused slots get arbitrary leaves
+    vMerkleTree.clear();
+    for (unsigned int i = 0; i < nMerkleSize; i++)
+        vMerkleTree.push_back(uint256(i));
+    BOOST_FOREACH(const CAuxBlock& block, vBlocks)
+        vMerkleTree[block.nChainIndex] = block.hashBlock;
+
+    int j = 0;
+    for (unsigned int nSize = nMerkleSize; nSize > 1; nSize /= 2)
+    {
+        for (unsigned int i = 0; i < nSize; i += 2)
+            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]), END(vMerkleTree[j+i]),
+                                       BEGIN(vMerkleTree[j+i+1]), END(vMerkleTree[j+i+1])));
+        j += nSize;
+    }
+    return true;
+}
+
+vector<uint256> CAuxWork::GetChainMerkleBranch(unsigned int nChainIndex) const
+{
+    vector<uint256> vBranch;
+    int j = 0;
+    for (unsigned int nSize = nMerkleSize; nSize > 1; nSize /= 2)
+    {
+        vBranch.push_back(vMerkleTree[j + (nChainIndex ^ 1)]);
+        nChainIndex >>= 1;
+        j += nSize;
+    }
+    return vBranch;
+}
+
+vector<unsigned char> CAuxWork::GetAuxData() const
+{
+    // The root goes in byte reversed, as CAuxPow::Check looks for it
+    uint256 hashRoot = GetMerkleRoot();
+    vector<unsigned char> vchAux(hashRoot.begin(), hashRoot.end());
+    std::reverse(vchAux.begin(), vchAux.end());
+    vchAux.insert(vchAux.end(), BEGIN(nMerkleSize), END(nMerkleSize));
+    vchAux.insert(vchAux.end(), BEGIN(nMerkleNonce), END(nMerkleNonce));
+    return vchAux;
+}
+
+uint256 CAuxWork::GetMaxTarget() const
+{
+    uint256 hashMax = 0;
+    BOOST_FOREACH(const CAuxBlock& block, vBlocks)
+        if (block.hashTarget > hashMax)
+            hashMax = block.hashTarget;
+    return hashMax;
+}
+
+bool CAuxWork::IsSameWork(const CAuxWork& work) const
+{
+    if (vBlocks.size() != work.vBlocks.size())
+        return false;
+    for (unsigned int i = 0; i < vBlocks.size(); i++)
+    {
+        const CAuxBlock& block = vBlocks[i];
+        const CAuxBlock& blockOther = work.vBlocks[i];
+        if (block.pchain != blockOther.pchain || block.hashBlock != blockOther.hashBlock ||
+            block.nChainID != blockOther.nChainID || block.hashTarget != blockOther.hashTarget)
+            return false;
+    }
+    return true;
+}
+
+void CAuxWork::CreateAuxPow(unsigned int i, const CTransaction& txCoinbase, const vector<uint256>& vMerkleBranch,
+                            const CBlockHeader& header, CAuxPow& auxpow) const
+{
+    const CAuxBlock& block = vBlocks[i];
+    auxpow = CAuxPow(txCoinbase);
+    auxpow.hashBlock = header.GetHash();
+    auxpow.vMerkleBranch = vMerkleBranch;
+    auxpow.nIndex = 0;
+    auxpow.vChainMerkleBranch = GetChainMerkleBranch(block.nChainIndex);
+    auxpow.nChainIndex = block.nChainIndex;
+    auxpow.parentBlockHeader = header;
+}
+
+CMergedMiner::~CMergedMiner()
+{
+    Stop();
+    BOOST_FOREACH(CAuxChain* pchain, vChains)
+        delete pchain;
+}
+
+static void GetAuxBlockOf(CAuxChain* pchain, CAuxWork::CAuxBlock* pblock, bool* pfOk)
+{
+    try {
+        *pfOk = pchain->GetAuxBlock(pblock->hashBlock, pblock->nChainID, pblock->hashTarget);
+        if (!*pfOk)
+            printf("MergedMining: bad getauxblock reply from %s\n", pchain->GetName().c_str());
+    }
+    catch (std::exception& e) {
+        *pfOk = false;
+        printf("MergedMining: getauxblock from %s failed: %s\n", pchain->GetName().c_str(), e.what());
+    }
+}
+
+bool CMergedMiner::Update()
+{
+    // One request per chain, all in flight together
+    vector<CAuxWork::CAuxBlock> vReplies(vChains.size());
+    boost::scoped_array<bool> pfOk(new bool[vChains.size()]);
+    boost::thread_group threads;
+    for (unsigned int i = 0; i < vChains.size(); i++)
+    {
+        vReplies[i].pchain = vChains[i];
+        threads.create_thread(boost::bind(&GetAuxBlockOf, vChains[i], &vReplies[i], &pfOk[i]));
+    }
+    threads.join_all();
+
+    boost::shared_ptr<CAuxWork> pworkNew(new CAuxWork());
+    set<int> setChainIDs;
+    for (unsigned int i = 0; i < vReplies.size(); i++)
+    {
+        if (!pfOk[i])
+            continue;
+        if (!setChainIDs.insert(vReplies[i].nChainID).second)
+        {
+            printf("MergedMining: %s has the chain ID %d of another aux chain, skipped\n",
+                   vReplies[i].pchain->GetName().c_str(), vReplies[i].nChainID);
+            continue;
+        }
+        pworkNew->vBlocks.push_back(vReplies[i]);
+    }
+
+    if (pworkNew->vBlocks.empty() || !pworkNew->BuildMerkleTree())
+        pworkNew.reset();
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!pworkNew || !pwork || !pwork->IsSameWork(*pworkNew))
+        pwork = pworkNew;
+    return pwork.get() != NULL;
+}
+
+boost::shared_ptr<const CAuxWork> CMergedMiner::GetWork() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return pwork;
+}
+
+void CMergedMiner::Submit(const boost::shared_ptr<const CAuxWork>& pworkIn, const CTransaction& txCoinbase,
+                          const vector<uint256>& vMerkleBranch, const CBlockHeader& header, const uint256& hashPoW)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (unsigned int i = 0; i < pworkIn->vBlocks.size(); i++)
+    {
+        const CAuxWork::CAuxBlock& block = pworkIn->vBlocks[i];
+        if (hashPoW > block.hashTarget)
+            continue;
+        CPendingSubmit submit;
+        submit.pchain = block.pchain;
+        submit.hashBlock = block.hashBlock;
+        submit.pauxpow.reset(new CAuxPow());
+        pworkIn->CreateAuxPow(i, txCoinbase, vMerkleBranch, header, *submit.pauxpow);
+        queueSubmit.push_back(submit);
+    }
+    cond.notify_one();
+}
+
+static void SubmitAuxBlockTo(CAuxChain* pchain, uint256 hashBlock, boost::shared_ptr<CAuxPow> pauxpow)
+{
+    try {
+        bool fAccepted = pchain->SubmitAuxBlock(hashBlock, *pauxpow);
+        printf("MergedMining: aux block %s %s by %s\n", hashBlock.ToString().c_str(),
+               fAccepted ? "accepted" : "rejected", pchain->GetName().c_str());
+    }
+    catch (std::exception& e) {
+        printf("MergedMining: submitting to %s failed: %s\n", pchain->GetName().c_str(), e.what());
+    }
+}
+
+void CMergedMiner::ThreadMergedMiner()
+{
+    RenameThread("bitcoin-mergedmining");
+
+    while (true)
+    {
+        // Fresh aux work first thing, and again after every round of submissions
+        Update();
+
+        deque<CPendingSubmit> queue;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fStop && queueSubmit.empty())
+                cond.timed_wait(lock, boost::posix_time::seconds(AUX_UPDATE_INTERVAL));
+            if (fStop)
+                return;
+            queue.swap(queueSubmit);
+        }
+
+        // Solved blocks go out to all their chains at once
+        boost::thread_group threads;
+        BOOST_FOREACH(const CPendingSubmit& submit, queue)
+            threads.create_thread(boost::bind(&SubmitAuxBlockTo, submit.pchain, submit.hashBlock, submit.pauxpow));
+        threads.join_all();
+    }
+}
+
+void CMergedMiner::Start()
+{
+    thread = boost::thread(boost::bind(&CMergedMiner::ThreadMergedMiner, this));
+}
+
+void CMergedMiner::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+    if (thread.joinable())
+        thread.join();
+}
+
+static CMergedMiner* pmergedminer = NULL;
+
+void StartMergedMining()
+{
+    if (mapMultiArgs["-auxchain"].empty())
+        return;
+
+    assert(pmergedminer == NULL);
+    CMergedMiner* pminer = new CMergedMiner();
+    try
+    {
+        BOOST_FOREACH(const string& strURL, mapMultiArgs["-auxchain"])
+            pminer->AddChain(new CRPCAuxChain(strURL));
+    }
+    catch (std::exception& e)
+    {
+        uiInterface.ThreadSafeMessageBox(e.what(), "", CClientUIInterface::MSG_ERROR);
+        delete pminer;
+        return;
+    }
+
+    pminer->Start();
+    pmergedminer = pminer;
+}
+
+void StopMergedMining()
+{
+    if (pmergedminer == NULL)
+        return;
+    delete pmergedminer;
+    pmergedminer = NULL;
+}
+
+CMergedMiner* GetMergedMiner()
+{
+    return pmergedminer;
+}
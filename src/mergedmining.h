@@ -0,0 +1,148 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MERGEDMINING_H
+#define BITCOIN_MERGEDMINING_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "auxpow.h"
+
+/**
+ * In-process merged mining coordinator, replacing merged-mining/merged-mine-proxy.
+ *
+ * The coordinator asks every configured aux chain for a block (getauxblock),
+ * places the block hashes into the chain merkle tree at the slots CAuxPow::Check
+ * expects, and hands out the tree root to be committed in our coinbase. When a
+ * share meets the target of some aux chains, the aux proofs of work are built
+ * here and submitted to those chains concurrently.
+ */
+
+/** An aux chain to merge mine, as seen through its getauxblock call */
+class CAuxChain
+{
+public:
+    virtual ~CAuxChain() {}
+
+    virtual std::string GetName() const = 0;
+
+    /** Get the block to mine next: its hash, the chain ID and the target */
+    virtual bool GetAuxBlock(uint256& hashBlock, int& nChainID, uint256& hashTarget) = 0;
+
+    /** Hand in the proof of work for a block returned by GetAuxBlock */
+    virtual bool SubmitAuxBlock(const uint256& hashBlock, const CAuxPow& auxpow) = 0;
+};
+
+/** An aux chain node reached over JSON-RPC, from <user>:<password>@<host>:<port> */
+class CRPCAuxChain : public CAuxChain
+{
+public:
+    CRPCAuxChain(const std::string& strURL);
+
+    std::string GetName() const { return strHost + ":" + strPort; }
+    bool GetAuxBlock(uint256& hashBlock, int& nChainID, uint256& hashTarget);
+    bool SubmitAuxBlock(const uint256& hashBlock, const CAuxPow& auxpow);
+
+private:
+    std::string strHost;
+    std::string strPort;
+    std::string strUserPass;
+    bool fUseSSL;
+};
+
+/** The aux blocks committed to by one chain merkle root */
+class CAuxWork
+{
+public:
+    struct CAuxBlock
+    {
+        CAuxChain* pchain;
+        uint256 hashBlock;
+        int nChainID;
+        uint256 hashTarget;
+        unsigned int nChainIndex;
+    };
+
+    std::vector<CAuxBlock> vBlocks;
+    unsigned int nMerkleSize;
+    int nMerkleNonce;
+    // chain merkle tree, leaves first
+    std::vector<uint256> vMerkleTree;
+
+    /** Place vBlocks in the smallest chain merkle tree that gives each its own slot */
+    bool BuildMerkleTree();
+
+    uint256 GetMerkleRoot() const { return vMerkleTree.back(); }
+    std::vector<uint256> GetChainMerkleBranch(unsigned int nChainIndex) const;
+
+    /** Root, tree size and nonce as committed after pchMergedMiningHeader (the getworkaux <aux>) */
+    std::vector<unsigned char> GetAuxData() const;
+
+    /** Easiest target among the aux blocks */
+    uint256 GetMaxTarget() const;
+
+    /** Same aux blocks, and so the same tree, as work */
+    bool IsSameWork(const CAuxWork& work) const;
+
+    /** Proof that the parent header, whose coinbase commits to this tree, solves aux block i */
+    void CreateAuxPow(unsigned int i, const CTransaction& txCoinbase, const std::vector<uint256>& vMerkleBranch,
+                      const CBlockHeader& header, CAuxPow& auxpow) const;
+};
+
+/** Keeps the current CAuxWork fresh and fans solved aux blocks out to their chains */
+class CMergedMiner
+{
+public:
+    CMergedMiner() : fStop(false) {}
+    ~CMergedMiner();
+
+    /** Takes ownership of pchain */
+    void AddChain(CAuxChain* pchain) { vChains.push_back(pchain); }
+
+    /** Query all aux chains at once and build a new tree from their blocks.
+        The current work is kept if the chains still give the same blocks,
+        so callers can tell it changed by comparing pointers. */
+    bool Update();
+
+    /** Latest aux work, or null if none could be built yet */
+    boost::shared_ptr<const CAuxWork> GetWork() const;
+
+    /** Queue submission of a parent header with PoW hash hashPoW to every aux chain of pwork whose target it meets */
+    void Submit(const boost::shared_ptr<const CAuxWork>& pwork, const CTransaction& txCoinbase,
+                const std::vector<uint256>& vMerkleBranch, const CBlockHeader& header, const uint256& hashPoW);
+
+    void Start();
+    void Stop();
+
+private:
+    struct CPendingSubmit
+    {
+        CAuxChain* pchain;
+        uint256 hashBlock;
+        boost::shared_ptr<CAuxPow> pauxpow;
+    };
+
+    std::vector<CAuxChain*> vChains;
+    boost::shared_ptr<const CAuxWork> pwork;
+    std::deque<CPendingSubmit> queueSubmit;
+    bool fStop;
+    mutable boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread thread;
+
+    void ThreadMergedMiner();
+};
+
+/** Start the coordinator for the -auxchain nodes, if any */
+void StartMergedMining();
+void StopMergedMining();
+
+/** The running coordinator, or NULL without -auxchain */
+CMergedMiner* GetMergedMiner();
+
+#endif
@@ -93,6 +93,17 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd)
+{
+    // Filter out duplicate requests
+    if (pindexBegin == pindexLastGetHeadersBegin && hashEnd == hashLastGetHeadersEnd)
+        return;
+    pindexLastGetHeadersBegin = pindexBegin;
+    hashLastGetHeadersEnd = hashEnd;
+
+    PushMessage("getheaders", CBlockLocator(pindexBegin), hashEnd);
+}
+
 // find 'best' local address for a particular peer
 bool GetLocal(CService& addr, const CNetAddr *paddrPeer)
 {
@@ -536,6 +547,7 @@ void CNode::CloseSocketDisconnect()
 
 void CNode::Cleanup()
 {
+    ReleaseBlocksInFlight(this);
 }
 
 
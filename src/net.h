@@ -213,6 +213,12 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
+    CBlockIndex* pindexLastGetHeadersBegin;
+    uint256 hashLastGetHeadersEnd;
+
+    // headers-first block download
+    CBlockIndex* pindexBestKnownBlock;
+    int nBlocksInFlight;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
@@ -256,6 +262,10 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        pindexLastGetHeadersBegin = 0;
+        hashLastGetHeadersEnd = 0;
+        pindexBestKnownBlock = 0;
+        nBlocksInFlight = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
@@ -608,6 +618,7 @@ public:
     }
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
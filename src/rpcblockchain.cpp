@@ -6,6 +6,10 @@
 #include "main.h"
 #include "bitcoinrpc.h"
 #include "auxpow.h"
+#include "txdb.h"
+#include "base58.h"
+
+#include <boost/algorithm/string.hpp>
 
 using namespace json_spirit;
 using namespace std;
@@ -212,6 +216,10 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (pblockindex->nStatus & BLOCK_PRUNED)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not available (pruned data)");
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not available (only its header is known)");
     block.ReadFromDisk(pblockindex);
 
     if (!fVerbose)
@@ -247,6 +255,126 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+static Object UTXOSnapshotToJSON(const CCoinsStats& stats)
+{
+    Object ret;
+    ret.push_back(Pair("height", (boost::int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (boost::int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (boost::int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset <filename>\n"
+            "Writes the unspent transaction output set at the best block, with the block\n"
+            "headers up to it, to <filename> for loadtxoutset.");
+
+    CCoinsStats stats;
+    try {
+        DumpUTXOSnapshot(params[0].get_str(), stats);
+    } catch (std::runtime_error& e) {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+    return UTXOSnapshotToJSON(stats);
+}
+
+Value loadtxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "loadtxoutset <filename>\n"
+            "Starts a node that has no blocks yet from a dumptxoutset file. Headers it has\n"
+            "synced already are kept. The snapshot must be known to the checkpoints of\n"
+            "this version. Blocks before the snapshot are not downloaded.");
+
+    CCoinsStats stats;
+    try {
+        LoadUTXOSnapshot(params[0].get_str(), stats);
+    } catch (std::runtime_error& e) {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+    return UTXOSnapshotToJSON(stats);
+}
+
+// The LevelDB databases called strName, or all of them for ""
+// Callers hold cs_LevelDB while they use them
+static vector<pair<string, CLevelDB*> > GetLevelDBs(const string& strName)
+{
+    vector<pair<string, CLevelDB*> > vDB;
+    if (pcoinsdbview && (strName == "" || strName == "chainstate"))
+        vDB.push_back(make_pair(string("chainstate"), &pcoinsdbview->GetDB()));
+    if (pblocktree && (strName == "" || strName == "blockindex"))
+        vDB.push_back(make_pair(string("blockindex"), (CLevelDB*)pblocktree));
+    if (vDB.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown database, use chainstate or blockindex");
+    return vDB;
+}
+
+Value compactdb(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "compactdb [database]\n"
+            "Compacts the chainstate or blockindex database, or both.\n"
+            "Returns the approximate size of each before and after, in bytes.");
+
+    // LevelDB compacts alongside its readers and writers, so only the
+    // databases themselves are held, not cs_main
+    LOCK(cs_LevelDB);
+    Object ret;
+    vector<pair<string, CLevelDB*> > vDB = GetLevelDBs(params.size() > 0 ? params[0].get_str() : "");
+    for (unsigned int i = 0; i < vDB.size(); i++)
+    {
+        CLevelDB* pdb = vDB[i].second;
+        uint64 nSizeBefore = pdb->GetApproximateSize();
+        int64 nStart = GetTimeMillis();
+        pdb->Compact();
+        Object entry;
+        entry.push_back(Pair("sizebefore", (boost::int64_t)nSizeBefore));
+        entry.push_back(Pair("sizeafter", (boost::int64_t)pdb->GetApproximateSize()));
+        entry.push_back(Pair("time_ms", (boost::int64_t)(GetTimeMillis() - nStart)));
+        ret.push_back(Pair(vDB[i].first, entry));
+    }
+    return ret;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getdbstats [database]\n"
+            "Returns the settings, files per level and internal statistics\n"
+            "of the chainstate and blockindex databases, or one of them.");
+
+    LOCK(cs_LevelDB);
+    Object ret;
+    vector<pair<string, CLevelDB*> > vDB = GetLevelDBs(params.size() > 0 ? params[0].get_str() : "");
+    for (unsigned int i = 0; i < vDB.size(); i++)
+    {
+        CLevelDB* pdb = vDB[i].second;
+        const leveldb::Options& options = pdb->GetDBOptions();
+        Object entry;
+        entry.push_back(Pair("writebuffer", (boost::int64_t)options.write_buffer_size));
+        entry.push_back(Pair("maxopenfiles", options.max_open_files));
+        entry.push_back(Pair("approximatesize", (boost::int64_t)pdb->GetApproximateSize()));
+        Array levels;
+        string strValue;
+        for (int nLevel = 0; pdb->GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strValue); nLevel++)
+            levels.push_back(atoi(strValue.c_str()));
+        entry.push_back(Pair("filesatlevel", levels));
+        if (pdb->GetProperty("leveldb.stats", strValue))
+            entry.push_back(Pair("stats", strValue));
+        ret.push_back(Pair(vDB[i].first, entry));
+    }
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -292,6 +420,270 @@ Value gettxout(const Array& params, bool fHelp)
     return ret;
 }
 
+// Parse the address (or array of addresses) argument of the -addressindex calls
+static void ParseIndexAddresses(const Value& param, std::vector<std::pair<unsigned char, uint160> >& vAddresses)
+{
+    Array arr;
+    if (param.type() == array_type)
+        arr = param.get_array();
+    else
+        arr.push_back(param);
+
+    BOOST_FOREACH(const Value& v, arr)
+    {
+        CBitcoinAddress address(v.get_str());
+        unsigned char type;
+        uint160 hash;
+        if (!address.IsValid() || !GetAddressIndexHash(address.Get(), type, hash))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid address: ")+v.get_str());
+        vAddresses.push_back(make_pair(type, hash));
+    }
+}
+
+static std::string AddressIndexToString(unsigned char type, const uint160& hash)
+{
+    if (type == ADDRESSINDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hash)).ToString();
+    return CBitcoinAddress(CKeyID(hash)).ToString();
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address|[address,...]>\n"
+            "Returns the unspent outputs paying to the given addresses.\n"
+            "Requires -addressindex.");
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (restart with -addressindex -reindex)");
+
+    std::vector<std::pair<unsigned char, uint160> > vAddresses;
+    ParseIndexAddresses(params[0], vAddresses);
+
+    Array ret;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        std::vector<CAddressUnspentEntry> vUnspent;
+        if (!pblocktree->ReadAddressUnspentIndex(vAddresses[i].first, vAddresses[i].second, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+
+        string strAddress = AddressIndexToString(vAddresses[i].first, vAddresses[i].second);
+        BOOST_FOREACH(const CAddressUnspentEntry& entry, vUnspent)
+        {
+            Object o;
+            o.push_back(Pair("address", strAddress));
+            o.push_back(Pair("txid", entry.first.txhash.GetHex()));
+            o.push_back(Pair("outputIndex", (int)entry.first.nIndex));
+            o.push_back(Pair("script", HexStr(entry.second.script.begin(), entry.second.script.end())));
+            o.push_back(Pair("satoshis", (boost::int64_t)entry.second.nValue));
+            o.push_back(Pair("height", entry.second.nBlockHeight));
+            ret.push_back(o);
+        }
+    }
+    return ret;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids <address|[address,...]> [start height] [end height]\n"
+            "Returns the ids of the transactions paying to or spending from the given addresses,\n"
+            "in chain order, optionally restricted to blocks start..end.\n"
+            "Requires -addressindex.");
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (restart with -addressindex -reindex)");
+
+    std::vector<std::pair<unsigned char, uint160> > vAddresses;
+    ParseIndexAddresses(params[0], vAddresses);
+
+    int nStart = 0, nEnd = 0;
+    if (params.size() > 1)
+        nStart = params[1].get_int();
+    if (params.size() > 2)
+        nEnd = params[2].get_int();
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid height range");
+
+    // sort by (height, position in block) across all the addresses, skipping duplicates
+    std::set<std::pair<std::pair<int, unsigned int>, uint256> > setTxids;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        std::vector<CAddressIndexEntry> vIndex;
+        if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, vIndex, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+        BOOST_FOREACH(const CAddressIndexEntry& entry, vIndex)
+            setTxids.insert(make_pair(make_pair(entry.first.nBlockHeight, entry.first.nTxIndex), entry.first.txhash));
+    }
+
+    Array ret;
+    for (std::set<std::pair<std::pair<int, unsigned int>, uint256> >::const_iterator it = setTxids.begin(); it != setTxids.end(); ++it)
+        ret.push_back(it->second.GetHex());
+    return ret;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <n>\n"
+            "Returns the transaction and input that spent the given output.\n"
+            "Requires -spentindex.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled (restart with -spentindex -reindex)");
+
+    uint256 hash(params[0].get_str());
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(COutPoint(hash, n), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object ret;
+    ret.push_back(Pair("txid", value.txid.GetHex()));
+    ret.push_back(Pair("index", (int)value.nInputIndex));
+    ret.push_back(Pair("height", value.nBlockHeight));
+    return ret;
+}
+
+// One block of a /blocks/ reply, located while holding cs_main
+struct CRawBlockRef
+{
+    int nHeight;
+    uint256 hash;
+    CDiskBlockPos pos;
+    unsigned int nSize;
+    CDiskBlockPos posUndo;
+    unsigned int nUndoSize;
+};
+
+static const int MAX_STREAM_BLOCKS = 2000;
+
+// Size of the record at pos, from the length field which precedes it on disk
+static bool ReadRawSize(const CDiskBlockPos& pos, bool fUndo, unsigned int& nSize)
+{
+    if (pos.IsNull() || pos.nPos < 4)
+        return false;
+    CDiskBlockPos posSize(pos.nFile, pos.nPos - 4);
+    CAutoFile file(fUndo ? OpenUndoFile(posSize, true) : OpenBlockFile(posSize, true), SER_DISK, CLIENT_VERSION);
+    if (!file)
+        return false;
+    try {
+        file >> nSize;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+// Copy nSize bytes starting at pos to the stream without deserializing them
+static bool CopyRaw(std::ostream& stream, const CDiskBlockPos& pos, bool fUndo, unsigned int nSize)
+{
+    FILE* file = fUndo ? OpenUndoFile(pos, true) : OpenBlockFile(pos, true);
+    if (!file)
+        return false;
+    char buf[65536];
+    while (nSize > 0)
+    {
+        size_t nRead = fread(buf, 1, std::min((size_t)nSize, sizeof(buf)), file);
+        if (nRead == 0)
+            break;
+        stream.write(buf, nRead);
+        nSize -= nRead;
+    }
+    fclose(file);
+    return nSize == 0;
+}
+
+static void WriteLE32(std::ostream& stream, unsigned int n)
+{
+    unsigned char buf[4] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)(n >> 16), (unsigned char)(n >> 24) };
+    stream.write((const char*)buf, 4);
+}
+
+bool HTTPStreamBlocks(std::ostream& stream, const std::string& strURI, bool keepalive)
+{
+    // /blocks/<height>/<count>[/undo]
+    std::vector<std::string> vParts;
+    boost::split(vParts, strURI, boost::is_any_of("/"));
+    int nStart = -1, nCount = 0;
+    bool fUndo = false;
+    if (vParts.size() == 4 || (vParts.size() == 5 && vParts[4] == "undo"))
+    {
+        nStart = atoi(vParts[2]);
+        nCount = atoi(vParts[3]);
+        fUndo = (vParts.size() == 5);
+        if (vParts[2].empty() || vParts[3].empty())
+            nStart = -1;
+    }
+    if (nStart < 0 || nCount <= 0 || nCount > MAX_STREAM_BLOCKS)
+    {
+        string strError = strprintf("expected /blocks/<height>/<count 1..%d>[/undo]\n", MAX_STREAM_BLOCKS);
+        stream << HTTPReplyHeader(HTTP_BAD_REQUEST, keepalive, strError.size(), "text/plain") << strError << std::flush;
+        return keepalive;
+    }
+
+    std::vector<CRawBlockRef> vBlocks;
+    {
+        LOCK(cs_main);
+        if (nStart <= nBestHeight)
+        {
+            for (CBlockIndex* pindex = FindBlockByHeight(nStart); pindex && (int)vBlocks.size() < nCount; pindex = pindex->pnext)
+            {
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+                    break;
+                CRawBlockRef ref;
+                ref.nHeight = pindex->nHeight;
+                ref.hash = pindex->GetBlockHash();
+                ref.pos = pindex->GetBlockPos();
+                ref.posUndo = (fUndo && (pindex->nStatus & BLOCK_HAVE_UNDO)) ? pindex->GetUndoPos() : CDiskBlockPos();
+                vBlocks.push_back(ref);
+            }
+        }
+    }
+
+    // Sizes come from the length prefixes in the files, so Content-Length is known before any data is sent
+    size_t nLength = 0;
+    BOOST_FOREACH(CRawBlockRef& ref, vBlocks)
+    {
+        ref.nUndoSize = 0;
+        if (!ReadRawSize(ref.pos, false, ref.nSize) || (!ref.posUndo.IsNull() && !ReadRawSize(ref.posUndo, true, ref.nUndoSize)))
+        {
+            string strError = strprintf("unable to read block %d from disk\n", ref.nHeight);
+            stream << HTTPReplyHeader(HTTP_INTERNAL_SERVER_ERROR, false, strError.size(), "text/plain") << strError << std::flush;
+            return false;
+        }
+        nLength += 4 + 32 + 4 + ref.nSize;
+        if (fUndo)
+            nLength += 4 + ref.nUndoSize;
+    }
+
+    stream << HTTPReplyHeader(HTTP_OK, keepalive, nLength, "application/octet-stream");
+    BOOST_FOREACH(const CRawBlockRef& ref, vBlocks)
+    {
+        WriteLE32(stream, ref.nHeight);
+        stream.write((const char*)ref.hash.begin(), 32);
+        WriteLE32(stream, ref.nSize);
+        // a short read leaves the reply truncated; the client sees the connection close
+        if (!CopyRaw(stream, ref.pos, false, ref.nSize))
+            return false;
+        if (fUndo)
+        {
+            WriteLE32(stream, ref.nUndoSize);
+            if (ref.nUndoSize && !CopyRaw(stream, ref.posUndo, true, ref.nUndoSize))
+                return false;
+        }
+    }
+    stream << std::flush;
+    return keepalive;
+}
+
 Value verifychain(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
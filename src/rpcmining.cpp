@@ -9,6 +9,8 @@
 #include "bitcoinrpc.h"
 #include "auxpow.h"
 
+#include <boost/unordered_map.hpp>
+
 using namespace json_spirit;
 using namespace std;
 
@@ -68,6 +70,8 @@ Value getnetworkhashps(const Array& params, bool fHelp)
 // Key used by getwork/getblocktemplate miners.
 // Allocated in InitRPCMining, free'd in ShutdownRPCMining
 static CReserveKey* pMiningKey = NULL;
+// Serializes getwork and getworkex, which share pMiningKey
+static CCriticalSection cs_getwork;
 
 void InitRPCMining()
 {
@@ -121,6 +125,8 @@ Value setgenerate(const Array& params, bool fHelp)
     }
     mapArgs["-gen"] = (fGenerate ? "1" : "0");
 
+    // threadSafe, so this runs without cs_main and cs_wallet, which the
+    // miner threads being stopped may be waiting on
     assert(pwalletMain != NULL);
     GenerateBitcoins(fGenerate, pwalletMain);
     return Value::null;
@@ -168,6 +174,85 @@ Value getmininginfo(const Array& params, bool fHelp)
 }
 
 
+// Work handed out by getwork, getworkex, getworkaux and getauxblock. Work
+// units share their block template and only record what was changed in it
+// for them; the oldest units are dropped past nMaxSize, and all of them once
+// work on a new tip comes in. Changes to a template itself are up to the
+// call that owns it.
+class CWorkRegistry
+{
+public:
+    CWorkRegistry(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    /** Record the current state of ptemplate's block as work unit hash */
+    void Add(const uint256& hash, const boost::shared_ptr<CBlockTemplate>& ptemplate)
+    {
+        const CBlock& block = ptemplate->block;
+        LOCK(cs);
+        if (block.hashPrevBlock != hashPrevBlock)
+        {
+            // Deallocate old work since it's obsolete now
+            mapWork.clear();
+            queueWork.clear();
+            hashPrevBlock = block.hashPrevBlock;
+        }
+        std::pair<WorkMap::iterator, bool> ret = mapWork.insert(make_pair(hash, CWork()));
+        CWork& work = ret.first->second;
+        work.ptemplate = ptemplate;
+        work.scriptSig = block.vtx[0].vin[0].scriptSig;
+        work.nTime = block.nTime;
+        if (!ret.second)
+            return;
+        queueWork.push_back(hash);
+        while (queueWork.size() > nMaxSize)
+        {
+            mapWork.erase(queueWork.front());
+            queueWork.pop_front();
+        }
+    }
+
+    /** The block of work unit hash, or false if it is unknown or was dropped */
+    bool GetBlock(const uint256& hash, CBlock& block) const
+    {
+        CWork work;
+        {
+            LOCK(cs);
+            WorkMap::const_iterator it = mapWork.find(hash);
+            if (it == mapWork.end())
+                return false;
+            work = it->second;
+        }
+        block = work.ptemplate->block;
+        block.vtx[0].vin[0].scriptSig = work.scriptSig;
+        block.nTime = work.nTime;
+        block.hashMerkleRoot = CBlock::CheckMerkleBranch(block.vtx[0].GetHash(), work.ptemplate->vCoinbaseMerkleBranch, 0);
+        block.vMerkleTree.clear();
+        return true;
+    }
+
+private:
+    struct CWork
+    {
+        boost::shared_ptr<CBlockTemplate> ptemplate;
+        CScript scriptSig; // of the coinbase input
+        unsigned int nTime;
+    };
+    struct WorkHasher
+    {
+        size_t operator()(const uint256& hash) const { return hash.Get64(); }
+    };
+    typedef boost::unordered_map<uint256, CWork, WorkHasher> WorkMap;
+
+    mutable CCriticalSection cs;
+    WorkMap mapWork;
+    std::deque<uint256> queueWork;
+    uint256 hashPrevBlock;
+    size_t nMaxSize;
+};
+
+// Work units remembered by each of those calls; a unit costs about a coinbase script
+static const size_t MAX_WORK_UNITS = 100000;
+
 Value getworkex(const Array& params, bool fHelp)
 {
     LOG() << "getworkex";
@@ -187,43 +272,39 @@ Value getworkex(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Umbrella-LTC is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
+    static CWorkRegistry work(MAX_WORK_UNITS);
     static CReserveKey reservekey(pwalletMain);
+    LOCK(cs_getwork);
 
     if (params.size() == 0)
     {
+        // The tip and the templates built on it are chain state
+        LOCK(cs_main);
+
         // Update block
         static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nTemplateChangesLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
+        static boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        unsigned int nTemplateChangesNow = GetTemplateChanges();
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60) ||
+            nTemplateChangesNow != nTemplateChangesLast)
         {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
             pindexPrev = NULL;
 
             // Store the pindexBest used before CreateNewBlock, to avoid races
             nTransactionsUpdatedLast = nTransactionsUpdated;
+            nTemplateChangesLast = nTemplateChangesNow;
             CBlockIndex* pindexPrevNew = pindexBest;
             nStart = GetTime();
 
             // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
+            pblocktemplate.reset(CreateNewBlockWithKey(*pMiningKey));
             if (!pblocktemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
 
             // Need to update only after we know CreateNewBlock succeeded
             pindexPrev = pindexPrevNew;
@@ -236,10 +317,10 @@ Value getworkex(const Array& params, bool fHelp)
 
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        IncrementExtraNonce(pblocktemplate.get(), pindexPrev, nExtraNonce);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        work.Add(pblock->hashMerkleRoot, pblocktemplate);
 
         // Pre-build hash buffers
         char pmidstate[32];
@@ -290,21 +371,20 @@ Value getworkex(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!work.GetBlock(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
-
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
 
-        if(coinbase.size() == 0)
-            pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        else
-            CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0];
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
 
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        if(coinbase.size() != 0)
+        {
+            CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> block.vtx[0];
+            block.hashMerkleRoot = block.BuildMerkleTree();
+        }
 
-        return CheckWork(pblock, *pwalletMain, reservekey);
+        return CheckWork(&block, *pwalletMain, reservekey);
     }
 }
 
@@ -332,42 +412,38 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Umbrella-LTC is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
+    static CWorkRegistry work(MAX_WORK_UNITS);
+    LOCK(cs_getwork);
 
     if (params.size() == 0)
     {
+        // The tip and the templates built on it are chain state
+        LOCK(cs_main);
+
         // Update block
         static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nTemplateChangesLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
+        static boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        unsigned int nTemplateChangesNow = GetTemplateChanges();
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60) ||
+            nTemplateChangesNow != nTemplateChangesLast)
         {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
             pindexPrev = NULL;
 
             // Store the pindexBest used before CreateNewBlock, to avoid races
             nTransactionsUpdatedLast = nTransactionsUpdated;
+            nTemplateChangesLast = nTemplateChangesNow;
             CBlockIndex* pindexPrevNew = pindexBest;
             nStart = GetTime();
 
             // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
+            pblocktemplate.reset(CreateNewBlockWithKey(*pMiningKey));
             if (!pblocktemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
 
             // Need to update only after we know CreateNewBlock succeeded
             pindexPrev = pindexPrevNew;
@@ -380,10 +456,10 @@ Value getwork(const Array& params, bool fHelp)
 
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        IncrementExtraNonce(pblocktemplate.get(), pindexPrev, nExtraNonce);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        work.Add(pblock->hashMerkleRoot, pblocktemplate);
 
         // Pre-build hash buffers
         char pmidstate[32];
@@ -413,17 +489,15 @@ Value getwork(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!work.GetBlock(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
 
         assert(pwalletMain != NULL);
-        return CheckWork(pblock, *pwalletMain, *pMiningKey);
+        return CheckWork(&block, *pwalletMain, *pMiningKey);
     }
 }
 
@@ -453,6 +527,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass as \"longpollid\" in params to wait for the next template change\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
@@ -481,17 +556,21 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
     // Update block
     static unsigned int nTransactionsUpdatedLast;
+    static unsigned int nTemplateChangesLast;
     static CBlockIndex* pindexPrev;
     static int64 nStart;
     static CBlockTemplate* pblocktemplate;
+    unsigned int nTemplateChangesNow = GetTemplateChanges();
     if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5) ||
+        nTemplateChangesNow != nTemplateChangesLast)
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
 
         // Store the pindexBest used before CreateNewBlock, to avoid races
         nTransactionsUpdatedLast = nTransactionsUpdated;
+        nTemplateChangesLast = nTemplateChangesNow;
         CBlockIndex* pindexPrevNew = pindexBest;
         nStart = GetTime();
 
@@ -578,6 +657,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits.compact)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + strprintf("%u", nTemplateChangesLast)));
 
     return result;
 }
@@ -608,6 +688,140 @@ Value submitblock(const Array& params, bool fHelp)
 
     return Value::null;
 }
+
+// A share handed to submitshares and what its check found
+struct CShareCheck
+{
+    vector<unsigned char> vchData;
+    CBlockHeader header;
+    uint256 hashPoW;
+    // why the share was not hashed, if it wasn't
+    const char* pszError;
+
+    CShareCheck() : pszError("Block decode failed") {}
+};
+
+// Decodes and hashes share i, if it builds on hashBest with nBitsExpected;
+// run on the RPC helper threads
+static void CheckShare(vector<CShareCheck>* pvShares, const uint256* phashBest, compact_bignum_t nBitsExpected, size_t i)
+{
+    CShareCheck& share = (*pvShares)[i];
+    try {
+        // Only the header (and the aux proof of work that follows it) is decoded here
+        CDataStream ss(share.vchData, SER_NETWORK, PROTOCOL_VERSION);
+        ss >> share.header;
+    }
+    catch (std::exception &e) {
+        return;
+    }
+    // the caller picks nBits, so it is only trusted if it is the one required
+    if (share.header.hashPrevBlock != *phashBest)
+        share.pszError = "Stale share";
+    else if (share.header.nBits != nBitsExpected)
+        share.pszError = "Unexpected nBits";
+    // the parent chain's work only counts if its coinbase commits to this header
+    else if (share.header.auxpow && !share.header.auxpow->Check(share.header.GetHash(), share.header.GetChainID()))
+        share.pszError = "Invalid aux proof of work";
+    else
+    {
+        share.hashPoW = share.header.auxpow ? share.header.auxpow->GetParentBlockHash() : share.header.GetPoWHash();
+        share.pszError = NULL;
+    }
+}
+
+// Proof-of-work hashes of the shares submitshares has credited on top of
+// hashSharesBest, so that resubmitted work is not counted twice
+static CCriticalSection cs_setSharesSeen;
+static uint256 hashSharesBest;
+static set<uint256> setSharesSeen;
+
+Value submitshares(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "submitshares <target> <data array>\n"
+            "Checks the proof of work of each block in <data array>, hex encoded as for\n"
+            "submitblock or as just the 80 byte header, against the share <target>.\n"
+            "Shares must build on the best block with the nBits required of the next one,\n"
+            "and an aux proof of work must commit to the share's header. Work already\n"
+            "submitted on top of the same best block is reported as a duplicate.\n"
+            "Shares are hashed on all cores; only blocks that also meet the network target\n"
+            "are decoded in full and processed. Returns for each share:\n"
+            "  \"hash\" : proof-of-work hash\n"
+            "  \"share\" : true if it meets <target>\n"
+            "  \"block\" : if it meets the network target, null if the block was accepted,\n"
+            "              otherwise \"rejected\" or \"incomplete\" for a header only\n");
+
+    uint256 hashShareTarget;
+    hashShareTarget.SetHex(params[0].get_str());
+    const Array& vData = params[1].get_array();
+
+    vector<CShareCheck> vShares(vData.size());
+    for (unsigned int i = 0; i < vData.size(); i++)
+        vShares[i].vchData = ParseHex(vData[i].get_str());
+
+    uint256 hashBest;
+    compact_bignum_t nBitsExpected;
+    {
+        LOCK(cs_main);
+        if (pindexBest == NULL)
+            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "No best block yet");
+        hashBest = pindexBest->GetBlockHash();
+        nBitsExpected = retarget::difficulty::instance().next_block_difficulty(pindexBest);
+    }
+    const uint256 hashBlockTarget = CBigNum(nBitsExpected).getuint256();
+
+    RPCParallelFor(vShares.size(), std::max(boost::thread::hardware_concurrency(), 1U),
+                   boost::bind(&CheckShare, &vShares, &hashBest, nBitsExpected, _1));
+
+    {
+        LOCK(cs_setSharesSeen);
+        if (hashSharesBest != hashBest)
+        {
+            hashSharesBest = hashBest;
+            setSharesSeen.clear();
+        }
+        BOOST_FOREACH(CShareCheck& share, vShares)
+            if (share.pszError == NULL && share.hashPoW <= hashShareTarget && !setSharesSeen.insert(share.hashPoW).second)
+                share.pszError = "Duplicate share";
+    }
+
+    Array result;
+    BOOST_FOREACH(const CShareCheck& share, vShares)
+    {
+        Object entry;
+        if (share.pszError != NULL)
+        {
+            entry.push_back(Pair("error", share.pszError));
+            result.push_back(entry);
+            continue;
+        }
+        entry.push_back(Pair("hash", share.hashPoW.GetHex()));
+        entry.push_back(Pair("share", share.hashPoW <= hashShareTarget));
+        if (share.hashPoW <= hashBlockTarget)
+        {
+            CBlock block;
+            try {
+                CDataStream ssBlock(share.vchData, SER_NETWORK, PROTOCOL_VERSION);
+                ssBlock >> block;
+            }
+            catch (std::exception &e) {
+                entry.push_back(Pair("block", "incomplete"));
+                result.push_back(entry);
+                continue;
+            }
+            CValidationState state;
+            bool fAccepted;
+            {
+                LOCK(cs_main);
+                fAccepted = ProcessBlock(state, NULL, &block);
+            }
+            entry.push_back(Pair("block", fAccepted ? Value::null : "rejected"));
+        }
+        result.push_back(entry);
+    }
+    return result;
+}
 Value getworkaux(const Array& params, bool fHelp)
 {
   LOG() << "getworkaux";
@@ -643,42 +857,41 @@ Value getworkaux(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(-10, "Umbrella-Ltc is downloading blocks...");
 
-    static map<uint256, pair<CBlock*, unsigned int> > mapNewBlock;
-    static vector<CBlockTemplate*> vNewBlockTemplate;
+    static CWorkRegistry work(MAX_WORK_UNITS);
     static CReserveKey reservekey(pwalletMain);
+    static CCriticalSection cs_getworkaux;
+    LOCK(cs_getworkaux);
 
     if (params.size() == 1)
     {
+        // The tip and the templates built on it are chain state
+        LOCK(cs_main);
+
         static vector<unsigned char> vchAuxPrev;
         vector<unsigned char> vchAux = ParseHex(params[0].get_str());
 
         // Update block
         static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nTemplateChangesLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
-        static CBlockTemplate* pblocktemplate;
+        static boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        unsigned int nTemplateChangesNow = GetTemplateChanges();
         if (pindexPrev != pindexBest ||
             vchAux != vchAuxPrev ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60) ||
+            nTemplateChangesNow != nTemplateChangesLast)
         {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
             nTransactionsUpdatedLast = nTransactionsUpdated;
+            nTemplateChangesLast = nTemplateChangesNow;
             pindexPrev = pindexBest;
             vchAuxPrev = vchAux;
             nStart = GetTime();
 
             // Create new block
-            pblocktemplate = CreateNewBlockWithKey(reservekey);
+            pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
             if (!pblocktemplate)
                 throw JSONRPCError(-7, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
         }
         CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
@@ -688,10 +901,10 @@ Value getworkaux(const Array& params, bool fHelp)
 
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
-        IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, vchAux);
+        IncrementExtraNonceWithAux(pblocktemplate.get(), pindexPrev, nExtraNonce, vchAux);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, nExtraNonce);
+        work.Add(pblock->hashMerkleRoot, pblocktemplate);
 
         // Prebuild hash buffers
         char pmidstate[32];
@@ -723,10 +936,10 @@ Value getworkaux(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        CBlock block;
+        if (!work.GetBlock(pdata->hashMerkleRoot, block))
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
-        unsigned int nExtraNonce = mapNewBlock[pdata->hashMerkleRoot].second;
+        CBlock* pblock = &block;
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
@@ -745,9 +958,6 @@ Value getworkaux(const Array& params, bool fHelp)
 
         RemoveMergedMiningHeader(vchAux);
 
-        pblock->vtx[0].vin[0].scriptSig = MakeCoinbaseWithAux(pblock->nBits, nExtraNonce, vchAux);
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
-
         if (params.size() > 2)
         {
             // Requested aux proof of work
@@ -762,7 +972,11 @@ Value getworkaux(const Array& params, bool fHelp)
                 pow.vChainMerkleBranch.push_back(nHash);
             }
 
-            pow.SetMerkleBranch(pblock);
+            {
+                // Looks the block up in mapBlockIndex
+                LOCK(cs_main);
+                pow.SetMerkleBranch(pblock);
+            }
             pow.nChainIndex = nChainIndex;
             pow.parentBlockHeader = *pblock;
             CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
@@ -809,35 +1023,35 @@ Value getauxblock(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(-10, "Umbrella-Ltc is downloading blocks...");
 
-    static map<uint256, CBlock*> mapNewBlock;
-    static vector<CBlockTemplate*> vNewBlockTemplate;
+    static CWorkRegistry work(MAX_WORK_UNITS);
     static CReserveKey reservekey(pwalletMain);
+    static CCriticalSection cs_getauxblock;
+    LOCK(cs_getauxblock);
 
     if (params.size() == 0)
     {
+        // The tip and the templates built on it are chain state
+        LOCK(cs_main);
+
         // Update block
         static unsigned int nTransactionsUpdatedLast;
+        static unsigned int nTemplateChangesLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
 	static CBlock* pblock;
-        static CBlockTemplate* pblocktemplate;
+        static boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        unsigned int nTemplateChangesNow = GetTemplateChanges();
         if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60) ||
+            nTemplateChangesNow != nTemplateChangesLast)
         {
-            if (pindexPrev != pindexBest)
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
             nTransactionsUpdatedLast = nTransactionsUpdated;
+            nTemplateChangesLast = nTemplateChangesNow;
             pindexPrev = pindexBest;
             nStart = GetTime();
 
             // Create new block with nonce = 0 and extraNonce = 1
-            pblocktemplate = CreateNewBlockWithKey(reservekey);
+            pblocktemplate.reset(CreateNewBlockWithKey(reservekey));
             if (!pblocktemplate)
                 throw JSONRPCError(-7, "Out of memory");
 
@@ -848,15 +1062,13 @@ Value getauxblock(const Array& params, bool fHelp)
 
             // Push OP_2 just in case we want versioning later
             pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(1) << OP_2;
-            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+            pblocktemplate->UpdateMerkleRoot();
 
             // Sets the version
             pblock->SetAuxPow(new CAuxPow());
 
             // Save
-            mapNewBlock[pblock->GetHash()] = pblock;
-
-            vNewBlockTemplate.push_back(pblocktemplate);
+            work.Add(pblock->GetHash(), pblocktemplate);
         }
 
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
@@ -875,13 +1087,13 @@ Value getauxblock(const Array& params, bool fHelp)
         CDataStream ss(vchAuxPow, SER_GETHASH, PROTOCOL_VERSION);
         CAuxPow* pow = new CAuxPow();
         ss >> *pow;
-        if (!mapNewBlock.count(hash))
+        CBlock block;
+        if (!work.GetBlock(hash, block))
             return ::error("getauxblock() : block not found");
 
-        CBlock* pblock = mapNewBlock[hash];
-        pblock->SetAuxPow(pow);
+        block.SetAuxPow(pow);
 
-        if (!CheckWork(pblock, *pwalletMain, reservekey))
+        if (!CheckWork(&block, *pwalletMain, reservekey))
         {
             return false;
         }
@@ -428,16 +428,20 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    map<CTxDestination, set<uint256> >::const_iterator mi = pwalletMain->mapTxByAddress.find(address.Get());
+    if (mi != pwalletMain->mapTxByAddress.end())
     {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !wtx.IsFinal())
-            continue;
+        BOOST_FOREACH(const uint256& hashTx, (*mi).second)
+        {
+            const CWalletTx& wtx = pwalletMain->mapWallet[hashTx];
+            if (wtx.IsCoinBase() || !wtx.IsFinal())
+                continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                if (txout.scriptPubKey == scriptPubKey)
+                    if (wtx.GetDepthInMainChain() >= nMinDepth)
+                        nAmount += txout.nValue;
+        }
     }
 
     return  ValueFromAmount(nAmount);
@@ -472,11 +476,20 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
     set<CTxDestination> setAddress;
     GetAccountAddresses(strAccount, setAddress);
 
+    // Only transactions paying to one of the account's addresses can count
+    set<uint256> setTx;
+    BOOST_FOREACH(const CTxDestination& address, setAddress)
+    {
+        map<CTxDestination, set<uint256> >::const_iterator mi = pwalletMain->mapTxByAddress.find(address);
+        if (mi != pwalletMain->mapTxByAddress.end())
+            setTx.insert((*mi).second.begin(), (*mi).second.end());
+    }
+
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const uint256& hashTx, setTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = pwalletMain->mapWallet[hashTx];
         if (wtx.IsCoinBase() || !wtx.IsFinal())
             continue;
 
@@ -622,6 +635,10 @@ Value movecmd(const Array& params, bool fHelp)
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    // only now that both are on disk
+    pwalletMain->LoadAccountingEntry(debit);
+    pwalletMain->LoadAccountingEntry(credit);
+
     return true;
 }
 
@@ -856,11 +873,17 @@ Value ListReceived(const Array& params, bool fByAccounts)
     if (params.size() > 1)
         fIncludeEmpty = params[1].get_bool();
 
+    // Only transactions paying to one of our addresses can count
+    set<uint256> setTx;
+    for (map<CTxDestination, set<uint256> >::const_iterator mi = pwalletMain->mapTxByAddress.begin(); mi != pwalletMain->mapTxByAddress.end(); ++mi)
+        if (IsMine(*pwalletMain, (*mi).first))
+            setTx.insert((*mi).second.begin(), (*mi).second.end());
+
     // Tally
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const uint256& hashTx, setTx)
     {
-        const CWalletTx& wtx = (*it).second;
+        const CWalletTx& wtx = pwalletMain->mapWallet[hashTx];
 
         if (wtx.IsCoinBase() || !wtx.IsFinal())
             continue;
@@ -1078,11 +1101,16 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    static const CWallet::TxItems txEmpty;
+    const CWallet::TxItems* ptxOrdered = &pwalletMain->wtxOrdered;
+    if (strAccount != "*")
+    {
+        map<string, CWallet::TxItems>::const_iterator mi = pwalletMain->mapTxByAccount.find(strAccount);
+        ptxOrdered = (mi != pwalletMain->mapTxByAccount.end()) ? &(*mi).second : &txEmpty;
+    }
 
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (CWallet::TxItems::const_reverse_iterator it = ptxOrdered->rbegin(); it != ptxOrdered->rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1150,9 +1178,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1192,12 +1218,22 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    for (map<uint256, set<uint256> >::const_iterator mi = pwalletMain->mapTxByBlock.begin(); mi != pwalletMain->mapTxByBlock.end(); ++mi)
     {
-        CWalletTx tx = (*it).second;
+        // Skip whole blocks at or below the requested one
+        if (depth != -1 && (*mi).first != 0)
+        {
+            BlockMap::iterator bi = mapBlockIndex.find((*mi).first);
+            if (bi != mapBlockIndex.end() && (*bi).second->IsInMainChain() && 1 + nBestHeight - (*bi).second->nHeight >= depth)
+                continue;
+        }
 
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        BOOST_FOREACH(const uint256& hashTx, (*mi).second)
+        {
+            const CWalletTx& wtx = pwalletMain->mapWallet[hashTx];
+            if (depth == -1 || wtx.GetDepthInMainChain() < depth)
+                ListTransactions(wtx, "*", 0, true, transactions);
+        }
     }
 
     uint256 lastblock;
@@ -1524,14 +1560,21 @@ Value validateaddress(const Array& params, bool fHelp)
         CTxDestination dest = address.Get();
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
-        bool fMine = pwalletMain ? IsMine(*pwalletMain, dest) : false;
-        ret.push_back(Pair("ismine", fMine));
-        if (fMine) {
-            Object detail = boost::apply_visitor(DescribeAddressVisitor(), dest);
-            ret.insert(ret.end(), detail.begin(), detail.end());
+        if (pwalletMain)
+        {
+            // Dispatched as thread-safe, so only the wallet lock is needed
+            LOCK(pwalletMain->cs_wallet);
+            bool fMine = IsMine(*pwalletMain, dest);
+            ret.push_back(Pair("ismine", fMine));
+            if (fMine) {
+                Object detail = boost::apply_visitor(DescribeAddressVisitor(), dest);
+                ret.insert(ret.end(), detail.begin(), detail.end());
+            }
+            if (pwalletMain->mapAddressBook.count(dest))
+                ret.push_back(Pair("account", pwalletMain->mapAddressBook[dest]));
         }
-        if (pwalletMain && pwalletMain->mapAddressBook.count(dest))
-            ret.push_back(Pair("account", pwalletMain->mapAddressBook[dest]));
+        else
+            ret.push_back(Pair("ismine", false));
     }
     return ret;
 }
@@ -1358,4 +1358,56 @@ public:
     }
 };
 
+/** Deserialize straight from memory owned elsewhere (such as a mapped
+ *  file), without first copying it into a CDataStream. The memory
+ *  must outlive the reader. */
+class CMemoryReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+
+    const char* begin() const { return pcur; }
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+
+    CMemoryReader& read(char* pch, size_t nSize) {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize) {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore() : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj) {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,868 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+#include "main.h"
+#include "wallet.h"
+#include "net.h"
+#include "bitcoinrpc.h"
+#include "init.h"
+#include "ui_interface.h"
+#include "hash/hash.h"
+#include "mergedmining.h"
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/signals2/connection.hpp>
+
+#include <deque>
+
+using namespace json_spirit;
+using namespace std;
+using namespace boost::asio;
+
+// Sizes of the two halves of the extra nonce in the coinbase: the server
+// picks extranonce1 per connection, the miner rolls extranonce2
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+
+// Longest request line we accept before dropping the connection
+static const size_t STRATUM_MAX_LINE = 16 * 1024;
+
+// Jobs older than this many are forgotten, their shares are stale
+static const unsigned int STRATUM_MAX_JOBS = 16;
+
+// How often jobs and difficulties are reviewed, in seconds
+static const int STRATUM_TIMER_INTERVAL = 5;
+
+// Rebuild the job for new mempool transactions at most this often, in seconds
+static const int STRATUM_TX_REFRESH = 30;
+
+// Shares a connection may submit in a burst before -stratummaxsharerate applies
+static const double STRATUM_SHARE_BURST = 50;
+
+// Share difficulty 1, as scrypt miners count it (0x0000ffff00..00)
+static const compact_bignum_t STRATUM_DIFF1_BITS = 0x1f00ffff;
+
+// Stratum error codes
+enum StratumErrorCode
+{
+    STRATUM_OTHER              = 20,
+    STRATUM_JOB_NOT_FOUND      = 21,
+    STRATUM_DUPLICATE_SHARE    = 22,
+    STRATUM_LOW_DIFFICULTY     = 23,
+    STRATUM_UNAUTHORIZED       = 24,
+    STRATUM_NOT_SUBSCRIBED     = 25,
+    STRATUM_RATE_LIMITED       = 26,
+};
+
+static Array StratumError(int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+// Share target for a (possibly fractional) stratum difficulty
+static uint256 StratumTarget(double dDifficulty)
+{
+    CBigNum bnTarget(STRATUM_DIFF1_BITS);
+    bnTarget *= 65536;
+    bnTarget /= CBigNum((uint64)std::max(1.0, dDifficulty * 65536));
+    return bnTarget.getuint256();
+}
+
+// 32-bit fields are sent as big endian hex
+static string HexInt(unsigned int n)
+{
+    return strprintf("%08x", n);
+}
+
+static bool ParseHexInt(const Value& value, unsigned int& n)
+{
+    if (value.type() != str_type || value.get_str().size() != 8 || !IsHex(value.get_str()))
+        return false;
+    n = strtoul(value.get_str().c_str(), NULL, 16);
+    return true;
+}
+
+// Put the height, the extra nonce placeholder and vchAux (if any) into the
+// coinbase's scriptSig, and return the serialized coinbase before and after
+// the extra nonce
+void SplitStratumCoinbase(CTransaction& txCoinbase, unsigned int nHeight, const vector<unsigned char>& vchAux,
+                          vector<unsigned char>& vchCoinb1, vector<unsigned char>& vchCoinb2)
+{
+    CScript scriptHeight = CScript() << nHeight;
+    vector<unsigned char> vchNoncePlaceholder(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    CScript scriptSig = CScript(scriptHeight) << vchNoncePlaceholder;
+    if (!vchAux.empty())
+        scriptSig << vchAux;
+    txCoinbase.vin[0].scriptSig = scriptSig + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << txCoinbase;
+    vector<unsigned char> vchCoinbase(ss.begin(), ss.end());
+    unsigned int nOffset = sizeof(txCoinbase.nVersion) + GetSizeOfCompactSize(txCoinbase.vin.size()) +
+                           sizeof(COutPoint) + GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) +
+                           scriptHeight.size() + 1;
+    assert(nOffset + vchNoncePlaceholder.size() <= vchCoinbase.size());
+    vchCoinb1.assign(vchCoinbase.begin(), vchCoinbase.begin() + nOffset);
+    vchCoinb2.assign(vchCoinbase.begin() + nOffset + vchNoncePlaceholder.size(), vchCoinbase.end());
+}
+
+// The coinbase and the header a miner hashed for a share of the block template
+CBlock StratumShareHeader(const CBlock& blockTemplate, const vector<unsigned char>& vchCoinb1,
+                          const vector<unsigned char>& vchCoinb2, const vector<uint256>& vMerkleBranch,
+                          unsigned int nExtraNonce1, const vector<unsigned char>& vchExtraNonce2,
+                          unsigned int nTime, unsigned int nNonce, vector<unsigned char>& vchCoinbaseRet)
+{
+    vchCoinbaseRet = vchCoinb1;
+    for (int i = STRATUM_EXTRANONCE1_SIZE - 1; i >= 0; i--)
+        vchCoinbaseRet.push_back((nExtraNonce1 >> (8 * i)) & 0xff);
+    vchCoinbaseRet.insert(vchCoinbaseRet.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vchCoinbaseRet.insert(vchCoinbaseRet.end(), vchCoinb2.begin(), vchCoinb2.end());
+
+    uint256 hashMerkleRoot = Hash(vchCoinbaseRet.begin(), vchCoinbaseRet.end());
+    BOOST_FOREACH(const uint256& hash, vMerkleBranch)
+        hashMerkleRoot = Hash(BEGIN(hashMerkleRoot), END(hashMerkleRoot), BEGIN(hash), END(hash));
+
+    CBlock header;
+    header.nVersion = blockTemplate.nVersion;
+    header.hashPrevBlock = blockTemplate.hashPrevBlock;
+    header.hashMerkleRoot = hashMerkleRoot;
+    header.nTime = nTime;
+    header.nBits = blockTemplate.nBits;
+    header.nNonce = nNonce;
+    return header;
+}
+
+// Vardiff step: the difficulty for one share every nShareTarget seconds,
+// after nShares shares in nElapsed seconds at dDifficulty, changing by at
+// most a factor of 4; dDifficulty itself if that is within 20%
+double StratumVardiff(double dDifficulty, int64 nShareTarget, int64 nElapsed, int nShares)
+{
+    double dRate = (double)std::max(nElapsed, (int64)1) / nShares;
+    double dNew = dDifficulty * nShareTarget / dRate;
+    dNew = std::max(dDifficulty / 4, std::min(dDifficulty * 4, dNew));
+    dNew = std::max(1.0 / 65536, dNew);
+    if (dNew < dDifficulty * 0.8 || dNew > dDifficulty * 1.2)
+        return dNew;
+    return dDifficulty;
+}
+
+/** A block template handed out to miners as one mining.notify */
+class CStratumJob
+{
+public:
+    string strId;
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    // aux chain blocks committed to in the coinbase, if merged mining
+    boost::shared_ptr<const CAuxWork> pauxwork;
+    CBlockIndex* pindexPrev;
+    int64 nMinTime;
+    uint256 hashTarget;
+    // coinbase bytes before and after extranonce1 + extranonce2
+    vector<unsigned char> vchCoinb1;
+    vector<unsigned char> vchCoinb2;
+    vector<uint256> vMerkleBranch;
+    // header hashes of the shares seen, to reject duplicates
+    set<uint256> setShares;
+
+    Value NotifyParams(bool fClean) const
+    {
+        const CBlock& block = ptemplate->block;
+
+        // prevhash goes out with each 32-bit word byte swapped
+        const unsigned char* p = block.hashPrevBlock.begin();
+        vector<unsigned char> vchPrev(32);
+        for (unsigned int i = 0; i < 32; i++)
+            vchPrev[i] = p[(i & ~3) + 3 - (i & 3)];
+
+        Array branch;
+        BOOST_FOREACH(const uint256& hash, vMerkleBranch)
+            branch.push_back(HexStr(hash.begin(), hash.end()));
+
+        Array params;
+        params.push_back(strId);
+        params.push_back(HexStr(vchPrev));
+        params.push_back(HexStr(vchCoinb1));
+        params.push_back(HexStr(vchCoinb2));
+        params.push_back(branch);
+        params.push_back(HexInt(block.nVersion));
+        params.push_back(HexInt(block.nBits.compact));
+        params.push_back(HexInt(block.nTime));
+        params.push_back(fClean);
+        return params;
+    }
+};
+
+class CStratumServer;
+
+/** One miner connection */
+class CStratumConnection : public boost::enable_shared_from_this<CStratumConnection>
+{
+public:
+    CStratumConnection(CStratumServer& serverIn, io_service& ios, unsigned int nExtraNonce1In, double dDifficultyIn) :
+        socket(ios), server(serverIn), bufIn(STRATUM_MAX_LINE), fWriting(false), fClosed(false),
+        nExtraNonce1(nExtraNonce1In), fSubscribed(false), fAuthorized(false),
+        dDifficulty(dDifficultyIn), dDifficultyPrev(dDifficultyIn),
+        nVardiffStart(GetTime()), nVardiffShares(0),
+        dShareAllowance(STRATUM_SHARE_BURST), nShareAllowanceTime(GetTimeMillis())
+    {
+    }
+
+    ip::tcp::socket socket;
+
+    void Start()
+    {
+        boost::system::error_code ec;
+        peer = socket.remote_endpoint(ec);
+        Read();
+    }
+
+    void Close()
+    {
+        if (fClosed)
+            return;
+        fClosed = true;
+        boost::system::error_code ec;
+        socket.close(ec);
+    }
+
+    bool IsClosed() const { return fClosed; }
+    bool IsSubscribed() const { return fSubscribed; }
+
+    void Notify(const string& strMethod, const Value& params)
+    {
+        Object msg;
+        msg.push_back(Pair("id", Value::null));
+        msg.push_back(Pair("method", strMethod));
+        msg.push_back(Pair("params", params));
+        Send(msg);
+    }
+
+    void SendDifficulty()
+    {
+        Array params;
+        params.push_back(dDifficulty);
+        Notify("mining.set_difficulty", params);
+    }
+
+    // Periodic vardiff check for miners that stopped finding shares
+    void CheckIdle(int64 nNow);
+
+private:
+    CStratumServer& server;
+    ip::tcp::endpoint peer;
+    boost::asio::streambuf bufIn;
+    deque<string> queueOut;
+    bool fWriting;
+    bool fClosed;
+
+    unsigned int nExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+    double dDifficulty;
+    double dDifficultyPrev;
+    int64 nVardiffStart;
+    int nVardiffShares;
+    // shares that may still be checked, refilled at -stratummaxsharerate
+    double dShareAllowance;
+    int64 nShareAllowanceTime;
+
+    void Read()
+    {
+        async_read_until(socket, bufIn, '\n',
+            boost::bind(&CStratumConnection::HandleRead, shared_from_this(),
+                boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    }
+
+    void HandleRead(const boost::system::error_code& error, size_t nBytes)
+    {
+        if (fClosed)
+            return;
+        if (error)
+        {
+            // also hit when a line exceeds STRATUM_MAX_LINE
+            Close();
+            return;
+        }
+
+        string strLine(buffers_begin(bufIn.data()), buffers_begin(bufIn.data()) + nBytes);
+        bufIn.consume(nBytes);
+
+        if (strLine.find_first_not_of(" \t\r\n") != string::npos)
+            HandleLine(strLine);
+
+        if (!fClosed)
+            Read();
+    }
+
+    void Send(const Object& msg)
+    {
+        if (fClosed)
+            return;
+        string strMsg;
+        fast_write_string(Value(msg), strMsg);
+        strMsg += '\n';
+        queueOut.push_back(strMsg);
+        if (!fWriting)
+            Write();
+    }
+
+    void Write()
+    {
+        fWriting = true;
+        async_write(socket, buffer(queueOut.front()),
+            boost::bind(&CStratumConnection::HandleWrite, shared_from_this(), boost::asio::placeholders::error));
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        fWriting = false;
+        if (fClosed)
+            return;
+        if (error)
+        {
+            Close();
+            return;
+        }
+        queueOut.pop_front();
+        if (!queueOut.empty())
+            Write();
+    }
+
+    void Reply(const Value& id, const Value& result, const Value& error)
+    {
+        Object msg;
+        msg.push_back(Pair("id", id));
+        msg.push_back(Pair("result", result));
+        msg.push_back(Pair("error", error));
+        Send(msg);
+    }
+
+    void HandleLine(const string& strLine);
+    bool AllowShare();
+    Value Submit(const Array& params, Value& error);
+    void Vardiff();
+};
+
+/** Listens for miners, keeps the current jobs and checks their shares */
+class CStratumServer
+{
+public:
+    CStratumServer(CWallet* pwalletIn) :
+        pwallet(pwalletIn), reservekey(pwalletIn), acceptor(ios), timer(ios),
+        nNextExtraNonce1(GetRand(0xffffffff)), nNextJob(0), nTransactionsUpdatedLast(0)
+    {
+        dInitialDifficulty = std::max(1.0 / 65536, atof(GetArg("-stratumdifficulty", "16").c_str()));
+        nShareTarget = std::max((int64)1, GetArg("-stratumsharetarget", 10));
+        nMaxConnections = std::max((int64)1, GetArg("-stratummaxconnections", 64));
+        dMaxShareRate = std::max(0.1, atof(GetArg("-stratummaxsharerate", "5").c_str()));
+    }
+
+    bool Bind(const ip::tcp::endpoint& endpoint, string& strError)
+    {
+        try
+        {
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+            acceptor.bind(endpoint);
+            acceptor.listen(socket_base::max_connections);
+        }
+        catch (boost::system::system_error &e)
+        {
+            strError = e.what();
+            return false;
+        }
+        Accept();
+        StartTimer();
+        return true;
+    }
+
+    void Run()
+    {
+        RenameThread("bitcoin-stratum");
+        ios.run();
+    }
+
+    void Stop()
+    {
+        ios.stop();
+    }
+
+    // Called by the block chain under cs_main; hands over to the server thread
+    void BlocksChanged()
+    {
+        ios.post(boost::bind(&CStratumServer::CheckTip, this));
+    }
+
+    double InitialDifficulty() const { return dInitialDifficulty; }
+    int64 ShareTarget() const { return nShareTarget; }
+    double MaxShareRate() const { return dMaxShareRate; }
+
+    boost::shared_ptr<CStratumJob> CurrentJob() const { return pjobCurrent; }
+
+    boost::shared_ptr<CStratumJob> FindJob(const string& strId) const
+    {
+        map<string, boost::shared_ptr<CStratumJob> >::const_iterator it = mapJobs.find(strId);
+        if (it == mapJobs.end())
+            return boost::shared_ptr<CStratumJob>();
+        return it->second;
+    }
+
+    bool SubmitBlock(CBlock& block)
+    {
+        return CheckWork(&block, *pwallet, reservekey);
+    }
+
+private:
+    CWallet* pwallet;
+    CReserveKey reservekey;
+    io_service ios;
+    ip::tcp::acceptor acceptor;
+    deadline_timer timer;
+
+    unsigned int nNextExtraNonce1;
+    unsigned int nNextJob;
+    unsigned int nTransactionsUpdatedLast;
+    int64 nJobTime;
+    double dInitialDifficulty;
+    int64 nShareTarget;
+    int64 nMaxConnections;
+    double dMaxShareRate;
+
+    boost::shared_ptr<CStratumJob> pjobCurrent;
+    map<string, boost::shared_ptr<CStratumJob> > mapJobs;
+    deque<string> queueJobs;
+    list<boost::shared_ptr<CStratumConnection> > listConnections;
+
+    void Accept()
+    {
+        boost::shared_ptr<CStratumConnection> conn(new CStratumConnection(*this, ios, nNextExtraNonce1++, dInitialDifficulty));
+        acceptor.async_accept(conn->socket,
+            boost::bind(&CStratumServer::HandleAccept, this, conn, boost::asio::placeholders::error));
+    }
+
+    void HandleAccept(boost::shared_ptr<CStratumConnection> conn, const boost::system::error_code& error)
+    {
+        if (error == error::operation_aborted || !acceptor.is_open())
+            return;
+        if (!error)
+        {
+            ForgetClosed();
+            if ((int64)listConnections.size() >= nMaxConnections)
+            {
+                boost::system::error_code ec;
+                ip::tcp::endpoint peer = conn->socket.remote_endpoint(ec);
+                printf("Stratum: connection limit reached, refusing %s\n", peer.address().to_string().c_str());
+                conn->Close();
+            }
+            else
+            {
+                listConnections.push_back(conn);
+                conn->Start();
+            }
+        }
+        Accept();
+    }
+
+    void ForgetClosed()
+    {
+        for (list<boost::shared_ptr<CStratumConnection> >::iterator it = listConnections.begin(); it != listConnections.end(); )
+        {
+            if ((*it)->IsClosed())
+                it = listConnections.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void StartTimer()
+    {
+        timer.expires_from_now(boost::posix_time::seconds(STRATUM_TIMER_INTERVAL));
+        timer.async_wait(boost::bind(&CStratumServer::HandleTimer, this, boost::asio::placeholders::error));
+    }
+
+    void HandleTimer(const boost::system::error_code& error)
+    {
+        if (error)
+            return;
+
+        ForgetClosed();
+
+        int64 nNow = GetTime();
+        BOOST_FOREACH(boost::shared_ptr<CStratumConnection>& conn, listConnections)
+            conn->CheckIdle(nNow);
+
+        // a missed notification still gets a new job here; otherwise pick up
+        // new transactions every STRATUM_TX_REFRESH seconds
+        CheckTip();
+        if (pjobCurrent && nTransactionsUpdated != nTransactionsUpdatedLast && nNow - nJobTime >= STRATUM_TX_REFRESH)
+            NewJob(false);
+        else if (pjobCurrent && GetMergedMiner() && IsNewAuxWork(GetMergedMiner()->GetWork()))
+            NewJob(false);
+
+        StartTimer();
+    }
+
+    // CMergedMiner::Update keeps its work while the aux blocks stay the
+    // same, but one built anew with the same blocks needs no new job either
+    bool IsNewAuxWork(const boost::shared_ptr<const CAuxWork>& pauxwork) const
+    {
+        const boost::shared_ptr<const CAuxWork>& pauxworkJob = pjobCurrent->pauxwork;
+        if (pauxwork == pauxworkJob)
+            return false;
+        return !pauxwork || !pauxworkJob || !pauxwork->IsSameWork(*pauxworkJob);
+    }
+
+    void CheckTip()
+    {
+        if (IsInitialBlockDownload())
+            return;
+        CBlockIndex* pindexTip;
+        {
+            LOCK(cs_main);
+            pindexTip = pindexBest;
+        }
+        if (!pjobCurrent || pjobCurrent->pindexPrev != pindexTip)
+            NewJob(true);
+    }
+
+    void NewJob(bool fClean);
+};
+
+void CStratumServer::NewJob(bool fClean)
+{
+    if (vNodes.empty() || IsInitialBlockDownload())
+        return;
+
+    unsigned int nTransactionsUpdatedNew = nTransactionsUpdated;
+    boost::shared_ptr<CBlockTemplate> ptemplate(CreateNewBlockWithKey(reservekey));
+    if (!ptemplate)
+    {
+        printf("Stratum: unable to create a new block template\n");
+        return;
+    }
+    CBlock& block = ptemplate->block;
+
+    boost::shared_ptr<CStratumJob> pjob(new CStratumJob());
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return;
+        pjob->pindexPrev = mi->second;
+        pjob->nMinTime = pjob->pindexPrev->GetMedianTimePast() + 1;
+    }
+    block.UpdateTime(pjob->pindexPrev);
+    block.nNonce = 0;
+
+    // Coinbase: <height> <extranonce1 extranonce2> [aux] flags; the nonce
+    // push is cut out of the serialized transaction and filled in by the miner
+    vector<unsigned char> vchAux;
+    if (GetMergedMiner() && (pjob->pauxwork = GetMergedMiner()->GetWork()))
+    {
+        vchAux.assign(UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+        vector<unsigned char> vchAuxData = pjob->pauxwork->GetAuxData();
+        vchAux.insert(vchAux.end(), vchAuxData.begin(), vchAuxData.end());
+    }
+    SplitStratumCoinbase(block.vtx[0], pjob->pindexPrev->nHeight + 1, vchAux, pjob->vchCoinb1, pjob->vchCoinb2);
+
+    ptemplate->UpdateMerkleRoot();
+    pjob->vMerkleBranch = ptemplate->vCoinbaseMerkleBranch;
+    pjob->hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+    pjob->ptemplate = ptemplate;
+    pjob->strId = strprintf("%x", ++nNextJob);
+
+    if (fClean)
+    {
+        mapJobs.clear();
+        queueJobs.clear();
+    }
+    mapJobs[pjob->strId] = pjob;
+    queueJobs.push_back(pjob->strId);
+    while (queueJobs.size() > STRATUM_MAX_JOBS)
+    {
+        mapJobs.erase(queueJobs.front());
+        queueJobs.pop_front();
+    }
+    pjobCurrent = pjob;
+    nJobTime = GetTime();
+    nTransactionsUpdatedLast = nTransactionsUpdatedNew;
+
+    Value params = pjob->NotifyParams(fClean);
+    BOOST_FOREACH(boost::shared_ptr<CStratumConnection>& conn, listConnections)
+        if (conn->IsSubscribed() && !conn->IsClosed())
+            conn->Notify("mining.notify", params);
+}
+
+void CStratumConnection::HandleLine(const string& strLine)
+{
+    Value valRequest;
+    if (!fast_read_string(strLine, valRequest) || valRequest.type() != obj_type)
+    {
+        printf("Stratum: malformed request from %s\n", peer.address().to_string().c_str());
+        Close();
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    const Value& valMethod = find_value(request, "method");
+    const Value& valParams = find_value(request, "params");
+    if (valMethod.type() != str_type)
+    {
+        Reply(id, Value::null, StratumError(STRATUM_OTHER, "Missing method"));
+        return;
+    }
+    const string& strMethod = valMethod.get_str();
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    if (strMethod == "mining.subscribe")
+    {
+        string strExtraNonce1 = HexInt(nExtraNonce1);
+        Array subscriptions, sub;
+        sub.push_back("mining.set_difficulty");
+        sub.push_back(strExtraNonce1);
+        subscriptions.push_back(sub);
+        sub[0] = "mining.notify";
+        subscriptions.push_back(sub);
+
+        Array result;
+        result.push_back(subscriptions);
+        result.push_back(strExtraNonce1);
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        Reply(id, result, Value::null);
+
+        fSubscribed = true;
+        SendDifficulty();
+        boost::shared_ptr<CStratumJob> pjob = server.CurrentJob();
+        if (pjob)
+            Notify("mining.notify", pjob->NotifyParams(true));
+    }
+    else if (strMethod == "mining.authorize")
+    {
+        // Rewards go to the node's wallet, so any worker name is accepted;
+        // who may connect at all is up to -stratumbind
+        fAuthorized = true;
+        Reply(id, true, Value::null);
+    }
+    else if (strMethod == "mining.submit")
+    {
+        Value error = Value::null;
+        Value result = Submit(params, error);
+        Reply(id, result, error);
+    }
+    else if (strMethod == "mining.extranonce.subscribe")
+        Reply(id, false, Value::null);
+    else
+        Reply(id, Value::null, StratumError(STRATUM_OTHER, "Method not found"));
+}
+
+// Token bucket: up to STRATUM_SHARE_BURST shares at once, then
+// -stratummaxsharerate per second, so no connection can keep the server
+// hashing shares as fast as it sends them
+bool CStratumConnection::AllowShare()
+{
+    int64 nNow = GetTimeMillis();
+    dShareAllowance = std::min(STRATUM_SHARE_BURST,
+        dShareAllowance + (nNow - nShareAllowanceTime) * server.MaxShareRate() / 1000);
+    nShareAllowanceTime = nNow;
+    if (dShareAllowance < 1)
+        return false;
+    dShareAllowance -= 1;
+    return true;
+}
+
+Value CStratumConnection::Submit(const Array& params, Value& error)
+{
+    if (!fSubscribed)
+    {
+        error = StratumError(STRATUM_NOT_SUBSCRIBED, "Not subscribed");
+        return Value::null;
+    }
+    if (!fAuthorized)
+    {
+        error = StratumError(STRATUM_UNAUTHORIZED, "Unauthorized worker");
+        return Value::null;
+    }
+    if (!AllowShare())
+    {
+        error = StratumError(STRATUM_RATE_LIMITED, "Too many shares");
+        return Value::null;
+    }
+
+    // [worker, job id, extranonce2, ntime, nonce]
+    unsigned int nTime, nNonce;
+    if (params.size() < 5 || params[1].type() != str_type || params[2].type() != str_type ||
+        !ParseHexInt(params[3], nTime) || !ParseHexInt(params[4], nNonce))
+    {
+        error = StratumError(STRATUM_OTHER, "Invalid parameters");
+        return Value::null;
+    }
+    vector<unsigned char> vchExtraNonce2 = ParseHex(params[2].get_str());
+    if (vchExtraNonce2.size() != STRATUM_EXTRANONCE2_SIZE || params[2].get_str().size() != 2 * STRATUM_EXTRANONCE2_SIZE)
+    {
+        error = StratumError(STRATUM_OTHER, "Invalid extranonce2 size");
+        return Value::null;
+    }
+
+    boost::shared_ptr<CStratumJob> pjob = server.FindJob(params[1].get_str());
+    if (!pjob)
+    {
+        error = StratumError(STRATUM_JOB_NOT_FOUND, "Job not found");
+        return Value::null;
+    }
+    if ((int64)nTime < pjob->nMinTime || (int64)nTime > GetAdjustedTime() + 2 * 60 * 60)
+    {
+        error = StratumError(STRATUM_OTHER, "ntime out of range");
+        return Value::null;
+    }
+
+    // Rebuild the coinbase and the header the miner hashed
+    const CBlock& blockTemplate = pjob->ptemplate->block;
+    vector<unsigned char> vchCoinbase;
+    CBlock header = StratumShareHeader(blockTemplate, pjob->vchCoinb1, pjob->vchCoinb2, pjob->vMerkleBranch,
+                                       nExtraNonce1, vchExtraNonce2, nTime, nNonce, vchCoinbase);
+
+    if (!pjob->setShares.insert(header.GetHash()).second)
+    {
+        error = StratumError(STRATUM_DUPLICATE_SHARE, "Duplicate share");
+        return Value::null;
+    }
+
+    uint256 hashPoW = header.GetPoWHash();
+    if (hashPoW > StratumTarget(std::min(dDifficulty, dDifficultyPrev)))
+    {
+        error = StratumError(STRATUM_LOW_DIFFICULTY, "Low difficulty share");
+        return Value::null;
+    }
+
+    bool fAux = pjob->pauxwork && GetMergedMiner() && hashPoW <= pjob->pauxwork->GetMaxTarget();
+    if (hashPoW <= pjob->hashTarget || fAux)
+    {
+        CTransaction txCoinbase;
+        try {
+            CDataStream(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION) >> txCoinbase;
+        }
+        catch (std::exception &e) {
+            error = StratumError(STRATUM_OTHER, "Coinbase decode failed");
+            return Value::null;
+        }
+
+        // aux chains whose target the share meets get it as their proof of work
+        if (fAux)
+            GetMergedMiner()->Submit(pjob->pauxwork, txCoinbase, pjob->vMerkleBranch, header, hashPoW);
+
+        if (hashPoW <= pjob->hashTarget)
+        {
+            CBlock block(blockTemplate);
+            block.vtx[0] = txCoinbase;
+            block.nTime = nTime;
+            block.nNonce = nNonce;
+            block.hashMerkleRoot = block.BuildMerkleTree();
+            printf("Stratum: block found by %s\n", peer.address().to_string().c_str());
+            if (!server.SubmitBlock(block))
+                printf("Stratum: block %s was not accepted\n", block.GetHash().ToString().c_str());
+        }
+    }
+
+    nVardiffShares++;
+    Vardiff();
+    return true;
+}
+
+// Aim for one share every -stratumsharetarget seconds, reviewed once a
+// minute or every 20 shares
+void CStratumConnection::Vardiff()
+{
+    int64 nElapsed = GetTime() - nVardiffStart;
+    if (nElapsed < 60 && nVardiffShares < 20)
+        return;
+
+    double dNew = StratumVardiff(dDifficulty, server.ShareTarget(), nElapsed, nVardiffShares);
+
+    nVardiffStart = GetTime();
+    nVardiffShares = 0;
+
+    if (dNew != dDifficulty)
+    {
+        dDifficultyPrev = dDifficulty;
+        dDifficulty = dNew;
+        SendDifficulty();
+    }
+}
+
+void CStratumConnection::CheckIdle(int64 nNow)
+{
+    if (!fSubscribed || nVardiffShares > 0)
+        return;
+    // nothing for a long while: the miner is too slow for this difficulty
+    if (nNow - nVardiffStart >= 6 * server.ShareTarget() && nNow - nVardiffStart >= 60)
+    {
+        nVardiffStart = nNow;
+        if (dDifficulty / 4 >= 1.0 / 65536)
+        {
+            dDifficultyPrev = dDifficulty;
+            dDifficulty /= 4;
+            SendDifficulty();
+        }
+    }
+}
+
+static CStratumServer* pstratum = NULL;
+static boost::thread* pthreadStratum = NULL;
+static boost::signals2::connection connBlocksChanged;
+
+void StartStratumServer()
+{
+    if (!GetBoolArg("-stratum"))
+        return;
+    if (!pwalletMain)
+    {
+        printf("Stratum: disabled, a wallet is required to receive the rewards\n");
+        return;
+    }
+
+    assert(pstratum == NULL);
+    pstratum = new CStratumServer(pwalletMain);
+
+    string strBind = GetArg("-stratumbind", "127.0.0.1");
+    boost::system::error_code ec;
+    ip::address bindAddress = ip::address::from_string(strBind, ec);
+    string strError;
+    if (ec || !pstratum->Bind(ip::tcp::endpoint(bindAddress, GetArg("-stratumport", 3333)), strError))
+    {
+        uiInterface.ThreadSafeMessageBox(strprintf(_("Unable to bind the Stratum port on %s: %s"),
+                                                   strBind.c_str(), ec ? ec.message().c_str() : strError.c_str()),
+                                         "", CClientUIInterface::MSG_ERROR);
+        delete pstratum;
+        pstratum = NULL;
+        return;
+    }
+
+    connBlocksChanged = uiInterface.NotifyBlocksChanged.connect(boost::bind(&CStratumServer::BlocksChanged, pstratum));
+    pthreadStratum = new boost::thread(boost::bind(&CStratumServer::Run, pstratum));
+    pstratum->BlocksChanged();
+}
+
+void StopStratumServer()
+{
+    if (pstratum == NULL)
+        return;
+
+    connBlocksChanged.disconnect();
+    pstratum->Stop();
+    pthreadStratum->join();
+    delete pthreadStratum; pthreadStratum = NULL;
+    delete pstratum; pstratum = NULL;
+}
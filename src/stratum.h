@@ -0,0 +1,24 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+/**
+ * Built-in Stratum mining server (line-delimited JSON over TCP).
+ *
+ * Miners subscribe once and get a mining.notify job pushed as soon as the
+ * best block changes, instead of polling getwork. Every connection gets its
+ * own extranonce1 and share difficulty (adjusted to -stratumsharetarget),
+ * shares are checked with the chain's proof-of-work hasher, and a share that
+ * meets the block target is submitted through CheckWork, paying the wallet.
+ * With -auxchain the coinbase also commits to the aux chain blocks, and shares
+ * meeting an aux target go to the merged mining coordinator.
+ */
+
+/** Start listening for Stratum miners if -stratum is set */
+void StartStratumServer();
+/** Close all miner connections and stop the server thread */
+void StopStratumServer();
+
+#endif
@@ -120,4 +120,110 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(6 == vpwtx[1]->nOrderPos);
 }
 
+BOOST_AUTO_TEST_CASE(acc_txindexes)
+{
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    CAccountingEntry ae;
+    CWalletTx wtx;
+
+    pwalletMain->RebuildTxIndexes(&walletdb);
+    size_t nItems = pwalletMain->wtxOrdered.size();
+    BOOST_CHECK(nItems == pwalletMain->mapWallet.size() + pwalletMain->laccentries.size());
+
+    ae.strAccount = "idx";
+    ae.nCreditDebit = 1;
+    ae.nTime = 1333333340;
+    ae.strOtherAccount = "";
+    ae.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    BOOST_CHECK(pwalletMain->AddAccountingEntry(ae, walletdb));
+
+    BOOST_CHECK(pwalletMain->wtxOrdered.size() == nItems + 1);
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.second->nTime == 1333333340);
+    BOOST_CHECK(pwalletMain->mapTxByAccount["idx"].size() == 1);
+
+    wtx.mapValue["comment"] = "w";
+    wtx.nLockTime = 1234;  // Just to get a fresh hash
+    pwalletMain->AddToWallet(wtx);
+    const CWalletTx* pwtx = &pwalletMain->mapWallet[wtx.GetHash()];
+
+    BOOST_CHECK(pwalletMain->wtxOrdered.size() == nItems + 2);
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.first == pwtx);
+    BOOST_CHECK(pwalletMain->mapTxByBlock[uint256(0)].count(wtx.GetHash()));
+
+    // Rebuilding from the database gives the same activity log
+    pwalletMain->RebuildTxIndexes(&walletdb);
+    BOOST_CHECK(pwalletMain->wtxOrdered.size() == nItems + 2);
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.first == pwtx);
+    BOOST_CHECK(pwalletMain->mapTxByAccount["idx"].size() == 1);
+}
+
+static bool
+AccountHasTx(const std::string& strAccount, const CWalletTx* pwtx)
+{
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, pwalletMain->mapTxByAccount[strAccount])
+        if (item.second.first == pwtx)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(acc_addressbook)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CTxDestination address = key.GetPubKey().GetID();
+    CWalletTx wtx;
+
+    wtx.vout.resize(1);
+    wtx.vout[0].nValue = 1;
+    wtx.vout[0].scriptPubKey.SetDestination(address);
+    wtx.nLockTime = 1235;  // Just to get a fresh hash
+    pwalletMain->AddToWallet(wtx);
+    const CWalletTx* pwtx = &pwalletMain->mapWallet[wtx.GetHash()];
+    BOOST_CHECK(pwalletMain->mapTxByAddress[address].count(wtx.GetHash()));
+    BOOST_CHECK(AccountHasTx("", pwtx));
+
+    // Labelling the address files its transactions under the label...
+    pwalletMain->SetAddressBookName(address, "label");
+    BOOST_CHECK(AccountHasTx("label", pwtx));
+
+    // ...and removing the label back under "", even from scratch
+    pwalletMain->mapTxByAccount[""].clear();
+    pwalletMain->DelAddressBookName(address);
+    BOOST_CHECK(AccountHasTx("", pwtx));
+    pwalletMain->RebuildTxIndexes();
+    BOOST_CHECK(AccountHasTx("", pwtx));
+    BOOST_CHECK(!AccountHasTx("label", pwtx));
+}
+
+BOOST_AUTO_TEST_CASE(acc_newkey_erase)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CTxDestination address = key.GetPubKey().GetID();
+    CWalletTx wtx;
+
+    wtx.vout.resize(1);
+    wtx.vout[0].nValue = 7;
+    wtx.vout[0].scriptPubKey.SetDestination(address);
+    wtx.nLockTime = 1236;  // Just to get a fresh hash
+    pwalletMain->AddToWallet(wtx);
+    const CWalletTx* pwtx = &pwalletMain->mapWallet[wtx.GetHash()];
+    BOOST_CHECK_EQUAL(pwtx->GetCredit(), 0);
+
+    // Adding the key makes the cached credit stale
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    BOOST_CHECK_EQUAL(pwtx->GetCredit(), 7);
+
+    // Erasing takes the transaction out of every index
+    size_t nOrdered = pwalletMain->wtxOrdered.size();
+    BOOST_CHECK(AccountHasTx("", pwtx));
+    BOOST_CHECK(pwalletMain->EraseFromWallet(wtx.GetHash()));
+    BOOST_CHECK_EQUAL(pwalletMain->wtxOrdered.size(), nOrdered - 1);
+    BOOST_CHECK(!pwalletMain->mapTxByAddress.count(address));
+    BOOST_CHECK(!pwalletMain->mapTxByBlock[uint256(0)].count(wtx.GetHash()));
+    BOOST_FOREACH(const PAIRTYPE(std::string, CWallet::TxItems)& item, pwalletMain->mapTxByAccount)
+        BOOST_FOREACH(const CWallet::TxItems::value_type& txitem, item.second)
+            BOOST_CHECK(txitem.second.first != pwtx);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,175 @@
+//
+// Unit tests for the -addressindex and -spentindex block tree indexes
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "base58.h"
+#include "bitcoinrpc.h"
+#include "keystore.h"
+
+using namespace std;
+using namespace json_spirit;
+
+static Value CallIndexRPC(const string& strMethod, const Value& arg1, const Value& arg2 = Value::null)
+{
+    Array params;
+    params.push_back(arg1);
+    if (arg2.type() != null_type)
+        params.push_back(arg2);
+    return tableRPC[strMethod]->actor(params, false);
+}
+
+// What the three index RPCs report about the two addresses and the funding output
+static string IndexState(const CBitcoinAddress& addressFrom, const CBitcoinAddress& addressTo, const uint256& hashFrom)
+{
+    Array vAddresses;
+    vAddresses.push_back(addressFrom.ToString());
+    vAddresses.push_back(addressTo.ToString());
+    string strState = write_string(CallIndexRPC("getaddresstxids", vAddresses), false);
+    strState += write_string(CallIndexRPC("getaddressutxos", vAddresses), false);
+    try {
+        strState += write_string(CallIndexRPC("getspentinfo", hashFrom.GetHex(), 0), false);
+    }
+    catch (Object& e) {
+        strState += "unspent";
+    }
+    return strState;
+}
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(connect_disconnect)
+{
+    LOCK(cs_main);
+    fAddressIndex = fSpentIndex = true;
+
+    CBasicKeyStore keystore;
+    CKey keyFrom, keyTo;
+    keyFrom.MakeNewKey(true);
+    keyTo.MakeNewKey(true);
+    keystore.AddKey(keyFrom);
+    CBitcoinAddress addressFrom(keyFrom.GetPubKey().GetID());
+    CBitcoinAddress addressTo(keyTo.GetPubKey().GetID());
+
+    // A block at height 2 spending an output of height 1 that the indexes already know
+    CBlockIndex indexParent;
+    uint256 hashParent = GetRandHash();
+    indexParent.phashBlock = &hashParent;
+    indexParent.pprev = pindexGenesisBlock;
+    indexParent.nHeight = 1;
+
+    CTransaction txFrom;
+    txFrom.vin.resize(1);
+    txFrom.vin[0].prevout.hash = GetRandHash();
+    txFrom.vin[0].prevout.n = 0;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = 10 * COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(keyFrom.GetPubKey().GetID());
+    uint256 hashFrom = txFrom.GetHash();
+
+    vector<CAddressIndexEntry> vAddressIndex;
+    vector<CAddressUnspentEntry> vAddressUnspent;
+    unsigned char type;
+    uint160 hashBytes;
+    BOOST_REQUIRE(GetAddressIndexHash(txFrom.vout[0].scriptPubKey, type, hashBytes));
+    vAddressIndex.push_back(make_pair(CAddressIndexKey(type, hashBytes, 1, 1, hashFrom, 0, false), txFrom.vout[0].nValue));
+    vAddressUnspent.push_back(make_pair(CAddressUnspentKey(type, hashBytes, hashFrom, 0),
+                                        CAddressUnspentValue(txFrom.vout[0].nValue, txFrom.vout[0].scriptPubKey, 1)));
+    CLevelDBBatch batchFrom;
+    pblocktree->WriteAddressIndex(batchFrom, vAddressIndex);
+    pblocktree->UpdateAddressUnspentIndex(batchFrom, vAddressUnspent);
+    BOOST_REQUIRE(pblocktree->WriteBatch(batchFrom));
+
+    CCoinsViewCache view(*pcoinsTip, true);
+    view.SetBestBlock(&indexParent);
+    view.SetCoins(hashFrom, CCoins(txFrom, 1));
+
+    CBlock block;
+    block.nVersion = 1;
+    block.hashPrevBlock = hashParent;
+    block.nTime = pindexGenesisBlock->nTime + 120;
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig = CScript() << 2 << OP_0;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = COIN;
+    block.vtx[0].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx[1].vin.resize(1);
+    block.vtx[1].vin[0].prevout = COutPoint(hashFrom, 0);
+    block.vtx[1].vout.resize(1);
+    block.vtx[1].vout[0].nValue = 9 * COIN;
+    block.vtx[1].vout[0].scriptPubKey.SetDestination(keyTo.GetPubKey().GetID());
+    BOOST_REQUIRE(SignSignature(keystore, txFrom, block.vtx[1], 0));
+    uint256 hashSpend = block.vtx[1].GetHash();
+    uint256 hashBlock = block.GetHash();
+
+    CBlockIndex index(block);
+    index.phashBlock = &hashBlock;
+    index.pprev = &indexParent;
+    index.nHeight = 2;
+
+    string strBefore = IndexState(addressFrom, addressTo, hashFrom);
+
+    // connecting puts the spend and its output in all three indexes
+    CValidationState state;
+    CLevelDBBatch batchConnect;
+    BOOST_REQUIRE(block.ConnectBlock(state, &index, view, true, &batchConnect));
+    BOOST_REQUIRE(pblocktree->WriteBatch(batchConnect));
+    view.SetBestBlock(&index);
+
+    Array txids = CallIndexRPC("getaddresstxids", addressFrom.ToString()).get_array();
+    BOOST_REQUIRE_EQUAL(txids.size(), 2U);
+    BOOST_CHECK_EQUAL(txids[0].get_str(), hashFrom.GetHex());
+    BOOST_CHECK_EQUAL(txids[1].get_str(), hashSpend.GetHex());
+    txids = CallIndexRPC("getaddresstxids", addressFrom.ToString(), 2).get_array();
+    BOOST_REQUIRE_EQUAL(txids.size(), 1U);
+    BOOST_CHECK_EQUAL(txids[0].get_str(), hashSpend.GetHex());
+
+    BOOST_CHECK(CallIndexRPC("getaddressutxos", addressFrom.ToString()).get_array().empty());
+    Array utxos = CallIndexRPC("getaddressutxos", addressTo.ToString()).get_array();
+    BOOST_REQUIRE_EQUAL(utxos.size(), 1U);
+    BOOST_CHECK_EQUAL(find_value(utxos[0].get_obj(), "txid").get_str(), hashSpend.GetHex());
+    BOOST_CHECK_EQUAL(find_value(utxos[0].get_obj(), "outputIndex").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(utxos[0].get_obj(), "satoshis").get_int64(), 9 * COIN);
+    BOOST_CHECK_EQUAL(find_value(utxos[0].get_obj(), "height").get_int(), 2);
+
+    Object spent = CallIndexRPC("getspentinfo", hashFrom.GetHex(), 0).get_obj();
+    BOOST_CHECK_EQUAL(find_value(spent, "txid").get_str(), hashSpend.GetHex());
+    BOOST_CHECK_EQUAL(find_value(spent, "index").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(spent, "height").get_int(), 2);
+
+    // disconnecting it again leaves the indexes exactly as they were
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(txFrom.vout[0], false, 1, txFrom.nVersion));
+    CDiskBlockPos pos(999, 0);
+    BOOST_REQUIRE(blockundo.WriteToDisk(pos, hashParent));
+    index.nFile = pos.nFile;
+    index.nUndoPos = pos.nPos;
+    index.nStatus |= BLOCK_HAVE_UNDO;
+
+    bool fClean = false;
+    CLevelDBBatch batchDisconnect;
+    BOOST_REQUIRE(block.DisconnectBlock(state, &index, view, &fClean, &batchDisconnect));
+    BOOST_CHECK(fClean);
+    BOOST_REQUIRE(pblocktree->WriteBatch(batchDisconnect));
+    BOOST_CHECK_EQUAL(IndexState(addressFrom, addressTo, hashFrom), strBefore);
+
+    CLevelDBBatch batchCleanup;
+    pblocktree->EraseAddressIndex(batchCleanup, vAddressIndex);
+    vAddressUnspent[0].second = CAddressUnspentValue();
+    pblocktree->UpdateAddressUnspentIndex(batchCleanup, vAddressUnspent);
+    BOOST_CHECK(pblocktree->WriteBatch(batchCleanup));
+    fAddressIndex = fSpentIndex = false;
+}
+
+BOOST_AUTO_TEST_CASE(disabled)
+{
+    BOOST_CHECK_THROW(CallIndexRPC("getaddressutxos", "LRxJUbwUWDgBYTchsEbzEuvPtdWgBLtK5d"), Object);
+    BOOST_CHECK_THROW(CallIndexRPC("getspentinfo", uint256(0).GetHex(), 0), Object);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,179 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "auxpow.h"
+#include "mergedmining.h"
+#include "bitcoinrpc.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// Stand-in for an aux chain node, answering getauxblock from memory
+class CTestAuxChain : public CAuxChain
+{
+public:
+    uint256 hashBlock;
+    int nChainID;
+    bool fOnline;
+
+    CTestAuxChain(int nChainIDIn) : hashBlock(GetRandHash()), nChainID(nChainIDIn), fOnline(true) {}
+
+    string GetName() const { return strprintf("test%d", nChainID); }
+
+    bool GetAuxBlock(uint256& hashBlockOut, int& nChainIDOut, uint256& hashTargetOut)
+    {
+        if (!fOnline)
+            throw runtime_error("couldn't connect to server");
+        hashBlockOut = hashBlock;
+        nChainIDOut = nChainID;
+        hashTargetOut = ~uint256(0) >> 20;
+        return true;
+    }
+
+    bool SubmitAuxBlock(const uint256& hashBlockIn, const CAuxPow& auxpow)
+    {
+        return false;
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(auxpow_tests)
+
+BOOST_AUTO_TEST_CASE(mergedmining_auxpow)
+{
+    CMergedMiner miner;
+    CTestAuxChain* pchain3 = new CTestAuxChain(3);
+    CTestAuxChain* pchainOffline = new CTestAuxChain(42);
+    pchainOffline->fOnline = false;
+    miner.AddChain(pchain3);
+    miner.AddChain(new CTestAuxChain(7));
+    miner.AddChain(pchainOffline);
+    miner.AddChain(new CTestAuxChain(11));
+    miner.AddChain(new CTestAuxChain(7)); // same chain ID as an earlier one
+
+    BOOST_CHECK(miner.GetWork() == NULL);
+    BOOST_CHECK(miner.Update());
+    boost::shared_ptr<const CAuxWork> pwork = miner.GetWork();
+    BOOST_REQUIRE(pwork != NULL);
+    BOOST_CHECK_EQUAL(pwork->vBlocks.size(), 3U);
+    BOOST_CHECK(pwork->nMerkleSize >= 4);
+
+    // Parent block committing to the aux work in its coinbase
+    vector<unsigned char> vchAux = pwork->GetAuxData();
+    CBlock parent;
+    parent.nVersion = 1;
+    parent.nBits = 0x1e0fffff;
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = MakeCoinbaseWithAux(parent.nBits, 1, vchAux);
+    txCoinbase.vout.resize(1);
+    parent.vtx.push_back(txCoinbase);
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    parent.vtx.push_back(tx);
+    parent.hashMerkleRoot = parent.BuildMerkleTree();
+    CBlockHeader header = parent.GetBlockHeader();
+
+    for (unsigned int i = 0; i < pwork->vBlocks.size(); i++)
+    {
+        const CAuxWork::CAuxBlock& block = pwork->vBlocks[i];
+        CAuxPow auxpow;
+        pwork->CreateAuxPow(i, txCoinbase, parent.GetMerkleBranch(0), header, auxpow);
+        BOOST_CHECK(auxpow.Check(block.hashBlock, block.nChainID));
+        BOOST_CHECK(!auxpow.Check(GetRandHash(), block.nChainID));
+
+        // and it survives the trip through getauxblock's hex encoding
+        CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << auxpow;
+        CAuxPow auxpow2;
+        ss >> auxpow2;
+        BOOST_CHECK(auxpow2.Check(block.hashBlock, block.nChainID));
+    }
+
+    // the same aux blocks again keep the work, a new one replaces it
+    BOOST_CHECK(miner.Update());
+    BOOST_CHECK(miner.GetWork() == pwork);
+    pchain3->hashBlock = GetRandHash();
+    BOOST_CHECK(miner.Update());
+    BOOST_REQUIRE(miner.GetWork() != pwork);
+    BOOST_CHECK(!miner.GetWork()->IsSameWork(*pwork));
+}
+
+// Aux proof of work for a parent chain block whose coinbase commits to hashAux alone
+static CAuxPow MakeAuxPow(const uint256& hashAux)
+{
+    vector<unsigned char> vchAux(hashAux.begin(), hashAux.end());
+    std::reverse(vchAux.begin(), vchAux.end());
+    int nSize = 1, nNonce = 0;
+    vchAux.insert(vchAux.end(), BEGIN(nSize), END(nSize));
+    vchAux.insert(vchAux.end(), BEGIN(nNonce), END(nNonce));
+
+    CBlock parent;
+    parent.nVersion = 1;
+    parent.nBits = 0x1e0fffff;
+    parent.nTime = GetTime();
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = MakeCoinbaseWithAux(parent.nBits, 1, vchAux);
+    txCoinbase.vout.resize(1);
+    parent.vtx.push_back(txCoinbase);
+    parent.hashMerkleRoot = parent.BuildMerkleTree();
+
+    CAuxPow auxpow(txCoinbase);
+    auxpow.nIndex = 0;
+    auxpow.vMerkleBranch = parent.GetMerkleBranch(0);
+    auxpow.nChainIndex = 0;
+    auxpow.parentBlockHeader = parent.GetBlockHeader();
+    return auxpow;
+}
+
+static Value SubmitShare(const CBlockHeader& header)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header;
+    Array vData;
+    vData.push_back(HexStr(ss.begin(), ss.end()));
+    Array params;
+    params.push_back((~uint256(0)).GetHex());
+    params.push_back(vData);
+    Value result = tableRPC["submitshares"]->actor(params, false);
+    BOOST_REQUIRE_EQUAL(result.get_array().size(), 1U);
+    return result.get_array()[0];
+}
+
+BOOST_AUTO_TEST_CASE(submitshares_auxpow)
+{
+    CBlockHeader header;
+    header.nVersion |= BLOCK_VERSION_AUXPOW;
+    header.nTime = GetTime();
+    {
+        LOCK(cs_main);
+        header.hashPrevBlock = pindexBest->GetBlockHash();
+        header.nBits = retarget::difficulty::instance().next_block_difficulty(pindexBest);
+    }
+
+    // a parent block that does not commit to this header earns nothing
+    header.auxpow.reset(new CAuxPow(MakeAuxPow(GetRandHash())));
+    Value share = SubmitShare(header);
+    BOOST_CHECK_EQUAL(find_value(share.get_obj(), "error").get_str(), "Invalid aux proof of work");
+    BOOST_CHECK(find_value(share.get_obj(), "share").type() == null_type);
+
+    // nor does one carrying our own chain ID
+    header.auxpow.reset(new CAuxPow(MakeAuxPow(header.GetHash())));
+    header.auxpow->parentBlockHeader.nVersion = header.nVersion & ~BLOCK_VERSION_AUXPOW;
+    share = SubmitShare(header);
+    BOOST_CHECK_EQUAL(find_value(share.get_obj(), "error").get_str(), "Invalid aux proof of work");
+
+    // one that does counts once
+    header.auxpow.reset(new CAuxPow(MakeAuxPow(header.GetHash())));
+    share = SubmitShare(header);
+    BOOST_CHECK(find_value(share.get_obj(), "error").type() == null_type);
+    BOOST_CHECK(find_value(share.get_obj(), "share").get_bool());
+    BOOST_CHECK_EQUAL(find_value(share.get_obj(), "hash").get_str(), header.auxpow->GetParentBlockHash().GetHex());
+    share = SubmitShare(header);
+    BOOST_CHECK_EQUAL(find_value(share.get_obj(), "error").get_str(), "Duplicate share");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,187 @@
+//
+// Unit tests for headers-first block download
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+// Tests these internal-to-main.cpp methods:
+extern CBlockIndex* pindexBestHeader;
+extern void FindBestHeader();
+extern void FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData);
+
+// Header-only index entries on top of the genesis block, as AcceptHeader
+// would add them; the proof of work is not checked past AcceptHeader
+struct CTestHeaderChain
+{
+    deque<CBlockIndex> vIndex;
+    vector<CBlockIndex*> vChain;
+
+    CTestHeaderChain(int nBlocks)
+    {
+        LOCK(cs_main);
+        vChain.push_back(pindexGenesisBlock);
+        for (int i = 1; i <= nBlocks; i++)
+        {
+            vIndex.push_back(CBlockIndex());
+            CBlockIndex* pindex = &vIndex.back();
+            BlockMap::iterator mi = mapBlockIndex.insert(make_pair(GetRandHash(), pindex)).first;
+            pindex->phashBlock = &mi->first;
+            pindex->pprev = vChain.back();
+            pindex->nHeight = i;
+            pindex->nChainWork = pindex->pprev->nChainWork + uint256(1);
+            pindex->nStatus = BLOCK_VALID_TREE;
+            vChain.push_back(pindex);
+        }
+        FindBestHeader();
+    }
+
+    ~CTestHeaderChain()
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH(CBlockIndex* pindex, vChain)
+            if (pindex != pindexGenesisBlock)
+                mapBlockIndex.erase(pindex->GetBlockHash());
+        FindBestHeader();
+    }
+};
+
+static CService ip(uint32_t i)
+{
+    struct in_addr s;
+    s.s_addr = i;
+    return CService(CNetAddr(s), GetDefaultPort());
+}
+
+// An outbound peer that says it has nHeight blocks
+static CNode* NewPeer(uint32_t nIP, int nHeight, bool fInbound = false)
+{
+    CNode* pnode = new CNode(INVALID_SOCKET, CAddress(ip(nIP)), "", fInbound);
+    pnode->fSuccessfullyConnected = true;
+    pnode->nStartingHeight = nHeight;
+    return pnode;
+}
+
+static vector<int> Download(CNode* pnode)
+{
+    vector<CInv> vGetData;
+    {
+        LOCK(cs_main);
+        FindBlocksToDownload(pnode, vGetData);
+    }
+    vector<int> vHeights;
+    BOOST_FOREACH(const CInv& inv, vGetData)
+    {
+        BOOST_CHECK_EQUAL(inv.type, MSG_BLOCK);
+        vHeights.push_back(mapBlockIndex[inv.hash]->nHeight);
+    }
+    return vHeights;
+}
+
+BOOST_AUTO_TEST_SUITE(headerssync_tests)
+
+BOOST_AUTO_TEST_CASE(acceptheader)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindex = NULL;
+    CValidationState state;
+
+    // a header we have already is simply looked up
+    CBlock genesis = pindexGenesisBlock->GetBlockHeader();
+    BOOST_CHECK(genesis.AcceptHeader(state, &pindex));
+    BOOST_CHECK(pindex == pindexGenesisBlock);
+
+    // a new one needs its proof of work before anything else
+    CBlock header;
+    header.hashPrevBlock = pindexGenesisBlock->GetBlockHash();
+    header.nTime = pindexGenesisBlock->nTime + 60;
+    header.nBits = retarget::difficulty::instance().next_block_difficulty(pindexGenesisBlock);
+    header.nNonce = 0;
+    while (header.GetPoWHash() <= CBigNum(header.nBits).getuint256())
+        header.nNonce++;
+    size_t nIndexSize = mapBlockIndex.size();
+    int nDoS = 0;
+    pindex = NULL;
+    BOOST_CHECK(!header.AcceptHeader(state, &pindex));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 50);
+    BOOST_CHECK(pindex == NULL);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nIndexSize);
+}
+
+BOOST_AUTO_TEST_CASE(findbestheader)
+{
+    CTestHeaderChain chain(40);
+    LOCK(cs_main);
+    BOOST_CHECK(pindexBestHeader == chain.vChain[40]);
+
+    // a failed block takes the headers built on it out of the running
+    chain.vChain[20]->nStatus |= BLOCK_FAILED_VALID;
+    FindBestHeader();
+    BOOST_CHECK(pindexBestHeader == chain.vChain[19]);
+
+    // ... and a failed parent those after it
+    chain.vChain[20]->nStatus &= ~BLOCK_FAILED_VALID;
+    chain.vChain[5]->nStatus |= BLOCK_FAILED_CHILD;
+    FindBestHeader();
+    BOOST_CHECK(pindexBestHeader == chain.vChain[4]);
+
+    chain.vChain[5]->nStatus &= ~BLOCK_FAILED_CHILD;
+    FindBestHeader();
+    BOOST_CHECK(pindexBestHeader == chain.vChain[40]);
+}
+
+BOOST_AUTO_TEST_CASE(download_window)
+{
+    CTestHeaderChain chain(40);
+    CNode* pnodeA = NewPeer(0xa0b0c001, 40);
+    CNode* pnodeB = NewPeer(0xa0b0c002, 40);
+    CNode* pnodeShort = NewPeer(0xa0b0c003, 10);
+    CNode* pnodeInbound = NewPeer(0xa0b0c004, 40, true);
+
+    // each peer gets the next MAX_BLOCKS_IN_TRANSIT_PER_PEER missing blocks
+    vector<int> vHeights = Download(pnodeA);
+    BOOST_REQUIRE_EQUAL(vHeights.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    for (int i = 0; i < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+        BOOST_CHECK_EQUAL(vHeights[i], i + 1);
+    BOOST_CHECK_EQUAL(pnodeA->nBlocksInFlight, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(Download(pnodeA).empty());
+
+    vHeights = Download(pnodeB);
+    BOOST_REQUIRE_EQUAL(vHeights.size(), (size_t)MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(vHeights[0], MAX_BLOCKS_IN_TRANSIT_PER_PEER + 1);
+
+    // nothing is asked twice, or past what the peer has
+    BOOST_CHECK(Download(pnodeShort).empty());
+    // inbound peers are left alone during the initial download
+    BOOST_CHECK(IsInitialBlockDownload());
+    BOOST_CHECK(Download(pnodeInbound).empty());
+
+    // a peer holding up the window's first missing block is dropped
+    SetMockTime(GetTime() + BLOCK_STALLING_TIMEOUT + 1);
+    BOOST_CHECK(Download(pnodeB).empty());
+    BOOST_CHECK(!pnodeB->fDisconnect);
+    BOOST_CHECK(Download(pnodeA).empty());
+    BOOST_CHECK(pnodeA->fDisconnect);
+    SetMockTime(0);
+
+    // and its blocks are handed to the others
+    ReleaseBlocksInFlight(pnodeA);
+    BOOST_CHECK_EQUAL(pnodeA->nBlocksInFlight, 0);
+    vHeights = Download(pnodeShort);
+    BOOST_REQUIRE_EQUAL(vHeights.size(), 10U);
+    BOOST_CHECK_EQUAL(vHeights[0], 1);
+
+    ReleaseBlocksInFlight(pnodeB);
+    ReleaseBlocksInFlight(pnodeShort);
+    delete pnodeA;
+    delete pnodeB;
+    delete pnodeShort;
+    delete pnodeInbound;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,100 @@
+//
+// Unit tests for importing blocks from external files (-loadblock, -reindex)
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static vector<unsigned char> Serialized(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return vector<unsigned char>(ss.begin(), ss.end());
+}
+
+// A block file record: the message start, the length nSize and then vch
+static void AppendRecord(vector<unsigned char>& vchFile, unsigned int nSize, const vector<unsigned char>& vch)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << FLATDATA(pchMessageStart) << nSize;
+    vchFile.insert(vchFile.end(), ss.begin(), ss.end());
+    vchFile.insert(vchFile.end(), vch.begin(), vch.end());
+}
+
+static bool ImportFile(const vector<unsigned char>& vchFile)
+{
+    boost::filesystem::path path = GetDataDir() / "import_test.dat";
+    FILE* file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(&vchFile[0], 1, vchFile.size(), file), vchFile.size());
+    fclose(file);
+
+    // LoadExternalBlockFile closes the file itself
+    file = fopen(path.string().c_str(), "rb");
+    BOOST_REQUIRE(file);
+    bool fLoaded = LoadExternalBlockFile(file);
+    FinishExternalBlockImport();
+    boost::filesystem::remove(path);
+    return fLoaded;
+}
+
+BOOST_AUTO_TEST_SUITE(import_tests)
+
+BOOST_AUTO_TEST_CASE(import_genesis)
+{
+    CBlock genesis;
+    BOOST_REQUIRE(genesis.ReadFromDisk(pindexGenesisBlock));
+    vector<unsigned char> vchGenesis = Serialized(genesis);
+    size_t nIndex = mapBlockIndex.size();
+    uint256 hashBest = hashBestChain;
+
+    // the block is read back as it was written, and already known, so
+    // importing it adds nothing
+    vector<unsigned char> vchFile;
+    AppendRecord(vchFile, vchGenesis.size(), vchGenesis);
+    BOOST_CHECK(!ImportFile(vchFile));
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nIndex);
+    BOOST_CHECK(hashBestChain == hashBest);
+    BOOST_CHECK(pindexGenesisBlock->GetBlockHash() == genesis.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(import_mismatch)
+{
+    CBlock genesis;
+    BOOST_REQUIRE(genesis.ReadFromDisk(pindexGenesisBlock));
+    vector<unsigned char> vchGenesis = Serialized(genesis);
+    size_t nIndex = mapBlockIndex.size();
+    uint256 hashBest = hashBestChain;
+
+    vector<unsigned char> vchFile;
+    // junk, including a stray first byte of the message start
+    vchFile.resize(100, 0x42);
+    vchFile[50] = pchMessageStart[0];
+    // lengths no block can have
+    AppendRecord(vchFile, 79, vector<unsigned char>(79, 0));
+    AppendRecord(vchFile, MAX_BLOCK_SIZE + 1, vector<unsigned char>());
+
+    // a coinbase that doesn't match the merkle root in the header
+    CBlock block(genesis);
+    block.vtx[0].vout[0].nValue++;
+    AppendRecord(vchFile, vchGenesis.size(), Serialized(block));
+
+    // a header that doesn't match its proof of work
+    block = genesis;
+    block.nNonce++;
+    AppendRecord(vchFile, vchGenesis.size(), Serialized(block));
+
+    // a record the length says is longer than what is there
+    vector<unsigned char> vchHalf(vchGenesis.begin(), vchGenesis.begin() + vchGenesis.size() / 2);
+    AppendRecord(vchFile, vchGenesis.size(), vchHalf);
+
+    // none of which is accepted, nor keeps the import from finishing
+    BOOST_CHECK(!ImportFile(vchFile));
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nIndex);
+    BOOST_CHECK(hashBestChain == hashBest);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
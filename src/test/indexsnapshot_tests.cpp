@@ -0,0 +1,144 @@
+//
+// Unit tests for the block index snapshot written on clean shutdown
+//
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Tests these internal-to-main.cpp methods:
+extern bool LoadBlockIndexSnapshot();
+extern void FindBestHeader();
+
+// Everything the snapshot keeps of a block index entry
+static string DescribeIndex(const CBlockIndex* pindex)
+{
+    return strprintf("%s %d %d %u %u %u %u %u %d %u %08x %u ",
+                     pindex->pprev ? pindex->pprev->GetBlockHash().ToString().c_str() : "-",
+                     pindex->nHeight, pindex->nFile, pindex->nDataPos, pindex->nUndoPos, pindex->nTx,
+                     pindex->nChainTx, pindex->nStatus, pindex->nVersion, pindex->nTime,
+                     pindex->nBits.compact, pindex->nNonce) +
+           pindex->nChainWork.ToString() + " " + pindex->hashMerkleRoot.ToString();
+}
+
+static map<uint256, string> DescribeBlockIndex()
+{
+    map<uint256, string> mapDescribed;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        mapDescribed[item.first] = DescribeIndex(item.second);
+    return mapDescribed;
+}
+
+// Drop the block index and build it from the snapshot again, as the next
+// start would, with the best chain at hashTipIn; false, leaving the index
+// empty, if the snapshot isn't used
+static bool ReloadBlockIndex(const uint256& hashTipIn)
+{
+    // the coins cache keeps a pointer to its best block, which goes with
+    // the index, so meanwhile it gets a stand-in with the same hash
+    static uint256 hashTip;
+    static CBlockIndex indexTip;
+    hashTip = hashTipIn;
+    indexTip.phashBlock = &hashTip;
+    pcoinsTip->SetBestBlock(&indexTip);
+
+    UnloadBlockIndex();
+    if (!LoadBlockIndexSnapshot())
+        return false;
+    pindexBest = mapBlockIndex[hashTip];
+    hashBestChain = hashTip;
+    nBestHeight = pindexBest->nHeight;
+    nBestChainWork = pindexBest->nChainWork;
+    pcoinsTip->SetBestBlock(pindexBest);
+    FindBestHeader();
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(indexsnapshot_tests)
+
+BOOST_AUTO_TEST_CASE(roundtrip)
+{
+    LOCK(cs_main);
+    uint256 hashTip = hashBestChain;
+    uint256 hashGenesis = pindexGenesisBlock->GetBlockHash();
+
+    // header entries on top of the genesis block, some with data, and a
+    // branch off height 5 so parents aren't always the record before
+    vector<uint256> vHashes;
+    CBlockIndex* pindexPrev = pindexGenesisBlock;
+    for (int i = 1; i <= 30; i++)
+    {
+        if (i == 21)
+            pindexPrev = mapBlockIndex[vHashes[4]];
+        vHashes.push_back(GetRandHash());
+        CBlockIndex* pindex = InsertBlockIndex(vHashes.back());
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = pindexPrev->nHeight + 1;
+        pindex->nFile = i % 3;
+        pindex->nDataPos = i * 1000 + 8;
+        pindex->nUndoPos = i % 2 ? i * 100 + 8 : 0;
+        pindex->nTx = i;
+        pindex->nChainTx = pindexPrev->nChainTx + i;
+        pindex->nChainWork = pindexPrev->nChainWork + uint256(i);
+        pindex->nStatus = BLOCK_VALID_TREE | (i % 2 ? BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO : 0);
+        pindex->nVersion = 2;
+        pindex->hashMerkleRoot = GetRandHash();
+        pindex->nTime = pindexPrev->nTime + 60;
+        pindex->nBits = 0x1e0ffff0;
+        pindex->nNonce = GetRand(0xffffffff);
+        pindexPrev = pindex;
+    }
+    map<uint256, string> mapBefore = DescribeBlockIndex();
+
+    // the index built from the snapshot is the one it was taken of
+    boost::filesystem::path pathSnapshot = GetDataDir() / "blocks" / "indexsnapshot.dat";
+    BOOST_REQUIRE(WriteBlockIndexSnapshot());
+    BOOST_REQUIRE(ReloadBlockIndex(hashTip));
+    BOOST_CHECK(DescribeBlockIndex() == mapBefore);
+    BOOST_CHECK(pindexGenesisBlock == mapBlockIndex[hashGenesis]);
+    BOOST_CHECK(find(setBlockIndexValid.begin(), setBlockIndexValid.end(), pindexGenesisBlock) != setBlockIndexValid.end());
+    BOOST_CHECK(find(setBlockIndexValid.begin(), setBlockIndexValid.end(), mapBlockIndex[vHashes[0]]) == setBlockIndexValid.end());
+    // and it is used only once
+    BOOST_CHECK(!boost::filesystem::exists(pathSnapshot));
+
+    // a snapshot whose records don't match its checksum is not used, and removed
+    BOOST_REQUIRE(WriteBlockIndexSnapshot());
+    boost::filesystem::path pathGood = pathSnapshot.string() + ".good";
+    boost::filesystem::copy_file(pathSnapshot, pathGood);
+    FILE* file = fopen(pathSnapshot.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    fseek(file, -10, SEEK_END);
+    int ch = fgetc(file);
+    fseek(file, -10, SEEK_END);
+    fputc(ch ^ 1, file);
+    fclose(file);
+    BOOST_CHECK(!ReloadBlockIndex(hashTip));
+    BOOST_CHECK(mapBlockIndex.empty());
+    BOOST_CHECK(!boost::filesystem::exists(pathSnapshot));
+
+    // nor is one cut short
+    boost::filesystem::copy_file(pathGood, pathSnapshot);
+    boost::filesystem::resize_file(pathSnapshot, boost::filesystem::file_size(pathGood) - 1);
+    BOOST_CHECK(!ReloadBlockIndex(hashTip));
+    BOOST_CHECK(mapBlockIndex.empty());
+
+    // or one taken at another best block than the coins are at
+    boost::filesystem::copy_file(pathGood, pathSnapshot);
+    BOOST_CHECK(!ReloadBlockIndex(vHashes[2]));
+    BOOST_CHECK(mapBlockIndex.empty());
+
+    boost::filesystem::rename(pathGood, pathSnapshot);
+    BOOST_REQUIRE(ReloadBlockIndex(hashTip));
+    BOOST_CHECK(DescribeBlockIndex() == mapBefore);
+
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        mapBlockIndex.erase(hash);
+    FindBestHeader();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
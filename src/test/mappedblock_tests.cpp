@@ -0,0 +1,274 @@
+//
+// Unit tests for reading stored blocks through memory-mapped block files
+// and CBlockView
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "bloom.h"
+
+using namespace std;
+
+// Blocks with the genesis header, so their proof of work holds, and nTx
+// made up transactions of assorted sizes
+static CBlock MakeBlock(int nTx)
+{
+    CBlock block(pindexGenesisBlock->GetBlockHeader());
+    block.vtx.resize(nTx);
+    for (int i = 0; i < nTx; i++)
+    {
+        CTransaction& tx = block.vtx[i];
+        tx.vin.resize(1 + i % 3);
+        for (unsigned int j = 0; j < tx.vin.size(); j++)
+        {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), j);
+            tx.vin[j].scriptSig = CScript() << vector<unsigned char>(70 + i % 50 * 4, i);
+        }
+        tx.vout.resize(1 + i % 2);
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+        {
+            tx.vout[j].nValue = (i + 1) * COIN + j;
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, j) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        tx.nLockTime = i;
+    }
+    return block;
+}
+
+static vector<unsigned char> Serialized(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return vector<unsigned char>(ss.begin(), ss.end());
+}
+
+// Append the message start, the length nSize and then vch to blk<nFile>;
+// the position of what follows the length
+static CDiskBlockPos AppendBlockFile(int nFile, unsigned int nSize, const vector<unsigned char>& vch)
+{
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+    CDiskBlockPos pos(nFile, boost::filesystem::exists(path) ? boost::filesystem::file_size(path) : 0);
+    CAutoFile fileout = CAutoFile(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    fileout << FLATDATA(pchMessageStart) << nSize;
+    if (!vch.empty())
+        fileout.write((const char*)&vch[0], vch.size());
+    pos.nPos += 8;
+    return pos;
+}
+
+static CDiskBlockPos WriteRawBlock(int nFile, const vector<unsigned char>& vch)
+{
+    return AppendBlockFile(nFile, vch.size(), vch);
+}
+
+static vector<unsigned char> MappedBytes(const CMappedBlock& block)
+{
+    CMemoryReader reader = block.GetReader();
+    return vector<unsigned char>(reader.begin(), reader.begin() + reader.size());
+}
+
+BOOST_AUTO_TEST_SUITE(mappedblock_tests)
+
+BOOST_AUTO_TEST_CASE(mapping_lru)
+{
+    // fill the cache with fresh mappings, each held here and by the cache
+    vector<boost::shared_ptr<const char> > vpfile;
+    size_t nSize;
+    for (unsigned int i = 0; i < MAX_MAPPED_BLOCK_FILES; i++)
+    {
+        WriteRawBlock(910 + i, vector<unsigned char>(100, i));
+        vpfile.push_back(MapBlockFile(910 + i, 1, nSize));
+        BOOST_REQUIRE(vpfile.back());
+        BOOST_CHECK_EQUAL(nSize, 108U);
+    }
+    BOOST_FOREACH(const boost::shared_ptr<const char>& pfile, vpfile)
+        BOOST_CHECK_EQUAL(pfile.use_count(), 2);
+
+    // using the oldest again makes the second oldest the one to go
+    BOOST_CHECK(MapBlockFile(910, 1, nSize) == vpfile[0]);
+    WriteRawBlock(910 + MAX_MAPPED_BLOCK_FILES, vector<unsigned char>(100, 0xff));
+    BOOST_REQUIRE(MapBlockFile(910 + MAX_MAPPED_BLOCK_FILES, 1, nSize));
+    BOOST_CHECK_EQUAL(vpfile[0].use_count(), 2);
+    BOOST_CHECK_EQUAL(vpfile[1].use_count(), 1);
+    for (unsigned int i = 2; i < MAX_MAPPED_BLOCK_FILES; i++)
+        BOOST_CHECK_EQUAL(vpfile[i].use_count(), 2);
+
+    // a dropped mapping stays readable for as long as it is held
+    BOOST_CHECK(memcmp(vpfile[1].get(), pchMessageStart, sizeof(pchMessageStart)) == 0);
+    BOOST_CHECK_EQUAL((unsigned char)vpfile[1].get()[107], 1);
+
+    // and the file is mapped anew when asked for again
+    boost::shared_ptr<const char> pfile = MapBlockFile(911, 1, nSize);
+    BOOST_REQUIRE(pfile);
+    BOOST_CHECK(pfile != vpfile[1]);
+    BOOST_CHECK_EQUAL(pfile.use_count(), 2);
+    BOOST_CHECK_EQUAL(vpfile[1].use_count(), 1);
+
+    for (unsigned int i = 0; i <= MAX_MAPPED_BLOCK_FILES; i++)
+        UnmapBlockFile(910 + i);
+}
+
+BOOST_AUTO_TEST_CASE(mapping_growth)
+{
+    CBlock blockA = MakeBlock(5), blockB = MakeBlock(9), blockC = MakeBlock(3);
+    vector<unsigned char> vchA = Serialized(blockA), vchB = Serialized(blockB), vchC = Serialized(blockC);
+
+    CDiskBlockPos posA = WriteRawBlock(901, vchA);
+    CMappedBlock mappedA(posA);
+    BOOST_REQUIRE(!mappedA.IsNull());
+    BOOST_CHECK(MappedBytes(mappedA) == vchA);
+
+    // a block appended after the file was mapped is found all the same
+    CDiskBlockPos posB = WriteRawBlock(901, vchB);
+    CMappedBlock mappedB(posB);
+    BOOST_REQUIRE(!mappedB.IsNull());
+    BOOST_CHECK(MappedBytes(mappedB) == vchB);
+    CBlock blockRead;
+    BOOST_REQUIRE(blockRead.ReadFromDisk(posB));
+    BOOST_CHECK(blockRead.GetHash() == blockB.GetHash());
+    BOOST_CHECK(Serialized(blockRead) == vchB);
+
+    // also when the mapping already covers its start but not its end
+    vector<unsigned char> vchHalf(vchC.begin(), vchC.begin() + vchC.size() / 2);
+    CDiskBlockPos posC = AppendBlockFile(901, vchC.size(), vchHalf);
+    size_t nSize;
+    BOOST_REQUIRE(MapBlockFile(901, posC.nPos, nSize));
+    BOOST_CHECK_EQUAL(nSize, posC.nPos + vchHalf.size());
+    {
+        CAutoFile fileout = CAutoFile(OpenBlockFile(CDiskBlockPos(901, nSize)), SER_DISK, CLIENT_VERSION);
+        fileout.write((const char*)&vchC[vchHalf.size()], vchC.size() - vchHalf.size());
+    }
+    CMappedBlock mappedC(posC);
+    BOOST_REQUIRE(!mappedC.IsNull());
+    BOOST_CHECK(MappedBytes(mappedC) == vchC);
+
+    // while the older mappings still hold their blocks
+    BOOST_CHECK(MappedBytes(mappedA) == vchA);
+    UnmapBlockFile(901);
+}
+
+BOOST_AUTO_TEST_CASE(mapping_corrupt_length)
+{
+    vector<unsigned char> vch = Serialized(MakeBlock(2));
+
+    // lengths no block can have
+    BOOST_CHECK(CMappedBlock(AppendBlockFile(902, 0, vch)).IsNull());
+    BOOST_CHECK(CMappedBlock(AppendBlockFile(902, 79, vch)).IsNull());
+    BOOST_CHECK(CMappedBlock(AppendBlockFile(902, MAX_BLOCK_SIZE + 1, vch)).IsNull());
+    BOOST_CHECK(CMappedBlock(AppendBlockFile(902, 0xffffffff, vch)).IsNull());
+
+    // positions with no room for a length before them
+    BOOST_CHECK(CMappedBlock(CDiskBlockPos(902, 0)).IsNull());
+    BOOST_CHECK(CMappedBlock(CDiskBlockPos(902, 3)).IsNull());
+    BOOST_CHECK(CMappedBlock(CDiskBlockPos()).IsNull());
+
+    // and a length running past the end of the file
+    CDiskBlockPos pos = AppendBlockFile(902, vch.size() + 1, vch);
+    BOOST_CHECK(CMappedBlock(pos).IsNull());
+    CBlock block;
+    BOOST_CHECK(!block.ReadFromDisk(pos));
+
+    // none of which spoil the file for the good blocks in it
+    pos = WriteRawBlock(902, vch);
+    CMappedBlock mapped(pos);
+    BOOST_REQUIRE(!mapped.IsNull());
+    BOOST_CHECK(MappedBytes(mapped) == vch);
+    UnmapBlockFile(902);
+}
+
+BOOST_AUTO_TEST_CASE(blockview_matches_block)
+{
+    CBlock block = MakeBlock(300);
+    CDiskBlockPos pos = WriteRawBlock(900, Serialized(block));
+
+    CBlockView view;
+    BOOST_REQUIRE(view.ReadFromDisk(pos));
+    BOOST_CHECK(view.GetHeader().GetHash() == block.GetHash());
+    BOOST_REQUIRE_EQUAL(view.GetTxCount(), block.vtx.size());
+    BOOST_CHECK(view.GetMappedBlock().GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION) ==
+                ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+
+    // in any order, hashes of the raw bytes and decoded transactions are the block's
+    for (int i = block.vtx.size() - 1; i >= 0; i -= 7)
+        BOOST_CHECK(view.GetTxHash(i) == block.vtx[i].GetHash());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        BOOST_CHECK(view.GetTxHash(i) == block.vtx[i].GetHash());
+        CTransaction tx;
+        BOOST_REQUIRE(view.GetTransaction(i, tx));
+        BOOST_CHECK(tx == block.vtx[i]);
+    }
+
+    // and a CBlock read from the same place agrees
+    CBlock blockRead;
+    BOOST_REQUIRE(blockRead.ReadFromDisk(pos));
+    BOOST_CHECK(Serialized(blockRead) == Serialized(block));
+}
+
+BOOST_AUTO_TEST_CASE(blockview_noncanonical)
+{
+    // a transaction count of 2 written in three bytes
+    CBlock block = MakeBlock(2);
+    vector<unsigned char> vch = Serialized(block);
+    BOOST_REQUIRE_EQUAL(vch[80], 2);
+    vch[80] = 0xfd;
+    unsigned char pchCount[] = { 2, 0 };
+    vch.insert(vch.begin() + 81, pchCount, pchCount + 2);
+    CBlockView view;
+    BOOST_CHECK(!view.ReadFromDisk(WriteRawBlock(900, vch)));
+
+    // a scriptSig length likewise
+    vch = Serialized(block);
+    unsigned int nScriptSig = 80 + 1 + 4 + 1 + 36;
+    BOOST_REQUIRE_EQUAL(vch[nScriptSig], block.vtx[0].vin[0].scriptSig.size());
+    unsigned char pchSize[] = { vch[nScriptSig], 0, 0, 0 };
+    vch[nScriptSig] = 0xfe;
+    vch.insert(vch.begin() + nScriptSig + 1, pchSize, pchSize + 4);
+    BOOST_CHECK(!view.ReadFromDisk(WriteRawBlock(900, vch)));
+
+    // while the canonical encoding reads fine
+    BOOST_CHECK(view.ReadFromDisk(WriteRawBlock(900, Serialized(block))));
+    BOOST_CHECK_EQUAL(view.GetTxCount(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(blockview_truncated)
+{
+    // a block cut short in its last transaction
+    vector<unsigned char> vch = Serialized(MakeBlock(3));
+    vch.resize(vch.size() - 3);
+    CBlockView view;
+    BOOST_CHECK(!view.ReadFromDisk(WriteRawBlock(900, vch)));
+}
+
+BOOST_AUTO_TEST_CASE(blockview_merkleblock)
+{
+    CBlock block = MakeBlock(40);
+    CBlockView view;
+    BOOST_REQUIRE(view.ReadFromDisk(WriteRawBlock(900, Serialized(block))));
+
+    // the same filter matches the same transactions in a view as in a CBlock
+    CBloomFilter filter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(block.vtx[3].GetHash());
+    filter.insert(vector<unsigned char>(20, 1)); // the second output of every odd transaction
+    filter.insert(block.vtx[39].GetHash());
+    CBloomFilter filterView(filter);
+
+    CMerkleBlock merkleBlock(block, filter);
+    CMerkleBlock merkleView(view, filterView);
+    BOOST_CHECK(merkleBlock.vMatchedTxn == merkleView.vMatchedTxn);
+    BOOST_CHECK(!merkleBlock.vMatchedTxn.empty());
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION), ssView(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << merkleBlock;
+    ssView << merkleView;
+    BOOST_CHECK(ssBlock.str() == ssView.str());
+
+    // and updates the filters alike
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION), ssFilterView(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << filter;
+    ssFilterView << filterView;
+    BOOST_CHECK(ssFilter.str() == ssFilterView.str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
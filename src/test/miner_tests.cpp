@@ -119,6 +119,10 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         tx.vin[0].prevout.hash = hash;
     }
     BOOST_CHECK(pblocktemplate = CreateNewBlockWithKey(reservekey));
+    // rolling the extranonce only rehashes the coinbase branch
+    unsigned int nExtraNonce = 0;
+    IncrementExtraNonce(pblocktemplate, pindexBest, nExtraNonce);
+    BOOST_CHECK(pblocktemplate->block.hashMerkleRoot == pblocktemplate->block.BuildMerkleTree());
     delete pblocktemplate;
     mempool.clear();
 
@@ -1,14 +1,23 @@
 #include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 #include "base58.h"
+#include "main.h"
 #include "util.h"
 #include "bitcoinrpc.h"
 
 using namespace std;
 using namespace json_spirit;
 
+// Tests these internal-to-bitcoinrpc.cpp methods:
+extern int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
+extern int ReadHTTPMessage(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet,
+                           string& strMessageRet, int nProto);
+extern string JSONRPCRequest(const string& strMethod, const Array& params, const Value& id);
+
 BOOST_AUTO_TEST_SUITE(rpc_tests)
 
 static Array
@@ -168,4 +177,285 @@ BOOST_AUTO_TEST_CASE(rpc_rawsign)
     BOOST_CHECK(find_value(r.get_obj(), "complete").get_bool() == true);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_signrawtransaction_txid)
+{
+    // signrawtransaction changes a decoded transaction in place; the
+    // transaction it hands back must carry the id of its signed form
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    string prevout =
+      "[{\"txid\":\"b4cc287e58f87cdae59417329f710f3ecd75a4ee1d2872b7248f50977c8493f3\","
+      "\"vout\":0,\"scriptPubKey\":\"" + HexStr(scriptPubKey.begin(), scriptPubKey.end()) + "\"}]";
+    Value r = CallRPC(string("createrawtransaction ")+prevout+" "+
+      "{\"" + CBitcoinAddress(key.GetPubKey().GetID()).ToString() + "\":11}");
+    string notsigned = r.get_str();
+    string privkey = "\"" + CBitcoinSecret(key).ToString() + "\"";
+    r = CallRPC(string("signrawtransaction ")+notsigned+" "+prevout+" "+"["+privkey+"]");
+    BOOST_CHECK(find_value(r.get_obj(), "complete").get_bool());
+    string signedtx = find_value(r.get_obj(), "hex").get_str();
+    BOOST_CHECK(signedtx != notsigned);
+
+    vector<unsigned char> vchSigned = ParseHex(signedtx);
+    r = CallRPC(string("decoderawtransaction ")+signedtx);
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "txid").get_str(), Hash(vchSigned.begin(), vchSigned.end()).GetHex());
+    vector<unsigned char> vchUnsigned = ParseHex(notsigned);
+    BOOST_CHECK(find_value(r.get_obj(), "txid").get_str() != Hash(vchUnsigned.begin(), vchUnsigned.end()).GetHex());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_fastjson)
+{
+    // The fast reader and writer must agree with json_spirit's own
+    const char* vJSON[] = {
+        "null", "true", "false", "0", "-1", "9223372036854775807", "18446744073709551615",
+        "1.5", "-0.00000001", "1e3", "\"\"", "\"a\\\"b\\\\c\\/d\\n\\t\\u0041\\x42\"",
+        "[]", "{}", "[1,[2,[3]],{\"a\":{}}]", " { \"x\" : [ true , null ] , \"y\" : \"z\" } ",
+        "{\"method\":\"sendmany\",\"params\":[\"\",{\"addr\":0.1}],\"id\":1}",
+    };
+    BOOST_FOREACH(const char* psz, vJSON)
+    {
+        Value vSpirit, vFast;
+        BOOST_CHECK(read_string(string(psz), vSpirit));
+        BOOST_CHECK_MESSAGE(fast_read_string(psz, vFast), psz);
+        BOOST_CHECK_EQUAL(write_string(vSpirit, false), fast_write_string(vFast, false));
+        BOOST_CHECK_EQUAL(write_string(vSpirit, true), fast_write_string(vFast, true));
+        BOOST_CHECK(vSpirit == vFast);
+    }
+
+    const char* vBad[] = { "", "[1,", "{\"a\" 1}", "[1 2]", "\"abc", "tru", "-", "{1:2}", "18446744073709551616" };
+    BOOST_FOREACH(const char* psz, vBad)
+    {
+        Value v;
+        BOOST_CHECK_MESSAGE(!fast_read_string(psz, v), psz);
+    }
+
+    Object obj;
+    obj.push_back(Pair("ctrl", string("\x01\x7f\xff")));
+    obj.push_back(Pair("amount", 21000000.0));
+    BOOST_CHECK_EQUAL(write_string(Value(obj), false), fast_write_string(Value(obj), false));
+}
+
+// An RPC server on a random loopback port, for as long as it is in scope
+struct CTestRPCServer
+{
+    string strPort;
+
+    CTestRPCServer(const string& strMaxIdle = "100")
+    {
+        strPort = itostr(20000 + GetRand(20000));
+        mapArgs["-rpcuser"] = "rpctest";
+        mapArgs["-rpcpassword"] = "rpctestpassword";
+        mapArgs["-rpcport"] = strPort;
+        mapArgs["-rpcthreads"] = "2";
+        mapArgs["-rpcservertimeout"] = "1";
+        mapArgs["-rpcmaxidle"] = strMaxIdle;
+        StartRPCThreads();
+    }
+
+    ~CTestRPCServer()
+    {
+        StopRPCThreads();
+        const char* vArgs[] = { "-rpcuser", "-rpcpassword", "-rpcport", "-rpcthreads", "-rpcservertimeout", "-rpcmaxidle" };
+        BOOST_FOREACH(const char* pszArg, vArgs)
+            mapArgs.erase(pszArg);
+    }
+};
+
+// A keep-alive HTTP request for valRequest
+static string RPCPost(const Value& valRequest)
+{
+    string strBody = write_string(valRequest, false);
+    return strprintf("POST / HTTP/1.1\r\n"
+                     "Host: 127.0.0.1\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: %" PRIszu "\r\n"
+                     "Authorization: Basic %s\r\n"
+                     "\r\n", strBody.size(), EncodeBase64("rpctest:rpctestpassword").c_str()) + strBody;
+}
+
+static string RPCPost(const string& strMethod, int nId)
+{
+    Value valRequest;
+    BOOST_REQUIRE(read_string(JSONRPCRequest(strMethod, Array(), nId), valRequest));
+    return RPCPost(valRequest);
+}
+
+// Reply body of the next response on stream, "" if the server closed it
+static string RPCReply(std::iostream& stream, map<string, string>* pmapHeaders = NULL)
+{
+    int nProto = 0;
+    map<string, string> mapHeaders;
+    string strReply;
+    ReadHTTPStatus(stream, nProto);
+    if (!stream)
+        return "";
+    ReadHTTPMessage(stream, pmapHeaders ? *pmapHeaders : mapHeaders, strReply, nProto);
+    return strReply;
+}
+
+static Value ReplyId(const string& strReply)
+{
+    Value valReply;
+    BOOST_REQUIRE(read_string(strReply, valReply));
+    return find_value(valReply.get_obj(), "id");
+}
+
+BOOST_AUTO_TEST_CASE(rpc_keepalive_pipelined)
+{
+    CTestRPCServer server;
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", server.strPort);
+    BOOST_REQUIRE(stream);
+
+    // requests sent back to back on one connection are answered in order
+    stream << RPCPost("getblockcount", 1) << RPCPost("getconnectioncount", 2) << RPCPost("getblockcount", 3) << std::flush;
+    for (int nId = 1; nId <= 3; nId++)
+        BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream)).get_int(), nId);
+
+    // and the connection stays open for more after it went idle
+    MilliSleep(100);
+    stream << RPCPost("getblockcount", 4) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream)).get_int(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_read_deadline)
+{
+    CTestRPCServer server;
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", server.strPort);
+    BOOST_REQUIRE(stream);
+
+    // a request that never completes is dropped after -rpcservertimeout,
+    // and its worker is free again for the others
+    int64 nStart = GetTime();
+    stream << "POST / HTTP/1.1\r\n" << std::flush;
+    boost::asio::ip::tcp::iostream stream2("127.0.0.1", server.strPort);
+    stream2 << RPCPost("getblockcount", 1) << RPCPost("getblockcount", 2) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream2)).get_int(), 1);
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream2)).get_int(), 2);
+    BOOST_CHECK_EQUAL(RPCReply(stream), "");
+    BOOST_CHECK(GetTime() - nStart <= 5);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_max_idle)
+{
+    CTestRPCServer server("2");
+    boost::asio::ip::tcp::iostream stream1("127.0.0.1", server.strPort);
+    boost::asio::ip::tcp::iostream stream2("127.0.0.1", server.strPort);
+    stream1 << RPCPost("getblockcount", 1) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream1)).get_int(), 1);
+    stream2 << RPCPost("getblockcount", 2) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream2)).get_int(), 2);
+    MilliSleep(100);
+
+    // with two connections idle, a third is one too many and gets closed
+    boost::asio::ip::tcp::iostream stream3("127.0.0.1", server.strPort);
+    stream3 << RPCPost("getblockcount", 3) << std::flush;
+    BOOST_CHECK_EQUAL(RPCReply(stream3), "");
+
+    // while the first two are still served
+    stream1 << RPCPost("getblockcount", 4) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream1)).get_int(), 4);
+}
+
+static void RecordThread(boost::mutex* pmutex, vector<int>* pvCalls, set<boost::thread::id>* psetThreads, size_t i)
+{
+    MilliSleep(50);
+    boost::unique_lock<boost::mutex> lock(*pmutex);
+    (*pvCalls)[i]++;
+    psetThreads->insert(boost::this_thread::get_id());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_parallel_batch)
+{
+    CTestRPCServer server;
+
+    // every item is run exactly once, on the caller and the helper threads
+    boost::mutex mutex;
+    vector<int> vCalls(8, 0);
+    set<boost::thread::id> setThreads;
+    RPCParallelFor(vCalls.size(), 4, boost::bind(&RecordThread, &mutex, &vCalls, &setThreads, _1));
+    BOOST_CHECK(std::count(vCalls.begin(), vCalls.end(), 1) == (int)vCalls.size());
+    BOOST_CHECK(setThreads.size() > 1);
+    BOOST_CHECK(setThreads.count(boost::this_thread::get_id()));
+
+    // a batch mixing thread-safe and other calls still answers in request order
+    CKey key;
+    key.MakeNewKey(true);
+    Array vBatch;
+    for (int nId = 0; nId < 8; nId++)
+    {
+        Array params;
+        params.push_back(nId % 2 ? CBitcoinAddress(key.GetPubKey().GetID()).ToString() : string("notanaddress"));
+        Value valRequest;
+        BOOST_REQUIRE(read_string(JSONRPCRequest(nId % 3 ? "validateaddress" : "getblockcount", nId % 3 ? params : Array(), nId), valRequest));
+        vBatch.push_back(valRequest);
+    }
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", server.strPort);
+    stream << RPCPost(vBatch) << std::flush;
+    Value valReply;
+    BOOST_REQUIRE(read_string(RPCReply(stream), valReply));
+    const Array& vReply = valReply.get_array();
+    BOOST_REQUIRE_EQUAL(vReply.size(), vBatch.size());
+    for (int nId = 0; nId < 8; nId++)
+    {
+        const Object& reply = vReply[nId].get_obj();
+        BOOST_CHECK_EQUAL(find_value(reply, "id").get_int(), nId);
+        BOOST_CHECK(find_value(reply, "error").type() == null_type);
+        if (nId % 3)
+            BOOST_CHECK_EQUAL(find_value(find_value(reply, "result").get_obj(), "isvalid").get_bool(), nId % 2 == 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpc_longpoll_header)
+{
+    // only replies handing out work tell the miner where to longpoll
+    BOOST_CHECK(HTTPReplyHeader(HTTP_OK, false, 0, "application/json", true).find("X-Long-Polling: /LP\r\n") != string::npos);
+    BOOST_CHECK(HTTPReplyHeader(HTTP_OK, false, 0).find("X-Long-Polling") == string::npos);
+
+    CTestRPCServer server;
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", server.strPort);
+    map<string, string> mapHeaders;
+    stream << RPCPost("getblockcount", 1) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream, &mapHeaders)).get_int(), 1);
+    BOOST_CHECK(mapHeaders.count("x-long-polling") == 0);
+}
+
+static void NotifyTemplateChangeAfter(int nMilliseconds)
+{
+    MilliSleep(nMilliseconds);
+    NotifyTemplateChange();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_longpollid)
+{
+    CTestRPCServer server;
+    Array params;
+    Object request;
+
+    // a longpollid of an older tip is answered right away
+    request.push_back(Pair("longpollid", uint256(1).GetHex() + strprintf("%u", GetTemplateChanges())));
+    params.push_back(request);
+    Value valRequest;
+    BOOST_REQUIRE(read_string(JSONRPCRequest("getblocktemplate", params, 1), valRequest));
+    boost::asio::ip::tcp::iostream stream("127.0.0.1", server.strPort);
+    int64 nStart = GetTimeMillis();
+    stream << RPCPost(valRequest) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream)).get_int(), 1);
+    BOOST_CHECK(GetTimeMillis() - nStart < 1000);
+
+    // one of the current template waits for the next template change
+    request.clear();
+    request.push_back(Pair("longpollid", hashBestChain.GetHex() + strprintf("%u", GetTemplateChanges())));
+    params[0] = request;
+    BOOST_REQUIRE(read_string(JSONRPCRequest("getblocktemplate", params, 2), valRequest));
+    boost::asio::ip::tcp::iostream stream2("127.0.0.1", server.strPort);
+    nStart = GetTimeMillis();
+    boost::thread notifier(boost::bind(&NotifyTemplateChangeAfter, 1500));
+    stream2 << RPCPost(valRequest) << std::flush;
+    BOOST_CHECK_EQUAL(ReplyId(RPCReply(stream2)).get_int(), 2);
+    int64 nElapsed = GetTimeMillis() - nStart;
+    BOOST_CHECK(nElapsed >= 1400 && nElapsed < 10000);
+    notifier.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
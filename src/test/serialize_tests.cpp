@@ -42,4 +42,42 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(memoryreader)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << (int)0x01020304 << string("abc") << VARINT(1000);
+    vector<char> vch(ss.begin(), ss.end());
+
+    CMemoryReader reader(&vch[0], &vch[0] + vch.size(), SER_DISK, 0);
+    int n;
+    string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 0x01020304);
+    BOOST_CHECK_EQUAL(str, "abc");
+    BOOST_CHECK_EQUAL(reader.size(), 2U);
+    BOOST_CHECK(reader.begin() == &vch[0] + 8);
+
+    // reading or skipping past the end fails, and leaves the reader where it was
+    char pch[3];
+    BOOST_CHECK_THROW(reader.read(pch, 3), std::ios_base::failure);
+    BOOST_CHECK_THROW(reader.ignore(3), std::ios_base::failure);
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    BOOST_CHECK_EQUAL(reader.size(), 2U);
+
+    unsigned int nVarInt;
+    reader >> VARINT(nVarInt);
+    BOOST_CHECK_EQUAL(nVarInt, 1000U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader.ignore(1), std::ios_base::failure);
+    reader.ignore(0);
+
+    // a length prefix promising more than there is
+    CMemoryReader readerStr(&vch[4], &vch[0] + 7, SER_DISK, 0);
+    BOOST_CHECK_THROW(readerStr >> str, std::ios_base::failure);
+    vector<char> vchHuge(1, (char)0xfe);
+    vchHuge.resize(5, (char)0xff);
+    CMemoryReader readerHuge(&vchHuge[0], &vchHuge[0] + vchHuge.size(), SER_DISK, 0);
+    BOOST_CHECK_THROW(readerHuge >> str, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,129 @@
+//
+// Unit tests for the Stratum server's coinbase, share header and vardiff
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "auxpow.h"
+
+using namespace std;
+
+// Tests these internal-to-stratum.cpp methods:
+extern void SplitStratumCoinbase(CTransaction& txCoinbase, unsigned int nHeight, const vector<unsigned char>& vchAux,
+                                 vector<unsigned char>& vchCoinb1, vector<unsigned char>& vchCoinb2);
+extern CBlock StratumShareHeader(const CBlock& blockTemplate, const vector<unsigned char>& vchCoinb1,
+                                 const vector<unsigned char>& vchCoinb2, const vector<uint256>& vMerkleBranch,
+                                 unsigned int nExtraNonce1, const vector<unsigned char>& vchExtraNonce2,
+                                 unsigned int nTime, unsigned int nNonce, vector<unsigned char>& vchCoinbaseRet);
+extern double StratumVardiff(double dDifficulty, int64 nShareTarget, int64 nElapsed, int nShares);
+
+// A template with a coinbase and nTx - 1 other transactions
+static void MakeTemplate(CBlockTemplate& tmpl, int nTx)
+{
+    CBlock& block = tmpl.block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0ffff0;
+    block.vtx.resize(nTx);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].nValue = 50 * COIN;
+    block.vtx[0].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    for (int i = 1; i < nTx; i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout = COutPoint(GetRandHash(), i);
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = i * COIN;
+    }
+    block.BuildMerkleTree();
+    tmpl.vCoinbaseMerkleBranch = block.GetMerkleBranch(0);
+}
+
+// What the miner's share amounts to, checked against the template
+static void CheckShare(int nTx, const vector<unsigned char>& vchAux)
+{
+    CBlockTemplate tmpl;
+    MakeTemplate(tmpl, nTx);
+    const CBlock& block = tmpl.block;
+    vector<unsigned char> vchCoinb1, vchCoinb2;
+    SplitStratumCoinbase(tmpl.block.vtx[0], 1234, vchAux, vchCoinb1, vchCoinb2);
+    tmpl.UpdateMerkleRoot();
+
+    // the nonce placeholder is all that is cut out
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.vtx[0];
+    vector<unsigned char> vchPlaceholder(vchCoinb1);
+    vchPlaceholder.resize(vchCoinb1.size() + 8, 0);
+    vchPlaceholder.insert(vchPlaceholder.end(), vchCoinb2.begin(), vchCoinb2.end());
+    BOOST_CHECK(vchPlaceholder == vector<unsigned char>(ss.begin(), ss.end()));
+
+    vector<unsigned char> vchExtraNonce2 = ParseHex("01020304");
+    vector<unsigned char> vchCoinbase;
+    CBlock header = StratumShareHeader(block, vchCoinb1, vchCoinb2, tmpl.vCoinbaseMerkleBranch,
+                                       0xa1b2c3d4, vchExtraNonce2, 1400000100, 0xdeadbeef, vchCoinbase);
+
+    // the coinbase carries height, extranonce1 and extranonce2, and the aux data after them
+    CTransaction txCoinbase;
+    CDataStream(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION) >> txCoinbase;
+    CScript scriptSig = CScript() << 1234 << ParseHex("a1b2c3d401020304");
+    if (!vchAux.empty())
+        scriptSig << vchAux;
+    BOOST_CHECK(txCoinbase.vin[0].scriptSig == scriptSig + COINBASE_FLAGS);
+    BOOST_CHECK(txCoinbase.vout == block.vtx[0].vout);
+
+    // and the header is the template's, with the share's merkle root, time and nonce
+    CBlock blockShare(block);
+    blockShare.vtx[0] = txCoinbase;
+    blockShare.nTime = 1400000100;
+    blockShare.nNonce = 0xdeadbeef;
+    blockShare.hashMerkleRoot = blockShare.BuildMerkleTree();
+    BOOST_CHECK(header.hashMerkleRoot == blockShare.hashMerkleRoot);
+    BOOST_CHECK(header.hashMerkleRoot == CBlock::CheckMerkleBranch(txCoinbase.GetHash(), tmpl.vCoinbaseMerkleBranch, 0));
+    BOOST_CHECK_EQUAL(header.nVersion, block.nVersion);
+    BOOST_CHECK(header.hashPrevBlock == block.hashPrevBlock);
+    BOOST_CHECK(header.nBits == block.nBits);
+    BOOST_CHECK_EQUAL(header.nTime, 1400000100U);
+    BOOST_CHECK_EQUAL(header.nNonce, 0xdeadbeefU);
+    BOOST_CHECK(header.GetHash() == blockShare.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE(stratum_tests)
+
+BOOST_AUTO_TEST_CASE(share_header)
+{
+    CheckShare(1, vector<unsigned char>());
+    CheckShare(2, vector<unsigned char>());
+    CheckShare(7, vector<unsigned char>());
+
+    // merged mining data goes after the extra nonce
+    vector<unsigned char> vchAux(UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+    uint256 hashAux = GetRandHash();
+    vchAux.insert(vchAux.end(), hashAux.begin(), hashAux.end());
+    vchAux.resize(vchAux.size() + 8, 0);
+    CheckShare(5, vchAux);
+}
+
+BOOST_AUTO_TEST_CASE(vardiff)
+{
+    // one share every 10 seconds is what is asked for
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 60, 6), 16);
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 60, 7), 16);
+
+    // twice too slow halves the difficulty, twice too fast doubles it
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 120, 6), 8);
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 30, 6), 32);
+
+    // but never by more than a factor of 4 in one step
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 60, 60), 64);
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 600, 1), 4);
+    BOOST_CHECK_EQUAL(StratumVardiff(16, 10, 0, 20), 64);
+
+    // nor below difficulty 1/65536
+    BOOST_CHECK_EQUAL(StratumVardiff(1.0 / 32768, 10, 600, 1), 1.0 / 65536);
+    BOOST_CHECK_EQUAL(StratumVardiff(1.0 / 65536, 10, 600, 1), 1.0 / 65536);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
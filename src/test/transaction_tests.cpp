@@ -273,4 +273,72 @@ BOOST_AUTO_TEST_CASE(test_IsStandard)
     BOOST_CHECK(!t.IsStandard());
 }
 
+BOOST_AUTO_TEST_CASE(test_HashCache)
+{
+    CTransaction t;
+    t.vin.resize(1);
+    t.vin[0].scriptSig << OP_1;
+    t.vout.resize(1);
+    t.vout[0].nValue = 90*CENT;
+    t.vout[0].scriptPubKey << OP_1;
+
+    // a transaction built in code is hashed afresh every time
+    uint256 hashBuilt = t.GetHash();
+    BOOST_CHECK(hashBuilt == SerializeHash(t));
+    t.vout[0].nValue = 91*CENT;
+    BOOST_CHECK(t.GetHash() != hashBuilt);
+    BOOST_CHECK(t.GetHash() == SerializeHash(t));
+
+    // a decoded one keeps its first hash until told otherwise
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << t;
+    vector<unsigned char> vchTx(ss.begin(), ss.end());
+    CTransaction tDecoded;
+    ss >> tDecoded;
+    uint256 hashDecoded = tDecoded.GetHash();
+    BOOST_CHECK(hashDecoded == t.GetHash());
+    tDecoded.vout[0].nValue = 92*CENT;
+    BOOST_CHECK(tDecoded.GetHash() == hashDecoded);
+    tDecoded.InvalidateHash();
+    BOOST_CHECK(tDecoded.GetHash() == SerializeHash(tDecoded));
+    BOOST_CHECK(tDecoded.GetHash() != hashDecoded);
+
+    // copies of a decoded transaction don't share the cache, hashed or not yet
+    CTransaction tCached;
+    CDataStream(vchTx, SER_NETWORK, PROTOCOL_VERSION) >> tCached;
+    CTransaction tUnhashed(tCached);
+    uint256 hashCached = tCached.GetHash();
+    CTransaction tCopy(tCached);
+    BOOST_CHECK(tCopy.GetHash() == hashCached);
+    tCopy.vin[0].scriptSig << OP_2;
+    BOOST_CHECK(tCopy.GetHash() == SerializeHash(tCopy));
+    BOOST_CHECK(tCopy.GetHash() != hashCached);
+    BOOST_CHECK(tCached.GetHash() == hashCached);
+    tUnhashed.vin[0].scriptSig << OP_3;
+    BOOST_CHECK(tUnhashed.GetHash() == SerializeHash(tUnhashed));
+    tUnhashed.vin[0].scriptSig << OP_4;
+    BOOST_CHECK(tUnhashed.GetHash() == SerializeHash(tUnhashed));
+
+    // nor does one assigned from it
+    CTransaction tAssigned;
+    tAssigned = tCached;
+    tAssigned.vout[0].nValue = 93*CENT;
+    BOOST_CHECK(tAssigned.GetHash() == SerializeHash(tAssigned));
+    BOOST_CHECK(tAssigned.GetHash() != hashCached);
+
+    // moving hands the cache over, and leaves nothing stale behind
+    CTransaction tMoved(std::move(tCached));
+    BOOST_CHECK(tMoved.GetHash() == hashCached);
+    BOOST_CHECK(tCached.GetHash() == SerializeHash(tCached));
+    tAssigned = std::move(tMoved);
+    BOOST_CHECK(tAssigned.GetHash() == hashCached);
+    tCached = tAssigned;
+
+    // SetNull starts over with an uncached transaction
+    tCached.SetNull();
+    BOOST_CHECK(tCached.GetHash() == SerializeHash(tCached));
+    tCached.nLockTime = 1;
+    BOOST_CHECK(tCached.GetHash() == SerializeHash(tCached));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,6 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
 #include "uint256.h"
+#include "bignum.h"
+#include "block.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +17,38 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_division)
+{
+    uint256 num1 = 1000;
+    num1 /= uint256(7);
+    BOOST_CHECK(num1 == 142);
+    BOOST_CHECK_EQUAL(num1.bits(), 8U);
+    BOOST_CHECK_EQUAL(uint256(0).bits(), 0U);
+    BOOST_CHECK_EQUAL((~uint256(0)).bits(), 256U);
+
+    uint256 num2 = ~uint256(0);
+    num2 /= (uint256(1) << 200);
+    BOOST_CHECK(num2 == (~uint256(0) >> 200));
+    num2 /= ~uint256(0);
+    BOOST_CHECK(num2 == 0);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_block_work)
+{
+    static const unsigned int vBits[] = { 0x1e0fffff, 0x1d00ffff, 0x1b0404cb, 0x1a05db8b, 0x207fffff, 0x03123456, 0x01120000 };
+    for (unsigned int i = 0; i < sizeof(vBits)/sizeof(vBits[0]); i++)
+    {
+        CBlockIndex index;
+        index.nBits = vBits[i];
+        BOOST_CHECK(index.GetBlockWork256() == index.GetBlockWork().getuint256());
+    }
+
+    // zero and negative targets carry no work
+    CBlockIndex index;
+    index.nBits = 0x1d000000;
+    BOOST_CHECK(index.GetBlockWork256() == 0);
+    index.nBits = 0x1d800001;
+    BOOST_CHECK(index.GetBlockWork256() == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,201 @@
+//
+// Unit tests for dumptxoutset / loadtxoutset UTXO snapshots
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Coins of made up transactions, as the coin database would hold them
+static vector<pair<uint256, CCoins> > MakeCoins(int nTx)
+{
+    vector<pair<uint256, CCoins> > vCoins;
+    for (int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(1 + i % 3);
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+        {
+            tx.vout[j].nValue = (i + 1) * COIN + j;
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        CCoins coins(tx, i + 1);
+        // some partly spent
+        if (tx.vout.size() > 1)
+            coins.Spend(0);
+        vCoins.push_back(make_pair(tx.GetHash(), coins));
+    }
+    return vCoins;
+}
+
+static void SetCoins(const vector<pair<uint256, CCoins> >& vCoins, bool fPrune)
+{
+    BOOST_FOREACH(const PAIRTYPE(uint256, CCoins)& item, vCoins)
+        BOOST_REQUIRE(pcoinsTip->SetCoins(item.first, fPrune ? CCoins() : item.second));
+    BOOST_REQUIRE(pcoinsTip->Flush());
+}
+
+BOOST_AUTO_TEST_SUITE(utxosnapshot_tests)
+
+BOOST_AUTO_TEST_CASE(dump_roundtrip)
+{
+    LOCK(cs_main);
+    vector<pair<uint256, CCoins> > vCoins = MakeCoins(6);
+    SetCoins(vCoins, false);
+
+    boost::filesystem::path path = GetDataDir() / "utxosnapshot_test.dat";
+    CCoinsStats stats;
+    DumpUTXOSnapshot(path, stats);
+    CCoinsStats statsTip;
+    BOOST_REQUIRE(pcoinsTip->GetStats(statsTip));
+    BOOST_CHECK(stats.hashBlock == hashBestChain);
+    BOOST_CHECK_EQUAL(stats.nHeight, nBestHeight);
+    BOOST_CHECK(stats.hashSerialized == statsTip.hashSerialized);
+    BOOST_CHECK_EQUAL(stats.nTransactions, statsTip.nTransactions);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, statsTip.nTotalAmount);
+
+    // the file holds the coins the database does, in txid order, and the
+    // hash that covers them
+    {
+        FILE* file = fopen(path.string().c_str(), "rb");
+        BOOST_REQUIRE(file);
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        int nVersion, nHeight;
+        uint256 hashBlock;
+        filein >> nVersion >> hashBlock >> nHeight;
+        BOOST_CHECK(hashBlock == hashBestChain);
+        BOOST_CHECK_EQUAL(nHeight, 0);
+
+        map<uint256, CCoins> mapRead;
+        uint256 txidLast = 0;
+        CCoinsStats statsRead;
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << hashBlock;
+        while (true)
+        {
+            uint256 txid;
+            filein >> txid;
+            if (txid == 0)
+                break;
+            BOOST_CHECK(mapRead.empty() || memcmp(txidLast.begin(), txid.begin(), 32) < 0);
+            filein >> mapRead[txid];
+            statsRead.Add(ss, txid, mapRead[txid]);
+            txidLast = txid;
+        }
+        uint256 hashSerialized;
+        filein >> hashSerialized;
+        BOOST_CHECK(hashSerialized == stats.hashSerialized);
+        BOOST_CHECK(ss.GetHash() == stats.hashSerialized);
+        BOOST_CHECK_EQUAL(mapRead.size(), statsTip.nTransactions);
+        BOOST_FOREACH(const PAIRTYPE(uint256, CCoins)& item, vCoins)
+            BOOST_CHECK(mapRead.count(item.first) && mapRead[item.first] == item.second);
+    }
+
+    // a snapshot of the genesis block is of no use to load
+    BOOST_CHECK_THROW(LoadUTXOSnapshot(path, stats), runtime_error);
+
+    boost::filesystem::remove(path);
+    SetCoins(vCoins, true);
+}
+
+// Write a snapshot at height 1, on a made up block; the hash it ends with
+static uint256 WriteSnapshot(const boost::filesystem::path& path, const vector<pair<uint256, CCoins> >& vCoins)
+{
+    CBlockIndex index;
+    index.pprev = pindexGenesisBlock;
+    index.nHeight = 1;
+    index.nTx = 1;
+    index.nVersion = 2;
+    index.hashMerkleRoot = GetRandHash();
+    index.nTime = pindexGenesisBlock->nTime + 150;
+    index.nBits = pindexGenesisBlock->nBits;
+    CDiskBlockIndex diskindex(&index, boost::shared_ptr<CAuxPow>());
+    uint256 hashBlock = diskindex.CalcBlockHash();
+
+    map<uint256, CCoins> mapSorted;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CCoins)& item, vCoins)
+        mapSorted[item.first] = item.second;
+
+    CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    fileout << 1 << hashBlock << 1 << diskindex;
+    CCoinsStats stats;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CCoins)& item, mapSorted)
+    {
+        fileout << item.first << item.second;
+        stats.Add(ss, item.first, item.second);
+    }
+    uint256 hashSerialized = ss.GetHash();
+    fileout << uint256(0) << hashSerialized;
+    return hashSerialized;
+}
+
+static string LoadError(const boost::filesystem::path& path)
+{
+    CCoinsStats stats;
+    try {
+        LoadUTXOSnapshot(path, stats);
+    } catch (std::exception& e) {
+        return e.what();
+    }
+    return "";
+}
+
+BOOST_AUTO_TEST_CASE(load_mismatch)
+{
+    LOCK(cs_main);
+    vector<pair<uint256, CCoins> > vCoins = MakeCoins(4);
+    boost::filesystem::path path = GetDataDir() / "utxosnapshot_test.dat";
+    size_t nIndex = mapBlockIndex.size();
+
+    // a sound snapshot gets as far as the checkpoints, which don't know it
+    uint256 hashSerialized = WriteSnapshot(path, vCoins);
+    BOOST_CHECK(LoadError(path).find("is not known to this version") != string::npos);
+    BOOST_CHECK(LoadError(path).find(hashSerialized.ToString()) != string::npos);
+
+    // one whose coins don't match its hash doesn't
+    boost::uintmax_t nSize = boost::filesystem::file_size(path);
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    // the height of the last coins, before the zero txid and the hash
+    fseek(file, -65, SEEK_END);
+    int ch = fgetc(file);
+    fseek(file, -65, SEEK_END);
+    fputc(ch ^ 1, file);
+    fclose(file);
+    BOOST_CHECK_EQUAL(LoadError(path), "snapshot is corrupt");
+
+    // nor one whose hash doesn't match its coins
+    WriteSnapshot(path, vCoins);
+    file = fopen(path.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    fseek(file, -1, SEEK_END);
+    ch = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(ch ^ 1, file);
+    fclose(file);
+    BOOST_CHECK_EQUAL(LoadError(path), "snapshot is corrupt");
+
+    // or one cut short
+    WriteSnapshot(path, vCoins);
+    boost::filesystem::resize_file(path, nSize - 1);
+    BOOST_CHECK(!LoadError(path).empty());
+
+    // and none of them touched the chain
+    BOOST_CHECK(pindexBest == pindexGenesisBlock);
+    BOOST_CHECK(pcoinsTip->GetBestBlock() == pindexGenesisBlock);
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nIndex);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CCoins)& item, vCoins)
+        BOOST_CHECK(!pcoinsTip->HaveCoins(item.first));
+    // nor left the databases for the next start to wipe
+    BOOST_CHECK(!UTXOSnapshotLoadUnfinished());
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,8 @@
 
 #include "log.h"
 
+#include <atomic>
+
 class CCoinsViewCache;
 class CValidationState;
 class CTxUndo;
@@ -258,11 +260,47 @@ public:
   std::vector<CTxOut> vout;
   unsigned int nLockTime;
 
-  CTransaction()
+  CTransaction() : nHashState(HASH_UNCACHED)
   {
     SetNull();
   }
 
+  // Copies start uncached, as they are usually made to be changed
+  CTransaction(const CTransaction& tx)
+    : nVersion(tx.nVersion), vin(tx.vin), vout(tx.vout),
+      nLockTime(tx.nLockTime), nHashState(HASH_UNCACHED)
+  {
+  }
+
+  // A move hands the cache over along with the transaction
+  CTransaction(CTransaction&& tx)
+    : nVersion(tx.nVersion), vin(std::move(tx.vin)),
+      vout(std::move(tx.vout)), nLockTime(tx.nLockTime),
+      nHashState(HASH_UNCACHED)
+  {
+    MoveHash(tx);
+  }
+
+  CTransaction& operator=(const CTransaction& tx)
+  {
+    nVersion = tx.nVersion;
+    vin = tx.vin;
+    vout = tx.vout;
+    nLockTime = tx.nLockTime;
+    nHashState = HASH_UNCACHED;
+    return *this;
+  }
+
+  CTransaction& operator=(CTransaction&& tx)
+  {
+    nVersion = tx.nVersion;
+    vin = std::move(tx.vin);
+    vout = std::move(tx.vout);
+    nLockTime = tx.nLockTime;
+    MoveHash(tx);
+    return *this;
+  }
+
   IMPLEMENT_SERIALIZE
   (
     READWRITE(this->nVersion);
@@ -270,6 +308,8 @@ public:
     READWRITE(vin);
     READWRITE(vout);
     READWRITE(nLockTime);
+    if (fRead)
+      const_cast<CTransaction*>(this)->nHashState = HASH_CACHEABLE;
   )
 
   void SetNull()
@@ -278,6 +318,7 @@ public:
     vin.clear();
     vout.clear();
     nLockTime = 0;
+    nHashState = HASH_UNCACHED;
   }
 
   bool IsNull() const
@@ -285,8 +326,21 @@ public:
     return (vin.empty() && vout.empty());
   }
 
+  /** The transaction id. A transaction read from a stream
+    is taken to be read-only and keeps its hash after the
+    first call; code that changes such a transaction must
+    call InvalidateHash() afterwards. Copies don't inherit
+    the cache, so changing a copy needs no such call.
+  */
   uint256 GetHash() const;
 
+  /** Forget the cached hash after changing a transaction
+    that was read from a stream */
+  void InvalidateHash()
+  {
+    nHashState = HASH_UNCACHED;
+  }
+
   bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const;
 
   bool IsNewerThan(const CTransaction& old) const
@@ -438,6 +492,33 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 protected:
   static const CTxOut &GetOutputFor(const CTxIn& input, CCoinsViewCache& mapInputs);
+
+private:
+  // Hash cache states. Only transactions read from a stream
+  // are CACHEABLE; the first GetHash() on one moves it to
+  // COMPUTING and then CACHED, so concurrent readers never
+  // see a half-written hashCached.
+  enum
+  {
+    HASH_UNCACHED,
+    HASH_CACHEABLE,
+    HASH_COMPUTING,
+    HASH_CACHED,
+  };
+  mutable std::atomic<int> nHashState;
+  mutable uint256 hashCached;
+
+  // Take over the cache of tx, which is left uncached (and empty)
+  void MoveHash(CTransaction& tx)
+  {
+    int nState = tx.nHashState.load(std::memory_order_acquire);
+    if (nState == HASH_CACHED)
+      hashCached = tx.hashCached;
+    else if (nState == HASH_COMPUTING)
+      nState = HASH_CACHEABLE;
+    nHashState.store(nState, std::memory_order_release);
+    tx.nHashState.store(HASH_UNCACHED, std::memory_order_release);
+  }
 };
 
 std::ostream& 
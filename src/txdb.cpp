@@ -3,6 +3,10 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <atomic>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 #include "txdb.h"
 #include "main.h"
 #include "hash/hash.h"
@@ -43,12 +47,19 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
 }
 
+uint256 CCoinsViewDB::GetBestBlockHash() {
+    uint256 hashBestChain;
+    if (!db.Read('B', hashBestChain))
+        return 0;
+    return hashBestChain;
+}
+
 bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     CLevelDBBatch batch;
     BatchWriteHashBestChain(batch, pindex->GetBlockHash()); 
@@ -122,14 +133,10 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
+// The iterator reads the database as it was when it was created
+static bool WalkCoins(boost::shared_ptr<leveldb::Iterator> pcursor, const CCoinsView::CCoinsVisitor &visitor) {
     pcursor->SeekToFirst();
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock()->GetBlockHash();
-    ss << stats.hashBlock;
-    int64 nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -144,32 +151,38 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                 ssValue >> coins;
                 uint256 txhash;
                 ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n'); 
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                if (!visitor(txhash, coins))
+                    break;
             }
             pcursor->Next();
         } catch (std::exception &e) {
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
-    delete pcursor;
+    return true;
+}
+
+CCoinsView::CCoinsWalker CCoinsViewDB::SnapshotCoins() {
+    return boost::bind(&WalkCoins, boost::shared_ptr<leveldb::Iterator>(db.NewIterator()), _1);
+}
+
+bool CCoinsViewDB::ForEachCoins(const CCoinsVisitor &visitor) {
+    return SnapshotCoins()(visitor);
+}
+
+static bool AddToStats(CCoinsStats *pstats, CHashWriter *pss, const uint256 &txid, const CCoins &coins) {
+    pstats->Add(*pss, txid, coins);
+    return true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.hashBlock = GetBestBlock()->GetBlockHash();
+    ss << stats.hashBlock;
+    if (!ForEachCoins(boost::bind(&AddToStats, &stats, &ss, _1, _2)))
+        return false;
     stats.nHeight = GetBestBlock()->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -184,6 +197,133 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool GetAddressIndexHash(const CTxDestination &dest, unsigned char &type, uint160 &hash) {
+    if (const CKeyID *keyID = boost::get<CKeyID>(&dest)) {
+        type = ADDRESSINDEX_PUBKEYHASH;
+        hash = *keyID;
+        return true;
+    }
+    if (const CScriptID *scriptID = boost::get<CScriptID>(&dest)) {
+        type = ADDRESSINDEX_SCRIPTHASH;
+        hash = *scriptID;
+        return true;
+    }
+    return false;
+}
+
+bool GetAddressIndexHash(const CScript &script, unsigned char &type, uint160 &hash) {
+    CTxDestination dest;
+    if (!ExtractDestination(script, dest))
+        return false;
+    return GetAddressIndexHash(dest, type, hash);
+}
+
+void CBlockTreeDB::WriteAddressIndex(CLevelDBBatch &batch, const std::vector<CAddressIndexEntry> &vect) {
+    for (std::vector<CAddressIndexEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+}
+
+void CBlockTreeDB::EraseAddressIndex(CLevelDBBatch &batch, const std::vector<CAddressIndexEntry> &vect) {
+    for (std::vector<CAddressIndexEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Erase(make_pair('a', it->first));
+}
+
+bool CBlockTreeDB::ReadAddressIndex(unsigned char type, const uint160 &hash, std::vector<CAddressIndexEntry> &vect, int nStart, int nEnd) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    // Seek to the first entry of this address at or above nStart
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'a' << type << hash;
+    CAddressIndexKey::SerializeBE32(ssKeySet, nStart > 0 ? nStart : 0);
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if (chType != 'a')
+                break;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hash || (nEnd > 0 && key.nBlockHeight > nEnd))
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64 nValue;
+            ssValue >> nValue;
+            vect.push_back(make_pair(key, nValue));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+void CBlockTreeDB::UpdateAddressUnspentIndex(CLevelDBBatch &batch, const std::vector<CAddressUnspentEntry> &vect) {
+    for (std::vector<CAddressUnspentEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(unsigned char type, const uint160 &hash, std::vector<CAddressUnspentEntry> &vect) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'u' << type << hash;
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            ssKey >> key;
+            if (key.type != type || key.hashBytes != hash)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vect.push_back(make_pair(key, value));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+void CBlockTreeDB::UpdateSpentIndex(CLevelDBBatch &batch, const std::vector<CSpentIndexEntry> &vect) {
+    for (std::vector<CSpentIndexEntry>::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('p', it->first));
+        else
+            batch.Write(make_pair('p', it->first), it->second);
+    }
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const COutPoint &out, CSpentIndexValue &value) {
+    return Read(make_pair('p', out), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -196,8 +336,64 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+// A block index record as read by the cursor, decoded later off the cursor thread
+struct CBlockIndexRecord
+{
+    CBlockIndex* pindex;
+    std::string strImmutable;
+    std::string strMutable;
+    uint256 hashPrev;
+    bool fDecoded;
+    bool fValid;
+};
+
+static void DecodeBlockIndexRecords(std::vector<CBlockIndexRecord>* pvRecords, std::atomic<size_t>* pnNext)
+{
+    std::vector<CBlockIndexRecord>& vRecords = *pvRecords;
+    for (size_t i = (*pnNext)++; i < vRecords.size(); i = (*pnNext)++) {
+        CBlockIndexRecord& record = vRecords[i];
+        CBlockIndex* pindexNew = record.pindex;
+        try {
+            CDataStream ssValue_immutable(record.strImmutable.data(), record.strImmutable.data()+record.strImmutable.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue_immutable >> diskindex; // read all immutable data
+            assert(diskindex.CalcBlockHash() == *pindexNew->phashBlock); // paranoia check
+
+            // Construct immutable parts of block index object, pprev is linked afterwards
+            record.hashPrev           = diskindex.hashPrev;
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nTx            = diskindex.nTx;
+            // the work of this block alone, LoadBlockIndexDB sums it up along the chain
+            pindexNew->nChainWork     = pindexNew->GetBlockWork256();
+
+            // CheckIndex needs phashBlock to be set
+            diskindex.phashBlock = pindexNew->phashBlock;
+            record.fValid = diskindex.CheckIndex();
+
+            CDataStream ssValue_mutable(record.strMutable.data(), record.strMutable.data()+record.strMutable.size(), SER_DISK, CLIENT_VERSION);
+            ssValue_mutable >> *pindexNew;      // read all mutable data
+            record.fDecoded = true;
+        } catch (std::exception &e) {
+            record.fDecoded = false;
+        }
+        // the serialized copies are not needed anymore
+        std::string().swap(record.strImmutable);
+        std::string().swap(record.strMutable);
+    }
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
+    // Records are read from the cursor in batches; decoding them (auxpow
+    // included), the hash check and the block work run on all cores
+    static const size_t nBatchSize = 16384;
+    const unsigned int nThreads = std::max(1U, boost::thread::hardware_concurrency());
+
     leveldb::Iterator *pcursor = NewIterator();
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
@@ -207,56 +403,69 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     pcursor->Seek(ssKeySet.str());
 
     // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            ssKey >> cType;
-            if (cType == 'b') {
+    std::vector<CBlockIndexRecord> vRecords;
+    vRecords.reserve(nBatchSize);
+    bool fDone = false;
+    while (!fDone) {
+        vRecords.clear();
+        while (vRecords.size() < nBatchSize && pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                ssKey >> cType;
+                if (cType != 'b')
+                    break; // if shutdown requested or finished loading block index
                 ssKey >> hash;
+            } catch (std::exception &e) {
+                delete pcursor;
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
 
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue_immutable(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue_immutable >> diskindex; // read all immutable data
-
-                // Construct immutable parts of block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(hash);
-                assert(diskindex.CalcBlockHash() == *pindexNew->phashBlock); // paranoia check
-
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-        if (pindexGenesisBlock == NULL && pindexNew->GetBlockHash() == genesis::block::instance().known_hash())
-                    pindexGenesisBlock = pindexNew;
-
-                // CheckIndex needs phashBlock to be set
-                diskindex.phashBlock = pindexNew->phashBlock;
-                if (!diskindex.CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next(); // now we should be on the 'b' subkey
-
-                assert(pcursor->Valid());
-
-                slValue = pcursor->value();
-                CDataStream ssValue_mutable(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                ssValue_mutable >> *pindexNew;      // read all mutable data
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            CBlockIndexRecord record;
+            record.pindex = InsertBlockIndex(hash);
+            record.fDecoded = record.fValid = false;
+            leveldb::Slice slValue = pcursor->value();
+            record.strImmutable.assign(slValue.data(), slValue.size());
+
+            pcursor->Next(); // now we should be on the 'b' subkey
+
+            assert(pcursor->Valid());
+
+            slValue = pcursor->value();
+            record.strMutable.assign(slValue.data(), slValue.size());
+            vRecords.push_back(record);
+
+            pcursor->Next();
+        }
+        fDone = vRecords.size() < nBatchSize;
+
+        std::atomic<size_t> nNext(0);
+        if (nThreads > 1 && vRecords.size() > 1) {
+            boost::thread_group decoders;
+            for (unsigned int i = 0; i < nThreads; i++)
+                decoders.create_thread(boost::bind(&DecodeBlockIndexRecords, &vRecords, &nNext));
+            decoders.join_all();
+        } else {
+            DecodeBlockIndexRecords(&vRecords, &nNext);
+        }
+
+        BOOST_FOREACH(const CBlockIndexRecord& record, vRecords) {
+            CBlockIndex* pindexNew = record.pindex;
+            if (!record.fDecoded) {
+                delete pcursor;
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            if (!record.fValid) {
+                delete pcursor;
+                return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+            }
+
+            pindexNew->pprev = InsertBlockIndex(record.hashPrev);
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && pindexNew->GetBlockHash() == genesis::block::instance().known_hash())
+                pindexGenesisBlock = pindexNew;
         }
     }
     delete pcursor;
@@ -8,6 +8,144 @@
 #include "main.h"
 #include "leveldb.h"
 
+/** Address kinds stored in the -addressindex (matching CTxDestination) */
+enum AddressIndexType
+{
+    ADDRESSINDEX_PUBKEYHASH = 1,
+    ADDRESSINDEX_SCRIPTHASH = 2,
+};
+
+/** Map a destination to its -addressindex type and hash; false if it has none */
+bool GetAddressIndexHash(const CTxDestination &dest, unsigned char &type, uint160 &hash);
+bool GetAddressIndexHash(const CScript &script, unsigned char &type, uint160 &hash);
+
+/** Key of an -addressindex history entry: every output paying to and every
+ *  input spending from an address. The height and position in the block are
+ *  stored big endian, so a LevelDB range scan returns them in chain order. */
+struct CAddressIndexKey
+{
+    unsigned char type;
+    uint160 hashBytes;
+    int nBlockHeight;
+    unsigned int nTxIndex;
+    uint256 txhash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() : type(0), hashBytes(0), nBlockHeight(0), nTxIndex(0), txhash(0), nIndex(0), fSpending(false) {}
+
+    CAddressIndexKey(unsigned char typeIn, const uint160 &hashIn, int nHeightIn, unsigned int nTxIndexIn,
+                     const uint256 &txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        type(typeIn), hashBytes(hashIn), nBlockHeight(nHeightIn), nTxIndex(nTxIndexIn),
+        txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 4 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, type, nType, nVersion);
+        ::Serialize(s, hashBytes, nType, nVersion);
+        SerializeBE32(s, nBlockHeight);
+        SerializeBE32(s, nTxIndex);
+        ::Serialize(s, txhash, nType, nVersion);
+        ::Serialize(s, nIndex, nType, nVersion);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        ::Unserialize(s, type, nType, nVersion);
+        ::Unserialize(s, hashBytes, nType, nVersion);
+        nBlockHeight = UnserializeBE32(s);
+        nTxIndex = UnserializeBE32(s);
+        ::Unserialize(s, txhash, nType, nVersion);
+        ::Unserialize(s, nIndex, nType, nVersion);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    static void SerializeBE32(Stream &s, unsigned int n) {
+        unsigned char buf[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((char*)buf, 4);
+    }
+
+    template<typename Stream>
+    static unsigned int UnserializeBE32(Stream &s) {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        return ((unsigned int)buf[0] << 24) | ((unsigned int)buf[1] << 16) | ((unsigned int)buf[2] << 8) | buf[3];
+    }
+};
+
+/** Key of an unspent output in the -addressindex */
+struct CAddressUnspentKey
+{
+    unsigned char type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : type(0), hashBytes(0), txhash(0), nIndex(0) {}
+
+    CAddressUnspentKey(unsigned char typeIn, const uint160 &hashIn, const uint256 &txhashIn, unsigned int nIndexIn) :
+        type(typeIn), hashBytes(hashIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(type);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+/** An unspent output in the -addressindex; a null value in an update erases the key */
+struct CAddressUnspentValue
+{
+    int64 nValue;
+    CScript script;
+    int nBlockHeight;
+
+    CAddressUnspentValue() : nValue(-1), nBlockHeight(0) {}
+
+    CAddressUnspentValue(int64 nValueIn, const CScript &scriptIn, int nHeightIn) :
+        nValue(nValueIn), script(scriptIn), nBlockHeight(nHeightIn) {}
+
+    bool IsNull() const { return nValue == -1; }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nBlockHeight);
+    )
+};
+
+/** Where an output was spent (-spentindex); a null value in an update erases the key */
+struct CSpentIndexValue
+{
+    uint256 txid;
+    unsigned int nInputIndex;
+    int nBlockHeight;
+
+    CSpentIndexValue() : txid(0), nInputIndex(0), nBlockHeight(0) {}
+
+    CSpentIndexValue(const uint256 &txidIn, unsigned int nInputIndexIn, int nHeightIn) :
+        txid(txidIn), nInputIndex(nInputIndexIn), nBlockHeight(nHeightIn) {}
+
+    bool IsNull() const { return txid == 0; }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nBlockHeight);
+    )
+};
+
+typedef std::pair<CAddressIndexKey, int64> CAddressIndexEntry;
+typedef std::pair<CAddressUnspentKey, CAddressUnspentValue> CAddressUnspentEntry;
+typedef std::pair<COutPoint, CSpentIndexValue> CSpentIndexEntry;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -20,9 +158,14 @@ public:
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
+    uint256 GetBestBlockHash();
     bool SetBestBlock(CBlockIndex *pindex);
     bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+    bool ForEachCoins(const CCoinsVisitor &visitor);
+    CCoinsWalker SnapshotCoins();
+
+    CLevelDB &GetDB() { return db; }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -47,6 +190,14 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // The index updates below only add to batch; the caller writes it
+    void WriteAddressIndex(CLevelDBBatch &batch, const std::vector<CAddressIndexEntry> &vect);
+    void EraseAddressIndex(CLevelDBBatch &batch, const std::vector<CAddressIndexEntry> &vect);
+    bool ReadAddressIndex(unsigned char type, const uint160 &hash, std::vector<CAddressIndexEntry> &vect, int nStart = 0, int nEnd = 0);
+    void UpdateAddressUnspentIndex(CLevelDBBatch &batch, const std::vector<CAddressUnspentEntry> &vect);
+    bool ReadAddressUnspentIndex(unsigned char type, const uint160 &hash, std::vector<CAddressUnspentEntry> &vect);
+    void UpdateSpentIndex(CLevelDBBatch &batch, const std::vector<CSpentIndexEntry> &vect);
+    bool ReadSpentIndex(const COutPoint &out, CSpentIndexValue &value);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
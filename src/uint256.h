@@ -6,6 +6,7 @@
 #define BITCOIN_UINT256_H
 
 #include <iostream>
+#include <assert.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
@@ -184,6 +185,49 @@ public:
     }
 
 
+    base_uint& operator/=(const base_uint& b)
+    {
+        // shift-and-subtract long division
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        assert(div_bits != 0); // division by zero
+        if (div_bits > num_bits)
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift;
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            div >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
+    // position of the highest bit set plus one, or zero for zero
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH-1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & (1U << nbits))
+                        return 32*pos + nbits + 1;
+                return 32*pos + 1;
+            }
+        }
+        return 0;
+    }
+
     base_uint& operator++()
     {
         // prefix operator
@@ -1087,6 +1087,16 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+void FileWriteBack(FILE *file, unsigned int offset, unsigned int length)
+{
+  fflush(file);
+#if defined(__linux__)
+  // queue the range for writeback without waiting for it, so a later
+  // FileCommit finds little left to do
+  sync_file_range(fileno(file), offset, length, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
 int GetFilesize(FILE* file)
 {
   int nSavePos = ftell(file);
@@ -1153,9 +1163,8 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
   }
   ftruncate(fileno(file), fst.fst_length);
 #elif defined(__linux__)
-  // Version using posix_fallocate
-  off_t nEndPos = (off_t)offset + length;
-  posix_fallocate(fileno(file), 0, nEndPos);
+  // Version using posix_fallocate; only the new range, the rest is allocated already
+  posix_fallocate(fileno(file), offset, length);
 #else
   // Fallback version
   // TODO: just write one byte per block
@@ -172,6 +172,8 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
   if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
     return false;
+  // what IsMine says about the wallet's transactions may have changed
+  MarkDirty();
   if (!fFileBacked)
     return true;
   if (!IsCrypted()) {
@@ -184,10 +186,13 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
   if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
     return false;
-  if (!fFileBacked)
-    return true;
   {
     LOCK(cs_wallet);
+    // encrypting the wallet re-adds the keys it already has
+    if (!pwalletdbEncryption)
+      MarkDirty();
+    if (!fFileBacked)
+      return true;
     if (pwalletdbEncryption)
       return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret);
     else
@@ -205,6 +210,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
   if (!CCryptoKeyStore::AddCScript(redeemScript))
     return false;
+  MarkDirty();
   if (!fFileBacked)
     return true;
   return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -433,28 +439,119 @@ int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
   return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::IndexAccountItem(const std::string& strAccount, const TxItems::value_type& item)
 {
-  CWalletDB walletdb(strWalletFile);
+  TxItems& txItems = mapTxByAccount[strAccount];
+  std::pair<TxItems::iterator, TxItems::iterator> range = txItems.equal_range(item.first);
+  for (TxItems::iterator it = range.first; it != range.second; ++it)
+    if ((*it).second == item.second)
+      return;
+  txItems.insert(item);
+}
+
+void CWallet::IndexWalletTx(CWalletTx& wtx)
+{
+  const uint256 hash = wtx.GetHash();
+  const TxItems::value_type item(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0));
+  wtxOrdered.insert(item);
+  mapTxByBlock[wtx.hashBlock].insert(hash);
+
+  // Sends are listed under the paying account, receives under the label
+  // of the output's address ("" if it has none)
+  IndexAccountItem(wtx.strFromAccount, item);
+  BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+  {
+    CTxDestination address;
+    if (!ExtractDestination(txout.scriptPubKey, address))
+    {
+      IndexAccountItem("", item);
+      continue;
+    }
+    mapTxByAddress[address].insert(hash);
+    std::map<CTxDestination, std::string>::const_iterator mi = mapAddressBook.find(address);
+    IndexAccountItem(mi != mapAddressBook.end() ? (*mi).second : "", item);
+  }
+}
+
+void CWallet::IndexAccountingEntry(CAccountingEntry& acentry)
+{
+  const TxItems::value_type item(acentry.nOrderPos, TxPair((CWalletTx*)0, &acentry));
+  wtxOrdered.insert(item);
+  IndexAccountItem(acentry.strAccount, item);
+}
+
+void CWallet::RebuildTxIndexes(CWalletDB *pwalletdb)
+{
+  LOCK(cs_wallet);
+  wtxOrdered.clear();
+  mapTxByAccount.clear();
+  mapTxByAddress.clear();
+  mapTxByBlock.clear();
+  laccentries.clear();
 
-  // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-  TxItems txOrdered;
+  if (fFileBacked)
+  {
+    if (pwalletdb)
+      pwalletdb->ListAccountCreditDebit("*", laccentries);
+    else
+      CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+  }
 
-  // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-  // would make this much faster for applications that do this a lot.
   for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    IndexWalletTx((*it).second);
+  BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+    IndexAccountingEntry(entry);
+}
+
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
+{
+  if (!walletdb.WriteAccountingEntry(acentry))
+    return false;
+  LoadAccountingEntry(acentry);
+  return true;
+}
+
+void CWallet::LoadAccountingEntry(const CAccountingEntry& acentry)
+{
+  LOCK(cs_wallet);
+  laccentries.push_back(acentry);
+  IndexAccountingEntry(laccentries.back());
+}
+
+void CWallet::UnindexWalletTx(CWalletTx& wtx)
+{
+  const uint256 hash = wtx.GetHash();
+
+  // The account buckets may hold the tx under labels it no longer has, so
+  // look in all of them; each is ordered by position, so that is cheap
+  std::vector<TxItems*> vItems(1, &wtxOrdered);
+  for (std::map<std::string, TxItems>::iterator mi = mapTxByAccount.begin(); mi != mapTxByAccount.end(); ++mi)
+    vItems.push_back(&(*mi).second);
+  BOOST_FOREACH(TxItems* pItems, vItems)
   {
-    CWalletTx* wtx = &((*it).second);
-    txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+    std::pair<TxItems::iterator, TxItems::iterator> range = pItems->equal_range(wtx.nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; )
+    {
+      if ((*it).second.first == &wtx)
+        pItems->erase(it++);
+      else
+        ++it;
+    }
   }
-  acentries.clear();
-  walletdb.ListAccountCreditDebit(strAccount, acentries);
-  BOOST_FOREACH(CAccountingEntry& entry, acentries)
+
+  BOOST_FOREACH(const CTxOut& txout, wtx.vout)
   {
-    txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    CTxDestination address;
+    if (!ExtractDestination(txout.scriptPubKey, address))
+      continue;
+    std::map<CTxDestination, std::set<uint256> >::iterator mi = mapTxByAddress.find(address);
+    if (mi != mapTxByAddress.end() && (*mi).second.erase(hash) && (*mi).second.empty())
+      mapTxByAddress.erase(mi);
   }
 
-  return txOrdered;
+  std::map<uint256, std::set<uint256> >::iterator mi = mapTxByBlock.find(wtx.hashBlock);
+  if (mi != mapTxByBlock.end() && (*mi).second.erase(hash) && (*mi).second.empty())
+    mapTxByBlock.erase(mi);
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
@@ -518,9 +615,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
           {
             // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
             int64 latestTolerated = latestNow + 300;
-            std::list<CAccountingEntry> acentries;
-            TxItems txOrdered = OrderedTxItems(acentries);
-            for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+            for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
             {
               CWalletTx *const pwtx = (*it).second.first;
               if (pwtx == &wtx)
@@ -550,9 +645,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         }
         else
           printf("AddToWallet() : found %s in block %s not in index\n",
-               wtxIn.GetHash().ToString().c_str(),
+               hash.ToString().c_str(),
                wtxIn.hashBlock.ToString().c_str());
       }
+
+      IndexWalletTx(wtx);
     }
 
     bool fUpdated = false;
@@ -561,7 +658,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
       // Merge
       if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
       {
+        std::map<uint256, std::set<uint256> >::iterator mi = mapTxByBlock.find(wtx.hashBlock);
+        if (mi != mapTxByBlock.end() && (*mi).second.erase(hash) && (*mi).second.empty())
+          mapTxByBlock.erase(mi);
         wtx.hashBlock = wtxIn.hashBlock;
+        mapTxByBlock[wtx.hashBlock].insert(hash);
         fUpdated = true;
       }
       if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
@@ -579,7 +680,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
     }
 
     //// debug print
-    printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
+    printf("AddToWallet %s  %s%s\n", hash.ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
     // Write to disk
     if (fInsertedNew || fUpdated)
@@ -615,7 +716,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 
     if ( !strCmd.empty())
     {
-      boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
+      boost::replace_all(strCmd, "%s", hash.GetHex());
       boost::thread t(runCommand, strCmd); // thread runs free
     }
 
@@ -652,8 +753,13 @@ bool CWallet::EraseFromWallet(uint256 hash)
     return false;
   {
     LOCK(cs_wallet);
-    if (mapWallet.erase(hash))
+    map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end())
+    {
+      UnindexWalletTx((*mi).second);
+      mapWallet.erase(mi);
       CWalletDB(strWalletFile).EraseTx(hash);
+    }
   }
   return true;
 }
@@ -759,10 +865,18 @@ int CWalletTx::GetRequestCount() const
 void CWalletTx::GetAmounts(list<pair<CTxDestination, int64> >& listReceived,
                list<pair<CTxDestination, int64> >& listSent, int64& nFee, string& strSentAccount) const
 {
+  strSentAccount = strFromAccount;
+  if (fAmountsCached)
+  {
+    listReceived = listReceivedCached;
+    listSent = listSentCached;
+    nFee = nFeeCached;
+    return;
+  }
+
   nFee = 0;
   listReceived.clear();
   listSent.clear();
-  strSentAccount = strFromAccount;
 
   // Compute fee:
   int64 nDebit = GetDebit();
@@ -794,6 +908,10 @@ void CWalletTx::GetAmounts(list<pair<CTxDestination, int64> >& listReceived,
       listReceived.push_back(make_pair(address, txout.nValue));
   }
 
+  listReceivedCached = listReceived;
+  listSentCached = listSent;
+  nFeeCached = nFee;
+  fAmountsCached = true;
 }
 
 void CWalletTx::GetAccountAmounts(const string& strAccount, int64& nReceived,
@@ -896,12 +1014,20 @@ bool CWalletTx::WriteToDisk()
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
   int ret = 0;
+  int nSkipped = 0;
 
   CBlockIndex* pindex = pindexStart;
   {
     LOCK(cs_wallet);
     while (pindex)
     {
+      if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+      {
+        // pruned, or below a loaded UTXO snapshot
+        nSkipped++;
+        pindex = pindex->pnext;
+        continue;
+      }
       CBlock block;
       block.ReadFromDisk(pindex);
       BOOST_FOREACH(CTransaction& tx, block.vtx)
@@ -912,6 +1038,8 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
       pindex = pindex->pnext;
     }
   }
+  if (nSkipped > 0)
+    printf("WARNING: ScanForWalletTransactions() : %d blocks are not on disk and were not scanned\n", nSkipped);
   return ret;
 }
 
@@ -1589,6 +1717,10 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     }
   }
 
+  // init keeps going after a noncritical error, so the wallet still needs its indexes
+  if (nLoadWalletRet == DB_LOAD_OK || nLoadWalletRet == DB_NONCRITICAL_ERROR)
+    RebuildTxIndexes();
+
   if (nLoadWalletRet != DB_LOAD_OK)
     return nLoadWalletRet;
   fFirstRunRet = !vchDefaultKey.IsValid();
@@ -1601,6 +1733,23 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
 {
   std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(address);
   mapAddressBook[address] = strName;
+  {
+    // File the transactions paying to this address under the new account too
+    LOCK(cs_wallet);
+    std::map<CTxDestination, std::set<uint256> >::const_iterator mt = mapTxByAddress.find(address);
+    if (mt != mapTxByAddress.end())
+    {
+      BOOST_FOREACH(const uint256& hashTx, (*mt).second)
+      {
+        std::map<uint256, CWalletTx>::iterator mw = mapWallet.find(hashTx);
+        if (mw == mapWallet.end())
+          continue;
+        CWalletTx& wtx = (*mw).second;
+        wtx.MarkDirty();
+        IndexAccountItem(strName, TxItems::value_type(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+      }
+    }
+  }
   NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address), (mi == mapAddressBook.end()) ? CT_NEW : CT_UPDATED);
   if (!fFileBacked)
     return false;
@@ -1610,6 +1759,23 @@ bool CWallet::SetAddressBookName(const CTxDestination& address, const string& st
 bool CWallet::DelAddressBookName(const CTxDestination& address)
 {
   mapAddressBook.erase(address);
+  {
+    // Without a label the transactions paying to this address belong to ""
+    LOCK(cs_wallet);
+    std::map<CTxDestination, std::set<uint256> >::const_iterator mt = mapTxByAddress.find(address);
+    if (mt != mapTxByAddress.end())
+    {
+      BOOST_FOREACH(const uint256& hashTx, (*mt).second)
+      {
+        std::map<uint256, CWalletTx>::iterator mw = mapWallet.find(hashTx);
+        if (mw == mapWallet.end())
+          continue;
+        CWalletTx& wtx = (*mw).second;
+        wtx.MarkDirty();
+        IndexAccountItem("", TxItems::value_type(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+      }
+    }
+  }
   NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address), CT_DELETED);
   if (!fFileBacked)
     return false;
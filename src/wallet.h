@@ -120,6 +120,10 @@ public:
     mutable int64 nImmatureCreditCached;
     mutable int64 nAvailableCreditCached;
     mutable int64 nChangeCached;
+    mutable bool fAmountsCached;
+    mutable std::list<std::pair<CTxDestination, int64> > listReceivedCached;
+    mutable std::list<std::pair<CTxDestination, int64> > listSentCached;
+    mutable int64 nFeeCached;
 
     CWalletTx()
     {
@@ -163,6 +167,10 @@ public:
         nImmatureCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        fAmountsCached = false;
+        listReceivedCached.clear();
+        listSentCached.clear();
+        nFeeCached = 0;
         nOrderPos = -1;
     }
 
@@ -247,9 +255,11 @@ public:
     void MarkDirty()
     {
         fCreditCached = false;
+        fImmatureCreditCached = false;
         fAvailableCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        fAmountsCached = false;
     }
 
     void BindWallet(CWallet *pwalletIn)
@@ -413,11 +423,30 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+    /** Secondary indexes over mapWallet and the accounting entries.
+        Maintained by AddToWallet(), AddAccountingEntry() and EraseFromWallet(),
+        rebuilt by RebuildTxIndexes() after loading or reordering.
+        The account and address buckets may hold extra entries; callers
+        still filter (see ListTransactions()), they only avoid full scans.
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    TxItems wtxOrdered;                                           // wallet activity log, by order position
+    std::map<std::string, TxItems> mapTxByAccount;                // by sending account and output labels
+    std::map<CTxDestination, std::set<uint256> > mapTxByAddress;  // by output destination
+    std::map<uint256, std::set<uint256> > mapTxByBlock;           // by containing block, 0 if none
+    std::list<CAccountingEntry> laccentries;                      // owns the entries referenced from wtxOrdered
+
+    void RebuildTxIndexes(CWalletDB *pwalletdb = NULL);
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
+    // Adds an entry already committed to the wallet database to the indexes
+    void LoadAccountingEntry(const CAccountingEntry& acentry);
+
+private:
+    void IndexWalletTx(CWalletTx& wtx);
+    void UnindexWalletTx(CWalletTx& wtx);
+    void IndexAccountingEntry(CAccountingEntry& acentry);
+    void IndexAccountItem(const std::string& strAccount, const TxItems::value_type& item);
+
+public:
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
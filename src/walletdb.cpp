@@ -178,6 +178,9 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
         }
     }
 
+    // Order positions changed, the in-memory indexes are keyed on them
+    pwallet->RebuildTxIndexes(this);
+
     return DB_LOAD_OK;
 }
 
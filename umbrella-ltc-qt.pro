@@ -173,6 +173,7 @@ HEADERS += \
     src/leveldb.h \
     src/limitedmap.h \
     src/main.h \
+    src/mergedmining.h \
     src/mruset.h \
     src/n_factor.h \
     src/net.h \
@@ -181,6 +182,7 @@ HEADERS += \
     src/protocol.h \
     src/script.h \
     src/serialize.h \
+    src/stratum.h \
     src/sync.h \
     src/threadsafety.h \
     src/transaction.h \
@@ -200,6 +202,7 @@ HEADERS += \
     src/hash/scrypt.hpp \
     src/json/json_spirit.h \
     src/json/json_spirit_error_position.h \
+    src/json/json_spirit_fast.h \
     src/json/json_spirit_reader.h \
     src/json/json_spirit_reader_template.h \
     src/json/json_spirit_stream_reader.h \
@@ -271,6 +274,7 @@ SOURCES += \
     src/keystore.cpp \
     src/leveldb.cpp \
     src/main.cpp \
+    src/mergedmining.cpp \
     src/n_factor.cpp \
     src/net.cpp \
     src/netbase.cpp \
@@ -284,6 +288,7 @@ SOURCES += \
     src/rpcrawtransaction.cpp \
     src/rpcwallet.cpp \
     src/script.cpp \
+    src/stratum.cpp \
     src/sync.cpp \
     src/txdb.cpp \
     src/types.cpp \